@@ -0,0 +1,163 @@
+#include "addr_map.hh"
+#include "debugger.hh"
+
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+
+std::atomic<uint64_t> epoch_domain::global_epoch{1};
+std::atomic<uint64_t> epoch_domain::shared_readers{0};
+epoch_domain::reader_slot epoch_domain::slots[MAX_READERS];
+thread_local epoch_domain::thread_reader epoch_domain::self;
+
+epoch_domain::thread_reader::~thread_reader()
+{
+    if (slot) {
+        slot->epoch.store(0);
+        slot->in_use.store(false);
+    }
+}
+
+// Returns nullptr if every slot is taken, the caller then counts itself in shared_readers.
+epoch_domain::reader_slot *epoch_domain::claim_slot()
+{
+    for (int i = 0; i < MAX_READERS; i++) {
+        bool expected = false;
+        if (!slots[i].in_use.load(std::memory_order_relaxed) &&
+            slots[i].in_use.compare_exchange_strong(expected, true)) {
+            return &slots[i];
+        }
+    }
+    static std::atomic<bool> warned{false};
+    if (!warned.exchange(true)) {
+        LOG_WARN("epoch_domain: more than %d reader threads, the rest share a counter",
+                 MAX_READERS);
+    }
+    return nullptr;
+}
+
+bool epoch_domain::in_reader()
+{
+    return self.nesting > 0;
+}
+
+void epoch_domain::read_lock()
+{
+    thread_reader &r = self;
+    if (r.nesting++ == 0) {
+        if (!r.slot) {
+            r.slot = claim_slot(); // Tried again on every entry until a slot frees up
+        }
+        r.shared = !r.slot;
+        // seq_cst so the announcement is visible before the protected pointer is loaded
+        if (r.shared) {
+            shared_readers.fetch_add(1);
+        } else {
+            r.slot->epoch.store(global_epoch.load());
+        }
+    }
+}
+
+void epoch_domain::read_unlock()
+{
+    thread_reader &r = self;
+    if (--r.nesting == 0) {
+        if (r.shared) {
+            shared_readers.fetch_sub(1, std::memory_order_release);
+        } else {
+            r.slot->epoch.store(0, std::memory_order_release);
+        }
+    }
+}
+
+void epoch_domain::synchronize()
+{
+    if (self.nesting) {
+        LOG_ERROR("epoch_domain: synchronize inside a read side critical section");
+        abort();
+    }
+    uint64_t target = global_epoch.fetch_add(1) + 1;
+    for (int i = 0; i < MAX_READERS; i++) {
+        for (;;) {
+            uint64_t e = slots[i].epoch.load();
+            if (e == 0 || e >= target) {
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+    // Shared readers do not announce their epoch, wait for all of them
+    while (shared_readers.load()) {
+        std::this_thread::yield();
+    }
+}
+
+bool epoch_domain::protect(const void *p)
+{
+    thread_reader &r = self;
+    if (r.shared || r.hazards == MAX_HAZARDS) {
+        return false;
+    }
+    // Ordered before the end of the critical section, which synchronize waits for
+    r.slot->hazards[r.hazards++].store(p, std::memory_order_release);
+    return true;
+}
+
+void epoch_domain::release(const void *p)
+{
+    thread_reader &r = self;
+    r.hazards--;
+    if (r.slot->hazards[r.hazards].load(std::memory_order_relaxed) != p) {
+        LOG_ERROR("epoch_domain: hazard pointers released out of order");
+    }
+    r.slot->hazards[r.hazards].store(nullptr, std::memory_order_release);
+}
+
+void epoch_domain::wait_unused(const void *p)
+{
+    thread_reader &r = self;
+    for (int h = 0; h < r.hazards; h++) {
+        if (r.slot->hazards[h].load(std::memory_order_relaxed) == p) {
+            return; // The others may be waiting for the calling thread to leave @p
+        }
+    }
+    for (int i = 0; i < MAX_READERS; i++) {
+        for (int h = 0; h < MAX_HAZARDS; h++) {
+            while (slots[i].hazards[h].load() == p) {
+                std::this_thread::yield();
+            }
+        }
+    }
+}
+
+addr_map *addr_map::with_ip(base_ip *ip, uint64_t base, uint64_t size) const
+{
+    addr_map *map = new addr_map(*this);
+    map->version = version + 1;
+    if (std::find(map->ips.begin(), map->ips.end(), ip) == map->ips.end()) {
+        map->ips.push_back(ip);
+    }
+    if (size) {
+        for (const addr_map_entry &e : ranges) {
+            if (base < e.base + e.size && e.base < base + size) {
+                delete map;
+                return nullptr;
+            }
+        }
+        addr_map_entry entry = { base, size, ip };
+        auto pos = std::upper_bound(map->ranges.begin(), map->ranges.end(), entry,
+            [](const addr_map_entry &a, const addr_map_entry &b) { return a.base < b.base; });
+        map->ranges.insert(pos, entry);
+    }
+    return map;
+}
+
+addr_map *addr_map::without_ip(base_ip *ip) const
+{
+    addr_map *map = new addr_map(*this);
+    map->version = version + 1;
+    map->ips.erase(std::remove(map->ips.begin(), map->ips.end(), ip), map->ips.end());
+    map->ranges.erase(std::remove_if(map->ranges.begin(), map->ranges.end(),
+        [ip](const addr_map_entry &e) { return e.ip == ip; }), map->ranges.end());
+    return map;
+}
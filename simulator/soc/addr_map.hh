@@ -0,0 +1,165 @@
+#ifndef ADDR_MAP_HH
+#define ADDR_MAP_HH
+
+#include <cstdint>
+#include <atomic>
+#include <vector>
+
+class base_ip; // Forward declaration
+
+// Epoch based reclamation for read-mostly data swapped with a single pointer store.
+// Readers announce the current epoch in a per-thread slot for the duration of a read
+// side critical section, which costs two stores and no shared writes. A writer publishes
+// the new version, advances the epoch and waits until no reader is still in an older
+// epoch before freeing the old version.
+// An object found inside a read side critical section can be kept beyond it with a
+// hazard pointer in the same slot (see epoch_ref), so a reader calling out into code
+// that may block does not hold up writers. Threads beyond MAX_READERS share a counter
+// instead of a slot, which writers wait on to drop to zero, and hold their critical
+// sections across such calls.
+class epoch_domain {
+public:
+    static const int MAX_READERS = 256;
+    static const int MAX_HAZARDS = 4; // Per thread, nested bus accesses take one each
+
+    // Enter and leave a read side critical section, may be nested.
+    static void read_lock();
+    static void read_unlock();
+
+    // True if the calling thread is inside a read side critical section.
+    static bool in_reader();
+
+    // Wait until every read side critical section that started before the call has ended.
+    // Must not be called from inside a read side critical section, it would wait for
+    // itself.
+    static void synchronize();
+
+    // Publish @p as used by the calling thread, from inside a read side critical section.
+    // Returns false if the thread has no hazard pointer left.
+    static bool protect(const void *p);
+
+    // Drop the hazard pointer taken last by protect(@p).
+    static void release(const void *p);
+
+    // Wait until no other thread protects @p. Called after synchronize(), so no thread
+    // can find @p any more and protect it again. Returns at once if the calling thread
+    // protects @p itself, since the others may be waiting for it, e.g. on a lock of @p.
+    static void wait_unused(const void *p);
+
+private:
+    struct alignas(64) reader_slot {
+        std::atomic<uint64_t> epoch{0}; // 0 when the thread is not reading
+        std::atomic<bool> in_use{false};
+        std::atomic<const void *> hazards[MAX_HAZARDS] = {};
+    };
+
+    struct thread_reader {
+        reader_slot *slot = nullptr;
+        int nesting = 0;
+        int hazards = 0;       // Hazard pointers in use
+        bool shared = false;   // Counted in shared_readers, no slot was free
+        ~thread_reader();
+    };
+
+    static reader_slot *claim_slot();
+
+    static std::atomic<uint64_t> global_epoch;
+    static std::atomic<uint64_t> shared_readers; // Readers in a critical section without a slot
+    static reader_slot slots[MAX_READERS];
+    static thread_local thread_reader self;
+};
+
+// RAII read side critical section.
+class epoch_guard {
+public:
+    epoch_guard() { epoch_domain::read_lock(); }
+    ~epoch_guard() { epoch_domain::read_unlock(); }
+    epoch_guard(const epoch_guard &) = delete;
+    epoch_guard &operator=(const epoch_guard &) = delete;
+};
+
+// Keeps an object found inside an epoch_guard usable once the guard is left, until the
+// epoch_ref is destroyed. Uses a hazard pointer, or stays in the read side critical
+// section if the thread has none left.
+class epoch_ref {
+public:
+    epoch_ref() = default;
+    ~epoch_ref()
+    {
+        if (held) {
+            epoch_domain::read_unlock();
+        } else if (p) {
+            epoch_domain::release(p);
+        }
+    }
+    epoch_ref(const epoch_ref &) = delete;
+    epoch_ref &operator=(const epoch_ref &) = delete;
+
+    // Keep @obj, called once from inside a read side critical section.
+    void hold(const void *obj)
+    {
+        p = obj;
+        held = !epoch_domain::protect(obj);
+        if (held) {
+            epoch_domain::read_lock();
+        }
+    }
+
+private:
+    const void *p = nullptr;
+    bool held = false;
+};
+
+// A decoded address range of the bus.
+struct addr_map_entry {
+    uint64_t base;
+    uint64_t size;
+    base_ip *ip;
+
+    // True if [@addr, @addr + @len) lies within the range, without overflowing for
+    // guest supplied values near the top of the address space.
+    bool contains(uint64_t addr, uint64_t len) const
+    {
+        return addr >= base && len <= size && addr - base <= size - len;
+    }
+};
+
+// Immutable, versioned address map of a bus.
+// A new map is built for every topology change and swapped in atomically, readers keep
+// decoding with the map they loaded until they leave their epoch_guard.
+class addr_map {
+public:
+    addr_map() : version(0) {}
+
+    // Decode @addr with a binary search over the sorted ranges.
+    // Returns the entry containing @addr or nullptr.
+    const addr_map_entry *decode(uint64_t addr) const
+    {
+        size_t lo = 0, hi = ranges.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            const addr_map_entry &e = ranges[mid];
+            if (addr < e.base) {
+                hi = mid;
+            } else if (addr - e.base >= e.size) {
+                lo = mid + 1;
+            } else {
+                return &e;
+            }
+        }
+        return nullptr;
+    }
+
+    // Copy of this map with @ip added at [@base, @base + @size).
+    // Returns nullptr if the range overlaps an existing one.
+    addr_map *with_ip(base_ip *ip, uint64_t base, uint64_t size) const;
+
+    // Copy of this map without @ip.
+    addr_map *without_ip(base_ip *ip) const;
+
+    uint64_t version;
+    std::vector<addr_map_entry> ranges; // Non-empty ranges sorted by base address
+    std::vector<base_ip *> ips;         // Every connected IP in connect order, for IRQ routing
+};
+
+#endif // ADDR_MAP_HH
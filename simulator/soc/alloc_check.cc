@@ -0,0 +1,100 @@
+#include "alloc_check.hh"
+
+#ifdef SOC_ALLOC_CHECK
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include <unistd.h>
+
+thread_local int alloc_check::depth = 0;
+
+static std::atomic<uint64_t> nr_allocations{0};
+
+uint64_t alloc_check::allocations()
+{
+    return nr_allocations.load(std::memory_order_relaxed);
+}
+
+static void *checked_alloc(size_t size, size_t align)
+{
+    nr_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (alloc_check::depth > 0) {
+        // No stdio, it may allocate itself
+        char msg[96];
+        int len = snprintf(msg, sizeof(msg), "alloc_check: %zu byte allocation on the "
+                           "steady-state path\n", size);
+        (void)!write(STDERR_FILENO, msg, len);
+        abort();
+    }
+    if (!size) {
+        size = 1;
+    }
+    void *p;
+    if (align <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        p = malloc(size);
+    } else {
+        p = aligned_alloc(align, (size + align - 1) & ~(align - 1));
+    }
+    return p;
+}
+
+void *operator new(size_t size)
+{
+    void *p = checked_alloc(size, 0);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, std::align_val_t align)
+{
+    void *p = checked_alloc(size, (size_t)align);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size, std::align_val_t align)
+{
+    return operator new(size, align);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return checked_alloc(size, 0);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return checked_alloc(size, 0);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { free(p); }
+
+#else
+
+uint64_t alloc_check::allocations()
+{
+    return 0;
+}
+
+#endif // SOC_ALLOC_CHECK
@@ -0,0 +1,69 @@
+#ifndef ALLOC_CHECK_HH
+#define ALLOC_CHECK_HH
+
+#include <cstdint>
+
+// Heap allocation checks for the steady-state hot paths (bridge packets, action queues,
+// coroutine scheduling), enabled by building with -DSOC_ALLOC_CHECK=ON.
+//
+// The checked build replaces the global operator new and delete: every allocation is
+// counted, and an allocation inside a no_alloc scope prints the offending size and
+// aborts, so a core dump points at the code that allocated. Pools and rings that grow
+// while the simulation warms up do so inside an allow scope. Without SOC_ALLOC_CHECK
+// the scopes compile to nothing and allocations() returns 0.
+//
+//     void base_ip::trigger_action(const ip_action &action)
+//     {
+//         alloc_check::no_alloc scope;
+//         ...
+//     }
+class alloc_check {
+public:
+    // Heap allocations by all threads so far.
+    static uint64_t allocations();
+
+    // Whether this is a checked build.
+    static constexpr bool enabled()
+    {
+#ifdef SOC_ALLOC_CHECK
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Scope in which the calling thread must not allocate.
+    class no_alloc {
+    public:
+#ifdef SOC_ALLOC_CHECK
+        no_alloc() { depth++; }
+        ~no_alloc() { depth--; }
+#else
+        no_alloc() {}
+#endif
+        no_alloc(const no_alloc &) = delete;
+        no_alloc &operator=(const no_alloc &) = delete;
+    };
+
+    // Scope in which the calling thread may allocate again, e.g. to grow a pool or log.
+    class allow {
+    public:
+#ifdef SOC_ALLOC_CHECK
+        allow() : saved(depth) { depth = 0; }
+        ~allow() { depth = saved; }
+    private:
+        int saved;
+#else
+        allow() {}
+#endif
+    public:
+        allow(const allow &) = delete;
+        allow &operator=(const allow &) = delete;
+    };
+
+#ifdef SOC_ALLOC_CHECK
+    static thread_local int depth; // Nesting of no_alloc scopes on this thread
+#endif
+};
+
+#endif // ALLOC_CHECK_HH
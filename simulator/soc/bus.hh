@@ -1,13 +1,23 @@
 #ifndef BUS_HH
 #define BUS_HH 
 
+#include <algorithm>
 #include <cstdint>
 #include <iostream>
 #include <thread>
 #include <mutex>
-#include <list>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <vector>
 
 #include "ip.hh"
+#include "addr_map.hh"
+#include "bus_timing.hh"
+#include "sim_mode.hh"
+#include "trace.hh"
+#include "probes.hh"
+#include "heat_profile.hh"
 
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -15,6 +25,27 @@
 
 #include <string.h>
 
+// A RAM region backed by the bus shared memory segment.
+// The SoC advertises these to QEMU so it can map them directly (e.g. as a RAM-backed BAR)
+// instead of forwarding every access through the cosim bridge.
+struct shm_region {
+    uint64_t ip_id;      // ID of the RAM IP owning the region
+    uint64_t shm_offset; // Offset of the region inside the shared memory segment
+    uint64_t size;       // Size of the region in bytes
+    uint64_t guest_addr; // Bus address the region is decoded at
+};
+
+// A doorbell of a connected IP (see ip_doorbell), advertised to QEMU so it can bind the
+// guest address to an eventfd.
+struct doorbell_region {
+    base_ip *ip;
+    unsigned index;      // In the IP's get_doorbells()
+    uint64_t addr;       // Bus address
+    uint32_t size;
+    uint32_t flags;      // IP_DOORBELL_*
+    uint64_t value;
+};
+
 class base_ip; // Forward declaration
 class base_bus {
 public:
@@ -22,70 +53,201 @@ public:
     // @id: Unique identifier for the bus.
     // @name: Name for the shared memory segment, used for inter-process communication.
     // It creates a shared memory segment with the specified name.
-    base_bus(int id, char *name) : bus_id(id) {
+    base_bus(int id, const char *name) : bus_id(id), shm_name(name) {
         LOG_DEBUG("base_bus constructed with ID: %d, name: %s", id, name);
         shm_fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+        if (shm_fd < 0) {
+            LOG_ERROR("Failed to open shared memory %s: %s", name, strerror(errno));
+        }
     }
 
     // Destructor for base_bus, cleans up the shared memory segment.
-    // It closes the shared memory file descriptor and unlinks the shared memory segment.
+    // It unmaps every RAM region, closes the shared memory file descriptor
+    // and unlinks the shared memory segment that was opened in the constructor.
     ~base_bus() {
         LOG_DEBUG("base_bus destructed with ID: %d", bus_id);
-        if (shm_ptr) {
-            munmap(shm_ptr, shm_fd);
-            shm_ptr = nullptr; // Set to nullptr after unmapping
+        delete map.load();
+        for (const addr_map *m : deferred) {
+            delete m;
+        }
+        for (auto &m : shm_maps) {
+            munmap(m.ptr, m.size);
         }
+        shm_maps.clear();
         if (shm_fd >= 0) {
             close(shm_fd);
             shm_fd = -1; // Set to -1 after closing
         }
-        shm_unlink("/soc_shm"); // Unlink the shared memory segment
-        LOG_DEBUG("Shared memory segment unlinked.");
+        shm_unlink(shm_name.c_str()); // Unlink the shared memory segment
+        LOG_DEBUG("Shared memory segment %s unlinked.", shm_name.c_str());
+    }
+
+    // Grow the shared memory segment to @size bytes up front.
+    // RAM IPs within the reserved size map their window without resizing the segment,
+    // which a topology with many RAMs would otherwise do once per RAM.
+    void reserve_shm(uint64_t size)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (size > shm_size) {
+            if (ftruncate(shm_fd, size) < 0) {
+                LOG_ERROR("Failed to resize shared memory: %s", strerror(errno));
+                return;
+            }
+            shm_size = size;
+        }
     }
 
     // Connects an IP to the bus.
     // @ip: Pointer to the base_ip object representing the IP to be connected.
-    // It adds the IP to the list of connected IPs and maps the shared memory if the IP type is RAM.
-    // It also sets the shared memory pointer in the IP to the start of the shared memory region.
+    // It adds the IP to the address map and maps the shared memory if the IP type is RAM.
+    // Each RAM IP gets its own mapping of [base_addr, base_addr + addr_size) of the segment,
+    // so the shared memory offset of a region equals its bus address at connect time.
     // If the IP type is not RAM, it does not map shared memory.
-    // If the mapping fails, it logs an error and sets the shared memory pointer to nullptr.
-
+    // If the mapping fails, it logs an error and leaves the IP's shared memory pointer as nullptr.
+    // If the IP's range overlaps a connected IP, it logs an error and the IP is not decoded.
+    // Safe to call while other threads access the bus. IPs connect from the base_ip
+    // constructor, before the derived class is complete, so an IP hot-plugged under traffic
+    // should be constructed at an address no master uses and moved into place with remap_ip.
     void connect_ip(base_ip *ip)
     {
-        ipList.push_back(ip);
-        if (ip->ip_type == IP_TYPE_RAM) {
-            LOG_DEBUG("Connecting IP with ID: %lu, type: %d, base_addr: %lx, addr_size: %lx",
-                      ip->id, ip->ip_type, ip->base_addr, ip->addr_size);
-            ftruncate(shm_fd, ip->base_addr + ip->addr_size);
-            shm_ptr = mmap(NULL, ip->base_addr + ip->addr_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-            if (shm_ptr == MAP_FAILED) {
-                LOG_ERROR("Failed to map shared memory: %s", strerror(errno));
-                shm_ptr = nullptr; // Set to nullptr on failure
-            } else {
-                ip->shm_ptr = ((char *)shm_ptr + ip->base_addr); // Set the shared memory pointer in the IP
-                LOG_INFO("Shared memory mapped at: %p for IP with ID: %lu", ip->shm_ptr, ip->id);
-            }        
+        const addr_map *old;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (ip->ip_type == IP_TYPE_RAM) {
+                LOG_DEBUG("Connecting IP with ID: %lu, type: %d, base_addr: %lx, addr_size: %lx",
+                          ip->id, ip->ip_type, ip->base_addr.load(), ip->addr_size.load());
+                map_shm(ip);
+            }
+            addr_map *next = map.load()->with_ip(ip, ip->base_addr, ip->addr_size);
+            if (!next) {
+                LOG_ERROR("IP %lu at %lx+%lx overlaps a connected IP.", ip->id,
+                          ip->base_addr.load(), ip->addr_size.load());
+                next = map.load()->with_ip(ip, 0, 0);
+            }
+            old = map.exchange(next);
         }
+        retire(old);
+    }
+
+    // Disconnects an IP from the bus, called by ~base_ip and a no-op if @ip is not connected.
+    // @ip: The IP to disconnect.
+    // Returns once no thread can still be accessing the IP through the bus, so the
+    // caller may delete the IP afterwards. An IP may also disconnect itself from its own
+    // slave access, or from inside an epoch_guard; later accesses no longer decode it,
+    // but ones in flight may still reach it after the call, so it must not be deleted there.
+    // The shared memory mapping of a RAM IP stays until the bus is destroyed, since
+    // masters may still hold pointers into it from master_get_shm_ptr or
+    // master_lookup_shm_ptr, and is reused if a RAM is connected over the same window again.
+    void disconnect_ip(base_ip *ip)
+    {
+        const addr_map *old;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            const addr_map *cur = map.load();
+            if (std::find(cur->ips.begin(), cur->ips.end(), ip) == cur->ips.end()) {
+                return;
+            }
+            old = map.exchange(cur->without_ip(ip));
+        }
+        retire(old);
+        epoch_domain::wait_unused(ip); // Accesses that decoded the IP before the swap
+        ip->shm_ptr = nullptr; // No reader can reach the IP any more
+        LOG_DEBUG("Disconnected IP with ID: %lu", ip->id);
+    }
+
+    // Moves an IP to a new address range, e.g. when the guest reprograms a BAR.
+    // @ip: The connected IP to move.
+    // @base: The new base address.
+    // @size: The new size, RAM IPs cannot change size since their shared memory stays mapped.
+    // Returns false if the new range overlaps another IP or the IP cannot be resized.
+    // Accesses in flight complete against the old range, later ones decode the new one.
+    // The bus decodes with the map entries only, the base_addr and addr_size of the IP
+    // are updated for its own use and may lag behind the map for a moment.
+    bool remap_ip(base_ip *ip, uint64_t base, uint64_t size)
+    {
+        const addr_map *old;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (ip->ip_type == IP_TYPE_RAM && size != ip->addr_size) {
+                LOG_ERROR("RAM IP %lu cannot be resized from %lx to %lx.", ip->id,
+                          ip->addr_size.load(), size);
+                return false;
+            }
+            std::unique_ptr<addr_map> removed(map.load()->without_ip(ip));
+            addr_map *next = removed->with_ip(ip, base, size);
+            if (!next) {
+                LOG_ERROR("Remapping IP %lu to %lx+%lx overlaps a connected IP.", ip->id, base, size);
+                return false;
+            }
+            old = map.exchange(next);
+            ip->base_addr = base;
+            ip->addr_size = size;
+        }
+        retire(old);
+        LOG_DEBUG("Remapped IP with ID: %lu to base_addr: %lx, addr_size: %lx", ip->id, base, size);
+        return true;
+    }
+
+    // Version of the address map, changes with every connect, disconnect and remap.
+    // Masters caching a pointer from master_lookup_shm_ptr look it up again when the
+    // version changes, the range may have moved to another IP.
+    uint64_t map_version()
+    {
+        epoch_guard guard;
+        return map.load()->version;
+    }
+
+    // Returns the name of the shared memory segment backing the RAM IPs.
+    const std::string &get_shm_name() const
+    {
+        return shm_name;
+    }
+
+    // Returns the RAM regions placed in the shared memory segment, ordered by address.
+    // Used by the cosim bridge to answer region advertisement requests from QEMU.
+    std::vector<shm_region> get_shm_regions()
+    {
+        std::vector<shm_region> regions;
+        epoch_guard guard;
+        for (const addr_map_entry &e : map.load()->ranges) {
+            if (e.ip->ip_type == IP_TYPE_RAM && e.ip->shm_ptr) {
+                shm_region region = { e.ip->id, e.ip->shm_offset, e.size, e.base };
+                regions.push_back(region);
+            }
+        }
+        return regions;
+    }
+
+    // Returns the doorbells of every connected IP, ordered by address.
+    std::vector<doorbell_region> get_doorbells()
+    {
+        std::vector<doorbell_region> regions;
+        epoch_guard guard;
+        for (const addr_map_entry &e : map.load()->ranges) {
+            const std::vector<ip_doorbell> &d = e.ip->get_doorbells();
+            for (unsigned i = 0; i < d.size(); i++) {
+                regions.push_back(doorbell_region{ e.ip, i, e.base + d[i].offset, d[i].size,
+                                                   d[i].flags, d[i].value });
+            }
+        }
+        return regions;
     }
 
     // Master read and write functions for the bus.
     // These functions are used by IPs to read from and write to the bus.
     // They take a global address and size, and perform the read or write operation.
+    // Decoding is lock-free, the address map is read inside an epoch_guard. The slave is
+    // called after leaving it, kept alive by a hazard pointer (see epoch_ref), so a slow
+    // slave does not hold up topology changes and may remap or disconnect itself.
+    // Accesses to slaves with timing (see set_ip_timing) are accounted as issued now.
     void master_read(uint64_t addr, uint64_t size, void *data)
     {
         LOG_DEBUG("master_read addr: %lx size: %lu", addr, size);
-
-        for (auto &ip : ipList) {
-            if (ip->mem_slave_addr_check(addr)) {
-                ip->mem_slave_access(MMIO_ACCESS_RW_R, addr, size, data);
-                return;
-            }
-        }
-        LOG_ERROR("No IP found for address: %lx", addr);
+        access(MMIO_ACCESS_RW_R, 0, addr, size, data);
     }
 
     // This function writes data to a specific address on the bus.
-    // It checks all connected IPs to find the one that can handle the address.
+    // It decodes the address to find the IP that can handle it.
     // If an IP can handle the address, it performs a write operation on that IP.
     // @addr: The global address where the data should be written.
     // @size: The size of the data to be written.
@@ -93,36 +255,108 @@ public:
     void master_write(uint64_t addr, uint64_t size, void *data)
     {
         LOG_DEBUG("master_write addr: %lx size: %lu", addr, size);
+        access(MMIO_ACCESS_RW_W, 0, addr, size, data);
+    }
 
-        for (auto &ip : ipList) {
-            if (ip->mem_slave_addr_check(addr)) {
-                ip->mem_slave_access(MMIO_ACCESS_RW_W, addr, size, data);
-                return;
-            }
+    // Timed master accesses.
+    // @issue_ns: Time the master issues the access, in steady_clock nanoseconds (e.g. an
+    //            ip_action::timestamp), 0 for now.
+    // Returns the time the access completes according to the slave's timing plus any
+    // latency the slave charged itself (see ip_timing::charge), or the issue time if the
+    // slave has neither or the simulator is in functional mode.
+    uint64_t master_read_at(uint64_t issue_ns, uint64_t addr, uint64_t size, void *data)
+    {
+        return access(MMIO_ACCESS_RW_R, issue_ns, addr, size, data);
+    }
+
+    uint64_t master_write_at(uint64_t issue_ns, uint64_t addr, uint64_t size, void *data)
+    {
+        return access(MMIO_ACCESS_RW_W, issue_ns, addr, size, data);
+    }
+
+    // Give an IP approximate timing, see ip_timing.
+    // @ip: A connected IP.
+    // @latency_ns: Latency of every access.
+    // @bandwidth_mbps: Bandwidth shared by all masters, in MB/s, 0 for unlimited.
+    // @burst_bytes: Bytes accepted without queueing after the slave was idle.
+    // Replaces any previous timing of the IP, the statistics of the old one are kept.
+    void set_ip_timing(base_ip *ip, uint64_t latency_ns, uint64_t bandwidth_mbps,
+                       uint64_t burst_bytes = 0)
+    {
+        // Built outside the lock, clearing the histogram dominates IP construction
+        auto timing = std::make_unique<ip_timing>(latency_ns, bandwidth_mbps, burst_bytes);
+        std::lock_guard<std::mutex> lock(mtx);
+        ip->timing.store(timing.get());
+        timings.emplace_back(ip->id, std::move(timing));
+    }
+
+    // Print per-IP utilization and queueing delay of every IP with timing.
+    void dump_timing_stats()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto &t : timings) {
+            char name[64];
+            snprintf(name, sizeof(name), "bus %d ip %lu timing", bus_id, t.first);
+            t.second->print(name);
         }
-        LOG_ERROR("No IP found for address: %lx", addr);
     }
 
     // For IPs that support shared memory, return a pointer to the shared memory for fast access.
-    // This function checks all IPs to find the one that can handle the address.
+    // This function decodes the address to find the IP that can handle it.
     // If no IP can handle the address, it returns nullptr.
     // This is useful for IPs that need to access shared memory directly without going through the bus.
     // It allows for faster access to shared memory regions.
     // @addr should be a global address that the IP can handle.
-    // Returns a pointer to the start of IP's shared memory if found, otherwise returns nullptr.
+    // Returns a pointer to @addr inside the IP's shared memory if found, otherwise returns nullptr.
+    // The pointer stays valid until the bus is destroyed, but once the IP is disconnected
+    // or remapped it no longer reaches what the bus decodes at @addr (see map_version).
     void *master_get_shm_ptr(uint64_t addr)
     {
-        for (auto &ip : ipList) {
-            if (ip->mem_slave_addr_check(addr) && ip->ip_type == IP_TYPE_RAM) {
-                return ((char *)shm_ptr + addr);
-            }
+        epoch_guard guard;
+        const addr_map_entry *e = map.load()->decode(addr);
+        if (e && e->ip->ip_type == IP_TYPE_RAM && e->ip->shm_ptr) {
+            return ((char *)e->ip->shm_ptr + (addr - e->base));
         }
         LOG_ERROR("No IP found for shared memory address: %lx", addr);
         return nullptr;
     }
+
+    // Like master_get_shm_ptr, but only succeeds if the whole range [addr, addr + size)
+    // is backed by the shared memory of one RAM IP, and does not log on failure.
+    // Used on fast paths which fall back to a regular bus access when it returns nullptr.
+    void *master_lookup_shm_ptr(uint64_t addr, uint64_t size)
+    {
+        epoch_guard guard;
+        const addr_map_entry *e = map.load()->decode(addr);
+        if (e && e->ip->ip_type == IP_TYPE_RAM && e->ip->shm_ptr && e->contains(addr, size)) {
+            return ((char *)e->ip->shm_ptr + (addr - e->base));
+        }
+        return nullptr;
+    }
     
+    // Serve an access to shared memory backed RAM with a copy under the IP lock of the RAM,
+    // with the probes and heat sampling of a bus access but without its trace span,
+    // timing and virtual slave call. Returns false, without accessing anything, unless
+    // [addr, addr + size) is within one RAM; the caller then uses master_read or
+    // master_write. Used by the bridge in functional mode.
+    bool master_access_shm(bool rw, uint64_t addr, uint64_t size, void *data)
+    {
+        epoch_guard guard;
+        const addr_map_entry *e = map.load()->decode(addr);
+        if (!e || e->ip->ip_type != IP_TYPE_RAM || !e->ip->shm_ptr || !e->contains(addr, size)) {
+            return false;
+        }
+        SOC_PROBE3(bus_access_start, rw, addr, size);
+        e->ip->shm_access(rw, addr - e->base, size, data);
+        SOC_PROBE4(bus_access_done, rw, addr, size, e->ip->id);
+        if (heat_profile::enabled()) {
+            heat_profile::sample(rw, e->ip->id, e->base, e->size, addr);
+        }
+        return true;
+    }
+
     // Posts an IRQ to the bus.
-    // This function iterates through the list of connected IPs and checks if any IP can respond to the IRQ.
+    // This function iterates through the connected IPs and checks if any IP can respond to the IRQ.
     // If an IP can respond, it calls the recv_irq method on that IP.
     // If no IP can respond, it logs an error message.
     // @id: The ID of the IP that is sending the IRQ.
@@ -132,21 +366,145 @@ public:
     void post_irq(uint64_t id, uint64_t vector)
     {
         LOG_DEBUG("Posting IRQ: id = %lu, vector = %lu", id, vector);
-        for (auto &ip : ipList) {
-            if (ip->irq_can_resp(id, vector)) {
-                ip->recv_irq(id, vector);
-                return;
+        trace::instant("irq", "irq", id << 32 | vector);
+        SOC_PROBE2(irq_post, id, vector);
+        base_ip *target = nullptr;
+        epoch_ref ref;
+        {
+            epoch_guard guard;
+            for (auto &ip : map.load()->ips) {
+                if (ip->irq_can_resp(id, vector)) {
+                    target = ip;
+                    ref.hold(ip);
+                    break;
+                }
             }
         }
-        LOG_ERROR("No IP can respond to IRQ: id = %lu, vector = %lu", id, vector);
+        if (!target) {
+            LOG_ERROR("No IP can respond to IRQ: id = %lu, vector = %lu", id, vector);
+            return;
+        }
+        target->recv_irq(id, vector);
     }
 
 private:
+    // Decode and perform an access, accounting it on the slave's timing if it has one.
+    // Returns the completion time, or @issue_ns if the access is not timed.
+    uint64_t access(bool rw, uint64_t issue_ns, uint64_t addr, uint64_t size, void *data)
+    {
+        trace_span span(rw == MMIO_ACCESS_RW_R ? "bus_read" : "bus_write", "bus", addr,
+                        size >= trace::bus_min_size());
+        SOC_PROBE3(bus_access_start, rw, addr, size);
+        addr_map_entry e;
+        epoch_ref ref;
+        {
+            epoch_guard guard;
+            const addr_map_entry *found = map.load()->decode(addr);
+            if (!found) {
+                SOC_PROBE3(bus_miss, rw, addr, size);
+                LOG_ERROR("No IP found for address: %lx", addr);
+                return issue_ns;
+            }
+            e = *found;
+            ref.hold(e.ip);
+        }
+        // Accesses the slave makes itself must not take or clear what it charges
+        uint64_t &charged = ip_timing::charged_ns();
+        uint64_t outer = charged;
+        charged = 0;
+        e.ip->mem_slave_access_offset(rw, addr - e.base, size, data);
+        uint64_t modelled = charged;
+        charged = outer;
+        SOC_PROBE4(bus_access_done, rw, addr, size, e.ip->id);
+        if (heat_profile::enabled()) {
+            heat_profile::sample(rw, e.ip->id, e.base, e.size, addr);
+        }
+
+        if (sim_mode::functional()) {
+            return issue_ns;
+        }
+        ip_timing *timing = e.ip->timing.load(std::memory_order_relaxed);
+        if (timing) {
+            return timing->account(issue_ns ? issue_ns : ip_timing::now_ns(), size) + modelled;
+        }
+        if (modelled) {
+            return (issue_ns ? issue_ns : ip_timing::now_ns()) + modelled;
+        }
+        return issue_ns;
+    }
+
+    // Maps the shared memory of a RAM IP, called with mtx held.
+    void map_shm(base_ip *ip)
+    {
+        if (ip->base_addr & (sysconf(_SC_PAGESIZE) - 1)) {
+            LOG_ERROR("RAM IP %lu base_addr %lx is not page aligned.", ip->id, ip->base_addr.load());
+            return;
+        }
+        if (ip->base_addr + ip->addr_size > shm_size) {
+            if (ftruncate(shm_fd, ip->base_addr + ip->addr_size) < 0) {
+                LOG_ERROR("Failed to resize shared memory: %s", strerror(errno));
+                return;
+            }
+            shm_size = ip->base_addr + ip->addr_size;
+        }
+        // A RAM connected again over the same window, e.g. hot-plugged, gets the mapping
+        // it had, which stays for the pointers handed out before it was disconnected
+        for (const shm_mapping &m : shm_maps) {
+            if (m.offset == ip->base_addr && m.size == ip->addr_size) {
+                ip->shm_ptr = m.ptr;
+                ip->shm_offset = m.offset;
+                return;
+            }
+        }
+        // Pages are allocated on first touch, no swap is reserved for untouched RAM
+        void *ptr = mmap(NULL, ip->addr_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE,
+                         shm_fd, ip->base_addr);
+        if (ptr == MAP_FAILED) {
+            LOG_ERROR("Failed to map shared memory: %s", strerror(errno));
+        } else {
+            ip->shm_ptr = ptr; // Set the shared memory pointer in the IP
+            ip->shm_offset = ip->base_addr;
+            shm_maps.push_back(shm_mapping{ ptr, ip->base_addr, ip->addr_size });
+            LOG_INFO("Shared memory mapped at: %p for IP with ID: %lu", ip->shm_ptr, ip->id);
+        }
+    }
+
+    // Frees a map swapped out by a topology change once no reader can see it.
+    // Called without mtx, so other topology changes do not wait for the readers.
+    // Inside a read side critical section it cannot wait, the map is freed by the next
+    // topology change made outside one, or with the bus.
+    void retire(const addr_map *old)
+    {
+        std::vector<const addr_map *> later;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (epoch_domain::in_reader()) {
+                deferred.push_back(old);
+                return;
+            }
+            later.swap(deferred);
+        }
+        epoch_domain::synchronize();
+        delete old;
+        for (const addr_map *m : later) {
+            delete m;
+        }
+    }
+
     int bus_id; // Unique ID for the bus, can be used for debugging or identification.
-    std::mutex mtx;
-    std::list<base_ip *> ipList;
+    std::mutex mtx; // Serializes topology changes, readers never take it.
+    std::atomic<const addr_map *> map{new addr_map()}; // Current address map
+    std::vector<const addr_map *> deferred; // Retired inside a reader, freed by the next retire
+    std::string shm_name; // Name of the shared memory segment, unlinked on destruction.
     int shm_fd; // File descriptor for shared memory.
-    void *shm_ptr; // Pointer to shared memory, if applicable.
+    uint64_t shm_size = 0; // Current size of the shared memory segment.
+    struct shm_mapping {
+        void *ptr;
+        uint64_t offset; // In the segment
+        uint64_t size;
+    };
+    std::vector<shm_mapping> shm_maps; // Mappings owned by the bus, until it is destroyed.
+    std::vector<std::pair<uint64_t, std::unique_ptr<ip_timing> > > timings; // By IP ID.
 };
 
 #endif // BUS_HH
\ No newline at end of file
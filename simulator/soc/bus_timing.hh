@@ -0,0 +1,117 @@
+#ifndef BUS_TIMING_HH
+#define BUS_TIMING_HH
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+
+#include "latency_hist.hh"
+
+// Approximate timing of a bus slave.
+// Each slave is a server with a fixed access latency and a bandwidth, arbitrated first
+// come first served between all masters. Instead of simulating cycles, the slave keeps
+// a token bucket in its virtual scheduling form (GCRA): @tat is the time at which the
+// slave would be idle if every earlier access had been served back to back. An access
+// issued at time T of S bytes starts at max(T, tat - burst), occupies the slave for
+// S / bandwidth and completes one latency later. Accounting an access is a handful of
+// arithmetic operations and one compare-exchange, whatever its size.
+//
+// Times are steady_clock nanoseconds, the same clock as ip_action::timestamp, so
+// untimed accesses issued "now" contend with timed ones issued at action timestamps.
+// The slave keeps @tat in picoseconds since its creation, so back to back accesses of a
+// few bytes add up to the configured bandwidth instead of each rounding up to a whole
+// nanosecond; only the completion time returned is rounded.
+struct ip_timing {
+    // @latency_ns: Fixed latency added to every access.
+    // @bandwidth_mbps: Bandwidth of the slave in MB/s, 0 for unlimited.
+    // @burst_bytes: Bytes the slave absorbs without queueing after being idle, i.e. the
+    //               depth of the token bucket.
+    ip_timing(uint64_t latency_ns, uint64_t bandwidth_mbps, uint64_t burst_bytes)
+        : latency_ns(latency_ns),
+          bandwidth_mbps(bandwidth_mbps),
+          burst_ps(service_ps(burst_bytes)),
+          origin_ns(now_ns())
+    {
+    }
+
+    static uint64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Time to transfer @size bytes in ps, rounded up. One MB/s is one byte per microsecond,
+    // so this is exact to the picosecond for any bandwidth.
+    uint64_t service_ps(uint64_t size) const
+    {
+        return bandwidth_mbps ? (size * 1000000 + bandwidth_mbps - 1) / bandwidth_mbps : 0;
+    }
+
+    // Add @ns to the access the calling thread is serving, for slaves that model their own
+    // latency, e.g. gem5_port with the completion time gem5 reports. Called from inside
+    // mem_slave_read or mem_slave_write, the bus adds it to the completion time of the
+    // access whether or not the slave also has an ip_timing.
+    static void charge(uint64_t ns)
+    {
+        charged_ns() += ns;
+    }
+
+    // Latency charged to the access in progress on this thread.
+    static uint64_t &charged_ns()
+    {
+        thread_local uint64_t ns = 0;
+        return ns;
+    }
+
+    // Account an access of @size bytes issued at @issue_ns, taken as issued at the creation
+    // of the slave if earlier.
+    // Returns the time the access completes.
+    uint64_t account(uint64_t issue_ns, uint64_t size)
+    {
+        uint64_t service = service_ps(size);
+        uint64_t issue_ps = (issue_ns > origin_ns ? issue_ns - origin_ns : 0) * 1000;
+        uint64_t cur = tat.load(std::memory_order_relaxed);
+        uint64_t start;
+        do {
+            start = cur > issue_ps + burst_ps ? cur - burst_ps : issue_ps;
+        } while (!tat.compare_exchange_weak(cur, std::max(cur, issue_ps) + service,
+                                            std::memory_order_relaxed));
+
+        // Statistics cost two more atomic adds, the access count, the busy time and the
+        // end of the measured span are derived from them and from tat when printing
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        queue_delay.record((start - issue_ps) / 1000);
+        if (!first_ns.load(std::memory_order_relaxed)) {
+            uint64_t zero = 0;
+            first_ns.compare_exchange_strong(zero, issue_ns, std::memory_order_relaxed);
+        }
+        return origin_ns + (start + service + 999) / 1000 + latency_ns;
+    }
+
+    // Print accesses, bandwidth, utilization and queueing delay on one line.
+    void print(const char *name) const
+    {
+        uint64_t first = first_ns.load(), last = origin_ns + tat.load() / 1000;
+        double span = last > first ? (double)(last - first) : 1.0;
+        double busy = bandwidth_mbps ? bytes.load() * 1000.0 / bandwidth_mbps : 0.0;
+        printf("%s: accesses=%lu bytes=%lu MB/s=%.1f util=%.1f%% queue ns p50=%lu p99=%lu max=%lu\n",
+               name, (unsigned long)queue_delay.count(), (unsigned long)bytes.load(),
+               bytes.load() * 1000.0 / span, busy * 100.0 / span,
+               (unsigned long)queue_delay.percentile(50),
+               (unsigned long)queue_delay.percentile(99), (unsigned long)queue_delay.max());
+    }
+
+    const uint64_t latency_ns;
+    const uint64_t bandwidth_mbps; // 0 for unlimited
+    const uint64_t burst_ps;
+    const uint64_t origin_ns;          // Creation time, tat counts from it
+
+    std::atomic<uint64_t> tat{0};      // Theoretical arrival time of the next access, in ps
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> first_ns{0}; // Issue time of the first access
+    latency_hist queue_delay;          // Time from issue to start in ns, one per access
+};
+
+#endif // BUS_TIMING_HH
@@ -0,0 +1,424 @@
+#include "cache.hh"
+#include "bus.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CACHE_SIMD_X86 1
+#endif
+
+static bool is_pow2(uint64_t v)
+{
+    return v && !(v & (v - 1));
+}
+
+static unsigned log2_of(uint64_t v)
+{
+    return 63 - __builtin_clzll(v);
+}
+
+static void *alloc_rows(size_t bytes, int fill)
+{
+    bytes = (bytes + 63) & ~(size_t)63;
+    void *p = aligned_alloc(64, bytes);
+    if (p) {
+        memset(p, fill, bytes);
+    }
+    return p;
+}
+
+#ifdef CACHE_SIMD_X86
+// Mask of the @n tags (a multiple of 8) equal to @tag in the 32-byte aligned @row. The
+// compare masks of the whole row are merged before looking at them, a branch per vector
+// would mispredict on every other random hit.
+__attribute__((target("avx2")))
+static uint32_t find_tag_avx2(const uint32_t *row, unsigned n, uint32_t tag)
+{
+    __m256i key = _mm256_set1_epi32(tag);
+    uint32_t mask = 0;
+    for (unsigned i = 0; i < n; i += 8) {
+        __m256i v = _mm256_load_si256((const __m256i *)(row + i));
+        mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, key))) << i;
+    }
+    return mask;
+}
+
+static inline uint32_t find_tag_sse2(const uint32_t *row, unsigned n, uint32_t tag)
+{
+    __m128i key = _mm_set1_epi32(tag);
+    uint32_t mask = 0;
+    for (unsigned i = 0; i < n; i += 4) {
+        __m128i v = _mm_load_si128((const __m128i *)(row + i));
+        mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key))) << i;
+    }
+    return mask;
+}
+#endif
+
+cache_ip::cache_ip(base_bus *bus, uint64_t id, uint64_t base_address, uint64_t size,
+                   uint64_t backing, const cache_config &config)
+    : base_ip(bus, id, IP_TYPE_PERIPHERAL, base_address, size, 0, 0),
+      cfg(config), backing(backing)
+{
+    if (!is_pow2(cfg.sets)) {
+        LOG_ERROR("cache %lu: %lu sets is not a power of two", id, cfg.sets);
+        cfg.sets = cfg.sets ? 1ULL << log2_of(cfg.sets) : 1;
+    }
+    if (!is_pow2(cfg.line_size) || cfg.line_size < 8) {
+        LOG_ERROR("cache %lu: bad line size %lu, using 64", id, cfg.line_size);
+        cfg.line_size = 64;
+    }
+    if (!cfg.ways || cfg.ways > CACHE_MAX_WAYS) {
+        LOG_ERROR("cache %lu: %lu ways, at most %d are supported", id, cfg.ways, CACHE_MAX_WAYS);
+        cfg.ways = std::clamp<uint64_t>(cfg.ways, 1, CACHE_MAX_WAYS);
+    }
+    if (cfg.policy == CACHE_POLICY_PLRU && !is_pow2(cfg.ways)) {
+        LOG_ERROR("cache %lu: tree-PLRU needs a power of two ways, using SRRIP", id);
+        cfg.policy = CACHE_POLICY_SRRIP;
+    }
+
+    line_bits = log2_of(cfg.line_size);
+    set_bits = log2_of(cfg.sets);
+    // Tags wider than 32 bits would alias, such a cache models nothing
+    unsigned tag_shift = line_bits + set_bits;
+    if (size && tag_shift < 64 && ((size - 1) >> tag_shift) > UINT32_MAX) {
+        LOG_ERROR("cache %lu: window of %lx bytes is too large for 32-bit tags, accesses are "
+                  "not cached", id, size);
+        passthrough = true;
+        return;
+    }
+    stride = (cfg.ways + 7) & ~7u;
+    plru_levels = log2_of(cfg.ways);
+    for (unsigned way = 0; way < cfg.ways; way++) {
+        unsigned node = 0;
+        plru_path[way] = plru_away[way] = 0;
+        for (int l = plru_levels - 1; l >= 0; l--) {
+            unsigned dir = (way >> l) & 1;
+            plru_path[way] |= 1u << node;
+            plru_away[way] |= (dir ^ 1) << node;
+            node = 2 * node + 1 + dir;
+        }
+    }
+
+    tags = (uint32_t *)alloc_rows(cfg.sets * stride * sizeof(uint32_t), 0);
+    valid = (uint32_t *)alloc_rows(cfg.sets * sizeof(uint32_t), 0);
+    if (cfg.policy == CACHE_POLICY_PLRU) {
+        plru = (uint32_t *)alloc_rows(cfg.sets * sizeof(uint32_t), 0);
+    } else {
+        // 16 more bytes, the vector compare of the last row may read past it
+        rrpv = (uint8_t *)alloc_rows(cfg.sets * stride + 16, 0);
+    }
+    if (cfg.mode == CACHE_MODE_WRITEBACK) {
+        dirty = (uint8_t *)alloc_rows(cfg.sets * cfg.ways, 0);
+        data = (uint8_t *)alloc_rows(cfg.sets * cfg.ways * cfg.line_size, 0);
+    }
+    if (!tags || !valid || (!plru && !rrpv) ||
+        (cfg.mode == CACHE_MODE_WRITEBACK && (!dirty || !data))) {
+        LOG_ERROR("cache %lu: cannot allocate the tables of %lu sets x %lu ways, accesses are "
+                  "not cached", id, cfg.sets, cfg.ways);
+        free(data);
+        data = nullptr; // The accesses take the statistics mode path, which does nothing
+        passthrough = true;
+        return;
+    }
+
+#ifdef CACHE_SIMD_X86
+    avx2 = __builtin_cpu_supports("avx2");
+#else
+    avx2 = false;
+#endif
+    invalidate();
+}
+
+cache_ip::~cache_ip()
+{
+    free(tags);
+    free(valid);
+    free(plru);
+    free(rrpv);
+    free(dirty);
+    free(data);
+}
+
+void cache_ip::reset()
+{
+    flush();
+    invalidate();
+}
+
+void cache_ip::invalidate()
+{
+    if (passthrough) {
+        return;
+    }
+    memset(valid, 0, cfg.sets * sizeof(uint32_t));
+    if (plru) {
+        memset(plru, 0, cfg.sets * sizeof(uint32_t));
+    }
+    if (rrpv) {
+        for (uint64_t set = 0; set < cfg.sets; set++) {
+            memset(rrpv + set * stride, 3, cfg.ways);
+        }
+    }
+}
+
+int cache_ip::find_way(uint64_t set, uint32_t tag) const
+{
+    const uint32_t *row = tags + set * stride;
+    uint32_t mask;
+#ifdef CACHE_SIMD_X86
+    mask = avx2 ? find_tag_avx2(row, stride, tag) : find_tag_sse2(row, stride, tag);
+#else
+    mask = 0;
+    for (unsigned i = 0; i < cfg.ways; i++) {
+        mask |= (uint32_t)(row[i] == tag) << i;
+    }
+#endif
+    mask &= valid[set]; // Empty ways keep stale tags, and the padding is never valid
+    return mask ? __builtin_ctz(mask) : -1;
+}
+
+int cache_ip::find_rrpv(const uint8_t *row, uint8_t value) const
+{
+#ifdef CACHE_SIMD_X86
+    __m128i key = _mm_set1_epi8(value);
+    uint32_t mask = 0;
+    for (unsigned i = 0; i < stride; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+        mask |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, key)) << i;
+    }
+    mask &= stride < 32 ? (1u << stride) - 1 : ~0u; // Rows of 8 or 24 end mid-vector
+    return mask ? __builtin_ctz(mask) : -1;
+#else
+    for (unsigned i = 0; i < cfg.ways; i++) {
+        if (row[i] == value) {
+            return i;
+        }
+    }
+    return -1;
+#endif
+}
+
+// Tree-PLRU: bit n of plru[set] tells which half below node n holds the next victim,
+// nodes numbered in heap order. An access points every node on its path away from it,
+// which the tables built by the constructor turn into a single masked update.
+void cache_ip::touch(uint64_t set, unsigned way)
+{
+    if (plru) {
+        plru[set] = (plru[set] & ~plru_path[way]) | plru_away[way];
+    } else {
+        rrpv[set * stride + way] = 0; // Hit: predicted to be re-referenced soon
+    }
+}
+
+void cache_ip::insert(uint64_t set, unsigned way)
+{
+    if (plru) {
+        touch(set, way);
+    } else {
+        rrpv[set * stride + way] = 2; // Long re-reference interval until proven useful
+    }
+}
+
+unsigned cache_ip::victim(uint64_t set)
+{
+    // Empty ways first
+    uint32_t empty = ~valid[set] & (cfg.ways < 32 ? (1u << cfg.ways) - 1 : ~0u);
+    if (empty) {
+        return __builtin_ctz(empty);
+    }
+
+    if (plru) {
+        uint32_t bits = plru[set];
+        unsigned node = 0, way = 0;
+        for (unsigned l = 0; l < plru_levels; l++) {
+            unsigned dir = (bits >> node) & 1;
+            way = (way << 1) | dir;
+            node = 2 * node + 1 + dir;
+        }
+        return way;
+    }
+
+    // SRRIP: the first way with a distant re-reference (3), after ageing the set just
+    // enough for one to exist, the same as ageing it one step at a time. The padding of
+    // the row stays 0 so it never matches.
+    uint8_t *r = rrpv + set * stride;
+    int way = find_rrpv(r, 3);
+    if (way >= 0) {
+        return way;
+    }
+    unsigned ways = cfg.ways; // Not reloaded after every byte store
+    uint8_t oldest = 0;
+    for (unsigned w = 0; w < ways; w++) {
+        oldest = std::max(oldest, r[w]);
+    }
+    for (unsigned w = 0; w < ways; w++) {
+        r[w] += 3 - oldest;
+    }
+    return find_rrpv(r, 3);
+}
+
+unsigned cache_ip::lookup(uint64_t line_off, bool rw, bool &hit)
+{
+    uint64_t lineno = line_off >> line_bits;
+    uint64_t set = lineno & (cfg.sets - 1);
+    uint32_t tag = lineno >> set_bits;
+    uint32_t *row = tags + set * stride;
+
+    int way = find_way(set, tag);
+    if (way >= 0) {
+        hit = true;
+        touch(set, way);
+        if (rw) {
+            st.write_hits++;
+        } else {
+            st.read_hits++;
+        }
+    } else {
+        hit = false;
+        if (rw) {
+            st.write_misses++;
+        } else {
+            st.read_misses++;
+        }
+        way = victim(set);
+        if (valid[set] & (1u << way)) {
+            st.evictions++;
+            if (dirty && dirty[set * cfg.ways + way]) {
+                write_back(set, way);
+            }
+        }
+        row[way] = tag;
+        valid[set] |= 1u << way;
+        insert(set, way);
+        if (data) {
+            fill(set, way, line_off);
+        }
+    }
+    if (rw && dirty) {
+        dirty[set * cfg.ways + way] = 1;
+    }
+    return way;
+}
+
+bool cache_ip::access(uint64_t offset, uint64_t size, bool rw)
+{
+    if (passthrough) {
+        return false;
+    }
+    bool all_hit = true;
+    uint64_t mask = cfg.line_size - 1;
+    uint64_t end = offset + (size ? size : 1);
+    for (uint64_t off = offset & ~mask; off < end; off += cfg.line_size) {
+        bool hit;
+        lookup(off, rw, hit);
+        all_hit &= hit;
+    }
+    return all_hit;
+}
+
+void cache_ip::copy_backing(bool rw, uint64_t offset, uint64_t size, void *buf)
+{
+    // Looked up on first use, the backing RAM may be constructed after the cache, and
+    // again whenever the bus topology changes
+    uint64_t version = bus->map_version();
+    if (version != backing_version) {
+        backing_ptr = (uint8_t *)bus->master_lookup_shm_ptr(backing, addr_size);
+        backing_version = version;
+    }
+    if (backing_ptr) {
+        if (rw == MMIO_ACCESS_RW_R) {
+            memcpy(buf, backing_ptr + offset, size);
+        } else {
+            memcpy(backing_ptr + offset, buf, size);
+        }
+    } else if (rw == MMIO_ACCESS_RW_R) {
+        mem_master_read(backing + offset, size, buf);
+    } else {
+        mem_master_write(backing + offset, size, buf);
+    }
+}
+
+void cache_ip::fill(uint64_t set, unsigned way, uint64_t line_off)
+{
+    copy_backing(MMIO_ACCESS_RW_R, line_off, cfg.line_size, line(set, way));
+}
+
+void cache_ip::write_back(uint64_t set, unsigned way)
+{
+    uint64_t lineno = ((uint64_t)tags[set * stride + way] << set_bits) | set;
+    copy_backing(MMIO_ACCESS_RW_W, lineno << line_bits, cfg.line_size, line(set, way));
+    dirty[set * cfg.ways + way] = 0;
+    st.writebacks++;
+}
+
+void cache_ip::flush()
+{
+    if (passthrough || !dirty) {
+        return;
+    }
+    for (uint64_t set = 0; set < cfg.sets; set++) {
+        for (unsigned way = 0; way < cfg.ways; way++) {
+            if (dirty[set * cfg.ways + way]) {
+                write_back(set, way);
+            }
+        }
+    }
+}
+
+void cache_ip::mem_slave_read(uint64_t offset, uint64_t size, void *buf)
+{
+    if (!data) { // Statistics mode, or not cached at all
+        access(offset, size, MMIO_ACCESS_RW_R);
+        copy_backing(MMIO_ACCESS_RW_R, offset, size, buf);
+        return;
+    }
+
+    uint8_t *p = (uint8_t *)buf;
+    uint64_t mask = cfg.line_size - 1;
+    while (size) {
+        uint64_t line_off = offset & ~mask;
+        uint64_t n = std::min(size, cfg.line_size - (offset - line_off));
+        bool hit;
+        unsigned way = lookup(line_off, MMIO_ACCESS_RW_R, hit);
+        memcpy(p, line((line_off >> line_bits) & (cfg.sets - 1), way) + (offset - line_off), n);
+        p += n;
+        offset += n;
+        size -= n;
+    }
+}
+
+void cache_ip::mem_slave_write(uint64_t offset, uint64_t size, void *buf)
+{
+    if (!data) { // Statistics mode, or not cached at all
+        access(offset, size, MMIO_ACCESS_RW_W);
+        copy_backing(MMIO_ACCESS_RW_W, offset, size, buf);
+        return;
+    }
+
+    const uint8_t *p = (const uint8_t *)buf;
+    uint64_t mask = cfg.line_size - 1;
+    while (size) {
+        uint64_t line_off = offset & ~mask;
+        uint64_t n = std::min(size, cfg.line_size - (offset - line_off));
+        bool hit;
+        unsigned way = lookup(line_off, MMIO_ACCESS_RW_W, hit);
+        memcpy(line((line_off >> line_bits) & (cfg.sets - 1), way) + (offset - line_off), p, n);
+        p += n;
+        offset += n;
+        size -= n;
+    }
+}
+
+void cache_ip::print_stats(const char *name) const
+{
+    uint64_t reads = st.read_hits + st.read_misses;
+    uint64_t writes = st.write_hits + st.write_misses;
+    printf("%s: %lu reads %.1f%% hits, %lu writes %.1f%% hits, %lu evictions, %lu writebacks\n",
+           name, (unsigned long)reads, reads ? st.read_hits * 100.0 / reads : 0.0,
+           (unsigned long)writes, writes ? st.write_hits * 100.0 / writes : 0.0,
+           (unsigned long)st.evictions, (unsigned long)st.writebacks);
+}
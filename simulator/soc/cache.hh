@@ -0,0 +1,139 @@
+#ifndef CACHE_HH
+#define CACHE_HH
+
+#include "ip.hh"
+
+#include <cstdint>
+
+enum CACHE_POLICY {
+    CACHE_POLICY_PLRU = 0,  // Tree pseudo-LRU, the number of ways is a power of two
+    CACHE_POLICY_SRRIP = 1, // Static re-reference interval prediction, 2-bit RRPV
+};
+
+enum CACHE_MODE {
+    // Only the tags are modelled: every access is looked up and counted, and the data
+    // goes straight to the backing memory, so the cache stays coherent with QEMU and
+    // with masters accessing the RAM directly.
+    CACHE_MODE_STATS = 0,
+    // Write-back, write-allocate cache holding the data of its lines. Misses fill the
+    // line from the backing memory and evict a victim, writing it back if dirty. The
+    // backing memory is stale until the line is evicted or flush() is called.
+    CACHE_MODE_WRITEBACK = 1,
+};
+
+struct cache_config {
+    uint64_t sets = 1024;    // Power of two
+    uint64_t ways = 16;      // At most CACHE_MAX_WAYS
+    uint64_t line_size = 64; // Power of two, at least 8
+    CACHE_POLICY policy = CACHE_POLICY_PLRU;
+    CACHE_MODE mode = CACHE_MODE_STATS;
+};
+
+#define CACHE_MAX_WAYS 32
+
+struct cache_stats {
+    uint64_t read_hits = 0;
+    uint64_t read_misses = 0;
+    uint64_t write_hits = 0;
+    uint64_t write_misses = 0;
+    uint64_t evictions = 0;  // Valid lines replaced
+    uint64_t writebacks = 0; // Dirty lines written to the backing memory
+};
+
+// Set-associative cache in front of a memory, modelling the locality of the accesses
+// going through it, e.g. DMA buffers of a device model. The cache has its own window
+// on the bus, which maps @size bytes of backing memory at @backing: an access at
+// base + X is looked up in the cache and served from backing + X.
+//
+// Tags are kept in structure-of-arrays layout, one row of 32-bit tags per set padded to
+// a multiple of 8 ways, and a lookup compares a whole row with SIMD instructions (AVX2
+// when the CPU has it, SSE2 otherwise) and keeps the matches among the valid ways of the
+// set, a bit mask per set. Replacement is tree-PLRU or SRRIP, both a few
+// bit operations per access. A lookup in statistics mode costs a few nanoseconds on top
+// of the bus access (see the "cache" case of soc_microbench).
+//
+//     cache_config cfg;                     // 1 MiB, 16 ways, 64 B lines
+//     cache_ip *llc = new cache_ip(bus, 40, 0x2000000000, 0x1000000, 0x400000000, cfg);
+//     ...                                   // DMA through 0x2000000000
+//     llc->print_stats("llc");
+class cache_ip : public base_ip {
+public:
+    // Constructor for cache_ip.
+    // @base_address: Base address of the cache window.
+    // @size: Size of the cache window and of the backing memory.
+    // @backing: Bus address of the backing memory, usually a ram IP.
+    // @cfg: Geometry, replacement policy and mode. Bad parameters are logged and replaced
+    //       by the closest valid ones (see soc_config for a validated setup). A window
+    //       whose tags do not fit in 32 bits, or tables that cannot be allocated, are
+    //       logged too and leave the cache passing accesses to the backing memory
+    //       without looking them up.
+    cache_ip(base_bus *bus, uint64_t id, uint64_t base_address, uint64_t size, uint64_t backing,
+             const cache_config &cfg);
+    ~cache_ip() override;
+
+    // Write back dirty lines and invalidate the whole cache. The statistics are kept.
+    void reset() override;
+
+    void mem_slave_read(uint64_t offset, uint64_t size, void *data) override;
+    void mem_slave_write(uint64_t offset, uint64_t size, void *data) override;
+
+    // Model an access of @size bytes at @offset in the window without transferring data to
+    // the caller (write-back mode still fills and writes back lines), for models that only
+    // want the hit/miss behaviour of their accesses. Not thread-safe
+    // against other accesses, the bus serializes slave accesses with the IP lock.
+    // Returns true if every line of the access hit.
+    bool access(uint64_t offset, uint64_t size, bool rw);
+
+    // Write back every dirty line, in write-back mode.
+    void flush();
+
+    const cache_stats &stats() const
+    {
+        return st;
+    }
+
+    // Print hits, misses and hit rates on one line.
+    void print_stats(const char *name) const;
+
+private:
+    int find_way(uint64_t set, uint32_t tag) const;
+    int find_rrpv(const uint8_t *row, uint8_t value) const;
+    void invalidate();
+    unsigned victim(uint64_t set);
+    void touch(uint64_t set, unsigned way);
+    void insert(uint64_t set, unsigned way);
+    // Look up the line at @line_off, allocating it on a miss. Returns the way.
+    unsigned lookup(uint64_t line_off, bool rw, bool &hit);
+    void fill(uint64_t set, unsigned way, uint64_t line_off);
+    void write_back(uint64_t set, unsigned way);
+    void copy_backing(bool rw, uint64_t offset, uint64_t size, void *data);
+
+    uint8_t *line(uint64_t set, unsigned way)
+    {
+        return data + (set * cfg.ways + way) * cfg.line_size;
+    }
+
+    cache_config cfg;
+    uint64_t backing;
+    unsigned line_bits;
+    unsigned set_bits;
+    unsigned stride;         // Tag row length, ways rounded up to 8
+    unsigned plru_levels;
+    uint32_t plru_path[CACHE_MAX_WAYS]; // Tree nodes on the path to a way
+    uint32_t plru_away[CACHE_MAX_WAYS]; // Their bits pointing away from it
+    bool avx2 = false;
+    bool passthrough = false; // Geometry not modelled, see the constructor
+
+    uint32_t *tags = nullptr;  // [sets][stride], meaningful in the valid ways only
+    uint32_t *valid = nullptr; // [sets] bit mask of the ways holding a line
+    uint32_t *plru = nullptr; // [sets] tree bits, PLRU
+    uint8_t *rrpv = nullptr;  // [sets][stride], SRRIP, 0 in the padding
+    uint8_t *dirty = nullptr; // [sets][ways], write-back
+    uint8_t *data = nullptr;  // [sets][ways][line_size], write-back
+    uint8_t *backing_ptr = nullptr; // Shared memory of the backing RAM, once looked up
+    uint64_t backing_version = ~0ULL; // Bus map version backing_ptr was looked up in
+
+    cache_stats st;
+};
+
+#endif // CACHE_HH
@@ -0,0 +1,182 @@
+#include "coro.hh"
+#include "bus.hh"
+#include "thread_placement.hh"
+#include "slab_pool.hh"
+#include <algorithm>
+#include <new>
+
+// Coroutine frame pools by size class of FRAME_CLASS bytes, larger frames use the heap.
+static const size_t FRAME_CLASS = 64;
+static const size_t FRAME_CLASSES = 16;
+static const size_t FRAMES_PER_SLAB = 64;
+
+static slab_pool *frame_pool(size_t size)
+{
+    static slab_pool *pools = [] {
+        alloc_check::allow init;
+        // Leaked on purpose, frames may still be freed by threads exiting after main()
+        slab_pool *p = (slab_pool *)operator new(sizeof(slab_pool) * FRAME_CLASSES);
+        for (size_t i = 0; i < FRAME_CLASSES; i++) {
+            new (&p[i]) slab_pool((i + 1) * FRAME_CLASS, FRAMES_PER_SLAB);
+        }
+        return p;
+    }();
+    size_t cls = (size + FRAME_CLASS - 1) / FRAME_CLASS;
+    return cls && cls <= FRAME_CLASSES ? &pools[cls - 1] : nullptr;
+}
+
+void *co_task::promise_type::operator new(size_t size)
+{
+    slab_pool *pool = frame_pool(size);
+    return pool ? pool->alloc() : ::operator new(size);
+}
+
+void co_task::promise_type::operator delete(void *p, size_t size)
+{
+    slab_pool *pool = frame_pool(size);
+    if (pool) {
+        pool->free(p);
+    } else {
+        ::operator delete(p);
+    }
+}
+
+co_executor::co_executor(unsigned nr_workers, unsigned nr_blocking)
+{
+    for (unsigned i = 0; i < nr_workers; i++) {
+        threads.emplace_back(&co_executor::worker_func, this);
+    }
+    for (unsigned i = 0; i < nr_blocking; i++) {
+        threads.emplace_back(&co_executor::blocking_func, this);
+    }
+    LOG_DEBUG("co_executor started with %u workers, %u blocking threads", nr_workers, nr_blocking);
+}
+
+co_executor::~co_executor()
+{
+    running.store(false);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(blocking_mtx);
+        blocking_cv.notify_all();
+    }
+    for (auto &t : threads) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+}
+
+co_executor &co_executor::shared()
+{
+    static co_executor inst(std::max(1u, std::thread::hardware_concurrency() / 2), 4);
+    return inst;
+}
+
+void co_executor::schedule(std::coroutine_handle<> h)
+{
+    alloc_check::no_alloc scope;
+    std::lock_guard<std::mutex> lock(mtx);
+    ready.push_grow(h);
+    cv.notify_one();
+}
+
+void co_executor::schedule_at(std::chrono::steady_clock::time_point deadline,
+                              std::coroutine_handle<> h)
+{
+    alloc_check::no_alloc scope;
+    std::lock_guard<std::mutex> lock(mtx);
+    if (timers.size() == timers.capacity()) {
+        alloc_check::allow grow;
+        timers.reserve(std::max(QUEUE_DEPTH, timers.capacity() * 2));
+    }
+    timers.push_back(timer_entry{deadline, h});
+    std::push_heap(timers.begin(), timers.end(), std::greater<timer_entry>());
+    // Wake a worker so it re-arms its wait with the new earliest deadline
+    cv.notify_one();
+}
+
+void co_executor::post_blocking(const co_bus_access &access, std::coroutine_handle<> h)
+{
+    alloc_check::no_alloc scope;
+    std::lock_guard<std::mutex> lock(blocking_mtx);
+    blocking_queue.push_grow(blocking_op{access, h});
+    blocking_cv.notify_one();
+}
+
+void co_executor::worker_func()
+{
+    thread_placement::apply("co_worker", "co_worker");
+    std::unique_lock<std::mutex> lock(mtx);
+
+    while (running.load()) {
+        // Move expired timers to the ready queue
+        auto now = std::chrono::steady_clock::now();
+        while (!timers.empty() && timers.front().deadline <= now) {
+            ready.push_grow(timers.front().handle);
+            std::pop_heap(timers.begin(), timers.end(), std::greater<timer_entry>());
+            timers.pop_back();
+        }
+
+        if (!ready.empty()) {
+            std::coroutine_handle<> h = ready.front();
+            ready.pop();
+            // Resume outside the lock, the coroutine may schedule other coroutines
+            lock.unlock();
+            h.resume();
+            lock.lock();
+        } else if (!timers.empty()) {
+            cv.wait_until(lock, timers.front().deadline);
+        } else {
+            cv.wait(lock);
+        }
+    }
+}
+
+void co_executor::blocking_func()
+{
+    thread_placement::apply("co_blocking", "co_blocking");
+    while (running.load()) {
+        blocking_op op;
+        {
+            std::unique_lock<std::mutex> lock(blocking_mtx);
+            blocking_cv.wait(lock, [this] {
+                return !blocking_queue.empty() || !running.load();
+            });
+            if (blocking_queue.empty()) {
+                break;
+            }
+            op = blocking_queue.front();
+            blocking_queue.pop();
+        }
+        if (op.access.rw == MMIO_ACCESS_RW_R) {
+            op.access.bus->master_read(op.access.addr, op.access.size, op.access.data);
+        } else {
+            op.access.bus->master_write(op.access.addr, op.access.size, op.access.data);
+        }
+        schedule(op.handle);
+    }
+}
+
+bool co_bus_access::await_ready()
+{
+    // Shared memory backed RAM never blocks, complete the access inline. It still goes
+    // through the bus, so the RAM lock, probes, trace, timing and heat profile see it
+    if (!bus->master_lookup_shm_ptr(addr, size)) {
+        return false;
+    }
+    if (rw == MMIO_ACCESS_RW_R) {
+        bus->master_read(addr, size, data);
+    } else {
+        bus->master_write(addr, size, data);
+    }
+    return true;
+}
+
+void co_bus_access::await_suspend(std::coroutine_handle<> h)
+{
+    executor->post_blocking(*this, h);
+}
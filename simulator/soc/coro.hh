@@ -0,0 +1,146 @@
+#ifndef CORO_HH
+#define CORO_HH
+
+#include <cstdint>
+#include <coroutine>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <exception>
+
+#include "debugger.hh"
+#include "sim_mode.hh"
+#include "ring.hh"
+
+class base_bus; // Forward declaration
+struct co_bus_access;
+
+// Coroutine-based device model support.
+// Device behaviors written as coroutines suspend on bus accesses, delays and IRQs instead
+// of blocking an OS thread, so many in-flight operations share a handful of executor threads.
+
+// Fire-and-forget coroutine type.
+// The coroutine starts suspended and is started by co_executor::spawn().
+// Its frame is destroyed automatically when it completes. Frames come from slab pools
+// (see slab_pool.hh) instead of the heap, every action starts a coroutine.
+struct co_task {
+    struct promise_type {
+        static void *operator new(size_t size);
+        static void operator delete(void *p, size_t size);
+
+        co_task get_return_object()
+        {
+            return co_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit co_task(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Executor running coroutines on a fixed pool of worker threads.
+// Workers only ever resume coroutines and never block on device I/O, accesses which may
+// block (e.g. bridge round trips to QEMU) are run on a separate pool of blocking threads
+// and resume the coroutine on completion.
+class co_executor {
+public:
+    // Constructor for co_executor.
+    // @nr_workers: Number of threads resuming coroutines.
+    // @nr_blocking: Number of threads running blocking bus accesses.
+    co_executor(unsigned nr_workers, unsigned nr_blocking);
+
+    // Destructor, stops and joins all threads. Suspended coroutines are leaked.
+    ~co_executor();
+
+    // The executor shared by all coroutine IPs, created on first use.
+    static co_executor &shared();
+
+    // Start a coroutine on the executor.
+    void spawn(co_task task)
+    {
+        schedule(task.handle);
+    }
+
+    // Queue a suspended coroutine to be resumed by a worker.
+    void schedule(std::coroutine_handle<> h);
+
+    // Queue a suspended coroutine to be resumed by a worker at @deadline.
+    void schedule_at(std::chrono::steady_clock::time_point deadline, std::coroutine_handle<> h);
+
+    // Run @access on a blocking thread, then schedule @h.
+    void post_blocking(const co_bus_access &access, std::coroutine_handle<> h);
+
+private:
+    struct timer_entry {
+        std::chrono::steady_clock::time_point deadline;
+        std::coroutine_handle<> handle;
+        bool operator>(const timer_entry &other) const { return deadline > other.deadline; }
+    };
+
+    void worker_func();
+    void blocking_func();
+
+    struct blocking_op;
+
+    // The queues start with room for QUEUE_DEPTH entries and only grow past the deepest
+    // backlog seen, coroutines cannot be pushed back on.
+    static constexpr size_t QUEUE_DEPTH = 256;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    fixed_ring<std::coroutine_handle<> > ready{QUEUE_DEPTH};
+    std::vector<timer_entry> timers; // Min-heap on the deadline
+
+    std::mutex blocking_mtx;
+    std::condition_variable blocking_cv;
+    fixed_ring<blocking_op> blocking_queue{QUEUE_DEPTH};
+
+    std::atomic<bool> running{true};
+    std::vector<std::thread> threads;
+};
+
+// Awaitable bus access.
+// Accesses to shared memory backed RAM complete inline without suspending, other accesses
+// are run on a blocking thread and resume the coroutine once the bus access completed.
+// Both are ordinary master_read/master_write calls.
+struct co_bus_access {
+    co_executor *executor;
+    base_bus *bus;
+    bool rw;
+    uint64_t addr;
+    uint64_t size;
+    void *data;
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() {}
+};
+
+struct co_executor::blocking_op {
+    co_bus_access access;
+    std::coroutine_handle<> handle;
+};
+
+// Awaitable delay, resumes the coroutine after @ns nanoseconds.
+// Completes immediately in functional mode.
+struct co_delay {
+    co_executor *executor;
+    uint64_t ns;
+
+    bool await_ready() { return ns == 0 || sim_mode::functional(); }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        executor->schedule_at(std::chrono::steady_clock::now() + std::chrono::nanoseconds(ns), h);
+    }
+    void await_resume() {}
+};
+
+#endif // CORO_HH
@@ -0,0 +1,64 @@
+#include "coro_ip.hh"
+#include <algorithm>
+
+// Append @v to @vec, growing it outside of the allocation checks.
+template <typename T>
+static void push_grow(std::vector<T> &vec, const T &v)
+{
+    if (vec.size() == vec.capacity()) {
+        alloc_check::allow grow;
+        vec.reserve(std::max<size_t>(8, vec.capacity() * 2));
+    }
+    vec.push_back(v);
+}
+
+void coro_ip::trigger_action(const ip_action &action)
+{
+    alloc_check::no_alloc scope;
+    executor->spawn(run_action(action));
+    LOG_DEBUG("IP %lu spawned action type=%d", id, action.type);
+}
+
+co_task coro_ip::run_action(ip_action action)
+{
+    process_action(action);
+    co_return;
+}
+
+void coro_ip::handle_irq(uint64_t vector)
+{
+    LOG_DEBUG("IP %lu handling IRQ vector %lu", id, vector);
+
+    std::lock_guard<std::mutex> lock(irq_mtx);
+    auto it = std::find_if(irq_waiters.begin(), irq_waiters.end(),
+                           [vector](const auto &w) { return w.first == vector; });
+    if (it != irq_waiters.end()) {
+        executor->schedule(it->second);
+        irq_waiters.erase(it);
+        return;
+    }
+    auto p = std::find_if(irq_pending.begin(), irq_pending.end(),
+                          [vector](const auto &e) { return e.first == vector; });
+    if (p != irq_pending.end()) {
+        p->second++;
+    } else {
+        push_grow(irq_pending, std::make_pair(vector, (uint64_t)1));
+    }
+}
+
+bool coro_ip::irq_awaitable::await_suspend(std::coroutine_handle<> h)
+{
+    std::lock_guard<std::mutex> lock(ip->irq_mtx);
+    uint64_t v = vector;
+    auto it = std::find_if(ip->irq_pending.begin(), ip->irq_pending.end(),
+                           [v](const auto &e) { return e.first == v; });
+    if (it != ip->irq_pending.end()) {
+        // Already received, consume it and continue without suspending
+        if (--it->second == 0) {
+            ip->irq_pending.erase(it);
+        }
+        return false;
+    }
+    push_grow(ip->irq_waiters, std::make_pair(vector, (std::coroutine_handle<>)h));
+    return true;
+}
@@ -0,0 +1,92 @@
+#ifndef CORO_IP_HH
+#define CORO_IP_HH
+
+#include "ip.hh"
+#include "coro.hh"
+
+#include <vector>
+#include <utility>
+
+// Base class for IPs whose actions are coroutines.
+// Instead of processing actions one at a time on a dedicated action thread, every
+// triggered action starts a run_action() coroutine on a shared co_executor, so an IP
+// can have many operations in flight without an OS thread per operation:
+//
+//     co_task my_dma::run_action(ip_action action)
+//     {
+//         uint64_t desc;
+//         co_await bus_read(action.addr, sizeof(desc), &desc);
+//         co_await delay(100);
+//         post_irq(bridge_id, 0);
+//         co_await irq_ack(1);
+//     }
+class coro_ip : public base_ip {
+public:
+    // Constructor for coro_ip, same parameters as base_ip plus the executor to run on.
+    // @executor: Executor running the action coroutines, co_executor::shared() by default.
+    coro_ip(base_bus *bus, uint64_t id, IP_TYPE type,
+            uint64_t base_address, uint64_t size,
+            uint64_t irq_vec_start, uint64_t irq_vector_cnt,
+            co_executor *executor = nullptr)
+        : base_ip(bus, id, type, base_address, size, irq_vec_start, irq_vector_cnt),
+          executor(executor ? executor : &co_executor::shared())
+        {
+        }
+
+    // Start a run_action() coroutine for @action on the executor.
+    void trigger_action(const ip_action &action) override;
+
+    // The coroutine processing an action.
+    // @action: The action to process, passed by value so it lives in the coroutine frame.
+    // The default implementation calls process_action() and completes.
+    virtual co_task run_action(ip_action action);
+
+    // Resumes coroutines waiting in irq_ack() for @vector.
+    void handle_irq(uint64_t vector) override;
+
+    // Awaitable bus accesses, e.g. co_await bus_read(addr, size, &data).
+    co_bus_access bus_read(uint64_t addr, uint64_t size, void *data)
+    {
+        return co_bus_access{executor, bus, MMIO_ACCESS_RW_R, addr, size, data};
+    }
+
+    co_bus_access bus_write(uint64_t addr, uint64_t size, void *data)
+    {
+        return co_bus_access{executor, bus, MMIO_ACCESS_RW_W, addr, size, data};
+    }
+
+    // Awaitable delay of @ns nanoseconds.
+    co_delay delay(uint64_t ns)
+    {
+        return co_delay{executor, ns};
+    }
+
+    // Awaitable for an IRQ with @vector to be received by this IP.
+    // IRQs received while nobody waits are counted, so an acknowledge arriving before
+    // the coroutine suspends is not lost.
+    struct irq_awaitable {
+        coro_ip *ip;
+        uint64_t vector;
+
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> h);
+        void await_resume() {}
+    };
+
+    irq_awaitable irq_ack(uint64_t vector)
+    {
+        return irq_awaitable{this, vector};
+    }
+
+protected:
+    co_executor *executor;
+
+private:
+    std::mutex irq_mtx;
+    // Few vectors are in use at a time, flat arrays keep their capacity so the IRQ path
+    // does not allocate once they grew
+    std::vector<std::pair<uint64_t, uint64_t> > irq_pending; // Vector, IRQs nobody waited for
+    std::vector<std::pair<uint64_t, std::coroutine_handle<> > > irq_waiters; // Vector, waiter
+};
+
+#endif // CORO_IP_HH
@@ -1,57 +1,655 @@
 #include "cosim_bridge.hh"
+#include "bus.hh"
+#include "guest_ram.hh"
+#include "thread_placement.hh"
+#include "sim_mode.hh"
+#include "trace.hh"
+#include "probes.hh"
+#include "heat_profile.hh"
+#include "alloc_check.hh"
+#include "verify.hh"
 
-void cosim_bridge::mem_slave_read(uint64_t offset, uint64_t size, void *data)
+#include <cstdlib>
+#include <poll.h>
+#include <sys/syscall.h>
+
+static inline uint64_t now_ns()
 {
-    exPktCmd cmd;
-    cmd.addr = offset;
-    cmd.length = size;
-    cmd.type = EX_PKT_RD;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Counters written by a single thread and read by others, no atomic read-modify-write needed.
+static inline void counter_add(std::atomic<uint64_t> &c, uint64_t v)
+{
+    c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+// read() until @len bytes arrived, FIFO reads may return less than asked for.
+static ssize_t read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = read(fd, (uint8_t *)buf + done, len - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return ret;
+        }
+        done += ret;
+    }
+    return done;
+}
 
-    ssize_t ret = write(tx_fd_req, &cmd, sizeof(cmd));
+bool cosim_bridge::tx_transaction(exPktCmd &cmd, const void *payload, size_t len,
+                                  void *resp_payload, size_t resp_len)
+{
+    // Header and payload go out in one write, FIFO writes up to PIPE_BUF are atomic
+    uint8_t buf[sizeof(exPktCmd) + TX_BURST_MAX];
+    memcpy(buf, &cmd, sizeof(cmd));
+    if (len) {
+        memcpy(buf + sizeof(cmd), payload, len);
+    }
+
+    alloc_check::no_alloc scope;
+    trace_span span("bridge_tx", "bridge", cmd.addr);
+    int type = cmd.type;
+    uint64_t addr = cmd.addr;
+    int size = cmd.length;
+    uint64_t start = now_ns();
+    ssize_t ret = write(tx_fd_req, buf, sizeof(cmd) + len);
     if (ret < 0) {
         LOG_ERROR("Error writing to tx_fd_req: %s", strerror(errno));
-        return; // Handle error appropriately
-    } else if (ret != sizeof(cmd)) {
+        return false;
+    } else if (ret != (ssize_t)(sizeof(cmd) + len)) {
         LOG_ERROR("Partial write to tx_fd_req.");
-        return; // Handle partial write appropriately
+        return false;
     }
+    tx_packets++;
 
-    ret = read(tx_fd_resp, &cmd, sizeof(cmd));
-    memcpy(data, &cmd.data, size);
+    if (read_full(tx_fd_resp, &cmd, sizeof(cmd)) != sizeof(cmd) ||
+        (resp_len && read_full(tx_fd_resp, resp_payload, resp_len) != (ssize_t)resp_len)) {
+        LOG_ERROR("Error reading from tx_fd_resp.");
+        return false;
+    }
+    uint64_t latency = now_ns() - start;
+    if (!sim_mode::functional()) {
+        tx_latency.record(latency);
+    }
+    SOC_PROBE4(bridge_tx_done, type, addr, size, latency);
+    return true;
+}
+
+const cosim_bridge::tx_region *cosim_bridge::find_tx_region(uint64_t offset, uint64_t size) const
+{
+    for (const tx_region &r : tx_regions) {
+        if (offset >= r.offset && offset + size <= r.offset + r.size) {
+            return &r;
+        }
+    }
+    return nullptr;
+}
+
+bool cosim_bridge::wc_flush()
+{
+    if (!wc_len) {
+        return true;
+    }
+    exPktCmd cmd;
+    cmd.type = EX_PKT_WR_BURST;
+    cmd.addr = wc_start;
+    cmd.length = wc_len;
+    cmd.data = 0;
+    wc_len = 0;
+    if (!tx_transaction(cmd, wc_data, cmd.length, nullptr, 0)) {
+        LOG_ERROR("cosim_bridge lost %d combined bytes at %lx, QEMU did not take the burst.",
+                  cmd.length, wc_start);
+        tx_errors++;
+        return false;
+    }
+    return true;
+}
+
+void cosim_bridge::pf_invalidate(uint64_t offset, uint64_t size)
+{
+    for (tx_line &l : pf_lines) {
+        if (l.offset != ~0ULL && l.offset < offset + size && offset < l.offset + TX_LINE_SIZE) {
+            l.offset = ~0ULL;
+        }
+    }
+}
+
+// Serve a read of a prefetchable region from the line cache, fetching ahead when the
+// reads form a sequential stream. Returns false if the read should go out on its own.
+// Only a read continuing the stream hits, so a master polling one word always sees
+// QEMU's current value, and lines fetched before QEMU's last packet are never used.
+bool cosim_bridge::pf_read(const tx_region &r, uint64_t offset, uint64_t size, void *data)
+{
+    bool sequential = offset == pf_next;
+    pf_seq = sequential ? pf_seq + 1 : 0;
+    pf_next = offset + size;
+
+    uint64_t line = offset & ~(uint64_t)(TX_LINE_SIZE - 1);
+    if (offset + size > line + TX_LINE_SIZE || line < r.offset) {
+        return false; // Crosses a line, or the line starts outside the region
+    }
+    uint64_t gen = rx_gen.load(std::memory_order_acquire);
+    tx_line *l = &pf_lines[(line / TX_LINE_SIZE) % TX_PF_LINES];
+    if (sequential && l->offset == line && l->gen == gen) {
+        memcpy(data, l->data + (offset - line), size);
+        pf_hits++;
+        return true;
+    }
+    if (pf_seq < TX_PF_TRIGGER) {
+        return false;
+    }
+
+    uint64_t len = std::min<uint64_t>(TX_PF_BURST_LINES * TX_LINE_SIZE, r.offset + r.size - line);
+    uint8_t buf[TX_PF_BURST_LINES * TX_LINE_SIZE];
+    exPktCmd cmd;
+    cmd.type = EX_PKT_RD_BURST;
+    cmd.addr = line;
+    cmd.length = len;
+    cmd.data = 0;
+    if (!tx_transaction(cmd, nullptr, 0, buf, len)) {
+        return false;
+    }
+    for (uint64_t off = 0; off + TX_LINE_SIZE <= len; off += TX_LINE_SIZE) {
+        tx_line &fill = pf_lines[((line + off) / TX_LINE_SIZE) % TX_PF_LINES];
+        fill.offset = line + off;
+        fill.gen = gen;
+        memcpy(fill.data, buf + off, TX_LINE_SIZE);
+    }
+    memcpy(data, buf + (offset - line), size);
+    return true;
+}
+
+void cosim_bridge::mem_slave_read(uint64_t offset, uint64_t size, void *data)
+{
+    std::lock_guard<std::mutex> lock(tx_mtx);
+    const tx_region *r = find_tx_region(offset, size);
+
+    // A read must observe earlier writes to the same lines, uncached reads all of them
+    uint64_t line = offset & ~(uint64_t)(TX_LINE_SIZE - 1);
+    uint64_t wc_line = wc_start & ~(uint64_t)(TX_LINE_SIZE - 1);
+    if (wc_len && (!r || (line < wc_start + wc_len && wc_line < offset + size)) &&
+        !wc_flush()) {
+        return; // The read must not overtake the lost writes
+    }
+    if (r && (r->flags & TX_REGION_PREFETCH) && pf_read(*r, offset, size, data)) {
+        return;
+    }
+
+    exPktCmd cmd;
+    cmd.addr = offset;
+    cmd.length = size;
+    cmd.type = EX_PKT_RD;
+    if (tx_transaction(cmd, nullptr, 0, nullptr, 0)) {
+        memcpy(data, &cmd.data, size);
+    }
 }
 
 void cosim_bridge::mem_slave_write(uint64_t offset, uint64_t size, void *data)
 {
+    std::lock_guard<std::mutex> lock(tx_mtx);
+    const tx_region *r = find_tx_region(offset, size);
+    pf_invalidate(offset, size);
+
+    if (r && (r->flags & TX_REGION_WC)) {
+        // Extend the buffered run if the write continues or overwrites it
+        bool mergeable = wc_len && offset >= wc_start && offset <= wc_start + wc_len &&
+                         offset + size - wc_start <= TX_BURST_MAX &&
+                         find_tx_region(wc_start, offset + size - wc_start) == r;
+        if (!mergeable) {
+            if (!wc_flush()) {
+                return;
+            }
+            wc_start = offset;
+            wc_deadline = now_ns() + TX_WC_TIMEOUT_NS;
+            tx_cv.notify_one();
+        }
+        memcpy(wc_data + (offset - wc_start), data, size);
+        wc_len = std::max(wc_len, offset + size - wc_start);
+        wc_merged++;
+        if (wc_len == TX_BURST_MAX) {
+            wc_flush();
+        }
+        return;
+    }
+
+    // Uncached writes may have side effects on anything, keep them ordered after
+    // buffered writes and forget prefetched data
+    pf_invalidate(0, ~0ULL);
+    if (!wc_flush()) {
+        return;
+    }
+
     exPktCmd cmd;
     cmd.addr = offset;
     cmd.length = size;
     cmd.type = EX_PKT_WR;
     memcpy(&cmd.data, data, size);
+    tx_transaction(cmd, nullptr, 0, nullptr, 0);
+}
 
-    ssize_t ret = write(tx_fd_req, &cmd, sizeof(cmd));
-    if (ret < 0) {
-        LOG_ERROR("Error writing to tx_fd_req: %s", strerror(errno));
-        return; // Handle error appropriately
-    } else if (ret != sizeof(cmd)) {
-        LOG_ERROR("Partial write to tx_fd_req.");
-        return; // Handle partial write appropriately
+bool cosim_bridge::tx_fence()
+{
+    std::lock_guard<std::mutex> lock(tx_mtx);
+    pf_invalidate(0, ~0ULL);
+    return wc_flush();
+}
+
+bool cosim_bridge::add_tx_region(uint64_t offset, uint64_t size, uint32_t flags)
+{
+    // Prefetches and bursts work on whole lines, which must not reach outside the region
+    if ((offset | size) & (TX_LINE_SIZE - 1) || size > addr_size || offset > addr_size - size) {
+        LOG_ERROR("cosim_bridge tx region %lx+%lx is not line aligned or not in the window",
+                  offset, size);
+        return false;
     }
 
-    ret = read(tx_fd_resp, &cmd, sizeof(cmd));
+    std::lock_guard<std::mutex> lock(tx_mtx);
+    wc_flush();
+    pf_invalidate(0, ~0ULL);
+
+    // Carve the range out of existing regions, then insert it
+    std::vector<tx_region> next;
+    for (const tx_region &r : tx_regions) {
+        if (r.offset < offset) {
+            next.push_back({ r.offset, std::min(r.size, offset - r.offset), r.flags });
+        }
+        if (r.offset + r.size > offset + size) {
+            uint64_t start = std::max(r.offset, offset + size);
+            next.push_back({ start, r.offset + r.size - start, r.flags });
+        }
+    }
+    if (flags & TX_REGION_FLAGS) {
+        next.push_back({ offset, size, flags & TX_REGION_FLAGS });
+    }
+    std::sort(next.begin(), next.end(),
+              [](const tx_region &a, const tx_region &b) { return a.offset < b.offset; });
+    tx_regions.swap(next);
+    LOG_INFO("cosim_bridge tx region %lx+%lx flags %x", offset, size, flags);
+    return true;
+}
+
+// Flushes combined writes that nobody else flushed within TX_WC_TIMEOUT_NS.
+void cosim_bridge::tx_flush_func()
+{
+    std::unique_lock<std::mutex> lock(tx_mtx);
+    while (!tx_stop) {
+        if (!wc_len) {
+            tx_cv.wait(lock);
+            continue;
+        }
+        uint64_t now = now_ns();
+        if (now >= wc_deadline) {
+            wc_flush();
+        } else {
+            tx_cv.wait_for(lock, std::chrono::nanoseconds(wc_deadline - now));
+        }
+    }
 }
 
 void cosim_bridge::handle_irq(uint64_t vector)
 {
     LOG_DEBUG("cosim_bridge handling IRQ vector %lu", vector);
+    if (!tx_fence()) {
+        // The interrupt would tell the guest about data QEMU never got
+        LOG_ERROR("cosim_bridge dropped IRQ vector %lu after failed writes.", vector);
+        return;
+    }
+
+    uint64_t index = vector - vector_start;
+    int fd = index < irqfds.size() ? irqfds[index].load(std::memory_order_acquire) : -1;
+    if (fd >= 0) {
+        uint64_t one = 1;
+        if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+            LOG_ERROR("Error signalling the irqfd of vector %lu: %s", vector, strerror(errno));
+        }
+        irqs_irqfd.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // Answered like any other request, so the responses on tx_fd_resp stay in step
+    exPktCmd cmd = { EX_PKT_IRQ, 0, 0, vector };
+    std::lock_guard<std::mutex> lock(tx_mtx);
+    if (tx_fd_req >= 0 && tx_transaction(cmd, nullptr, 0, nullptr, 0)) {
+        irqs_packet.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool cosim_bridge::bind_irqfd(uint64_t vector, int fd)
+{
+    uint64_t index = vector - vector_start;
+    if (index >= irqfds.size()) {
+        LOG_ERROR("IRQ vector %lu is not a vector of the bridge.", vector);
+        return false;
+    }
+
+    int old = irqfds[index].load(std::memory_order_acquire);
+    if (old < 0) {
+        irqfds[index].store(fd, std::memory_order_release);
+        return true;
+    }
+    // Swap the new eventfd in under the old fd number
+    if (dup2(fd, old) < 0) {
+        LOG_ERROR("Cannot rebind the irqfd of vector %lu: %s", vector, strerror(errno));
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+BUS_ACCESS_CODE cosim_bridge::handle_guest_ram_ctrl(int op, uint64_t arg, uint64_t data)
+{
+    if (!gram) {
+        LOG_ERROR("Guest RAM control opcode %d without a guest_ram window.", op);
+        return ACCESS_DENIED;
+    }
+
+    switch (op) {
+    case EX_CTRL_GUEST_RAM_ATTACH: {
+        // The RAM backend fd lives in QEMU, reopen it through procfs.
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%lu/fd/%lu", arg, data);
+        if (!gram->attach(path)) {
+            return ACCESS_DENIED;
+        }
+        gram_file_offset = 0;
+        break;
+    }
+    case EX_CTRL_GUEST_RAM_BLOCK:
+        gram->add_ram_block(arg, gram_file_offset, data);
+        gram_file_offset += data;
+        break;
+    case EX_CTRL_IOMMU_MODE:
+        gram->set_iommu_enabled(data != 0);
+        break;
+    case EX_CTRL_IOTLB_MAP:
+        gram->iotlb_map(arg, data & ~0xfffULL, 1ULL << ((data >> 2) & 0x3f), data & IOTLB_PERM_RW);
+        break;
+    case EX_CTRL_IOTLB_UNMAP:
+        gram->iotlb_unmap(arg, 1ULL << ((data >> 2) & 0x3f));
+        break;
+    }
+    return ACCESS_OK;
+}
+
+// Duplicate the file descriptor @fd of process @pid into this process, -1 on failure.
+static int fetch_remote_fd(uint64_t pid, uint64_t fd)
+{
+    int pidfd = syscall(SYS_pidfd_open, (pid_t)pid, 0);
+    if (pidfd < 0) {
+        LOG_ERROR("pidfd_open of process %lu failed: %s", pid, strerror(errno));
+        return -1;
+    }
+    int local = syscall(SYS_pidfd_getfd, pidfd, (int)fd, 0);
+    if (local < 0 && errno == EPERM) {
+        LOG_ERROR("Cannot take fd %lu of process %lu: no ptrace access to it. Under Yama "
+                  "ptrace_scope 1 the process must allow it with prctl(PR_SET_PTRACER).",
+                  fd, pid);
+    } else if (local < 0) {
+        LOG_ERROR("Cannot take fd %lu of process %lu: %s", fd, pid, strerror(errno));
+    }
+    close(pidfd);
+    return local;
+}
+
+BUS_ACCESS_CODE cosim_bridge::handle_doorbell_ctrl(exPktCmd &cmd, uint64_t arg, uint64_t data)
+{
+    std::vector<doorbell_region> doorbells = bus->get_doorbells();
+    if (cmd.length == EX_CTRL_DOORBELL_COUNT) {
+        cmd.data = doorbells.size();
+        return ACCESS_OK;
+    }
+    if (arg >= doorbells.size()) {
+        return ACCESS_ADDR_ERROR;
+    }
+
+    const doorbell_region &d = doorbells[arg];
+    switch (cmd.length) {
+    case EX_CTRL_DOORBELL_ADDR:
+        cmd.addr = d.addr;
+        cmd.data = d.size | d.flags;
+        break;
+    case EX_CTRL_DOORBELL_VALUE:
+        cmd.data = d.value;
+        break;
+    case EX_CTRL_DOORBELL_BIND: {
+        int fd = fetch_remote_fd(data >> 32, data & 0xffffffff);
+        if (fd >= 0 && !d.ip->bind_doorbell(d.index, fd)) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) {
+            LOG_ERROR("Doorbell %lx of IP %lu keeps coming from QEMU as write packets.", d.addr,
+                      d.ip->id);
+            return ACCESS_DENIED;
+        }
+        LOG_INFO("Doorbell %lx of IP %lu bound to an eventfd", d.addr, d.ip->id);
+        break;
+    }
+    }
+    return ACCESS_OK;
+}
+
+void cosim_bridge::handle_ctrl(exPktCmd &cmd)
+{
+    std::vector<shm_region> regions = bus->get_shm_regions();
+    const std::string &name = bus->get_shm_name();
+    uint64_t arg = cmd.addr;
+    uint64_t data = cmd.data;
+    BUS_ACCESS_CODE status = ACCESS_OK;
+
+    cmd.addr = 0;
+    cmd.data = 0;
+    switch (cmd.length) {
+    case EX_CTRL_SHM_NAME:
+        cmd.addr = name.size();
+        // Compare chunk indices, a byte offset of a large @arg would wrap
+        if (arg < (name.size() + sizeof(cmd.data) - 1) / sizeof(cmd.data)) {
+            memcpy(&cmd.data, name.c_str() + arg * sizeof(cmd.data),
+                   std::min(sizeof(cmd.data), name.size() - arg * sizeof(cmd.data)));
+        }
+        break;
+    case EX_CTRL_REGION_COUNT:
+        cmd.data = regions.size();
+        break;
+    case EX_CTRL_REGION_ADDR:
+    case EX_CTRL_REGION_SHM:
+        if (arg >= regions.size()) {
+            status = ACCESS_ADDR_ERROR;
+        } else if (cmd.length == EX_CTRL_REGION_ADDR) {
+            cmd.addr = regions[arg].guest_addr;
+            cmd.data = regions[arg].size;
+        } else {
+            cmd.addr = regions[arg].shm_offset;
+            cmd.data = regions[arg].ip_id;
+        }
+        break;
+    case EX_CTRL_GUEST_RAM_ATTACH:
+    case EX_CTRL_GUEST_RAM_BLOCK:
+    case EX_CTRL_IOMMU_MODE:
+    case EX_CTRL_IOTLB_MAP:
+    case EX_CTRL_IOTLB_UNMAP:
+        status = handle_guest_ram_ctrl(cmd.length, arg, data);
+        break;
+    case EX_CTRL_SIM_MODE:
+        cmd.data = sim_mode::set(data ? SIM_MODE_FUNCTIONAL : SIM_MODE_TIMED);
+        break;
+    case EX_CTRL_TRACE:
+        if (data) {
+            trace::start();
+        } else {
+            cmd.data = trace::stop();
+        }
+        break;
+    case EX_CTRL_HEAT_PROFILE:
+        if (!data) {
+            heat_profile::stop();
+        } else if (arg) {
+            heat_profile::start_timed(data * 1000);
+        } else {
+            heat_profile::start(data);
+        }
+        break;
+    case EX_CTRL_VERIFY:
+        status = mem_verify::run(bus, arg, cmd.data);
+        break;
+    case EX_CTRL_DOORBELL_COUNT:
+    case EX_CTRL_DOORBELL_ADDR:
+    case EX_CTRL_DOORBELL_VALUE:
+    case EX_CTRL_DOORBELL_BIND:
+        status = handle_doorbell_ctrl(cmd, arg, data);
+        break;
+    case EX_CTRL_IRQFD_BIND: {
+        int fd = fetch_remote_fd(data >> 32, data & 0xffffffff);
+        if (fd < 0) {
+            LOG_ERROR("IRQ vector %lu keeps going to QEMU as packets.", arg);
+            status = ACCESS_DENIED;
+        } else if (!bind_irqfd(arg, fd)) {
+            close(fd);
+            status = ACCESS_DENIED;
+        } else {
+            LOG_INFO("IRQ vector %lu bound to an irqfd", arg);
+        }
+        break;
+    }
+    case EX_CTRL_TX_REGION:
+        if (data & (TX_LINE_SIZE - 1) & ~TX_REGION_FLAGS ||
+            !add_tx_region(arg, data & ~(uint64_t)(TX_LINE_SIZE - 1), data & TX_REGION_FLAGS)) {
+            status = ACCESS_DENIED;
+        }
+        break;
+    default:
+        LOG_ERROR("Unknown control opcode: %d", cmd.length);
+        status = ACCESS_DENIED;
+        break;
+    }
+
+    cmd.type = (exPktType)(EX_PKT_CTRL | EX_PKT_RESP_FLAG);
+    cmd.length = status;
+}
+
+void cosim_bridge::dump_latency_stats()
+{
+    tx_latency.print("cosim_bridge tx round trip ns");
+    rx_latency.print("cosim_bridge rx service ns");
+
+    printf("cosim_bridge rx: %lu packets, %lu found polling, %lu sleeps; polling %.1f ms, "
+           "sleeping %.1f ms, poll budget %lu us\n", rx_packets.load(), rx_polled.load(),
+           rx_sleeps.load(), rx_poll_ns.load() / 1e6, rx_sleep_ns.load() / 1e6,
+           (unsigned long)(rx_poll_budget_ns.load() / 1000));
+
+    printf("cosim_bridge irq: %lu through irqfds, %lu as packets\n", irqs_irqfd.load(),
+           irqs_packet.load());
+
+    std::lock_guard<std::mutex> lock(tx_mtx);
+    printf("cosim_bridge tx: %lu packets, %lu writes combined, %lu prefetch hits, "
+           "%lu failed bursts\n", tx_packets, wc_merged, pf_hits, tx_errors);
+}
+
+bool cosim_bridge::fast_forward(exPktCmd &cmd)
+{
+    if (cmd.length < 0 || cmd.length > (int)sizeof(cmd.data)) {
+        return false;
+    }
+    uint64_t data = cmd.type == EX_PKT_RD ? 0 : cmd.data;
+    if (!bus->master_access_shm(cmd.type == EX_PKT_RD ? MMIO_ACCESS_RW_R : MMIO_ACCESS_RW_W,
+                                cmd.addr, cmd.length, &data)) {
+        return false;
+    }
+    if (cmd.type == EX_PKT_RD) {
+        cmd.data = data;
+    } else {
+        cmd.type = EX_PKT_RESP_FLAG;
+    }
+    if (write(rx_fd_resp, &cmd, sizeof(cmd)) != sizeof(cmd)) {
+        LOG_ERROR("Error writing to rx_fd_resp: %s", strerror(errno));
+    }
+    return true;
+}
+
+// Read the next request from QEMU. An empty FIFO is polled for the poll budget, which
+// starts when the previous request was answered, then the thread sleeps in poll() until
+// QEMU writes again. Returns like read().
+ssize_t cosim_bridge::rx_read(exPktCmd &cmd)
+{
+    uint64_t budget = rx_poll_budget_ns.load(std::memory_order_relaxed);
+    if ((budget != 0) != rx_nonblock) {
+        rx_nonblock = budget != 0;
+        fcntl(rx_fd_req, F_SETFL, rx_nonblock ? O_NONBLOCK : 0);
+    }
+    if (!rx_nonblock) {
+        uint64_t start = now_ns();
+        ssize_t ret = read(rx_fd_req, &cmd, sizeof(cmd));
+        counter_add(rx_sleep_ns, now_ns() - start);
+        counter_add(rx_sleeps, 1);
+        return ret;
+    }
+
+    uint64_t idle_start = 0;
+    bool slept = false;
+    while (1) {
+        ssize_t ret = read(rx_fd_req, &cmd, sizeof(cmd));
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret >= 0 || errno != EAGAIN) {
+            if (idle_start) {
+                counter_add(rx_poll_ns, now_ns() - idle_start);
+            }
+            if (ret > 0 && !slept) {
+                counter_add(rx_polled, 1);
+            }
+            return ret;
+        }
+
+        uint64_t now = now_ns();
+        if (!idle_start) {
+            idle_start = now;
+        }
+        if (now - idle_start < budget) {
+            cpu_relax();
+            continue;
+        }
+        counter_add(rx_poll_ns, now - idle_start);
+        struct pollfd pfd = { rx_fd_req, POLLIN, 0 };
+        while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+        }
+        counter_add(rx_sleep_ns, now_ns() - now);
+        counter_add(rx_sleeps, 1);
+        idle_start = 0;
+        slept = true;
+    }
 }
 
 void cosim_bridge::fifo_recv_func()
 {
+    thread_placement::apply("bridge_rx", "bridge_rx");
+
     rx_fd_req = open(rx_fd_req_path, O_RDONLY, 0666);
     if (rx_fd_req < 0) {
         LOG_ERROR("Error opening rx_fd_req: %s", strerror(errno));
     }
     fcntl(rx_fd_req, F_SETFL, 0);
+    rx_nonblock = false;
+
+    // Polling only pays off when QEMU runs on another CPU meanwhile
+    const char *env = getenv("SOC_RX_POLL_US");
+    uint64_t budget = env ? strtoull(env, NULL, 0) * 1000 :
+                      std::thread::hardware_concurrency() > 1 ? RX_POLL_BUDGET_NS : 0;
+    uint64_t unset = ~0ULL;
+    rx_poll_budget_ns.compare_exchange_strong(unset, budget);
 
     rx_fd_resp = open(rx_fd_resp_path, O_WRONLY, 0666);
     if (rx_fd_resp < 0) {
@@ -63,7 +661,7 @@ void cosim_bridge::fifo_recv_func()
     
     while(1) {
         exPktCmd cmd;
-        ssize_t ret = read(rx_fd_req, &cmd, sizeof(cmd));
+        ssize_t ret = rx_read(cmd);
         if (ret < 0) {
             LOG_ERROR("Error reading from rx_fd_req: %s", strerror(errno));
             continue; // Handle error appropriately
@@ -71,9 +669,27 @@ void cosim_bridge::fifo_recv_func()
             LOG_ERROR("EOF reached on rx_fd_req, exiting loop.");
             break; // Exit loop on EOF
         } else {
+            counter_add(rx_packets, 1);
+            // QEMU may have changed prefetchable memory before sending anything, drop
+            // the prefetched lines without waiting for tx_mtx
+            rx_gen.fetch_add(1, std::memory_order_release);
+            // Control packets set up the SoC and may allocate, requests and IRQs must not
+            alloc_check::no_alloc scope;
+            trace_span span("bridge_rx", "bridge", cmd.addr);
+            int type = cmd.type;
+            uint64_t addr = cmd.addr;
+            int size = cmd.length;
+            SOC_PROBE3(bridge_rx_start, type, addr, size);
+            bool functional = sim_mode::functional();
+            uint64_t start = functional ? 0 : now_ns();
             // Process the command
             LOG_DEBUG("Received command: type=%d, addr=0x%lx, length=%d, data=0x%lx",
                       cmd.type, cmd.addr, cmd.length, cmd.data);
+            if (functional && (cmd.type == EX_PKT_RD || cmd.type == EX_PKT_WR) &&
+                fast_forward(cmd)) {
+                SOC_PROBE4(bridge_rx_done, type, addr, size, 0);
+                continue;
+            }
             if (cmd.type == EX_PKT_RD) {
                 uint64_t data = 0;
                 mem_master_read(cmd.addr, cmd.length, &data);
@@ -95,10 +711,27 @@ void cosim_bridge::fifo_recv_func()
                     LOG_ERROR("Partial write to rx_fd_resp.");
                 }
             } else if (cmd.type == EX_PKT_IRQ) {
-                handle_irq(cmd.data); // Assuming cmd.data contains the vector
+                // IRQs from QEMU are not routed into the SoC, and must not be sent
+                // back to QEMU through handle_irq
+                LOG_DEBUG("cosim_bridge IRQ packet from QEMU, vector %lu", cmd.data);
+                tx_fence();
+            } else if (cmd.type == EX_PKT_CTRL) {
+                alloc_check::allow setup;
+                handle_ctrl(cmd);
+                ssize_t write_ret = write(rx_fd_resp, &cmd, sizeof(cmd));
+                if (write_ret < 0) {
+                    LOG_ERROR("Error writing to rx_fd_resp: %s", strerror(errno));
+                } else if (write_ret != sizeof(cmd)) {
+                    LOG_ERROR("Partial write to rx_fd_resp.");
+                }
             } else {
                 LOG_ERROR("Unknown command type: %d", cmd.type);
             }
+            uint64_t latency = functional ? 0 : now_ns() - start;
+            if (!functional) {
+                rx_latency.record(latency);
+            }
+            SOC_PROBE4(bridge_rx_done, type, addr, size, latency);
         }
     }
 }
@@ -119,8 +752,9 @@ void cosim_bridge::cosim_start_polling_remote()
         //throw std::runtime_error("Failed to open tx_fd_resp");
     }
 
+    tx_flusher = std::thread(&cosim_bridge::tx_flush_func, this);
+
     LOG_DEBUG("start listening...\n");
-    auto bindfunc = std::bind(&cosim_bridge::fifo_recv_func, this);
-    std::thread t(bindfunc);
+    std::thread t(&cosim_bridge::fifo_recv_func, this);
     t.detach(); // Detach the thread to run independently
 }
\ No newline at end of file
@@ -1,4 +1,8 @@
+#ifndef COSIM_BRIDGE_HH
+#define COSIM_BRIDGE_HH
+
 #include "ip.hh"
+#include "latency_hist.hh"
 #include <iostream>
 
 #include <cstdint>
@@ -11,14 +15,132 @@
 #include <errno.h>
 #include <string.h>
 #include <functional>
+#include <algorithm>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 enum exPktType {
       EX_PKT_RD = 0,
       EX_PKT_WR = 1,
       EX_PKT_IRQ = 2,
+      EX_PKT_CTRL = 3,
+      EX_PKT_WR_BURST = 4,
+      EX_PKT_RD_BURST = 5,
       EX_PKT_RESP_FLAG = 0x100
 };
 
+// Burst packets carry up to TX_BURST_MAX bytes at exPktCmd.addr, exPktCmd.length is the
+// byte count and exPktCmd.data is unused.
+//   EX_PKT_WR_BURST: the header is followed by the payload on the same FIFO, the
+//                    response is a single header.
+//   EX_PKT_RD_BURST: the response header is followed by the payload.
+// The SoC only sends bursts to regions declared with EX_CTRL_TX_REGION or add_tx_region.
+#define TX_BURST_MAX 256
+#define TX_LINE_SIZE 64
+
+// Control operations carried by EX_PKT_CTRL packets.
+// The opcode is placed in exPktCmd.length and its argument in exPktCmd.addr.
+// The response has type EX_PKT_CTRL | EX_PKT_RESP_FLAG, exPktCmd.length holds a
+// BUS_ACCESS_CODE and exPktCmd.addr/exPktCmd.data hold the results.
+//
+// Region advertisement: QEMU queries the RAM regions of the SoC at setup time and maps
+// them directly from the shared memory segment, so only register windows go through
+// the bridge. Only the SoC end is in this tree: the QEMU device model of the simulator/qemu
+// fork must send these queries, until it does QEMU keeps reaching RAM through the bridge.
+//   EX_CTRL_SHM_NAME:     addr = chunk index, returns addr = name length,
+//                         data = 8 bytes of the shared memory name (NUL padded), 0 past
+//                         the end of the name.
+//   EX_CTRL_REGION_COUNT: returns data = number of RAM regions.
+//   EX_CTRL_REGION_ADDR:  addr = region index, returns addr = guest address, data = size.
+//   EX_CTRL_REGION_SHM:   addr = region index, returns addr = shm offset, data = IP ID.
+//
+// Guest RAM sharing: QEMU shares its guest RAM (memory-backend-memfd or a shared
+// memory-backend-file) so SoC masters reach it through the guest_ram window, and mirrors
+// the guest IOMMU mappings of the device into its IOTLB.
+//   EX_CTRL_GUEST_RAM_ATTACH: addr = QEMU pid, data = fd of the RAM backend in QEMU.
+//   EX_CTRL_GUEST_RAM_BLOCK:  addr = guest physical address, data = size. Blocks are laid
+//                             out back to back in the backend in the order they are sent.
+//   EX_CTRL_IOMMU_MODE:       data = 1 to translate IOVAs, 0 for passthrough.
+//   EX_CTRL_IOTLB_MAP:        addr = IOVA, data = GPA | log2(size) << 2 | IOTLB_PERM_*.
+//   EX_CTRL_IOTLB_UNMAP:      addr = IOVA, data = log2(size) << 2.
+//
+// TX buffering: QEMU declares which parts of the bridge window behave like memory, so
+// SoC accesses to them may be combined into bursts or prefetched.
+//   EX_CTRL_TX_REGION: addr = offset in the bridge window, data = size | TX_REGION_*.
+//                      Offset and size are multiples of TX_LINE_SIZE and the region lies
+//                      in the window, ACCESS_DENIED otherwise. Flags 0 drops the region.
+// Prefetched data only serves reads continuing a sequential stream, and is dropped by
+// every packet from QEMU, so QEMU's updates are seen once it has sent anything after them.
+//
+// Execution mode: QEMU fast-forwards the SoC through boot and switches to the detailed
+// mode for the workload (see sim_mode.hh).
+//   EX_CTRL_SIM_MODE: data = SIM_MODE to switch to, returns data = previous mode.
+//
+// Tracing (see trace.hh):
+//   EX_CTRL_TRACE:    data = 1 to start, 0 to stop and write the trace file in the
+//                     background, returns data = number of events recorded. Stopping
+//                     while tracing is off returns 0 and leaves the file alone.
+//
+// Address heat profile (see heat_profile.hh):
+//   EX_CTRL_HEAT_PROFILE: addr = 0 to sample every data accesses, 1 to sample every data
+//                         microseconds, data = 0 stops sampling.
+//
+// DMA result verification (see verify.hh):
+//   EX_CTRL_VERIFY: addr = bus address of a verify_desc in SoC RAM, returns data = its
+//                   result (CRC32C or number of mismatching ranges).
+//
+// Doorbells (see ip_doorbell): QEMU binds each advertised doorbell address to an eventfd,
+// a KVM ioeventfd for the guest mapping of the address, and hands the eventfd to the SoC,
+// whose action thread then wakes on it directly. Guest writes to the doorbell complete
+// in KVM without a packet or a response. The SoC takes the eventfd from QEMU with
+// pidfd_getfd, which needs ptrace access to QEMU (prctl(PR_SET_PTRACER) under Yama).
+// A failed bind returns ACCESS_DENIED, QEMU then keeps forwarding guest writes to the
+// doorbell as EX_PKT_WR packets, which reach the same IP register.
+//   EX_CTRL_DOORBELL_COUNT: returns data = number of doorbells.
+//   EX_CTRL_DOORBELL_ADDR:  addr = doorbell index, returns addr = bus address,
+//                           data = size | IP_DOORBELL_DATAMATCH if the value must match.
+//   EX_CTRL_DOORBELL_VALUE: addr = doorbell index, returns data = value to match.
+//   EX_CTRL_DOORBELL_BIND:  addr = doorbell index, data = QEMU pid << 32 | eventfd.
+//
+// Interrupts: QEMU registers a KVM irqfd for each MSI/MSI-X vector of the device and hands
+// its eventfd to the SoC, taken the same way as doorbell eventfds. An IRQ the SoC posts
+// to the bridge on a bound vector is a write to the eventfd, injected by KVM without
+// waking QEMU. Vectors without an irqfd, including vectors whose bind failed, are sent
+// as EX_PKT_IRQ requests, data = vector, answered with a header like writes. A failed
+// bind returns ACCESS_DENIED, so QEMU knows to keep serving IRQ packets for the vector.
+//   EX_CTRL_IRQFD_BIND: addr = IRQ vector of the bridge, data = QEMU pid << 32 | eventfd.
+enum exCtrlOp {
+      EX_CTRL_SHM_NAME = 0,
+      EX_CTRL_REGION_COUNT = 1,
+      EX_CTRL_REGION_ADDR = 2,
+      EX_CTRL_REGION_SHM = 3,
+      EX_CTRL_GUEST_RAM_ATTACH = 4,
+      EX_CTRL_GUEST_RAM_BLOCK = 5,
+      EX_CTRL_IOMMU_MODE = 6,
+      EX_CTRL_IOTLB_MAP = 7,
+      EX_CTRL_IOTLB_UNMAP = 8,
+      EX_CTRL_TX_REGION = 9,
+      EX_CTRL_SIM_MODE = 10,
+      EX_CTRL_TRACE = 11,
+      EX_CTRL_HEAT_PROFILE = 12,
+      EX_CTRL_VERIFY = 13,
+      EX_CTRL_DOORBELL_COUNT = 14,
+      EX_CTRL_DOORBELL_ADDR = 15,
+      EX_CTRL_DOORBELL_VALUE = 16,
+      EX_CTRL_DOORBELL_BIND = 17,
+      EX_CTRL_IRQFD_BIND = 18,
+};
+
+// Attributes of a region of the bridge window, accesses outside any region are uncached:
+// one packet each, in order, after flushing buffered writes.
+#define TX_REGION_WC       0x1 // Adjacent writes may be merged into one burst
+#define TX_REGION_PREFETCH 0x2 // Reads have no side effects and may be fetched ahead
+#define TX_REGION_FLAGS    (TX_REGION_WC | TX_REGION_PREFETCH)
+
+class guest_ram; // Forward declaration
+
 typedef struct exPktCmd {
     enum exPktType type;
     int length;
@@ -35,7 +157,11 @@ public:
                  uint64_t irq_vec_start, uint64_t irq_vector_cnt,
                  char *rx_fd_req_path, char *rx_fd_resp_path,
                  char *tx_fd_req_path, char *tx_fd_resp_path)
-        : base_ip(bus, id, IP_TYPE_PERIPHERAL, base_address, size, irq_vec_start, irq_vector_cnt) {
+        : base_ip(bus, id, IP_TYPE_PERIPHERAL, base_address, size, irq_vec_start, irq_vector_cnt),
+          irqfds(irq_vector_cnt) {
+        for (auto &fd : irqfds) {
+            fd.store(-1, std::memory_order_relaxed);
+        }
         this->rx_fd_req_path = rx_fd_req_path;
         this->rx_fd_resp_path = rx_fd_resp_path;
         this->tx_fd_req_path = tx_fd_req_path;
@@ -43,10 +169,19 @@ public:
     }
 
     ~cosim_bridge() override {
+        {
+            std::lock_guard<std::mutex> lock(tx_mtx);
+            tx_stop = true;
+        }
+        tx_cv.notify_all();
+        if (tx_flusher.joinable()) tx_flusher.join();
         if (rx_fd_req >= 0) close(rx_fd_req);
         if (rx_fd_resp >= 0) close(rx_fd_resp);
         if (tx_fd_req >= 0) close(tx_fd_req);
         if (tx_fd_resp >= 0) close(tx_fd_resp);
+        for (auto &fd : irqfds) {
+            if (fd >= 0) close(fd);
+        }
     }
 
     void reset() override {
@@ -56,19 +191,156 @@ public:
     void mem_slave_read(uint64_t offset, uint64_t size, void *data) override;
     void mem_slave_write(uint64_t offset, uint64_t size, void *data) override;
 
+    // Forward an IRQ to QEMU, through the irqfd of @vector if one is bound.
     void handle_irq(uint64_t vector) override;
 
+    // Handle a control packet received from QEMU.
+    // @cmd: The received packet, updated in place with the response.
+    void handle_ctrl(exPktCmd &cmd);
+
+    // Handle a doorbell control opcode.
+    // Returns a BUS_ACCESS_CODE for the response, results are stored in @cmd.
+    BUS_ACCESS_CODE handle_doorbell_ctrl(exPktCmd &cmd, uint64_t arg, uint64_t data);
+
+    // Bind @vector to the eventfd @fd, which the bridge then owns.
+    // Returns false if @vector is not one of the bridge vectors.
+    bool bind_irqfd(uint64_t vector, int fd);
+
+    // Handle a guest RAM or IOMMU control opcode.
+    // Returns a BUS_ACCESS_CODE for the response.
+    BUS_ACCESS_CODE handle_guest_ram_ctrl(int op, uint64_t arg, uint64_t data);
+
+    // Set the guest RAM window updated by guest RAM and IOMMU control packets.
+    void set_guest_ram(guest_ram *ram)
+    {
+        this->gram = ram;
+    }
+
+    // Declare the attributes of a range of the bridge window.
+    // @offset: Offset of the range in the bridge window.
+    // @size: Size of the range.
+    // @flags: TX_REGION_* flags, 0 makes the range uncached again.
+    // Buffered writes are flushed and prefetched lines dropped before the change.
+    // Returns false if the range is not line aligned or not inside the window.
+    bool add_tx_region(uint64_t offset, uint64_t size, uint32_t flags);
+
+    // Flush combined writes to QEMU and drop prefetched lines.
+    // Called before IRQs are forwarded so QEMU sees the data before the interrupt.
+    // Returns false if buffered writes could not be sent and were lost.
+    bool tx_fence();
+
+    // Serve a QEMU read or write of shared memory backed RAM with a copy under the RAM lock
+    // (see base_bus::master_access_shm). Used in functional mode, returns false if @cmd
+    // needs a regular bus access.
+    bool fast_forward(exPktCmd &cmd);
+
+    // Receive loop for QEMU requests. After a request it keeps polling the request FIFO
+    // for the idle budget (see set_rx_poll_budget) so back-to-back requests do not pay a
+    // wake-up each, and blocks once the FIFO stayed empty for the whole budget.
     void fifo_recv_func();
     void fifo_send_func();
     void cosim_start_polling_remote();
 
+    // Print p50/p99/p99.9 latencies of SoC to QEMU round trips and of requests
+    // served for QEMU, in nanoseconds.
+    void dump_latency_stats();
+
+    // Set how long the receive loop busy-polls an empty request FIFO before it blocks,
+    // 0 to always block. Taken into account the next time the loop goes idle.
+    // Without a call the budget is read from the SOC_RX_POLL_US environment variable,
+    // and defaults to RX_POLL_BUDGET_NS on hosts with more than one CPU, 0 otherwise.
+    void set_rx_poll_budget(uint64_t ns)
+    {
+        rx_poll_budget_ns.store(ns, std::memory_order_relaxed);
+    }
+
+    static const uint64_t RX_POLL_BUDGET_NS = 50000;
+
 private:
-    int rx_fd_req;
-    int rx_fd_resp;
-    int tx_fd_req;
-    int tx_fd_resp;
+    int rx_fd_req = -1;
+    int rx_fd_resp = -1;
+    int tx_fd_req = -1;
+    int tx_fd_resp = -1;
     char *rx_fd_req_path;
     char *rx_fd_resp_path;
     char *tx_fd_req_path;
     char *tx_fd_resp_path;
-};
\ No newline at end of file
+
+    latency_hist tx_latency; // SoC to QEMU round trips
+    latency_hist rx_latency; // QEMU requests, from receive to response
+
+    // Receive loop counters, written by the receive thread only
+    std::atomic<uint64_t> rx_poll_budget_ns{~0ULL}; // ~0 until chosen by the receive loop
+    std::atomic<uint64_t> rx_packets{0};
+    std::atomic<uint64_t> rx_polled{0};   // Packets found by polling, without blocking
+    std::atomic<uint64_t> rx_sleeps{0};   // Times the loop blocked for the next packet
+    std::atomic<uint64_t> rx_poll_ns{0};  // Time spent polling an empty FIFO
+    std::atomic<uint64_t> rx_sleep_ns{0}; // Time spent blocked
+    bool rx_nonblock = false;             // rx_fd_req is in O_NONBLOCK mode
+
+    // Irqfd of each bridge vector, -1 when unbound. Bound by control packets, which the
+    // receive thread handles one at a time; a rebind reuses the fd number so a
+    // concurrent handle_irq never writes to a closed fd.
+    std::vector<std::atomic<int> > irqfds;
+    std::atomic<uint64_t> irqs_irqfd{0};  // IRQs injected through an irqfd
+    std::atomic<uint64_t> irqs_packet{0}; // IRQs sent as packets
+
+    guest_ram *gram = nullptr;
+    uint64_t gram_file_offset = 0; // Backend offset of the next guest RAM block
+
+    struct tx_region {
+        uint64_t offset;
+        uint64_t size;
+        uint32_t flags;
+    };
+
+    struct tx_line {
+        uint64_t offset = ~0ULL; // Line aligned offset, ~0 when invalid
+        uint64_t gen = 0;        // rx_gen when the line was fetched
+        uint8_t data[TX_LINE_SIZE];
+    };
+
+    static const int TX_PF_LINES = 8;            // Lines in the prefetch cache
+    static const int TX_PF_BURST_LINES = 4;      // Lines fetched per prefetch burst
+    static const int TX_PF_TRIGGER = 2;          // Sequential reads before prefetching
+    static const uint64_t TX_WC_TIMEOUT_NS = 20000;
+
+    // Send @cmd followed by @len bytes of @payload and wait for the response header and
+    // @resp_len bytes of @resp_payload. Called with tx_mtx held.
+    bool tx_transaction(exPktCmd &cmd, const void *payload, size_t len,
+                        void *resp_payload, size_t resp_len);
+    const tx_region *find_tx_region(uint64_t offset, uint64_t size) const;
+    bool wc_flush(); // False if the burst failed, the buffer is dropped either way
+    void pf_invalidate(uint64_t offset, uint64_t size);
+    bool pf_read(const tx_region &r, uint64_t offset, uint64_t size, void *data);
+    void tx_flush_func();
+    ssize_t rx_read(exPktCmd &cmd);
+
+    // Everything below is protected by tx_mtx. base_ip serializes slave accesses already,
+    // the lock orders them against the timeout flusher and control packets.
+    std::mutex tx_mtx;
+    std::condition_variable tx_cv;
+    std::thread tx_flusher;
+    bool tx_stop = false;
+    std::vector<tx_region> tx_regions; // Sorted by offset, non-overlapping
+
+    uint64_t wc_start = 0;
+    uint64_t wc_len = 0;             // 0 when nothing is buffered
+    uint64_t wc_deadline = 0;        // now_ns() by which the buffer is flushed
+    uint8_t wc_data[TX_BURST_MAX];
+
+    tx_line pf_lines[TX_PF_LINES];   // Direct mapped by line number
+    uint64_t pf_next = ~0ULL;        // Offset a sequential stream reads next
+    int pf_seq = 0;                  // Length of the current sequential stream
+
+    uint64_t tx_packets = 0;         // Packets sent to QEMU
+    uint64_t wc_merged = 0;          // Writes that went into a burst
+    uint64_t pf_hits = 0;            // Reads served from prefetched lines
+    uint64_t tx_errors = 0;          // Combined bursts QEMU did not take
+
+    // Bumped by the receive loop for every packet from QEMU, IRQs included. Prefetched
+    // lines of an older generation are stale.
+    std::atomic<uint64_t> rx_gen{0};
+};
+
+#endif // COSIM_BRIDGE_HH
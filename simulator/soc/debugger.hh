@@ -7,6 +7,8 @@
 #include <atomic>
 #include <mutex>
 
+#include "alloc_check.hh"
+
 class debugger {
 public:
     enum LEVEL {
@@ -26,6 +28,7 @@ public:
                    const char* format, Args... args) {
         auto& inst = instance();
         if(level <= inst.m_level.load()) {
+            alloc_check::allow logging; // Formatting allocates, log levels are for debugging
             std::lock_guard<std::mutex> lock(inst.m_mutex);
             inst.print_log(level, file, line, format, args...);
         }
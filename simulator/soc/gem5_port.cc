@@ -0,0 +1,374 @@
+#include "gem5_port.hh"
+#include "bus_timing.hh"
+#include "debugger.hh"
+
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Yields of an idle stand-in before it sleeps on the doorbell
+#define GEM5_STANDIN_YIELDS 256
+
+// Spinning only helps when the other side runs on another CPU
+static unsigned default_spin_limit()
+{
+    return std::thread::hardware_concurrency() > 1 ? 4000 : 0;
+}
+
+// Shared, not FUTEX_PRIVATE: the other end of the ring may be another process
+static void futex_wait(std::atomic<uint32_t> *word, uint32_t value)
+{
+    struct timespec timeout = { 0, 100 * 1000 * 1000 };
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static uint64_t now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+gem5_ring::gem5_ring(const std::string &shm, uint32_t nr_slots, unsigned timeout_ms)
+    : shm(shm), spin_limit(default_spin_limit()), timeout_ms(timeout_ms)
+{
+    if (nr_slots < 4 || (nr_slots & (nr_slots - 1))) {
+        LOG_ERROR("gem5 ring %s: %u slots is not a power of two of at least 4, using %d",
+                  shm.c_str(), nr_slots, GEM5_PORT_SLOTS);
+        nr_slots = GEM5_PORT_SLOTS;
+    }
+    int fd = shm_open(shm.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0666);
+    if (fd < 0) {
+        LOG_ERROR("gem5 ring %s: shm_open failed: %s", shm.c_str(), strerror(errno));
+        return;
+    }
+    ring_bytes = gem5_port_ring::bytes(nr_slots);
+    void *ptr = MAP_FAILED;
+    if (ftruncate(fd, ring_bytes) == 0) {
+        ptr = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        LOG_ERROR("gem5 ring %s: mapping %zu bytes failed: %s", shm.c_str(), ring_bytes,
+                  strerror(errno));
+        shm_unlink(shm.c_str());
+        return;
+    }
+
+    // The segment is zero filled, only the sequence numbers need setting up
+    gem5_port_ring *r = (gem5_port_ring *)ptr;
+    r->nr_slots = nr_slots;
+    r->slot_size = sizeof(gem5_port_slot);
+    for (uint64_t pos = 0; pos < nr_slots; pos++) {
+        r->slot(pos)->seq.store(pos, std::memory_order_relaxed);
+    }
+    __atomic_store_n(&r->magic, GEM5_PORT_MAGIC, __ATOMIC_RELEASE);
+    ring = r;
+}
+
+gem5_ring::~gem5_ring()
+{
+    if (ring) {
+        munmap(ring, ring_bytes);
+        shm_unlink(shm.c_str());
+    }
+}
+
+bool gem5_ring::wait_seq(gem5_port_slot *s, uint64_t seq)
+{
+    uint64_t progress = 0, deadline = 0;
+    for (unsigned i = 0; s->seq.load(std::memory_order_acquire) != seq; i++) {
+        if (i < spin_limit) {
+            cpu_relax();
+            continue;
+        }
+        sched_yield();
+        if (broken.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        // The clock only matters once spinning is over, a yield costs more than reading it
+        uint64_t now = now_ms();
+        uint64_t p = ring->tail.load(std::memory_order_relaxed) +
+                     ring->heartbeat.load(std::memory_order_relaxed);
+        if (!deadline || p != progress) {
+            progress = p;
+            deadline = now + timeout_ms;
+        } else if (now >= deadline) {
+            if (!broken.exchange(true)) {
+                LOG_ERROR("gem5 ring %s: no progress from the gem5 side in %u ms (%s), its "
+                          "accesses fail from now on", shm.c_str(), timeout_ms,
+                          ring->heartbeat.load() ? "server stopped" : "no server started");
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+bool gem5_ring::transfer(bool rw, uint64_t addr, uint64_t size, void *data, uint64_t &latency_ps)
+{
+    uint8_t *p = (uint8_t *)data;
+    uint64_t first_issue = ~0ULL, last_done = 0;
+    latency_ps = 0;
+    if (!ring || failed()) {
+        if (!ring) {
+            LOG_ERROR("gem5 ring %s is not mapped, access at %lx dropped", shm.c_str(), addr);
+        }
+        if (rw == MMIO_ACCESS_RW_R) {
+            memset(data, 0, size);
+        }
+        return false;
+    }
+    while (size) {
+        // At most half the ring per group, so concurrent masters keep making progress
+        uint64_t n = std::min<uint64_t>((size + GEM5_PORT_DATA - 1) / GEM5_PORT_DATA,
+                                        ring->nr_slots / 2);
+        uint64_t pos = ring->head.fetch_add(n, std::memory_order_relaxed);
+        for (uint64_t i = 0; i < n; i++) {
+            gem5_port_slot *s = ring->slot(pos + i);
+            uint64_t len = std::min<uint64_t>(size - i * GEM5_PORT_DATA, GEM5_PORT_DATA);
+            if (!wait_seq(s, pos + i)) {
+                // The claimed positions stay unpublished, which the ring has failed for anyway
+                if (rw == MMIO_ACCESS_RW_R) {
+                    memset(p, 0, size);
+                }
+                return false;
+            }
+            s->addr = addr + i * GEM5_PORT_DATA;
+            s->size = len;
+            s->rw = rw;
+            if (rw == MMIO_ACCESS_RW_W) {
+                memcpy(s->data, p + i * GEM5_PORT_DATA, len);
+            }
+            s->seq.store(pos + i + 1, std::memory_order_release);
+        }
+        // Pairs with the fence of a server going to sleep, one of the two sees the other
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ring->server_waiting.load(std::memory_order_relaxed)) {
+            ring->doorbell.fetch_add(1);
+            futex_wake(&ring->doorbell);
+        }
+
+        for (uint64_t i = 0; i < n; i++) {
+            gem5_port_slot *s = ring->slot(pos + i);
+            uint64_t len = std::min<uint64_t>(size - i * GEM5_PORT_DATA, GEM5_PORT_DATA);
+            if (!wait_seq(s, pos + i + 2)) {
+                if (rw == MMIO_ACCESS_RW_R) {
+                    memset(p, 0, size);
+                }
+                return false;
+            }
+            if (rw == MMIO_ACCESS_RW_R) {
+                memcpy(p + i * GEM5_PORT_DATA, s->data, len);
+            }
+            first_issue = std::min(first_issue, s->issue_tick);
+            last_done = std::max(last_done, s->done_tick);
+            s->seq.store(pos + i + ring->nr_slots, std::memory_order_release);
+        }
+
+        uint64_t done = std::min(size, n * GEM5_PORT_DATA);
+        p += done;
+        addr += done;
+        size -= done;
+    }
+    latency_ps = last_done > first_issue ? last_done - first_issue : 0;
+    return true;
+}
+
+void gem5_ring::print_stats(const char *name) const
+{
+    uint64_t batches = ring->batches.load(), served = ring->served.load();
+    printf("%s: %lu requests in %lu batches (%.1f per batch), tick %lu ps\n", name,
+           (unsigned long)served, (unsigned long)batches,
+           batches ? (double)served / batches : 0.0, (unsigned long)ring->cur_tick.load());
+}
+
+gem5_port::gem5_port(base_bus *bus, uint64_t id, uint64_t base_address, uint64_t size,
+                     gem5_ring *ring)
+    : base_ip(bus, id, IP_TYPE_PERIPHERAL, base_address, size, 0, 0), ring(ring)
+{
+}
+
+void gem5_port::transfer(bool rw, uint64_t offset, uint64_t size, void *data)
+{
+    uint64_t ps;
+    if (!ring->transfer(rw, base_addr + offset, size, data, ps)) {
+        failures++;
+        return;
+    }
+    modelled.record(ps / 1000);
+    ip_timing::charge(ps / 1000);
+}
+
+void gem5_port::mem_slave_read(uint64_t offset, uint64_t size, void *data)
+{
+    transfer(MMIO_ACCESS_RW_R, offset, size, data);
+}
+
+void gem5_port::mem_slave_write(uint64_t offset, uint64_t size, void *data)
+{
+    transfer(MMIO_ACCESS_RW_W, offset, size, data);
+}
+
+void gem5_port::print_stats(const char *name) const
+{
+    printf("%s: %lu accesses, modelled latency ns p50 %lu p99 %lu max %lu, %lu failed\n", name,
+           (unsigned long)modelled.count(), (unsigned long)modelled.percentile(50),
+           (unsigned long)modelled.percentile(99), (unsigned long)modelled.max(),
+           (unsigned long)failures);
+}
+
+gem5_standin::gem5_standin(const std::string &shm, uint64_t latency_ns, uint64_t bank_ns,
+                           unsigned banks)
+    : latency_ps(latency_ns * 1000), bank_ps(bank_ns * 1000),
+      bank_free(std::max(1u, banks), 0), spin_limit(default_spin_limit())
+{
+    int fd = shm_open(shm.c_str(), O_RDWR, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(gem5_port_ring)) {
+        LOG_ERROR("gem5 stand-in: cannot open ring %s", shm.c_str());
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    void *ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        LOG_ERROR("gem5 stand-in: mapping ring %s failed: %s", shm.c_str(), strerror(errno));
+        return;
+    }
+    gem5_port_ring *r = (gem5_port_ring *)ptr;
+    if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != GEM5_PORT_MAGIC ||
+        r->slot_size != sizeof(gem5_port_slot) ||
+        gem5_port_ring::bytes(r->nr_slots) > (size_t)st.st_size) {
+        LOG_ERROR("gem5 stand-in: %s is not a gem5 port ring", shm.c_str());
+        munmap(ptr, st.st_size);
+        return;
+    }
+    ring = r;
+    ring_bytes = st.st_size;
+    thread = std::thread(&gem5_standin::serve, this);
+}
+
+gem5_standin::~gem5_standin()
+{
+    if (!ring) {
+        return;
+    }
+    stop.store(true);
+    ring->doorbell.fetch_add(1);
+    futex_wake(&ring->doorbell);
+    thread.join();
+    munmap(ring, ring_bytes);
+}
+
+uint8_t *gem5_standin::page(uint64_t addr, bool alloc)
+{
+    auto it = pages.find(addr >> 12);
+    if (it != pages.end()) {
+        return it->second.get();
+    }
+    if (!alloc) {
+        return nullptr;
+    }
+    uint8_t *p = new uint8_t[4096]();
+    pages.emplace(addr >> 12, std::unique_ptr<uint8_t[]>(p));
+    return p;
+}
+
+uint64_t gem5_standin::handle(gem5_port_slot *s, uint64_t tick)
+{
+    uint64_t &bank = bank_free[(s->addr >> 6) % bank_free.size()];
+    uint64_t start = std::max(tick, bank);
+    bank = start + bank_ps;
+    s->issue_tick = tick;
+    s->done_tick = start + bank_ps + latency_ps;
+
+    uint64_t size = std::min<uint64_t>(s->size, GEM5_PORT_DATA);
+    for (uint64_t done = 0; done < size; ) {
+        uint64_t addr = s->addr + done;
+        uint64_t len = std::min(size - done, 4096 - (addr & 4095));
+        uint8_t *pg = page(addr, s->rw == MMIO_ACCESS_RW_W);
+        if (s->rw == MMIO_ACCESS_RW_W) {
+            memcpy(pg + (addr & 4095), s->data + done, len);
+        } else if (pg) {
+            memcpy(s->data + done, pg + (addr & 4095), len);
+        } else {
+            memset(s->data + done, 0, len);
+        }
+        done += len;
+    }
+    return s->done_tick;
+}
+
+void gem5_standin::serve()
+{
+    unsigned idle = 0;
+    ring->heartbeat.fetch_add(1, std::memory_order_relaxed);
+    while (!stop.load(std::memory_order_relaxed)) {
+        // One batch: every request published since the last one, in order
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed), end = tail;
+        while (end - tail < ring->nr_slots &&
+               ring->slot(end)->seq.load(std::memory_order_acquire) == end + 1) {
+            end++;
+        }
+
+        if (end == tail) {
+            // Spin, then yield for a while, which on a single CPU is the fast path, then sleep
+            if (++idle < spin_limit) {
+                cpu_relax();
+                continue;
+            }
+            if (idle < spin_limit + GEM5_STANDIN_YIELDS) {
+                sched_yield();
+                continue;
+            }
+            uint32_t bell = ring->doorbell.load();
+            ring->server_waiting.store(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ring->slot(tail)->seq.load(std::memory_order_acquire) != tail + 1 &&
+                !stop.load()) {
+                futex_wait(&ring->doorbell, bell);
+            }
+            ring->server_waiting.store(0, std::memory_order_relaxed);
+            ring->heartbeat.fetch_add(1, std::memory_order_relaxed);
+            idle = 0;
+            continue;
+        }
+
+        uint64_t tick = ring->cur_tick.load(std::memory_order_relaxed), next = ~0ULL;
+        for (uint64_t pos = tail; pos < end; pos++) {
+            gem5_port_slot *s = ring->slot(pos);
+            next = std::min(next, handle(s, tick));
+            s->seq.store(pos + 2, std::memory_order_release);
+        }
+        ring->tail.store(end, std::memory_order_release);
+        ring->cur_tick.store(std::max(tick + 1, next), std::memory_order_relaxed);
+        ring->batches.fetch_add(1, std::memory_order_relaxed);
+        ring->served.fetch_add(end - tail, std::memory_order_relaxed);
+        ring->heartbeat.fetch_add(1, std::memory_order_relaxed);
+        idle = 0;
+    }
+}
@@ -0,0 +1,185 @@
+#ifndef GEM5_PORT_HH
+#define GEM5_PORT_HH
+
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+
+#include "ip.hh"
+#include "latency_hist.hh"
+
+// Forwarding of bus ranges to a gem5 memory system.
+//
+// Most of the SoC runs on the approximate timing of ip_timing; address ranges that need
+// detailed memory timing are given to a gem5_port instead of a ram IP. Every access to a
+// port becomes one request per GEM5_PORT_DATA bytes in a gem5_ring, a request ring in a
+// shared memory segment of its own. The gem5 side (a SimObject polling the ring, or the
+// gem5_standin timing server for runs without gem5) takes every request published since
+// its last tick as one batch, issues the batch into its memory system at the current
+// tick and completes each request with its data and completion tick. Several ports,
+// e.g. the channels of one memory, may share a ring so concurrent masters batch
+// together.
+//
+// Ring protocol, for the request at position p (slot p % nr_slots, positions start at 0):
+//   seq == p             slot free, the SoC fills it and sets seq = p + 1
+//   seq == p + 1         request published, gem5 serves it and sets seq = p + 2
+//   seq == p + 2         completed, the SoC copies the result and sets seq = p + nr_slots
+// The SoC claims positions with head.fetch_add, gem5 serves them in order from tail.
+// A sleeping server sets server_waiting and waits on the doorbell futex, which the SoC
+// increments and wakes after publishing. The server bumps heartbeat when it starts, after
+// every batch and whenever it wakes up, at least every 100 ms while it sleeps. An access
+// that sees neither tail nor heartbeat move for the timeout of the ring fails, and so
+// does every later access to the ring, since the requests it claimed are never served.
+
+#define GEM5_PORT_MAGIC 0x31747270356d6567ULL // "gem5prt1"
+#define GEM5_PORT_DATA 64                     // Payload bytes per request
+#define GEM5_PORT_SLOTS 256
+#define GEM5_PORT_TIMEOUT_MS 5000             // Without progress from the gem5 side
+
+struct alignas(64) gem5_port_slot {
+    std::atomic<uint64_t> seq;
+    uint64_t addr;         // Bus address
+    uint32_t size;         // 1 to GEM5_PORT_DATA
+    uint32_t rw;           // MMIO_ACCESS_RW_R or MMIO_ACCESS_RW_W
+    uint64_t issue_tick;   // Written by gem5, in ps
+    uint64_t done_tick;
+    uint8_t data[GEM5_PORT_DATA];
+};
+
+struct gem5_port_ring {
+    uint64_t magic;
+    uint32_t nr_slots;     // Power of two
+    uint32_t slot_size;    // sizeof(gem5_port_slot), checked by gem5
+    alignas(64) std::atomic<uint64_t> head; // Next position claimed by the SoC
+    alignas(64) std::atomic<uint64_t> tail; // Next position served by gem5
+    std::atomic<uint64_t> cur_tick;         // gem5 time, in ps
+    std::atomic<uint64_t> batches;
+    std::atomic<uint64_t> served;
+    alignas(64) std::atomic<uint32_t> doorbell;
+    std::atomic<uint32_t> server_waiting;
+    std::atomic<uint64_t> heartbeat;        // Bumped by the server, 0 until it runs
+    // Followed by nr_slots gem5_port_slot at the next multiple of 64 bytes
+
+    gem5_port_slot *slot(uint64_t pos)
+    {
+        return (gem5_port_slot *)((uint8_t *)this + sizeof(*this)) + (pos & (nr_slots - 1));
+    }
+
+    static size_t bytes(uint32_t nr_slots)
+    {
+        return sizeof(gem5_port_ring) + nr_slots * sizeof(gem5_port_slot);
+    }
+};
+
+// The SoC end of a ring: creates the shared memory segment and unlinks it when deleted.
+class gem5_ring {
+public:
+    // @shm: Shared memory name, e.g. soc_instance::shm_name("gem5_port").
+    // @nr_slots: Power of two, at least 4.
+    // @timeout_ms: Time an access waits without progress from the gem5 side before it
+    //              fails, including for a server that has not started yet.
+    gem5_ring(const std::string &shm, uint32_t nr_slots = GEM5_PORT_SLOTS,
+              unsigned timeout_ms = GEM5_PORT_TIMEOUT_MS);
+    ~gem5_ring();
+
+    bool ok() const
+    {
+        return ring != nullptr;
+    }
+
+    const std::string &name() const
+    {
+        return shm;
+    }
+
+    // Forward an access of @size bytes at bus address @addr and wait for its completion.
+    // @latency_ps: Set to the modelled latency, from the issue tick of the first request
+    //              to the completion of the last.
+    // Returns false, with read data zeroed, if the ring is not mapped or has failed.
+    bool transfer(bool rw, uint64_t addr, uint64_t size, void *data, uint64_t &latency_ps);
+
+    // True once the gem5 side stopped making progress, every access fails from then on.
+    bool failed() const
+    {
+        return broken.load(std::memory_order_relaxed);
+    }
+
+    // Print the requests served and the average batch size on one line.
+    void print_stats(const char *name) const;
+
+private:
+    // Wait for @s to reach @seq, returns false if the ring fails meanwhile.
+    bool wait_seq(gem5_port_slot *s, uint64_t seq);
+
+    std::string shm;
+    gem5_port_ring *ring = nullptr;
+    size_t ring_bytes = 0;
+    unsigned spin_limit; // Busy polls before yielding, 0 on a single CPU
+    unsigned timeout_ms;
+    std::atomic<bool> broken{false};
+};
+
+// A bus window whose accesses are served by gem5 through a gem5_ring. The latency gem5
+// models for an access is charged to it (see ip_timing::charge), so timed masters see
+// it in the completion time of master_read_at and master_write_at. A failed access is
+// logged by the ring and reads zeros.
+class gem5_port : public base_ip {
+public:
+    // @ring: Shared with other ports, must outlive the port.
+    gem5_port(base_bus *bus, uint64_t id, uint64_t base_address, uint64_t size, gem5_ring *ring);
+
+    void reset() override {}
+
+    void mem_slave_read(uint64_t offset, uint64_t size, void *data) override;
+    void mem_slave_write(uint64_t offset, uint64_t size, void *data) override;
+
+    // Print the accesses, their modelled latency and the failed ones on one line.
+    void print_stats(const char *name) const;
+
+private:
+    void transfer(bool rw, uint64_t offset, uint64_t size, void *data);
+
+    gem5_ring *ring;
+    latency_hist modelled; // ns, accessed under the IP lock
+    uint64_t failures = 0;
+};
+
+// Stand-in for the gem5 side of a ring, for runs and tests without gem5: a thread serving
+// batches with a banked memory model. Requests are spread over @banks banks by 64-byte
+// line, each request occupies its bank for @bank_ns and completes @latency_ns after that.
+// After every batch the tick advances to the earliest completion in it, as gem5 would
+// run to its next event. Data is kept in sparse pages allocated on first write.
+class gem5_standin {
+public:
+    // Opens the ring @shm, which may belong to another process.
+    gem5_standin(const std::string &shm, uint64_t latency_ns = 50, uint64_t bank_ns = 10,
+                 unsigned banks = 16);
+    ~gem5_standin();
+
+    bool ok() const
+    {
+        return ring != nullptr;
+    }
+
+private:
+    void serve();
+    // Serve @s issued at @tick, returns its completion tick.
+    uint64_t handle(gem5_port_slot *s, uint64_t tick);
+    uint8_t *page(uint64_t addr, bool alloc);
+
+    gem5_port_ring *ring = nullptr;
+    size_t ring_bytes = 0;
+    uint64_t latency_ps;
+    uint64_t bank_ps;
+    std::vector<uint64_t> bank_free; // Tick each bank becomes idle
+    std::unordered_map<uint64_t, std::unique_ptr<uint8_t[]> > pages;
+    unsigned spin_limit;
+    std::atomic<bool> stop{false};
+    std::thread thread;
+};
+
+#endif // GEM5_PORT_HH
@@ -0,0 +1,253 @@
+#include "guest_ram.hh"
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+guest_ram::~guest_ram()
+{
+    if (map_ptr) {
+        munmap(map_ptr, map_size);
+    }
+}
+
+void guest_ram::reset()
+{
+    LOG_DEBUG("guest_ram reset called.");
+    std::lock_guard<std::mutex> lock(iotlb_mtx);
+    iotlb.clear();
+    iommu_enabled = false;
+    tcache_gen++;
+}
+
+bool guest_ram::attach(const char *path)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        LOG_ERROR("Failed to open guest RAM %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        LOG_ERROR("Failed to get size of guest RAM %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    void *ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        LOG_ERROR("Failed to map guest RAM %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(iotlb_mtx);
+    if (map_ptr) {
+        munmap(map_ptr, map_size);
+    }
+    map_ptr = (uint8_t *)ptr;
+    map_size = st.st_size;
+    ram_blocks.clear();
+    tcache_gen++;
+    LOG_INFO("guest_ram %lu attached %s, size: %lx", id, path, map_size);
+    return true;
+}
+
+void guest_ram::add_ram_block(uint64_t gpa, uint64_t file_offset, uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(iotlb_mtx);
+    if (!map_ptr || size > map_size || file_offset > map_size - size) {
+        LOG_ERROR("guest_ram %lu: RAM block gpa: %lx offset: %lx size: %lx outside of mapping.",
+                  id, gpa, file_offset, size);
+        return;
+    }
+    ram_block block = { gpa, size, map_ptr + file_offset };
+    ram_blocks.push_back(block);
+    tcache_gen++;
+    LOG_DEBUG("guest_ram %lu RAM block gpa: %lx offset: %lx size: %lx", id, gpa, file_offset, size);
+}
+
+void guest_ram::set_iommu_enabled(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(iotlb_mtx);
+    iommu_enabled = enabled;
+    tcache_gen++;
+    LOG_DEBUG("guest_ram %lu IOMMU %s", id, enabled ? "enabled" : "passthrough");
+}
+
+void guest_ram::iotlb_map(uint64_t iova, uint64_t gpa, uint64_t size, int perm)
+{
+    std::lock_guard<std::mutex> lock(iotlb_mtx);
+    iotlb_entry entry = { iova, gpa, size, perm };
+    iotlb[iova] = entry;
+    tcache_gen++;
+    LOG_DEBUG("guest_ram %lu IOTLB map iova: %lx gpa: %lx size: %lx perm: %d",
+              id, iova, gpa, size, perm);
+}
+
+void guest_ram::iotlb_unmap(uint64_t iova, uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(iotlb_mtx);
+    auto it = iotlb.lower_bound(iova);
+    while (it != iotlb.end() && it->first < iova + size) {
+        it = iotlb.erase(it);
+    }
+    tcache_gen++;
+    LOG_DEBUG("guest_ram %lu IOTLB unmap iova: %lx size: %lx", id, iova, size);
+}
+
+uint8_t *guest_ram::gpa_to_host(uint64_t gpa, uint64_t &left)
+{
+    left = 0;
+    if (ram_blocks.empty()) {
+        left = gpa < map_size ? map_size - gpa : 0;
+        return left ? map_ptr + gpa : nullptr;
+    }
+    for (auto &block : ram_blocks) {
+        if (gpa >= block.gpa && gpa - block.gpa < block.size) {
+            left = block.size - (gpa - block.gpa);
+            return block.host + (gpa - block.gpa);
+        }
+    }
+    return nullptr;
+}
+
+uint8_t *guest_ram::lookup(uint64_t iova, int &perm, uint64_t &left)
+{
+    uint64_t gpa;
+    uint64_t entry_left = ~0ULL;
+    perm = IOTLB_PERM_RW;
+    if (iommu_enabled) {
+        auto it = iotlb.upper_bound(iova);
+        if (it == iotlb.begin()) {
+            return nullptr;
+        }
+        --it;
+        const iotlb_entry &entry = it->second;
+        if (iova - entry.iova >= entry.size) {
+            return nullptr;
+        }
+        gpa = entry.gpa + (iova - entry.iova);
+        perm = entry.perm;
+        entry_left = entry.size - (iova - entry.iova);
+    } else {
+        gpa = iova;
+    }
+
+    uint8_t *host = gpa_to_host(gpa, left);
+    left = std::min(left, entry_left);
+    return host;
+}
+
+uint8_t *guest_ram::translate(uint64_t iova, bool rw, uint64_t &len)
+{
+    uint64_t iova_page = iova >> PAGE_SHIFT;
+    uint64_t page_off = iova & (PAGE_SIZE - 1);
+    tcache_entry &tc = tcache[iova_page % TCACHE_ENTRIES];
+    int need = (rw == MMIO_ACCESS_RW_R) ? IOTLB_PERM_RO : IOTLB_PERM_WO;
+
+    len = PAGE_SIZE - page_off;
+    if (tc.gen == tcache_gen && tc.iova_page == iova_page) {
+        tcache_hits.fetch_add(1, std::memory_order_relaxed);
+        return (tc.perm & need) ? tc.host_page + page_off : nullptr;
+    }
+    tcache_misses.fetch_add(1, std::memory_order_relaxed);
+
+    // Only a page mapped whole by one IOTLB entry and one RAM block is cached, a page
+    // split between mappings or running off the end of one is translated every time
+    int perm;
+    uint64_t left;
+    uint8_t *host_page = lookup(iova - page_off, perm, left);
+    if (host_page && left >= PAGE_SIZE) {
+        tc.iova_page = iova_page;
+        tc.gen = tcache_gen;
+        tc.host_page = host_page;
+        tc.perm = perm;
+        return (perm & need) ? host_page + page_off : nullptr;
+    }
+
+    uint8_t *host = lookup(iova, perm, left);
+    len = std::min(len, left);
+    return host && (perm & need) ? host : nullptr;
+}
+
+bool guest_ram::range_mapped(bool rw, uint64_t offset, uint64_t size)
+{
+    while (size) {
+        uint64_t len;
+        if (!translate(offset, rw, len)) {
+            return false;
+        }
+        len = std::min(len, size);
+        offset += len;
+        size -= len;
+    }
+    return true;
+}
+
+void guest_ram::access(bool rw, uint64_t offset, uint64_t size, void *data)
+{
+    std::lock_guard<std::mutex> lock(iotlb_mtx);
+    uint8_t *buf = (uint8_t *)data;
+
+    // memaddr_can_access checked the range, but the guest may have changed the mapping
+    // since. Checking again first keeps a faulting write from being partially applied.
+    if (!range_mapped(rw, offset, size)) {
+        LOG_ERROR("guest_ram %lu: %s fault at iova: %lx size: %lx", id,
+                  rw == MMIO_ACCESS_RW_R ? "read" : "write", offset, size);
+        if (rw == MMIO_ACCESS_RW_R) {
+            memset(buf, 0xff, size);
+        }
+        return;
+    }
+
+    // Translate piece by piece, contiguous IOVAs need not be contiguous in guest RAM
+    while (size) {
+        uint64_t len;
+        uint8_t *host = translate(offset, rw, len);
+        len = std::min(len, size);
+        if (rw == MMIO_ACCESS_RW_R) {
+            memcpy(buf, host, len);
+        } else {
+            memcpy(host, buf, len);
+        }
+        buf += len;
+        offset += len;
+        size -= len;
+    }
+}
+
+BUS_ACCESS_CODE guest_ram::memaddr_can_access(bool rw, uint64_t offset, uint64_t size)
+{
+    if (size > addr_size || offset > addr_size - size) {
+        return ACCESS_ADDR_ERROR;
+    }
+    // attach and the IOTLB updates run concurrently, from the bridge RX thread
+    std::lock_guard<std::mutex> lock(iotlb_mtx);
+    if (!map_ptr) {
+        LOG_ERROR("guest_ram %lu accessed before guest RAM was attached.", id);
+        return ACCESS_DENIED;
+    }
+    if (!range_mapped(rw, offset, size)) {
+        LOG_ERROR("guest_ram %lu: %s fault at iova: %lx size: %lx", id,
+                  rw == MMIO_ACCESS_RW_R ? "read" : "write", offset, size);
+        return ACCESS_ADDR_ERROR;
+    }
+    return ACCESS_OK;
+}
+
+void guest_ram::mem_slave_read(uint64_t offset, uint64_t size, void *data)
+{
+    access(MMIO_ACCESS_RW_R, offset, size, data);
+    LOG_DEBUG("guest_ram read: iova: %lx size: %lx", offset, size);
+}
+
+void guest_ram::mem_slave_write(uint64_t offset, uint64_t size, void *data)
+{
+    access(MMIO_ACCESS_RW_W, offset, size, data);
+    LOG_DEBUG("guest_ram write: iova: %lx size: %lx", offset, size);
+}
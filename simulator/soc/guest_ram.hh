@@ -0,0 +1,131 @@
+#ifndef GUEST_RAM_HH
+#define GUEST_RAM_HH
+
+#include "ip.hh"
+#include <iostream>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// IOTLB permission bits, matching QEMU's IOMMUAccessFlags.
+#define IOTLB_PERM_RO 1
+#define IOTLB_PERM_WO 2
+#define IOTLB_PERM_RW (IOTLB_PERM_RO | IOTLB_PERM_WO)
+
+// Guest RAM window IP.
+// Maps QEMU's guest RAM (a shared memory-backend-memfd or memory-backend-file) into the
+// SoC address space, so SoC masters such as DMA engines access guest memory with a host
+// memcpy instead of one bridge round trip per 8 bytes.
+// An access at offset X of the window is an access to IOVA X of the device. IOVAs are
+// translated to guest physical addresses through an IOTLB kept in sync with the guest
+// IOMMU by the cosim bridge, or used as guest physical addresses directly when the
+// IOMMU is in passthrough mode.
+class guest_ram : public base_ip {
+public:
+    using base_ip::base_ip;
+
+    guest_ram(base_bus *bus, uint64_t id,
+              uint64_t base_address, uint64_t size,
+              uint64_t irq_vec_start, uint64_t irq_vector_cnt)
+        : base_ip(bus, id, IP_TYPE_PERIPHERAL, base_address, size, irq_vec_start, irq_vector_cnt)
+        {
+        }
+
+    ~guest_ram() override;
+
+    void reset() override;
+
+    BUS_ACCESS_CODE memaddr_can_access(bool rw, uint64_t offset, uint64_t size) override;
+
+    void mem_slave_read(uint64_t offset, uint64_t size, void *data) override;
+    void mem_slave_write(uint64_t offset, uint64_t size, void *data) override;
+
+    // Map the file backing QEMU's guest RAM.
+    // @path: Path of the backing file, e.g. the mem-path of a memory-backend-file or
+    //        /proc/<qemu pid>/fd/<fd> for a memory-backend-memfd.
+    // Returns true on success. Any previous mapping and RAM block layout is dropped.
+    bool attach(const char *path);
+
+    // Describe where a guest physical range lives in the backing file.
+    // @gpa: Guest physical address of the block.
+    // @file_offset: Offset of the block in the backing file.
+    // @size: Size of the block in bytes.
+    // Without any block the whole file is assumed to be mapped at guest physical address 0.
+    void add_ram_block(uint64_t gpa, uint64_t file_offset, uint64_t size);
+
+    // Enable or disable IOVA translation.
+    // When disabled (passthrough), IOVAs are used as guest physical addresses.
+    void set_iommu_enabled(bool enabled);
+
+    // Install or remove an IOTLB entry, as notified by the guest IOMMU.
+    // @iova: IO virtual address, aligned to @size.
+    // @gpa: Guest physical address the IOVA range maps to.
+    // @size: Size of the mapping, a power of two.
+    // @perm: IOTLB_PERM_* access permissions.
+    void iotlb_map(uint64_t iova, uint64_t gpa, uint64_t size, int perm);
+    void iotlb_unmap(uint64_t iova, uint64_t size);
+
+    // Translation cache statistics, readable while the window is in use.
+    uint64_t get_tcache_hits() const { return tcache_hits.load(std::memory_order_relaxed); }
+    uint64_t get_tcache_misses() const { return tcache_misses.load(std::memory_order_relaxed); }
+
+private:
+    static const uint64_t PAGE_SHIFT = 12;
+    static const uint64_t PAGE_SIZE = 1ULL << PAGE_SHIFT;
+    static const int TCACHE_ENTRIES = 256;
+
+    struct ram_block {
+        uint64_t gpa;
+        uint64_t size;
+        uint8_t *host;
+    };
+
+    struct iotlb_entry {
+        uint64_t iova;
+        uint64_t gpa;
+        uint64_t size;
+        int perm;
+    };
+
+    // Direct mapped cache of page translations, invalidated by bumping tcache_gen.
+    struct tcache_entry {
+        uint64_t iova_page;
+        uint64_t gen;
+        uint8_t *host_page;
+        int perm;
+    };
+
+    // Translate an IOVA into a host pointer.
+    // @iova: The IOVA to translate.
+    // @rw: The type of access (read or write).
+    // @len: Set to the number of bytes from @iova reachable through the pointer, at most
+    //       up to the end of the page.
+    // Returns the host pointer, or nullptr if the IOVA is unmapped or the access is not
+    // permitted. Must be called with iotlb_mtx held, like the helpers below.
+    uint8_t *translate(uint64_t iova, bool rw, uint64_t &len);
+    // Host pointer of @iova, its permissions and the bytes left in its IOTLB entry and
+    // RAM block, without the translation cache.
+    uint8_t *lookup(uint64_t iova, int &perm, uint64_t &left);
+    uint8_t *gpa_to_host(uint64_t gpa, uint64_t &left);
+    // Whether every byte of the range translates with the permission @rw needs.
+    bool range_mapped(bool rw, uint64_t offset, uint64_t size);
+    void access(bool rw, uint64_t offset, uint64_t size, void *data);
+
+    std::mutex iotlb_mtx;
+    std::map<uint64_t, iotlb_entry> iotlb; // IOTLB entries keyed by IOVA
+    std::vector<ram_block> ram_blocks;
+    bool iommu_enabled = false;
+
+    tcache_entry tcache[TCACHE_ENTRIES] = {};
+    uint64_t tcache_gen = 1;
+    std::atomic<uint64_t> tcache_hits{0};   // Updated under iotlb_mtx
+    std::atomic<uint64_t> tcache_misses{0};
+
+    uint8_t *map_ptr = nullptr; // Protected by iotlb_mtx, like everything above
+    uint64_t map_size = 0;
+};
+
+#endif // GUEST_RAM_HH
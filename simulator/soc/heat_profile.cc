@@ -0,0 +1,239 @@
+#include "heat_profile.hh"
+#include "ip.hh"
+#include "debugger.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <map>
+#include <algorithm>
+
+std::atomic<bool> heat_profile::on{false};
+std::atomic<uint64_t> heat_profile::period{0};
+std::atomic<uint64_t> heat_profile::interval_ns{0};
+std::string heat_profile::csv_path;
+std::mutex heat_profile::mtx;
+std::vector<heat_profile::thread_buffer *> heat_profile::buffers;
+thread_local heat_profile::thread_state heat_profile::self;
+
+struct heat_count {
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+};
+
+struct heat_ip_range {
+    uint64_t base;
+    uint64_t size;
+};
+
+// Folded counts, protected by heat_profile::mtx
+static std::map<std::pair<uint64_t, uint64_t>, heat_count> page_counts; // By (IP, page)
+static std::map<uint64_t, heat_ip_range> ip_ranges;                     // By IP
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void heat_profile::start(uint64_t n)
+{
+    if (!n) {
+        stop();
+        return;
+    }
+    period.store(n);
+    on.store(true);
+    LOG_INFO("Heat profile sampling every %lu accesses.", n);
+}
+
+void heat_profile::start_timed(uint64_t ns)
+{
+    interval_ns.store(ns);
+    period.store(0);
+    on.store(true);
+    LOG_INFO("Heat profile sampling every %lu ns.", ns);
+}
+
+void heat_profile::stop()
+{
+    on.store(false);
+}
+
+void heat_profile::record(thread_state &t, bool rw, uint64_t ip_id, uint64_t base,
+                          uint64_t size, uint64_t addr)
+{
+    uint64_t p = period.load(std::memory_order_relaxed);
+    if (p) {
+        t.countdown = p;
+    } else {
+        t.countdown = TIMED_CHECK;
+        uint64_t now = now_ns();
+        if (now - t.last_ns < interval_ns.load(std::memory_order_relaxed)) {
+            return;
+        }
+        t.last_ns = now;
+    }
+
+    alloc_check::allow profiling; // Sample buffers are handed off and replaced while sampling
+    if (!t.buf) {
+        t.buf = new thread_buffer();
+        t.buf->samples.reserve(BUFFER_SAMPLES);
+        std::lock_guard<std::mutex> lock(mtx);
+        buffers.push_back(t.buf);
+    }
+
+    std::vector<heat_sample> full;
+    {
+        std::lock_guard<std::mutex> lock(t.buf->mtx);
+        t.buf->samples.push_back(heat_sample{ addr, base, size, ip_id, rw });
+        if (t.buf->samples.size() < BUFFER_SAMPLES) {
+            return;
+        }
+        full.swap(t.buf->samples);
+        t.buf->samples.reserve(BUFFER_SAMPLES);
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    fold(full);
+}
+
+void heat_profile::fold(std::vector<heat_sample> &samples)
+{
+    for (const heat_sample &s : samples) {
+        heat_count &c = page_counts[std::make_pair(s.ip_id, s.addr >> PAGE_SHIFT)];
+        if (s.rw == MMIO_ACCESS_RW_R) {
+            c.reads++;
+        } else {
+            c.writes++;
+        }
+        ip_ranges[s.ip_id] = heat_ip_range{ s.base, s.size };
+    }
+    samples.clear();
+}
+
+void heat_profile::fold_all()
+{
+    for (thread_buffer *buf : buffers) {
+        std::lock_guard<std::mutex> lock(buf->mtx);
+        fold(buf->samples);
+    }
+}
+
+void heat_profile::reset()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    fold_all();
+    page_counts.clear();
+    ip_ranges.clear();
+}
+
+void heat_profile::print(int top_n)
+{
+    static const char shades[] = " .:-=+*#%@";
+    static const int COLUMNS = 64;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    fold_all();
+
+    uint64_t total = 0;
+    for (auto &p : page_counts) {
+        total += p.second.reads + p.second.writes;
+    }
+    printf("heat profile: %lu samples, %zu pages, %zu IPs\n", total, page_counts.size(),
+           ip_ranges.size());
+    if (!total) {
+        return;
+    }
+
+    // One row per IP, its range split into COLUMNS cells shaded by log of the samples,
+    // on a scale shared by all rows so IPs can be compared
+    std::map<uint64_t, std::vector<uint64_t> > rows;
+    uint64_t peak = 0;
+    for (auto &p : page_counts) {
+        const heat_ip_range &r = ip_ranges[p.first.first];
+        std::vector<uint64_t> &cells = rows[p.first.first];
+        cells.resize(COLUMNS);
+        uint64_t offset = (p.first.second << PAGE_SHIFT) - r.base;
+        int cell = std::min<uint64_t>(offset * COLUMNS / std::max<uint64_t>(r.size, 1), COLUMNS - 1);
+        cells[cell] += p.second.reads + p.second.writes;
+        peak = std::max(peak, cells[cell]);
+    }
+    for (auto &row : rows) {
+        const heat_ip_range &r = ip_ranges[row.first];
+        uint64_t ip_total = 0;
+        char line[COLUMNS + 1];
+        for (int i = 0; i < COLUMNS; i++) {
+            uint64_t c = row.second[i];
+            int shade = c ? 1 + (int)(log2((double)c) * 8 / log2((double)peak + 1)) : 0;
+            line[i] = shades[std::min(shade, 9)];
+            ip_total += c;
+        }
+        line[COLUMNS] = 0;
+        printf("  ip %3lu %12lx+%-9lx |%s| %5.1f%%\n", row.first, r.base, r.size, line,
+               ip_total * 100.0 / total);
+    }
+
+    std::vector<std::pair<uint64_t, std::pair<uint64_t, uint64_t> > > hot;
+    for (auto &p : page_counts) {
+        hot.push_back(std::make_pair(p.second.reads + p.second.writes, p.first));
+    }
+    int n = std::min<int>(top_n, hot.size());
+    std::partial_sort(hot.begin(), hot.begin() + n, hot.end(),
+                      [](const auto &a, const auto &b) { return a.first > b.first; });
+    printf("  top %d pages:\n", n);
+    for (int i = 0; i < n; i++) {
+        const heat_count &c = page_counts[hot[i].second];
+        printf("    ip %3lu page %12lx  reads %8lu  writes %8lu  %5.1f%%\n", hot[i].second.first,
+               hot[i].second.second << PAGE_SHIFT, c.reads, c.writes, hot[i].first * 100.0 / total);
+    }
+}
+
+bool heat_profile::write_csv(const char *path)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    fold_all();
+
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        LOG_ERROR("Failed to open heat profile file %s.", path);
+        return false;
+    }
+    fprintf(f, "ip,page_addr,reads,writes\n");
+    for (auto &p : page_counts) {
+        fprintf(f, "%lu,0x%lx,%lu,%lu\n", p.first.first, p.first.second << PAGE_SHIFT,
+                p.second.reads, p.second.writes);
+    }
+    fclose(f);
+    return true;
+}
+
+void heat_profile::dump()
+{
+    print();
+    if (!csv_path.empty()) {
+        write_csv(csv_path.c_str());
+    }
+}
+
+void heat_profile::load_from_env()
+{
+    const char *csv = getenv("SOC_HEAT_CSV");
+    if (csv) {
+        csv_path = csv;
+    }
+    const char *env = getenv("SOC_HEAT");
+    if (!env || !env[0]) {
+        return;
+    }
+    char *end;
+    uint64_t n = strtoull(env, &end, 0);
+    if (n && strcmp(end, "us") == 0) {
+        start_timed(n * 1000);
+    } else if (n && !*end) {
+        start(n);
+    } else {
+        LOG_ERROR("Bad SOC_HEAT %s, expected <N> or <N>us.", env);
+    }
+}
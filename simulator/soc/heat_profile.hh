@@ -0,0 +1,107 @@
+#ifndef HEAT_PROFILE_HH
+#define HEAT_PROFILE_HH
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Sampling profiler of bus access addresses.
+// Shows which pages of each IP, e.g. the RAM windows placed by soc_top, are hot, to
+// guide memory layout and huge page placement. Every Nth bus access of each thread is
+// appended to a buffer of the thread, or with time based sampling about one access per
+// interval (the clock is read every 64 accesses). Buffers are folded into page granular
+// read and write counts per IP when full and when a report is made.
+// With sampling off base_bus pays one relaxed load and a not-taken branch per access.
+//
+// Sampling is started with SOC_HEAT=<N> (every Nth access) or SOC_HEAT=<N>us (every N
+// microseconds per thread), or at runtime with the EX_CTRL_HEAT_PROFILE bridge control
+// packet. soc_top prints the report on SIGUSR1, and writes every sampled page to the
+// CSV file named by SOC_HEAT_CSV if it is set.
+class heat_profile {
+public:
+    static bool enabled()
+    {
+        return on.load(std::memory_order_relaxed);
+    }
+
+    // Sample every @period accesses of each thread, 0 stops sampling.
+    // Counts collected so far are kept.
+    static void start(uint64_t period);
+
+    // Sample the first access of each thread after every @interval_ns.
+    static void start_timed(uint64_t interval_ns);
+
+    static void stop();
+
+    // Drop all counts.
+    static void reset();
+
+    // Configure from SOC_HEAT and SOC_HEAT_CSV.
+    static void load_from_env();
+
+    // Called by base_bus for every access while enabled.
+    // @rw: MMIO_ACCESS_RW_R or MMIO_ACCESS_RW_W.
+    // @ip_id, @base, @size: The IP serving the access and its address range.
+    // @addr: The bus address accessed.
+    static void sample(bool rw, uint64_t ip_id, uint64_t base, uint64_t size, uint64_t addr)
+    {
+        thread_state &t = self;
+        if (--t.countdown > 0) {
+            return;
+        }
+        record(t, rw, ip_id, base, size, addr);
+    }
+
+    // Print a heatmap row per IP and the @top_n hottest pages.
+    static void print(int top_n = 20);
+
+    // Write ip,page_addr,reads,writes lines for every sampled page to @path.
+    static bool write_csv(const char *path);
+
+    // Print the report and write the SOC_HEAT_CSV file, if configured.
+    static void dump();
+
+    static const uint64_t PAGE_SHIFT = 12;
+
+private:
+    struct heat_sample {
+        uint64_t addr;
+        uint64_t base;
+        uint64_t size;
+        uint64_t ip_id;
+        bool rw;
+    };
+
+    // Sampling state of one thread. Samples are appended under @mtx, which is only
+    // contended while a report is being made.
+    struct thread_buffer {
+        std::mutex mtx;
+        std::vector<heat_sample> samples;
+    };
+
+    struct thread_state {
+        int64_t countdown = 1;
+        uint64_t last_ns = 0;
+        thread_buffer *buf = nullptr;
+    };
+
+    static const size_t BUFFER_SAMPLES = 4096;
+    static const int64_t TIMED_CHECK = 64; // Accesses between clock reads in timed mode
+
+    static void record(thread_state &t, bool rw, uint64_t ip_id, uint64_t base,
+                       uint64_t size, uint64_t addr);
+    static void fold(std::vector<heat_sample> &samples); // Called with mtx held
+    static void fold_all();                               // Called with mtx held
+
+    static std::atomic<bool> on;
+    static std::atomic<uint64_t> period;      // Accesses per sample, 0 in timed mode
+    static std::atomic<uint64_t> interval_ns; // Time per sample in timed mode
+    static std::string csv_path;
+    static std::mutex mtx; // Protects buffers and the folded counts
+    static std::vector<thread_buffer *> buffers; // Never freed, threads may still hold them
+    static thread_local thread_state self;
+};
+
+#endif // HEAT_PROFILE_HH
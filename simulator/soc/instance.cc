@@ -0,0 +1,165 @@
+#include "instance.hh"
+#include "debugger.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <getopt.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+std::string soc_instance::instance_name;
+std::string soc_instance::fifo_dir;
+std::string soc_instance::config;
+unsigned soc_instance::jobs = 0;
+char soc_instance::shm_names[MAX_SHM][256];
+int soc_instance::nr_shm = 0;
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\n"
+           "  --instance NAME    namespace for shared memory, FIFOs and output files\n"
+           "                     (default SOC_INSTANCE, or none)\n"
+           "  --fifo-dir DIR     directory of the bridge FIFOs (default ./fifo[/NAME])\n"
+           "  --log-level L      off, error, warn, info or debug (default debug)\n"
+           "  --config FILE      SoC topology, see soc_config (default SOC_CONFIG, or built in)\n"
+           "  --jobs N           threads constructing the IPs (default one per CPU)\n", prog);
+}
+
+bool soc_instance::init(int argc, char **argv)
+{
+    static struct option opts[] = {
+        { "instance", required_argument, 0, 'i' },
+        { "fifo-dir", required_argument, 0, 'f' },
+        { "log-level", required_argument, 0, 'l' },
+        { "config", required_argument, 0, 'c' },
+        { "jobs", required_argument, 0, 'j' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+    static const char *levels[] = { "off", "error", "warn", "info", "debug" };
+
+    const char *env = getenv("SOC_INSTANCE");
+    if (env) {
+        instance_name = env;
+    }
+    env = getenv("SOC_CONFIG");
+    if (env) {
+        config = env;
+    }
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+        switch (c) {
+        case 'i':
+            instance_name = optarg;
+            break;
+        case 'f':
+            fifo_dir = optarg;
+            break;
+        case 'c':
+            config = optarg;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'l': {
+            int level = -1;
+            for (int i = 0; i < 5; i++) {
+                if (strcmp(optarg, levels[i]) == 0) {
+                    level = i;
+                }
+            }
+            if (level < 0) {
+                usage(argv[0]);
+                return false;
+            }
+            debugger::set_level((debugger::LEVEL)level);
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (instance_name.find('/') != std::string::npos) {
+        fprintf(stderr, "instance name %s must not contain '/'\n", instance_name.c_str());
+        return false;
+    }
+    if (fifo_dir.empty()) {
+        fifo_dir = instance_name.empty() ? "./fifo" : "./fifo/" + instance_name;
+    }
+    return true;
+}
+
+std::string soc_instance::shm_name(const char *base)
+{
+    if (instance_name.empty()) {
+        return std::string("/") + base;
+    }
+    return "/" + instance_name + "_" + base;
+}
+
+std::string soc_instance::fifo_path(const char *fifo)
+{
+    return fifo_dir + "/" + fifo;
+}
+
+std::string soc_instance::make_fifo(const char *fifo)
+{
+    // mkdir -p of the FIFO directory
+    for (size_t pos = 1; pos <= fifo_dir.size(); pos++) {
+        if (pos == fifo_dir.size() || fifo_dir[pos] == '/') {
+            std::string dir = fifo_dir.substr(0, pos);
+            if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+                LOG_ERROR("Failed to create %s: %s", dir.c_str(), strerror(errno));
+                return "";
+            }
+        }
+    }
+    std::string path = fifo_path(fifo);
+    if (mkfifo(path.c_str(), 0666) < 0 && errno != EEXIST) {
+        LOG_ERROR("Failed to create FIFO %s: %s", path.c_str(), strerror(errno));
+        return "";
+    }
+    return path;
+}
+
+std::string soc_instance::file_name(const char *base)
+{
+    if (instance_name.empty()) {
+        return base;
+    }
+    return instance_name + "_" + base;
+}
+
+void soc_instance::register_shm(const std::string &shm)
+{
+    if (nr_shm == MAX_SHM || shm.size() >= sizeof(shm_names[0])) {
+        LOG_ERROR("Cannot register %s for cleanup.", shm.c_str());
+        return;
+    }
+    strcpy(shm_names[nr_shm], shm.c_str());
+    nr_shm++;
+}
+
+void soc_instance::crash_handler(int sig)
+{
+    for (int i = 0; i < nr_shm; i++) {
+        shm_unlink(shm_names[i]);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void soc_instance::install_crash_handlers()
+{
+    static const int sigs[] = { SIGINT, SIGTERM, SIGHUP, SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL };
+    for (int sig : sigs) {
+        signal(sig, crash_handler);
+    }
+}
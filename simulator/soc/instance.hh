@@ -0,0 +1,68 @@
+#ifndef INSTANCE_HH
+#define INSTANCE_HH
+
+#include <string>
+
+// Namespace of one simulator instance, so several SoCs can run on one host.
+// Everything an instance creates outside its process is named from here:
+//   shared memory   /<instance>_<name>, /<name> without an instance name
+//   FIFOs           <fifo dir>/<name>, the fifo dir defaults to ./fifo/<instance>
+//   output files    <instance>_<name> in the working directory
+//
+// The instance is named by --instance NAME on the command line or SOC_INSTANCE, the
+// FIFO directory by --fifo-dir DIR. Shared memory registered with register_shm() is
+// unlinked when the process is killed or crashes, so dead instances leave nothing behind.
+class soc_instance {
+public:
+    // Parse the soc.out command line: --instance, --fifo-dir, --log-level, --config and
+    // --jobs.
+    // Returns false and prints the usage on bad arguments.
+    static bool init(int argc, char **argv);
+
+    static const std::string &name()
+    {
+        return instance_name;
+    }
+
+    // SoC topology file, empty for the built-in one.
+    static const std::string &config_path()
+    {
+        return config;
+    }
+
+    // Threads constructing the IPs, 0 for one per CPU.
+    static unsigned init_jobs()
+    {
+        return jobs;
+    }
+
+    static std::string shm_name(const char *base);
+    static std::string fifo_path(const char *fifo);
+    static std::string file_name(const char *base);
+
+    // Create the FIFO @fifo, and its directory, if they do not exist yet.
+    // Returns its path, or an empty string on failure.
+    static std::string make_fifo(const char *fifo);
+
+    // Unlink the shared memory segment @shm when the process dies on a signal.
+    static void register_shm(const std::string &shm);
+
+    // Install the handlers cleaning up after fatal signals (SIGINT, SIGTERM, SIGHUP,
+    // SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL). The signal is re-raised afterwards, so
+    // the exit status and core dumps are unchanged.
+    static void install_crash_handlers();
+
+private:
+    static void crash_handler(int sig);
+
+    static const int MAX_SHM = 8;
+
+    static std::string instance_name;
+    static std::string fifo_dir;
+    static std::string config;
+    static unsigned jobs;
+    static char shm_names[MAX_SHM][256]; // Plain arrays, read from signal handlers
+    static int nr_shm;
+};
+
+#endif // INSTANCE_HH
@@ -1,6 +1,17 @@
 #include "ip.hh"
 #include "bus.hh"
+#include "thread_placement.hh"
+#include "sim_mode.hh"
+#include "trace.hh"
+#include "probes.hh"
+#include "alloc_check.hh"
 #include <chrono>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 base_ip::base_ip(base_bus *bus, uint64_t id, IP_TYPE type,
             uint64_t base_address, uint64_t size,
@@ -22,6 +33,26 @@ base_ip::base_ip(base_bus *bus, uint64_t id, IP_TYPE type,
     this->bus->connect_ip(this);
 }
 
+base_ip::~base_ip()
+{
+    bus->disconnect_ip(this);
+    for (ip_doorbell &d : doorbells) {
+        if (d.fd >= 0) {
+            close(d.fd);
+        }
+    }
+    if (wake_fd >= 0) {
+        close(wake_fd);
+    }
+}
+
+// Add @n to the counter of an eventfd, waking whoever polls it.
+static void eventfd_signal(int fd, uint64_t n = 1)
+{
+    ssize_t ret = write(fd, &n, sizeof(n));
+    (void)ret; // Only fails once the counter is near overflow, which still wakes
+}
+
 void base_ip::mem_master_read(uint64_t addr, uint64_t size, void *data)
 {
     if (bus) {
@@ -40,6 +71,24 @@ void base_ip::mem_master_write(uint64_t addr, uint64_t size, void *data)
     }
 }
 
+void base_ip::mem_master_read(ip_action &action, uint64_t addr, uint64_t size, void *data)
+{
+    if (bus) {
+        action.timestamp = bus->master_read_at(action.timestamp, addr, size, data);
+    } else {
+        LOG_ERROR("Error: No bus connected to this IP.");
+    }
+}
+
+void base_ip::mem_master_write(ip_action &action, uint64_t addr, uint64_t size, void *data)
+{
+    if (bus) {
+        action.timestamp = bus->master_write_at(action.timestamp, addr, size, data);
+    } else {
+        LOG_ERROR("Error: No bus connected to this IP.");
+    }
+}
+
 void base_ip::post_irq(uint64_t id, uint64_t vector)
 {
     if (bus) {
@@ -49,17 +98,93 @@ void base_ip::post_irq(uint64_t id, uint64_t vector)
     }
 }
 
+// Run @action inline, then the actions queued behind it while there is no action thread
+// to take them. Actions triggered meanwhile, by other threads or by process_action itself,
+// are queued rather than run next to it.
+bool base_ip::run_inline(const ip_action &action)
+{
+    std::unique_lock<std::mutex> lock(action_mtx);
+    ip_action next = action;
+    if (action_busy || !action_queue.empty()) {
+        if (action_thread_running.load()) {
+            return false; // Behind the actions before the switch, on the action thread
+        }
+        // Whoever runs actions inline, maybe further up this thread, runs it in turn
+        action_queue.push_grow(action);
+        if (action_busy) {
+            return true;
+        }
+        next = action_queue.front(); // Left in the queue by timed mode, older than @action
+        action_queue.pop();
+    }
+
+    action_busy = true;
+    for (;;) {
+        lock.unlock();
+        {
+            trace_span span("action", "action", next.type);
+            SOC_PROBE3(action_start, id, next.type, 0);
+            process_action(next);
+            SOC_PROBE2(action_done, id, next.type);
+        }
+        lock.lock();
+        // An action thread started meanwhile takes the rest
+        if (action_thread_running.load() || action_queue.empty()) {
+            break;
+        }
+        next = action_queue.front();
+        action_queue.pop();
+    }
+    action_busy = false;
+    lock.unlock();
+    action_cv.notify_all(); // The action thread waits for an inline action to finish
+    action_space_cv.notify_all();
+    return true;
+}
+
 void base_ip::trigger_action(const ip_action &action)
 {
-    std::lock_guard<std::mutex> lock(action_mtx);
-    action_queue.push(action);
+    // Fast-forward: no timing to model, skip the hand-off to the action thread
+    if (sim_mode::functional() && run_inline(action)) {
+        return;
+    }
+
+    alloc_check::no_alloc scope;
+    ip_action queued = action;
+    queued.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    std::unique_lock<std::mutex> lock(action_mtx);
+    if (action_queue.full()) {
+        if (action_thread_running.load() && std::this_thread::get_id() != action_thread.get_id()) {
+            action_space_cv.wait(lock, [this] {
+                return !action_queue.full() || !action_thread_running.load();
+            });
+        }
+        // The action thread queueing for itself, or no action thread, cannot wait
+        if (action_queue.full()) {
+            alloc_check::allow grow;
+            action_queue.reserve(action_queue.capacity() * 2);
+            // Pops no longer see a full queue, so wake the producers waiting for space
+            action_space_cv.notify_all();
+        }
+    }
+    action_queue.push(queued);
     action_cv.notify_one();
+    // With doorbells bound the action thread may be in poll() instead
+    if (wake_fd >= 0 && std::this_thread::get_id() != action_thread.get_id()) {
+        eventfd_signal(wake_fd);
+    }
     LOG_DEBUG("IP %lu triggered action type=%d", id, action.type);
 }
 
 void base_ip::start_action_thread()
 {
     if (!action_thread_running.load()) {
+        {
+            std::lock_guard<std::mutex> lock(action_mtx);
+            action_queue.reserve(IP_ACTION_QUEUE_DEPTH);
+        }
         action_thread_running.store(true);
         action_thread = std::thread(&base_ip::action_thread_func, this);
         LOG_DEBUG("IP %lu action thread started", id);
@@ -71,6 +196,13 @@ void base_ip::stop_action_thread()
     if (action_thread_running.load()) {
         action_thread_running.store(false);
         action_cv.notify_all();
+        {
+            std::lock_guard<std::mutex> lock(action_mtx);
+            if (wake_fd >= 0) {
+                eventfd_signal(wake_fd);
+            }
+        }
+        action_space_cv.notify_all();
         if (action_thread.joinable()) {
             action_thread.join();
         }
@@ -80,6 +212,9 @@ void base_ip::stop_action_thread()
 
 void base_ip::action_thread_func()
 {
+    char name[16];
+    snprintf(name, sizeof(name), "ip%lu_action", id);
+    thread_placement::apply("ip_action", name);
     LOG_DEBUG("IP %lu action thread running", id);
     
     while (action_thread_running.load()) {
@@ -88,27 +223,126 @@ void base_ip::action_thread_func()
         {
             std::unique_lock<std::mutex> lock(action_mtx);
             // Wait for new actions or shutdown signal
+            // Actions run inline in functional mode finish first, they were triggered earlier
             action_cv.wait(lock, [this] {
-                return !action_queue.empty() || !action_thread_running.load();
+                return !action_busy &&
+                       (!action_queue.empty() || !action_thread_running.load() || wake_fd >= 0);
             });
             
             // Check if we should exit
             if (!action_thread_running.load() && action_queue.empty()) {
                 break;
             }
+
+            // Doorbells bound, wait for them and for new actions together
+            if (action_queue.empty()) {
+                lock.unlock();
+                wait_doorbells();
+                continue;
+            }
             
             // Get the next action
             if (!action_queue.empty()) {
+                bool was_full = action_queue.full();
                 action = action_queue.front();
                 action_queue.pop();
+                action_busy = true;
+                if (was_full) {
+                    action_space_cv.notify_all();
+                }
             }
         }
         
         // Process the action (outside the lock)
         if (action.type != IP_ACTION_NONE) {
+            trace_span span("action", "action", action.type);
+            SOC_PROBE3(action_start, id, action.type, action.timestamp);
             process_action(action);
+            SOC_PROBE2(action_done, id, action.type);
         }
+        std::lock_guard<std::mutex> lock(action_mtx);
+        action_busy = false;
     }
     
     LOG_DEBUG("IP %lu action thread exiting", id);
 }
+
+void base_ip::add_doorbell(uint64_t offset, uint32_t size, uint64_t value, uint32_t flags)
+{
+    if (doorbells.size() >= IP_MAX_DOORBELLS) {
+        LOG_ERROR("IP %lu: more than %d doorbells", id, IP_MAX_DOORBELLS);
+        return;
+    }
+    ip_doorbell d;
+    d.offset = offset;
+    d.size = size;
+    d.flags = flags;
+    d.value = value;
+    doorbells.push_back(d);
+}
+
+bool base_ip::bind_doorbell(unsigned index, int fd)
+{
+    if (index >= doorbells.size() || !action_thread_running.load()) {
+        LOG_ERROR("IP %lu: no doorbell %u or no action thread to serve it", id, index);
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(action_mtx);
+    if (wake_fd < 0) {
+        wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (wake_fd < 0) {
+            LOG_ERROR("IP %lu: eventfd failed: %s", id, strerror(errno));
+            return false;
+        }
+    }
+    ip_doorbell &d = doorbells[index];
+    if (d.fd >= 0) {
+        // Keep the fd number, the action thread may be polling it right now
+        dup2(fd, d.fd);
+        close(fd);
+    } else {
+        d.fd = fd;
+    }
+    action_cv.notify_one();
+    eventfd_signal(wake_fd);
+    return true;
+}
+
+void base_ip::wait_doorbells()
+{
+    struct pollfd fds[IP_MAX_DOORBELLS + 1];
+    unsigned index[IP_MAX_DOORBELLS + 1];
+    nfds_t n = 0;
+    {
+        std::lock_guard<std::mutex> lock(action_mtx);
+        if (!action_queue.empty() || !action_thread_running.load()) {
+            return;
+        }
+        fds[n++] = { wake_fd, POLLIN, 0 };
+        for (unsigned i = 0; i < doorbells.size(); i++) {
+            if (doorbells[i].fd >= 0) {
+                index[n] = i;
+                fds[n++] = { doorbells[i].fd, POLLIN, 0 };
+            }
+        }
+    }
+    if (poll(fds, n, -1) <= 0) {
+        return;
+    }
+
+    uint64_t count;
+    if (fds[0].revents & POLLIN) {
+        ssize_t ret = read(fds[0].fd, &count, sizeof(count));
+        (void)ret;
+    }
+    for (nfds_t k = 1; k < n; k++) {
+        // Rings since the last read collapse into one, as a doorbell only says "look"
+        if (!(fds[k].revents & POLLIN) || read(fds[k].fd, &count, sizeof(count)) != sizeof(count)) {
+            continue;
+        }
+        const ip_doorbell &d = doorbells[index[k]];
+        uint64_t value = d.value;
+        trace::instant("doorbell", "action", d.offset);
+        mem_slave_access_offset(MMIO_ACCESS_RW_W, d.offset, d.size, &value);
+    }
+}
@@ -2,20 +2,27 @@
 #define IP_HH 
 
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
-#include <queue>
 #include <functional>
 #include <atomic>
 #include <chrono>
+#include <vector>
 
 #include "debugger.hh"
+#include "probes.hh"
+#include "ring.hh"
 
 #define MMIO_ACCESS_RW_R 0
 #define MMIO_ACCESS_RW_W 1
 
+// Slots of an IP's action queue. A full queue makes trigger_action wait for the action
+// thread, like a device pushing back on its doorbell.
+#define IP_ACTION_QUEUE_DEPTH 256
+
 // Action types for asynchronous operations
 enum IP_ACTION_TYPE {
     IP_ACTION_NONE = 0,
@@ -30,12 +37,28 @@ struct ip_action {
     uint64_t addr;       // Address involved in the action
     uint64_t data;       // Data for the action
     uint64_t size;       // Size of the data
-    uint64_t timestamp;  // Timestamp when action was triggered
+    uint64_t timestamp;  // Timestamp when action was triggered, in ns (timed mode only)
     
     ip_action(IP_ACTION_TYPE t = IP_ACTION_NONE, uint64_t a = 0, uint64_t d = 0, uint64_t s = 0)
         : type(t), addr(a), data(d), size(s), timestamp(0) {}
 };
 
+// A register write that QEMU may deliver through an eventfd instead of a bridge packet,
+// e.g. bound to a KVM ioeventfd. The write of @value to @offset is then replayed on the
+// action thread when the eventfd is signalled, and the vCPU never waits for the SoC.
+// Without IP_DOORBELL_DATAMATCH any write of @size bytes signals the eventfd, and the
+// replayed value is @value whatever the guest wrote.
+#define IP_DOORBELL_DATAMATCH 0x100
+#define IP_MAX_DOORBELLS      32
+
+struct ip_doorbell {
+    uint64_t offset;
+    uint32_t size;   // 1, 2, 4 or 8
+    uint32_t flags;  // IP_DOORBELL_*
+    uint64_t value;
+    int fd = -1;     // Bound eventfd, owned by the IP
+};
+
 enum BUS_ACCESS_CODE {
     /* Remote port responses. */
     ACCESS_OK                =  0x0,
@@ -52,6 +75,7 @@ enum IP_TYPE {
 };
 
 class base_bus; // Forward declaration
+struct ip_timing; // Forward declaration
 
 class base_ip {
 public:
@@ -72,7 +96,10 @@ public:
 
     // Destructor for base_ip, cleans up the IP.
     // It is declared virtual to allow derived classes to override it.
-    virtual ~base_ip() = default;
+    // Disconnects the IP from the bus, which must still exist, and closes the eventfds
+    // bound to doorbells. The derived class is destroyed by then, so an IP that masters
+    // may still be accessing is disconnected with disconnect_ip before it is deleted.
+    virtual ~base_ip();
     
     // Check if the given address is within the IP's memory range.
     // @addr: The address to check.
@@ -80,7 +107,8 @@ public:
     // false otherwise.
     bool mem_slave_addr_check(uint64_t addr)
     {
-        return (addr >= base_addr && addr < base_addr + addr_size);
+        uint64_t base = base_addr;
+        return (addr >= base && addr - base < addr_size);
     }
 
     // Reset the IP to its initial state.
@@ -110,9 +138,20 @@ public:
     // and then unlocks the mutex. If the access is denied, it returns an error code.
     // This function is thread-safe and ensures that only one thread can access the memory
     // at a time by using a mutex.
+    // After a successful write, should_trigger_action is consulted and the action returned
+    // by get_action is triggered, outside of the mutex. This is the contract the two hooks
+    // were declared with; their defaults trigger nothing, so IPs not overriding them see
+    // no change, and register writes of virtqueue_ip and coro_ip devices rely on it.
     int mem_slave_access(bool rw, uint64_t addr, uint64_t size, void *data)
     {
-        uint64_t offset = addr - base_addr;
+        return mem_slave_access_offset(rw, addr - base_addr, size, data);
+    }
+
+    // Same as mem_slave_access, but with an offset the caller already decoded.
+    // Used by the bus, which decodes with its own snapshot of the address map so the
+    // access stays consistent while the IP is being remapped.
+    int mem_slave_access_offset(bool rw, uint64_t offset, uint64_t size, void *data)
+    {
         BUS_ACCESS_CODE ret = ACCESS_OK;
         ret = memaddr_can_access(rw, offset, size);
         if (ret == ACCESS_OK) {
@@ -123,11 +162,32 @@ public:
                 mem_slave_write(offset, size, data);
             }
             mtx.unlock();
+
+            if (rw == MMIO_ACCESS_RW_W && should_trigger_action(offset, size, rw, data)) {
+                ip_action action = get_action(offset, size, data);
+                SOC_PROBE4(action_trigger, id, action.type, action.addr, action.data);
+                trigger_action(action);
+            }
         }
+        SOC_PROBE5(ip_access, id, rw, offset, size, ret);
 
         return (int)ret;
     }
 
+    // Copy @size bytes at @offset of the shared memory of a RAM IP to or from @data, under
+    // the IP lock like a slave access. For paths serving RAM without the virtual slave
+    // functions, see base_bus::master_access_shm.
+    void shm_access(bool rw, uint64_t offset, uint64_t size, void *data)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (rw == MMIO_ACCESS_RW_R) {
+            memcpy(data, (uint8_t *)shm_ptr + offset, size);
+        } else {
+            memcpy((uint8_t *)shm_ptr + offset, data, size);
+        }
+        SOC_PROBE5(ip_access, id, rw, offset, size, ACCESS_OK);
+    }
+
     // Slave memory read and write functions.
     // These functions are pure virtual, meaning derived classes must implement them.
     // They are used to read from and write to the IP's memory region.
@@ -155,6 +215,13 @@ public:
     void mem_master_read(uint64_t addr, uint64_t size, void *data);
     void mem_master_write(uint64_t addr, uint64_t size, void *data);
 
+    // Timed master accesses on behalf of an action.
+    // The access is issued at @action.timestamp (now if 0), which is advanced to the
+    // completion time of the access, so a sequence of accesses in process_action()
+    // leaves the time the action completes in the timestamp. See base_bus::set_ip_timing.
+    void mem_master_read(ip_action &action, uint64_t addr, uint64_t size, void *data);
+    void mem_master_write(ip_action &action, uint64_t addr, uint64_t size, void *data);
+
     // Get a pointer to the shared memory region for fast access.
     // This function is used by the IP to access shared memory directly without going through the bus.
     // It checks all IPs to find the one that can handle the address.
@@ -220,7 +287,11 @@ public:
     // Trigger an action to be processed asynchronously.
     // @action: The action structure containing type, addr, data, and size.
     // This function pushes the action to a queue and signals the action thread to process it.
-    void trigger_action(const ip_action &action);
+    // In functional mode (see sim_mode.hh) the action is processed inline instead, unless
+    // actions queued before the switch are still waiting or running: it is then queued
+    // behind them, so the actions of an IP never run out of order or concurrently.
+    // Derived classes can override this to dispatch actions differently (see coro_ip).
+    virtual void trigger_action(const ip_action &action);
 
     // Check if the given offset should trigger an action.
     // @offset: The offset from the base address to check.
@@ -247,6 +318,18 @@ public:
         return ip_action(IP_ACTION_NONE);
     }
 
+    // Doorbells declared by the IP with add_doorbell, fixed after construction.
+    const std::vector<ip_doorbell> &get_doorbells() const
+    {
+        return doorbells;
+    }
+
+    // Bind doorbell @index to the eventfd @fd, which the IP takes over.
+    // The action thread then also waits on the eventfd, replaces a previous one.
+    // Returns false, without taking @fd, if there is no such doorbell or the IP has no
+    // action thread.
+    bool bind_doorbell(unsigned index, int fd);
+
     // Process a single action asynchronously.
     // @action: The action to process.
     // This function is called by the action thread for each action in the queue.
@@ -268,22 +351,40 @@ protected:
     // Stop the action processing thread.
     void stop_action_thread();
 
+    // Declare a doorbell, see ip_doorbell. Called from the constructor, before the IP is
+    // used, at most IP_MAX_DOORBELLS times.
+    void add_doorbell(uint64_t offset, uint32_t size, uint64_t value, uint32_t flags);
+
+    // Wait in poll() for the bound doorbells or wake_fd, and replay the signalled ones.
+    // Called by the action thread with an empty queue once a doorbell is bound.
+    void wait_doorbells();
+
+    // Functional mode part of trigger_action. Returns false if @action must be queued for
+    // the action thread instead.
+    bool run_inline(const ip_action &action);
+
     std::mutex action_mtx; // Mutex for protecting the action queue
-    std::queue<ip_action> action_queue; // Queue of pending actions
+    fixed_ring<ip_action> action_queue; // Pending actions, allocated by start_action_thread
     std::condition_variable action_cv; // Condition variable for action processing
+    std::condition_variable action_space_cv; // Signalled when a full queue has room again
     std::atomic<bool> action_thread_running{false}; // Flag to control action thread
+    bool action_busy = false; // An action is running, on the action thread or inline
     std::thread action_thread; // The action processing thread
+    std::vector<ip_doorbell> doorbells; // Their fds are protected by action_mtx
+    int wake_fd = -1; // Wakes the action thread out of poll(), once a doorbell is bound
 
 public:
     enum IP_TYPE ip_type; // Default type, can be set in derived classes
     uint64_t id;
-    uint64_t base_addr;
-    uint64_t addr_size;
+    std::atomic<uint64_t> base_addr; // Updated by base_bus::remap_ip while the IP is live
+    std::atomic<uint64_t> addr_size;
 
     uint64_t vector_start;
     uint64_t nr_vectors;
 
     void *shm_ptr = NULL; // Pointer to shared memory, if applicable
+    uint64_t shm_offset = 0; // Offset of the IP's region in the bus shared memory segment
+    std::atomic<ip_timing *> timing{nullptr}; // Slave timing, set by base_bus::set_ip_timing
 
 private:
     std::mutex mtx;
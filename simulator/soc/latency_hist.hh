@@ -0,0 +1,140 @@
+#ifndef LATENCY_HIST_HH
+#define LATENCY_HIST_HH
+
+#include <cstdint>
+#include <atomic>
+#include <cstdio>
+
+// Log-linear latency histogram with bounded relative error.
+// Values below 2^SUB_BITS are recorded exactly, larger values are bucketed by their
+// position of the most significant bit and the SUB_BITS bits following it, which
+// bounds the relative error to 2^-SUB_BITS (< 1%) for any value.
+// Recording is a single relaxed atomic increment, so one histogram can be shared by
+// several threads without a lock.
+class latency_hist {
+public:
+    static const int SUB_BITS = 7;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int NR_BUCKETS = (65 - SUB_BITS) << SUB_BITS;
+
+    latency_hist()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        for (int i = 0; i < NR_BUCKETS; i++) {
+            buckets[i].store(0, std::memory_order_relaxed);
+        }
+        total.store(0, std::memory_order_relaxed);
+        max_value.store(0, std::memory_order_relaxed);
+    }
+
+    // Record one value, typically a latency in nanoseconds.
+    void record(uint64_t value)
+    {
+        buckets[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        uint64_t cur = max_value.load(std::memory_order_relaxed);
+        while (value > cur &&
+               !max_value.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Add all values recorded in @other to this histogram.
+    void merge(const latency_hist &other)
+    {
+        for (int i = 0; i < NR_BUCKETS; i++) {
+            uint64_t n = other.buckets[i].load(std::memory_order_relaxed);
+            if (n) {
+                buckets[i].fetch_add(n, std::memory_order_relaxed);
+            }
+        }
+        total.fetch_add(other.count(), std::memory_order_relaxed);
+        uint64_t m = other.max();
+        uint64_t cur = max_value.load(std::memory_order_relaxed);
+        while (m > cur && !max_value.compare_exchange_weak(cur, m, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const
+    {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const
+    {
+        return max_value.load(std::memory_order_relaxed);
+    }
+
+    // Returns the value at percentile @p (0 < @p <= 100), 0 if nothing was recorded.
+    uint64_t percentile(double p) const
+    {
+        uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(p / 100.0 * n + 0.5);
+        if (rank == 0) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (int i = 0; i < NR_BUCKETS; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                uint64_t v = highest_value_of(i);
+                return v < max() ? v : max();
+            }
+        }
+        return max();
+    }
+
+    // Call @fn(upper bound, count) for every non-empty bucket, for exporting.
+    template <typename F>
+    void for_each_bucket(F fn) const
+    {
+        for (int i = 0; i < NR_BUCKETS; i++) {
+            uint64_t n = buckets[i].load(std::memory_order_relaxed);
+            if (n) {
+                fn(highest_value_of(i), n);
+            }
+        }
+    }
+
+    // Print count, p50/p99/p99.9 and max on one line, prefixed with @name.
+    void print(const char *name) const
+    {
+        printf("%s: count=%lu p50=%lu p99=%lu p99.9=%lu max=%lu\n", name,
+               (unsigned long)count(), (unsigned long)percentile(50),
+               (unsigned long)percentile(99), (unsigned long)percentile(99.9),
+               (unsigned long)max());
+    }
+
+    static int index_of(uint64_t value)
+    {
+        if (value < (uint64_t)SUB_COUNT) {
+            return (int)value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        uint64_t mantissa = value >> (msb - SUB_BITS); // In [SUB_COUNT, 2 * SUB_COUNT)
+        return ((msb - SUB_BITS + 1) << SUB_BITS) + (int)(mantissa - SUB_COUNT);
+    }
+
+    static uint64_t highest_value_of(int index)
+    {
+        if (index < SUB_COUNT) {
+            return index;
+        }
+        int shift = (index >> SUB_BITS) - 1;
+        uint64_t mantissa = (uint64_t)(index & (SUB_COUNT - 1)) + SUB_COUNT;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+private:
+    std::atomic<uint64_t> buckets[NR_BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max_value;
+};
+
+#endif // LATENCY_HIST_HH
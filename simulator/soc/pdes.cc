@@ -0,0 +1,204 @@
+#include "pdes.hh"
+#include "bus_timing.hh"
+#include "thread_placement.hh"
+#include "debugger.hh"
+
+#include <cstdio>
+#include <algorithm>
+#include <thread>
+
+bool pdes_context::send(unsigned dst, uint64_t delay, const ip_action &action)
+{
+    pdes_engine::lp_state &s = engine->lps[lp];
+    if (dst != lp) {
+        uint64_t lookahead = dst < s.out_lookahead.size() ? s.out_lookahead[dst] : pdes_engine::NEVER;
+        if (lookahead == pdes_engine::NEVER) {
+            LOG_ERROR("pdes: LP %u has no link to LP %u, event dropped", lp, dst);
+            return false;
+        }
+        if (delay < lookahead) {
+            engine->violations.fetch_add(1, std::memory_order_relaxed);
+            delay = lookahead;
+        }
+    }
+
+    pdes_event ev{cur_time + delay, lp, dst, s.seq++, action};
+    if (dst == lp) {
+        engine->push(s, ev);
+    } else {
+        engine->outbox[thread * engine->run_threads + dst % engine->run_threads].push_back(ev);
+    }
+    return true;
+}
+
+pdes_engine::pdes_engine(unsigned threads)
+    : nr_threads(std::max(1u, threads))
+{
+}
+
+unsigned pdes_engine::add_lp(pdes_lp *lp)
+{
+    unsigned n = lps.size();
+    lps.emplace_back();
+    lps.back().lp = lp;
+    for (lp_state &s : lps) {
+        s.out_lookahead.resize(lps.size(), NEVER);
+    }
+    return n;
+}
+
+bool pdes_engine::add_link(unsigned src, unsigned dst, uint64_t lookahead_ns)
+{
+    if (src >= lps.size() || dst >= lps.size() || src == dst || !lookahead_ns) {
+        LOG_ERROR("pdes: bad link from LP %u to LP %u with lookahead %lu", src, dst, lookahead_ns);
+        return false;
+    }
+    uint64_t &out = lps[src].out_lookahead[dst];
+    out = std::min(out, lookahead_ns);
+    for (link &l : lps[dst].in_links) {
+        if (l.src == src) {
+            l.lookahead = out;
+            return true;
+        }
+    }
+    lps[dst].in_links.push_back(link{src, out});
+    return true;
+}
+
+uint64_t pdes_engine::bus_lookahead(const base_ip *ip, uint64_t fallback_ns)
+{
+    const ip_timing *timing = ip->timing.load(std::memory_order_relaxed);
+    return timing && timing->latency_ns ? timing->latency_ns : fallback_ns;
+}
+
+void pdes_engine::push(lp_state &s, const pdes_event &ev)
+{
+    s.queue.push_back(ev);
+    std::push_heap(s.queue.begin(), s.queue.end(), std::greater<pdes_event>());
+}
+
+void pdes_engine::schedule(unsigned lp, uint64_t time, const ip_action &action)
+{
+    lp_state &s = lps[lp];
+    push(s, pdes_event{time, lp, lp, s.seq++, action});
+}
+
+uint64_t pdes_engine::next_event_time() const
+{
+    uint64_t next = NEVER;
+    for (const lp_state &s : lps) {
+        if (!s.queue.empty()) {
+            next = std::min(next, s.queue.front().time);
+        }
+    }
+    return next;
+}
+
+// Set the horizons of the LPs of @thread for the next window.
+// Returns false once no event before @until is left. Every thread reads the same next
+// times, so they all agree on when to stop.
+bool pdes_engine::plan_window(unsigned thread, uint64_t until)
+{
+    uint64_t earliest = NEVER;
+    for (const lp_state &s : lps) {
+        earliest = std::min(earliest, s.next);
+    }
+    if (earliest >= until) {
+        return false;
+    }
+
+    for (unsigned i = thread; i < lps.size(); i += run_threads) {
+        lp_state &s = lps[i];
+        uint64_t horizon = until;
+        for (const link &l : s.in_links) {
+            uint64_t next = lps[l.src].next;
+            if (next != NEVER) {
+                horizon = std::min(horizon, next + l.lookahead);
+            }
+        }
+        s.horizon = horizon;
+    }
+    return true;
+}
+
+// Move the events sent to the LPs of @thread during the window into their queues.
+void pdes_engine::deliver(unsigned thread)
+{
+    for (unsigned src = 0; src < run_threads; src++) {
+        std::vector<pdes_event> &box = outbox[src * run_threads + thread];
+        for (const pdes_event &ev : box) {
+            push(lps[ev.dst], ev);
+        }
+        box.clear();
+    }
+    for (unsigned i = thread; i < lps.size(); i += run_threads) {
+        lp_state &s = lps[i];
+        s.next = s.queue.empty() ? NEVER : s.queue.front().time;
+    }
+}
+
+void pdes_engine::worker(unsigned thread, uint64_t until, std::barrier<> &sync)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "pdes%u", thread);
+    thread_placement::apply("pdes", name);
+
+    pdes_context ctx(this, thread, 0);
+    uint64_t processed = 0;
+    while (plan_window(thread, until)) {
+        for (unsigned i = thread; i < lps.size(); i += run_threads) {
+            lp_state &s = lps[i];
+            ctx.lp = i;
+            while (!s.queue.empty() && s.queue.front().time < s.horizon) {
+                std::pop_heap(s.queue.begin(), s.queue.end(), std::greater<pdes_event>());
+                pdes_event ev = s.queue.back();
+                s.queue.pop_back();
+                ctx.cur_time = ev.time;
+                s.lp->handle_event(ctx, ev);
+                s.events++;
+                processed++;
+            }
+        }
+        // Everything sent in the window is out, deliver it and publish the next times
+        sync.arrive_and_wait();
+        deliver(thread);
+        sync.arrive_and_wait();
+        if (thread == 0) {
+            windows++;
+        }
+    }
+    events.fetch_add(processed, std::memory_order_relaxed);
+}
+
+uint64_t pdes_engine::run(uint64_t until_ns)
+{
+    if (lps.empty()) {
+        return 0;
+    }
+    run_threads = std::min<size_t>(nr_threads, lps.size());
+    outbox.resize((size_t)run_threads * run_threads);
+    for (lp_state &s : lps) {
+        s.next = s.queue.empty() ? NEVER : s.queue.front().time;
+    }
+
+    uint64_t before = events.load();
+    std::barrier<> sync(run_threads);
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < run_threads; t++) {
+        threads.emplace_back(&pdes_engine::worker, this, t, until_ns, std::ref(sync));
+    }
+    worker(0, until_ns, sync);
+    for (auto &t : threads) {
+        t.join();
+    }
+    return events.load() - before;
+}
+
+void pdes_engine::print_stats(const char *name) const
+{
+    uint64_t n = events.load();
+    printf("%s: %lu events in %lu windows (%.1f per window) on %u threads, %lu lookahead "
+           "violations\n", name, (unsigned long)n, (unsigned long)windows,
+           windows ? (double)n / windows : 0.0, run_threads,
+           (unsigned long)violations.load());
+}
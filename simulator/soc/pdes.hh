@@ -0,0 +1,186 @@
+#ifndef PDES_HH
+#define PDES_HH
+
+#include <cstdint>
+#include <vector>
+#include <atomic>
+#include <barrier>
+
+#include "ip.hh"
+
+// Conservative parallel discrete-event execution.
+//
+// A standalone engine for timing models written as logical processes (LPs): every
+// modelled component (an IP or a whole bus partition) is an LP advancing in simulated
+// nanoseconds, and LPs only interact through timestamped events. Every link between two
+// LPs has a lookahead, the minimum delay of an event sent over it, usually the latency
+// of the bus path it models (see bus_lookahead()).
+//
+// The engine is not wired into the simulator. base_ip actions, base_bus accesses and the
+// cosim bridge keep running on free-running threads with no shared notion of time, and
+// soc_top does not create a pdes_engine, so nothing said here about determinism applies
+// to them. A model gets the guarantees below only by being written as pdes_lp
+// subclasses driven by run(); ip_action is reused as the event payload and
+// bus_lookahead() reads the bus timing of an IP, nothing else is shared. It is built as
+// the separate soc_pdes library, used by test_pdes and the "pdes" case of
+// soc_microbench.
+//
+// The engine runs in windows separated by barriers. At the start of a window each LP
+// gets a horizon, the earliest time any event can still arrive from its senders: for
+// every link into the LP, the time of the sender's next event plus the link lookahead.
+// The LP may process every event before its horizon in parallel with the others, and
+// events sent to other LPs are delivered at the end of the window. The LP holding the
+// earliest event always has a horizon past it, so execution never stalls as long as
+// every lookahead is at least 1 ns.
+//
+// Events of an LP are processed in (time, sending LP, sequence number of the sender)
+// order. That order only depends on the simulated behaviour, not on the number of
+// threads or on which thread ran first, so a run on N threads is bit-identical to a run
+// on one thread provided handlers only touch the state of their own LP.
+//
+//     class dma_lp : public pdes_lp {
+//         void handle_event(pdes_context &ctx, const pdes_event &ev) override
+//         {
+//             ...
+//             ctx.send(mem_lp, pdes_engine::bus_lookahead(mem, 10), ip_action(...));
+//         }
+//     };
+//
+//     pdes_engine engine(8);
+//     unsigned dma = engine.add_lp(&dma_model), mem = engine.add_lp(&mem_model);
+//     engine.add_link(dma, mem, pdes_engine::bus_lookahead(mem_ip, 10));
+//     engine.schedule(dma, 0, ip_action(IP_ACTION_DMA_START));
+//     engine.run(1000000);
+
+struct pdes_event {
+    uint64_t time;     // Simulated time in ns
+    uint32_t src;      // Sending LP
+    uint32_t dst;      // Receiving LP
+    uint64_t seq;      // Sequence number among the events sent by src
+    ip_action action;
+
+    // Order of processing, smallest first
+    bool operator>(const pdes_event &other) const
+    {
+        if (time != other.time) {
+            return time > other.time;
+        }
+        if (src != other.src) {
+            return src > other.src;
+        }
+        return seq > other.seq;
+    }
+};
+
+class pdes_engine;
+
+// Handle given to an LP while it processes an event.
+class pdes_context {
+public:
+    // Simulated time of the event being processed.
+    uint64_t now() const { return cur_time; }
+
+    // Index of the LP processing the event.
+    unsigned self() const { return lp; }
+
+    // Send @action to LP @dst, to be processed at now() + @delay.
+    // Events to another LP need a link and a @delay of at least its lookahead, a shorter
+    // delay is raised to the lookahead and counted as a violation. Returns false if
+    // there is no link to @dst, the event is dropped.
+    bool send(unsigned dst, uint64_t delay, const ip_action &action);
+
+private:
+    friend class pdes_engine;
+
+    pdes_context(pdes_engine *engine, unsigned thread, unsigned lp)
+        : engine(engine), thread(thread), lp(lp)
+        {
+        }
+
+    pdes_engine *engine;
+    unsigned thread;
+    unsigned lp;
+    uint64_t cur_time = 0;
+};
+
+// A logical process. All its state is only accessed from handle_event(), which the
+// engine calls on one thread at a time.
+class pdes_lp {
+public:
+    virtual ~pdes_lp() = default;
+
+    // Process @ev at ctx.now() == ev.time.
+    virtual void handle_event(pdes_context &ctx, const pdes_event &ev) = 0;
+};
+
+class pdes_engine {
+public:
+    static constexpr uint64_t NEVER = ~0ULL;
+
+    // @threads: Worker threads running the LPs, LP n runs on thread n % @threads.
+    explicit pdes_engine(unsigned threads);
+
+    // Add @lp, returns its index. LPs cannot be added while run() executes.
+    unsigned add_lp(pdes_lp *lp);
+
+    // Allow LP @src to send events to LP @dst with a delay of at least @lookahead_ns,
+    // which must be at least 1. A second call for the same pair keeps the smaller one.
+    bool add_link(unsigned src, unsigned dst, uint64_t lookahead_ns);
+
+    // Lookahead of a link whose events are bus accesses to @ip: the fixed latency of its
+    // bus timing (see base_bus::set_ip_timing), or @fallback_ns for an untimed IP.
+    static uint64_t bus_lookahead(const base_ip *ip, uint64_t fallback_ns);
+
+    // Queue @action for LP @lp at @time, before or between runs.
+    void schedule(unsigned lp, uint64_t time, const ip_action &action);
+
+    // Process every event before @until_ns. Later events stay queued for the next run.
+    // Returns the number of events processed.
+    uint64_t run(uint64_t until_ns);
+
+    // Time of the earliest queued event, NEVER if there is none.
+    uint64_t next_event_time() const;
+
+    // Statistics of the runs so far.
+    uint64_t nr_events() const { return events.load(); }
+    uint64_t nr_windows() const { return windows; }
+    uint64_t nr_violations() const { return violations.load(); }
+    uint64_t lp_events(unsigned lp) const { return lps[lp].events; }
+    void print_stats(const char *name) const;
+
+private:
+    friend class pdes_context;
+
+    struct link {
+        unsigned src;
+        uint64_t lookahead;
+    };
+
+    // Cache line aligned, LPs next to each other usually run on different threads
+    struct alignas(64) lp_state {
+        pdes_lp *lp = nullptr;
+        std::vector<pdes_event> queue; // Min-heap on pdes_event order
+        std::vector<link> in_links;
+        std::vector<uint64_t> out_lookahead; // By destination LP, NEVER without a link
+        uint64_t seq = 0;
+        uint64_t next = NEVER;                // Earliest queued event, set between windows
+        uint64_t horizon = 0;                 // Events before it may be processed
+        uint64_t events = 0;
+    };
+
+    void push(lp_state &s, const pdes_event &ev);
+    void worker(unsigned thread, uint64_t until, std::barrier<> &sync);
+    void deliver(unsigned thread);
+    bool plan_window(unsigned thread, uint64_t until);
+
+    unsigned nr_threads;
+    unsigned run_threads = 1; // Threads of the current run, at most one per LP
+    std::vector<lp_state> lps;
+    // outbox[src thread * run_threads + dst thread]: events sent during the window
+    std::vector<std::vector<pdes_event> > outbox;
+    std::atomic<uint64_t> events{0};
+    std::atomic<uint64_t> violations{0};
+    uint64_t windows = 0;
+};
+
+#endif // PDES_HH
@@ -0,0 +1,47 @@
+#ifndef PROBES_HH
+#define PROBES_HH
+
+// USDT static tracepoints, provider "soc".
+// Built on <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel), which compiles every
+// probe to a single nop plus an ELF note describing where its arguments live, so an
+// unattached probe costs nothing and perf or bpftrace can attach to a running SoC:
+//
+//     perf list sdt_soc:*                            (after perf buildid-cache --add soc.out)
+//     bpftrace -p $(pgrep -x soc_main) probes/bus_latency.bt
+//
+// Without <sys/sdt.h> the probes compile to nothing. Arguments must be free to compute,
+// anything costing more than a register move is left to the attached script.
+//
+// Probes and arguments:
+//   bus_access_start(rw, addr, size)             base_bus master access entered, pairs
+//                                                with bus_access_done or bus_miss and nests
+//                                                when a slave accesses the bus itself
+//   bus_access_done(rw, addr, size, ip_id)       access served by IP ip_id
+//   bus_miss(rw, addr, size)                     no IP decodes addr
+//   irq_post(src_id, vector)                     base_bus::post_irq
+//   ip_access(ip_id, rw, offset, size, ret)      slave access, ret is a BUS_ACCESS_CODE
+//   action_trigger(ip_id, type, addr, data)      action triggered by a register write
+//   action_start(ip_id, type, trigger_ns)        trigger_ns is CLOCK_MONOTONIC, 0 in
+//                                                functional mode
+//   action_done(ip_id, type)
+//   bridge_rx_start(type, addr, size)            request from QEMU received
+//   bridge_rx_done(type, addr, size, latency_ns) request served, latency 0 in functional mode
+//   bridge_tx_done(type, addr, size, latency_ns) SoC to QEMU round trip completed
+
+#if defined(__has_include) && __has_include(<sys/sdt.h>) && !defined(SOC_NO_USDT)
+#include <sys/sdt.h>
+#define SOC_PROBE2(name, a1, a2) DTRACE_PROBE2(soc, name, a1, a2)
+#define SOC_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(soc, name, a1, a2, a3)
+#define SOC_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(soc, name, a1, a2, a3, a4)
+#define SOC_PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5(soc, name, a1, a2, a3, a4, a5)
+#else
+// Arguments are still evaluated so that variables kept only for probes are used
+#define SOC_PROBE2(name, a1, a2) do { (void)(a1); (void)(a2); } while (0)
+#define SOC_PROBE3(name, a1, a2, a3) do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+#define SOC_PROBE4(name, a1, a2, a3, a4) \
+    do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } while (0)
+#define SOC_PROBE5(name, a1, a2, a3, a4, a5) \
+    do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); (void)(a5); } while (0)
+#endif
+
+#endif // PROBES_HH
@@ -0,0 +1,94 @@
+#ifndef RING_HH
+#define RING_HH
+
+#include <cstddef>
+#include <utility>
+
+#include "alloc_check.hh"
+
+// FIFO of preallocated slots, used for the queues on the hot paths instead of std::deque,
+// which allocates and frees a chunk every few elements as the queue moves along.
+// push() and pop() never allocate, the capacity only changes in reserve(). Not
+// thread-safe, users hold their own lock.
+template <typename T>
+class fixed_ring {
+public:
+    explicit fixed_ring(size_t capacity = 0)
+    {
+        reserve(capacity);
+    }
+
+    ~fixed_ring()
+    {
+        delete[] slots;
+    }
+
+    fixed_ring(const fixed_ring &) = delete;
+    fixed_ring &operator=(const fixed_ring &) = delete;
+
+    bool empty() const { return head == tail; }
+    bool full() const { return tail - head == cap; }
+    size_t size() const { return tail - head; }
+    size_t capacity() const { return cap; }
+
+    // Append @v. Returns false if the ring is full.
+    bool push(const T &v)
+    {
+        if (full()) {
+            return false;
+        }
+        slots[tail++ & (cap - 1)] = v;
+        return true;
+    }
+
+    // Append @v, doubling the capacity if the ring is full. For queues that cannot push
+    // back on their producer; the ring settles at the deepest backlog seen.
+    void push_grow(const T &v)
+    {
+        if (full()) {
+            alloc_check::allow grow;
+            reserve(cap * 2);
+        }
+        slots[tail++ & (cap - 1)] = v;
+    }
+
+    T &front()
+    {
+        return slots[head & (cap - 1)];
+    }
+
+    void pop()
+    {
+        head++;
+    }
+
+    // Grow to at least @capacity slots, rounded up to a power of two, keeping the contents.
+    void reserve(size_t capacity)
+    {
+        size_t n = 1;
+        while (n < capacity) {
+            n <<= 1;
+        }
+        if (n <= cap) {
+            return;
+        }
+        T *grown = new T[n];
+        size_t count = size();
+        for (size_t i = 0; i < count; i++) {
+            grown[i] = std::move(slots[(head + i) & (cap - 1)]);
+        }
+        delete[] slots;
+        slots = grown;
+        cap = n;
+        head = 0;
+        tail = count;
+    }
+
+private:
+    T *slots = nullptr;
+    size_t cap = 0;
+    size_t head = 0; // Free running indices, masked on access
+    size_t tail = 0;
+};
+
+#endif // RING_HH
@@ -0,0 +1,38 @@
+#include "sim_ctrl.hh"
+#include <cstring>
+#include <algorithm>
+
+BUS_ACCESS_CODE sim_ctrl::memaddr_can_access(bool rw, uint64_t offset, uint64_t size)
+{
+    if (offset + size > SIM_CTRL_SIZE) {
+        return ACCESS_ADDR_ERROR;
+    }
+    if (rw == MMIO_ACCESS_RW_W && offset != SIM_CTRL_REG_MODE) {
+        return ACCESS_DENIED;
+    }
+    return ACCESS_OK;
+}
+
+void sim_ctrl::mem_slave_read(uint64_t offset, uint64_t size, void *data)
+{
+    uint64_t val = 0;
+    switch (offset & ~7ULL) {
+    case SIM_CTRL_REG_MODE:
+        val = sim_mode::get();
+        break;
+    case SIM_CTRL_REG_SWITCHES:
+        val = sim_mode::switches();
+        break;
+    }
+    val >>= (offset & 7) * 8;
+    memcpy(data, &val, std::min<uint64_t>(size, sizeof(val)));
+}
+
+void sim_ctrl::mem_slave_write(uint64_t offset, uint64_t size, void *data)
+{
+    uint64_t val = 0;
+    memcpy(&val, data, std::min<uint64_t>(size, sizeof(val)));
+    if (offset == SIM_CTRL_REG_MODE) {
+        sim_mode::set(val ? SIM_MODE_FUNCTIONAL : SIM_MODE_TIMED);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef SIM_CTRL_HH
+#define SIM_CTRL_HH
+
+#include "ip.hh"
+#include "sim_mode.hh"
+
+// Register offsets of the sim_ctrl IP, 64-bit registers.
+#define SIM_CTRL_REG_MODE     0x00 // RW: SIM_MODE, writing switches the mode
+#define SIM_CTRL_REG_SWITCHES 0x08 // RO: number of mode switches so far
+#define SIM_CTRL_SIZE         0x1000
+
+// Magic MMIO register block for the guest to control the simulator.
+// A workload switches the SoC to timed mode right before its region of interest by
+// writing SIM_MODE_TIMED to SIM_CTRL_REG_MODE, e.g. with busybox devmem, and back to
+// functional mode afterwards, without restarting QEMU or the SoC.
+class sim_ctrl : public base_ip {
+public:
+    using base_ip::base_ip;
+
+    sim_ctrl(base_bus *bus, uint64_t id, uint64_t base_address)
+        : base_ip(bus, id, IP_TYPE_PERIPHERAL, base_address, SIM_CTRL_SIZE, 0, 0)
+        {
+        }
+
+    void reset() override {
+        LOG_DEBUG("sim_ctrl reset called.");
+    }
+
+    BUS_ACCESS_CODE memaddr_can_access(bool rw, uint64_t offset, uint64_t size) override;
+
+    void mem_slave_read(uint64_t offset, uint64_t size, void *data) override;
+    void mem_slave_write(uint64_t offset, uint64_t size, void *data) override;
+};
+
+#endif // SIM_CTRL_HH
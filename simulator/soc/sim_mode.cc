@@ -0,0 +1,57 @@
+#include "sim_mode.hh"
+#include "debugger.hh"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+std::atomic<int> sim_mode::mode{SIM_MODE_TIMED};
+std::mutex sim_mode::mtx;
+uint64_t sim_mode::nr_switches = 0;
+uint64_t sim_mode::since_ns = 0;
+
+static const char *mode_name(int m)
+{
+    return m == SIM_MODE_FUNCTIONAL ? "functional" : "timed";
+}
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SIM_MODE sim_mode::set(SIM_MODE m)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    SIM_MODE prev = (SIM_MODE)mode.exchange(m);
+    if (prev != m) {
+        uint64_t now = now_ns();
+        nr_switches++;
+        LOG_INFO("Switching from %s to %s mode after %.3f s.", mode_name(prev), mode_name(m),
+                 since_ns ? (now - since_ns) / 1e9 : 0.0);
+        since_ns = now;
+    }
+    return prev;
+}
+
+void sim_mode::load_from_env()
+{
+    const char *env = getenv("SOC_SIM_MODE");
+    if (!env) {
+        return;
+    }
+    if (strcmp(env, "functional") == 0) {
+        set(SIM_MODE_FUNCTIONAL);
+    } else if (strcmp(env, "timed") == 0) {
+        set(SIM_MODE_TIMED);
+    } else {
+        LOG_ERROR("Unknown SOC_SIM_MODE %s, expected functional or timed.", env);
+    }
+}
+
+uint64_t sim_mode::switches()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return nr_switches;
+}
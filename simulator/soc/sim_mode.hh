@@ -0,0 +1,52 @@
+#ifndef SIM_MODE_HH
+#define SIM_MODE_HH
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+
+// Execution modes of the SoC.
+enum SIM_MODE {
+    // Detailed mode: actions run on their IP's action thread with timestamps, coroutine
+    // delays are honoured and bridge latencies are recorded.
+    SIM_MODE_TIMED = 0,
+    // Fast-forward mode, e.g. while the guest boots: actions run inline in the thread
+    // that triggered them, coroutine delays complete immediately, bridge requests to
+    // shared memory backed RAM are served with a memcpy and nothing is recorded.
+    SIM_MODE_FUNCTIONAL = 1,
+};
+
+// Global execution mode of the simulator, switchable at runtime.
+// The mode is switched by the EX_CTRL_SIM_MODE bridge control packet, by the guest
+// through the sim_ctrl IP, or set at startup with SOC_SIM_MODE=functional|timed.
+// Hot paths read it with a relaxed load; a switch takes effect for accesses and actions
+// started after it, work in flight finishes in the mode it started in.
+class sim_mode {
+public:
+    static SIM_MODE get()
+    {
+        return (SIM_MODE)mode.load(std::memory_order_relaxed);
+    }
+
+    static bool functional()
+    {
+        return get() == SIM_MODE_FUNCTIONAL;
+    }
+
+    // Switch to @m. Returns the previous mode.
+    static SIM_MODE set(SIM_MODE m);
+
+    // Set the initial mode from SOC_SIM_MODE, if set.
+    static void load_from_env();
+
+    // Number of mode switches so far.
+    static uint64_t switches();
+
+private:
+    static std::atomic<int> mode;
+    static std::mutex mtx;
+    static uint64_t nr_switches;
+    static uint64_t since_ns; // When the current mode was entered
+};
+
+#endif // SIM_MODE_HH
@@ -0,0 +1,86 @@
+#ifndef SLAB_POOL_HH
+#define SLAB_POOL_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "alloc_check.hh"
+
+// Pool of fixed-size blocks carved out of slabs, for objects allocated and freed at a high
+// rate on the hot paths (e.g. coroutine frames). Freed blocks go on a free list and are
+// reused; slabs are only allocated when the free list runs dry and are never returned to
+// the heap, so once the number of live blocks stopped growing the pool does not allocate.
+// Blocks may be freed by another thread than the one that allocated them.
+class slab_pool {
+public:
+    // @block_size: Size of every block, rounded up to a multiple of 16 bytes.
+    // @blocks_per_slab: Blocks allocated at once when the pool runs dry.
+    slab_pool(size_t block_size, size_t blocks_per_slab)
+        : block_size((block_size + 15) & ~(size_t)15), blocks_per_slab(blocks_per_slab)
+        {
+        }
+
+    ~slab_pool()
+    {
+        for (uint8_t *slab : slabs) {
+            delete[] slab;
+        }
+    }
+
+    slab_pool(const slab_pool &) = delete;
+    slab_pool &operator=(const slab_pool &) = delete;
+
+    void *alloc()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!free_list) {
+            grow();
+        }
+        free_block *b = free_list;
+        free_list = b->next;
+        live++;
+        return b;
+    }
+
+    void free(void *p)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        free_block *b = (free_block *)p;
+        b->next = free_list;
+        free_list = b;
+        live--;
+    }
+
+    // Blocks handed out and not freed yet, and blocks allocated in total.
+    size_t nr_live() const { return live; }
+    size_t nr_blocks() const { return slabs.size() * blocks_per_slab; }
+
+private:
+    struct free_block {
+        free_block *next;
+    };
+
+    // Called with mtx held.
+    void grow()
+    {
+        alloc_check::allow grow;
+        uint8_t *slab = new uint8_t[block_size * blocks_per_slab];
+        slabs.push_back(slab);
+        for (size_t i = blocks_per_slab; i-- > 0; ) {
+            free_block *b = (free_block *)(slab + i * block_size);
+            b->next = free_list;
+            free_list = b;
+        }
+    }
+
+    const size_t block_size;
+    const size_t blocks_per_slab;
+    std::mutex mtx;
+    free_block *free_list = nullptr;
+    std::vector<uint8_t *> slabs;
+    size_t live = 0;
+};
+
+#endif // SLAB_POOL_HH
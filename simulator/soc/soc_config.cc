@@ -0,0 +1,446 @@
+#include "soc_config.hh"
+#include "bus.hh"
+#include "ram.hh"
+#include "guest_ram.hh"
+#include "sim_ctrl.hh"
+#include "cosim_bridge.hh"
+#include "cache.hh"
+#include "gem5_port.hh"
+#include "instance.hh"
+#include "debugger.hh"
+
+#include <cerrno>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <set>
+
+// The SoC soc_top used to build: 4 x 8 RAM windows of 16 MiB at (i << 38) | (j << 34), the
+// guest RAM window at 1 << 48 and the sim_ctrl registers. The RAMs are untimed, master_read
+// and master_write drop the completion time, so timing them would only cost accounting;
+// give a config file latency= and bandwidth= keys to model them.
+const char *soc_config::default_topology =
+    "ram        id=0  base=0x0400000000 size=16M count=8 stride=0x400000000\n"
+    "ram        id=8  base=0x4400000000 size=16M count=8 stride=0x400000000\n"
+    "ram        id=16 base=0x8400000000 size=16M count=8 stride=0x400000000\n"
+    "ram        id=24 base=0xc400000000 size=16M count=8 stride=0x400000000\n"
+    "bridge     id=32 irq=0+1024\n"
+    "guest_ram  id=33 base=0x1000000000000 size=0x1000000000000\n"
+    "sim_ctrl   id=34 base=0x10000000\n";
+
+static const char *default_fifos[4] = {
+    "qemu_to_soc_req", "qemu_to_soc_resp", "soc_to_qemu_req", "soc_to_qemu_resp"
+};
+
+soc_config::soc::~soc()
+{
+    for (auto it = ips.rbegin(); it != ips.rend(); ++it) {
+        delete *it;
+    }
+    for (gem5_standin *s : gem5_standins) {
+        delete s;
+    }
+    for (gem5_ring *r : gem5_rings) {
+        delete r;
+    }
+}
+
+// Parse a number with an optional 0x prefix and K/M/G/T suffix.
+static bool parse_num(const std::string &s, uint64_t &v)
+{
+    char *end;
+    // strtoull takes a sign and saturates on overflow, neither is a valid setting
+    if (s.empty() || !isxdigit((unsigned char)s[0])) {
+        return false;
+    }
+    errno = 0;
+    v = strtoull(s.c_str(), &end, 0);
+    if (errno == ERANGE) {
+        return false;
+    }
+    unsigned shift = 0;
+    switch (*end) {
+    case 'K': shift = 10; end++; break;
+    case 'M': shift = 20; end++; break;
+    case 'G': shift = 30; end++; break;
+    case 'T': shift = 40; end++; break;
+    default: break;
+    }
+    if (v > UINT64_MAX >> shift) {
+        return false;
+    }
+    v <<= shift;
+    return *end == '\0';
+}
+
+bool soc_config::load(const char *path)
+{
+    std::ifstream f(path);
+    if (!f) {
+        LOG_ERROR("Failed to open SoC config %s", path);
+        return false;
+    }
+    std::stringstream ss;
+    ss << f.rdbuf();
+    return parse(ss.str(), path);
+}
+
+bool soc_config::parse(const std::string &text, const char *source)
+{
+    std::stringstream in(text);
+    std::string line;
+    int lineno = 0;
+    bool ok = true;
+
+    descs.clear();
+    while (std::getline(in, line)) {
+        lineno++;
+        line = line.substr(0, line.find('#'));
+        std::stringstream ss(line);
+        ip_desc d;
+        std::string kv;
+        if (!(ss >> d.type)) {
+            continue;
+        }
+        if (d.type != "ram" && d.type != "guest_ram" && d.type != "sim_ctrl" && d.type != "bridge" &&
+            d.type != "cache" && d.type != "gem5") {
+            LOG_ERROR("%s:%d: unknown IP type %s", source, lineno, d.type.c_str());
+            ok = false;
+            continue;
+        }
+        d.line = lineno;
+        for (int i = 0; i < 4; i++) {
+            d.fifos[i] = default_fifos[i];
+        }
+        if (d.type == "gem5") {
+            d.ring = "gem5_port";
+            d.ring_slots = GEM5_PORT_SLOTS;
+        }
+
+        uint64_t count = 1, stride = 0;
+        bool has_id = false;
+        while (ss >> kv) {
+            size_t eq = kv.find('=');
+            std::string key = kv.substr(0, eq);
+            std::string value = eq == std::string::npos ? "" : kv.substr(eq + 1);
+            bool good = true;
+            if (key == "id") {
+                good = parse_num(value, d.id);
+                has_id = true;
+            } else if (key == "base") {
+                good = parse_num(value, d.base);
+            } else if (key == "size") {
+                good = parse_num(value, d.size);
+            } else if (key == "irq") {
+                size_t plus = value.find('+');
+                good = plus != std::string::npos && parse_num(value.substr(0, plus), d.irq_start) &&
+                       parse_num(value.substr(plus + 1), d.irq_count);
+            } else if (key == "latency" && (d.type == "ram" || d.type == "gem5")) {
+                good = parse_num(value, d.latency_ns);
+            } else if (key == "bandwidth" && d.type == "ram") {
+                good = parse_num(value, d.bandwidth_mbps);
+            } else if (key == "burst" && d.type == "ram") {
+                good = parse_num(value, d.burst_bytes);
+            } else if (key == "count" && (d.type == "ram" || d.type == "gem5")) {
+                good = parse_num(value, count) && count > 0;
+            } else if (key == "stride" && (d.type == "ram" || d.type == "gem5")) {
+                good = parse_num(value, stride);
+            } else if (key == "backing" && d.type == "cache") {
+                good = parse_num(value, d.backing);
+            } else if (key == "sets" && d.type == "cache") {
+                good = parse_num(value, d.cache.sets);
+            } else if (key == "ways" && d.type == "cache") {
+                good = parse_num(value, d.cache.ways);
+            } else if (key == "line" && d.type == "cache") {
+                good = parse_num(value, d.cache.line_size);
+            } else if (key == "policy" && d.type == "cache") {
+                d.cache.policy = value == "srrip" ? CACHE_POLICY_SRRIP : CACHE_POLICY_PLRU;
+                good = value == "plru" || value == "srrip";
+            } else if (key == "mode" && d.type == "cache") {
+                d.cache.mode = value == "writeback" ? CACHE_MODE_WRITEBACK : CACHE_MODE_STATS;
+                good = value == "stats" || value == "writeback";
+            } else if (key == "ring" && d.type == "gem5") {
+                d.ring = value;
+                good = !value.empty() && value.find('/') == std::string::npos;
+            } else if (key == "slots" && d.type == "gem5") {
+                good = parse_num(value, d.ring_slots) && d.ring_slots >= 4 &&
+                       d.ring_slots <= (1u << 20) && !(d.ring_slots & (d.ring_slots - 1));
+            } else if (key == "standin" && d.type == "gem5") {
+                good = parse_num(value, d.standin) && d.standin <= 1;
+            } else if (d.type == "bridge" && (key == "rx_req" || key == "rx_resp" ||
+                                              key == "tx_req" || key == "tx_resp")) {
+                int n = key == "rx_req" ? 0 : key == "rx_resp" ? 1 : key == "tx_req" ? 2 : 3;
+                d.fifos[n] = value;
+                good = !value.empty() && value.find('/') == std::string::npos;
+            } else {
+                good = false;
+            }
+            if (!good) {
+                LOG_ERROR("%s:%d: bad setting %s for %s", source, lineno, kv.c_str(), d.type.c_str());
+                ok = false;
+            }
+        }
+        if (!has_id) {
+            LOG_ERROR("%s:%d: %s without an id", source, lineno, d.type.c_str());
+            ok = false;
+        }
+        if (d.type == "sim_ctrl") {
+            d.size = SIM_CTRL_SIZE;
+        }
+        if (count > 1 && stride < d.size) {
+            LOG_ERROR("%s:%d: stride %lx is smaller than size %lx", source, lineno, stride, d.size);
+            ok = false;
+        }
+        if (count > 1 && stride && count - 1 > (UINT64_MAX - d.base) / stride) {
+            LOG_ERROR("%s:%d: %lu x stride %lx from %lx wraps around", source, lineno, count, stride,
+                      d.base);
+            ok = false;
+            count = 1;
+        }
+        for (uint64_t n = 0; n < count; n++) {
+            descs.push_back(d);
+            descs.back().id = d.id + n;
+            descs.back().base = d.base + n * stride;
+        }
+    }
+    bool valid = validate(source);
+    return ok && valid;
+}
+
+bool soc_config::validate(const char *source) const
+{
+    bool ok = true;
+    int bridges = 0, grams = 0;
+    long page = sysconf(_SC_PAGESIZE);
+
+    std::vector<const ip_desc *> sorted;
+    for (const ip_desc &d : descs) {
+        sorted.push_back(&d);
+        bridges += d.type == "bridge";
+        grams += d.type == "guest_ram";
+        if ((d.type == "ram" || d.type == "guest_ram" || d.type == "gem5") && !d.size) {
+            LOG_ERROR("%s:%d: %s %lu without a size", source, d.line, d.type.c_str(), d.id);
+            ok = false;
+        }
+        // The overlap checks below need every range to end below 2^64
+        if (d.size > UINT64_MAX - d.base || d.irq_count > UINT64_MAX - d.irq_start) {
+            LOG_ERROR("%s:%d: %s %lu address or irq range wraps around", source, d.line,
+                      d.type.c_str(), d.id);
+            ok = false;
+        }
+        if (d.type == "ram" && ((d.base | d.size) & (page - 1))) {
+            LOG_ERROR("%s:%d: ram %lu is not page aligned", source, d.line, d.id);
+            ok = false;
+        }
+        if (d.type == "cache" && !validate_cache(source, d)) {
+            ok = false;
+        }
+        for (const ip_desc &o : descs) {
+            if (&o == &d) {
+                break;
+            }
+            if (d.type == "gem5" && o.type == "gem5" && o.ring == d.ring &&
+                o.ring_slots != d.ring_slots) {
+                LOG_ERROR("%s:%d: gem5 %lu sets %lu slots for ring %s, %lu on line %d", source,
+                          d.line, d.id, d.ring_slots, d.ring.c_str(), o.ring_slots, o.line);
+                ok = false;
+                break;
+            }
+        }
+    }
+    if (bridges > 1 || grams > 1) {
+        LOG_ERROR("%s: at most one bridge and one guest_ram are supported", source);
+        ok = false;
+    }
+
+    // IDs and IRQ vectors identify an IP, address ranges must decode to a single one
+    auto check = [&](auto key, auto end, const char *what) {
+        std::sort(sorted.begin(), sorted.end(), [&](const ip_desc *a, const ip_desc *b) {
+            return key(a) < key(b);
+        });
+        const ip_desc *last = nullptr; // The non-empty range reaching furthest so far
+        for (const ip_desc *b : sorted) {
+            if (end(b) <= key(b)) {
+                continue;
+            }
+            if (last && end(last) > key(b)) {
+                LOG_ERROR("%s:%d: %s of %s %lu overlaps %s %lu from line %d", source, b->line,
+                          what, b->type.c_str(), b->id, last->type.c_str(), last->id, last->line);
+                ok = false;
+            }
+            if (!last || end(b) > end(last)) {
+                last = b;
+            }
+        }
+    };
+    check([](const ip_desc *d) { return d->id; },
+          [](const ip_desc *d) { return d->id + 1; }, "id");
+    check([](const ip_desc *d) { return d->base; },
+          [](const ip_desc *d) { return d->size ? d->base + d->size : 0; }, "address range");
+    check([](const ip_desc *d) { return d->irq_start; },
+          [](const ip_desc *d) { return d->irq_count ? d->irq_start + d->irq_count : 0; },
+          "irq range");
+    return ok;
+}
+
+bool soc_config::validate_cache(const char *source, const ip_desc &d) const
+{
+    const cache_config &c = d.cache;
+    bool ok = true;
+    auto pow2 = [](uint64_t v) { return v && !(v & (v - 1)); };
+    if (!d.size) {
+        LOG_ERROR("%s:%d: cache %lu without a size", source, d.line, d.id);
+        ok = false;
+    }
+    if (!pow2(c.sets) || !pow2(c.line_size) || c.line_size < 8 || !c.ways ||
+        c.ways > CACHE_MAX_WAYS) {
+        LOG_ERROR("%s:%d: cache %lu needs power of two sets and lines of at least 8 bytes, "
+                  "and 1 to %d ways", source, d.line, d.id, CACHE_MAX_WAYS);
+        ok = false;
+    }
+    if (c.policy == CACHE_POLICY_PLRU && !pow2(c.ways)) {
+        LOG_ERROR("%s:%d: cache %lu with PLRU needs a power of two ways", source, d.line, d.id);
+        ok = false;
+    }
+    // Every line of the window needs its own 32-bit tag
+    if (ok && d.size) {
+        unsigned tag_shift = __builtin_ctzll(c.sets) + __builtin_ctzll(c.line_size);
+        if (tag_shift < 64 && ((d.size - 1) >> tag_shift) > UINT32_MAX) {
+            LOG_ERROR("%s:%d: cache %lu window of %lx bytes needs tags wider than 32 bits, "
+                      "use more sets or longer lines", source, d.line, d.id, d.size);
+            ok = false;
+        }
+    }
+
+    // The backing window must be one memory, so the cache never forwards to itself
+    for (const ip_desc &m : descs) {
+        if ((m.type == "ram" || m.type == "guest_ram") && d.backing >= m.base &&
+            d.size <= m.size && d.backing - m.base <= m.size - d.size) {
+            return ok;
+        }
+    }
+    LOG_ERROR("%s:%d: backing %lx+%lx of cache %lu is not within one ram or guest_ram", source,
+              d.line, d.backing, d.size, d.id);
+    return false;
+}
+
+uint64_t soc_config::shm_span() const
+{
+    uint64_t span = 0;
+    for (const ip_desc &d : descs) {
+        if (d.type == "ram") {
+            span = std::max(span, d.base + d.size);
+        }
+    }
+    return span;
+}
+
+uint64_t soc_config::ram_size() const
+{
+    uint64_t size = 0;
+    for (const ip_desc &d : descs) {
+        if (d.type == "ram") {
+            size += d.size;
+        }
+    }
+    return size;
+}
+
+base_ip *soc_config::construct(base_bus *bus, const ip_desc &d, soc &out) const
+{
+    if (d.type == "ram") {
+        ram *r = new ram(bus, d.id, d.base, d.size, d.irq_start, d.irq_count);
+        if (d.latency_ns || d.bandwidth_mbps) {
+            bus->set_ip_timing(r, d.latency_ns, d.bandwidth_mbps, d.burst_bytes);
+        }
+        return r;
+    } else if (d.type == "guest_ram") {
+        out.gram = new guest_ram(bus, d.id, d.base, d.size, d.irq_start, d.irq_count);
+        return out.gram;
+    } else if (d.type == "sim_ctrl") {
+        return new sim_ctrl(bus, d.id, d.base);
+    } else if (d.type == "cache") {
+        return new cache_ip(bus, d.id, d.base, d.size, d.backing, d.cache);
+    } else if (d.type == "gem5") {
+        // The rings are all created before construction starts, the list is not changing
+        std::string shm = soc_instance::shm_name(d.ring.c_str());
+        gem5_ring *ring = *std::find_if(out.gem5_rings.begin(), out.gem5_rings.end(),
+                                        [&](gem5_ring *r) { return r->name() == shm; });
+        return new gem5_port(bus, d.id, d.base, d.size, ring);
+    }
+    out.bridge = new cosim_bridge(bus, d.id, d.base, d.size, d.irq_start, d.irq_count,
+                                  out.fifo_paths[0].data(), out.fifo_paths[1].data(),
+                                  out.fifo_paths[2].data(), out.fifo_paths[3].data());
+    return out.bridge;
+}
+
+// One ring per ring name, and one stand-in for a ring if any of its ports asks for it.
+void soc_config::build_gem5_rings(soc &out) const
+{
+    std::set<std::string> served;
+    for (const ip_desc &d : descs) {
+        if (d.type != "gem5") {
+            continue;
+        }
+        std::string shm = soc_instance::shm_name(d.ring.c_str());
+        if (std::none_of(out.gem5_rings.begin(), out.gem5_rings.end(),
+                         [&](gem5_ring *r) { return r->name() == shm; })) {
+            out.gem5_rings.push_back(new gem5_ring(shm, d.ring_slots));
+            soc_instance::register_shm(shm);
+        }
+        if (d.standin && served.insert(shm).second) {
+            out.gem5_standins.push_back(new gem5_standin(shm, d.latency_ns ? d.latency_ns : 50));
+        }
+    }
+}
+
+void soc_config::build(base_bus *bus, soc &out, unsigned jobs) const
+{
+    for (const ip_desc &d : descs) {
+        if (d.type == "bridge") {
+            for (int i = 0; i < 4; i++) {
+                out.fifo_paths.push_back(soc_instance::make_fifo(d.fifos[i].c_str()));
+            }
+        }
+    }
+    bus->reserve_shm(shm_span());
+    build_gem5_rings(out);
+
+    // Constructors only contend on the bus topology lock, the rest runs in parallel.
+    // Every IP has its own IRQ range, so the connect order does not change IRQ routing.
+    if (!jobs) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    jobs = std::min<size_t>(jobs, descs.size());
+    std::vector<base_ip *> ips(descs.size());
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < descs.size(); ) {
+            ips[i] = construct(bus, descs[i], out);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < jobs; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) {
+        t.join();
+    }
+    out.ips.insert(out.ips.end(), ips.begin(), ips.end());
+    for (size_t i = 0; i < descs.size(); i++) {
+        if (descs[i].type == "cache") {
+            out.caches.push_back(static_cast<cache_ip *>(ips[i]));
+        } else if (descs[i].type == "gem5") {
+            out.gem5_ports.push_back(static_cast<gem5_port *>(ips[i]));
+        }
+    }
+
+    if (out.bridge && out.gram) {
+        out.bridge->set_guest_ram(out.gram);
+    }
+}
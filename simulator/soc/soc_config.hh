@@ -0,0 +1,119 @@
+#ifndef SOC_CONFIG_HH
+#define SOC_CONFIG_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cache.hh"
+
+class base_bus;
+class base_ip;
+class cosim_bridge;
+class guest_ram;
+class gem5_ring;
+class gem5_port;
+class gem5_standin;
+
+// SoC topology read from a configuration file with one IP per line, the IP type followed
+// by key=value settings, e.g.
+//
+//     # type     settings
+//     ram        id=0 base=0x400000000 size=16M count=8 stride=0x400000000 latency=80
+//     guest_ram  id=40 base=0x1000000000000 size=0x1000000000000
+//     sim_ctrl   id=41 base=0x10000000
+//     bridge     id=32 irq=0+1024
+//     cache      id=42 base=0x2000000000 size=16M backing=0x400000000 sets=1024 ways=16
+//     gem5       id=43 base=0x3000000000 size=1G count=2 stride=1G ring=ddr standin=1
+//
+// Types and their keys:
+//   ram        id, base, size, latency=NS, bandwidth=MBPS, burst=BYTES (bus timing, see
+//              ip_timing, untimed by default), count=N and stride=BYTES for N RAMs with
+//              consecutive IDs at base, base + stride, ...
+//   guest_ram  id, base, size
+//   sim_ctrl   id, base
+//   bridge     id, irq=START+COUNT, rx_req, rx_resp, tx_req, tx_resp (FIFO names in
+//              the instance FIFO directory, the QEMU to SoC and SoC to QEMU pairs by
+//              default)
+//   cache      id, base, size, backing=ADDR (a window of that size of one ram or
+//              guest_ram), sets, ways, line=BYTES, policy=plru|srrip, mode=stats|writeback
+//              (see cache_ip, 1024 sets of 16 ways of 64 B, PLRU, statistics only by
+//              default)
+//   gem5       id, base, size, ring=NAME (the gem5_ring, gem5_port by default; ports
+//              naming the same ring batch together), slots=N (ring size, 256 by
+//              default), standin=1 to serve the ring with gem5_standin instead of gem5,
+//              with latency=NS (50 by default), count and stride as for ram
+// Numbers take a 0x prefix and a K, M, G or T suffix. IDs must be unique and address
+// ranges must not overlap or wrap around, there is at most one bridge and one guest_ram.
+//
+// The file is named by --config FILE (see soc_instance) or the SOC_CONFIG environment
+// variable, without one the built-in topology of default_topology is used.
+class soc_config {
+public:
+    struct ip_desc {
+        std::string type;
+        uint64_t id = 0;
+        uint64_t base = 0;
+        uint64_t size = 0;
+        uint64_t irq_start = 0;
+        uint64_t irq_count = 0;
+        uint64_t latency_ns = 0;
+        uint64_t bandwidth_mbps = 0;
+        uint64_t burst_bytes = 0;
+        std::string fifos[4]; // Bridge rx_req, rx_resp, tx_req, tx_resp
+        uint64_t backing = 0;  // Cache backing memory
+        cache_config cache;
+        std::string ring;      // gem5 ring name
+        uint64_t ring_slots = 0;
+        uint64_t standin = 0;
+        int line = 0;
+    };
+
+    // The SoC built from a configuration. Owns the IPs, not the bus.
+    struct soc {
+        std::vector<base_ip *> ips;
+        std::vector<std::string> fifo_paths; // Kept alive for the bridge
+        cosim_bridge *bridge = nullptr;
+        guest_ram *gram = nullptr;
+        std::vector<cache_ip *> caches;
+        std::vector<gem5_port *> gem5_ports;
+        std::vector<gem5_ring *> gem5_rings;      // Outlive the ports using them
+        std::vector<gem5_standin *> gem5_standins;
+        ~soc();
+    };
+
+    // Parse the configuration file @path.
+    // Returns false on a bad line or an invalid topology, after logging every error.
+    bool load(const char *path);
+
+    // Parse configuration text, @source names it in error messages.
+    bool parse(const std::string &text, const char *source);
+
+    // Size of the bus shared memory segment needed by the RAM IPs.
+    uint64_t shm_span() const;
+
+    // Total size of the RAM IPs.
+    uint64_t ram_size() const;
+
+    // Construct every IP on @bus with @jobs threads (0 for one per CPU).
+    // RAM IPs only map their window of the segment, their pages are allocated on first
+    // touch, so construction time does not depend on the amount of RAM.
+    void build(base_bus *bus, soc &out, unsigned jobs) const;
+
+    const std::vector<ip_desc> &ips() const
+    {
+        return descs;
+    }
+
+    static const char *default_topology;
+
+private:
+    bool validate(const char *source) const;
+    bool validate_cache(const char *source, const ip_desc &d) const;
+    base_ip *construct(base_bus *bus, const ip_desc &d, soc &out) const;
+    void build_gem5_rings(soc &out) const;
+
+    std::vector<ip_desc> descs;
+};
+
+#endif // SOC_CONFIG_HH
@@ -1,33 +1,120 @@
 #include "soc_top.hh"
 #include "bus.hh"
 #include "cosim_bridge.hh"
-#include "ram.hh"
+#include "soc_config.hh"
+#include "gem5_port.hh"
 #include "debugger.hh"
+#include "thread_placement.hh"
+#include "trace.hh"
+#include "heat_profile.hh"
+#include "instance.hh"
 
-int main() {
-    uint64_t i = 0, j = 0;
+#include <chrono>
 
+#include <signal.h>
+
+static volatile sig_atomic_t dump_stats = 0;
+static volatile sig_atomic_t toggle_trace = 0;
+
+static void dump_stats_handler(int sig)
+{
+    (void)sig;
+    dump_stats = 1;
+}
+
+static void toggle_trace_handler(int sig)
+{
+    (void)sig;
+    toggle_trace = 1;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point &since)
+{
+    auto now = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(now - since).count();
+    since = now;
+    return ms;
+}
+
+int main(int argc, char **argv) {
     debugger::set_level(debugger::DEBUG);
+    if (!soc_instance::init(argc, argv)) {
+        return 1;
+    }
 
-    base_bus *bus = new base_bus(0, "soc_bus");
-    ram *dev[32];
-    for (i = 0; i < 4; i++) {
-        for (j = 1; j <=8; j++) {
-            dev[i] = new ram(bus, i, (i << 38) | (j << 34), 0x1000000, 0, 0);
-        }
-        
+    thread_placement::load_from_env();
+    thread_placement::apply("main", "soc_main");
+    sim_mode::load_from_env();
+    trace::set_path(soc_instance::file_name("soc_trace.json").c_str());
+    trace::load_from_env();
+    heat_profile::load_from_env();
+    signal(SIGUSR1, dump_stats_handler);
+    signal(SIGUSR2, toggle_trace_handler);
+
+    auto t = std::chrono::steady_clock::now();
+    soc_config config;
+    const std::string &config_path = soc_instance::config_path();
+    if (config_path.empty() ? !config.parse(soc_config::default_topology, "built-in topology")
+                            : !config.load(config_path.c_str())) {
+        return 1;
+    }
+    double config_ms = elapsed_ms(t);
+
+    // The shared memory name must match soc_backend_shm_name passed to the QEMU device,
+    // QEMU maps the advertised RAM regions directly from this segment.
+    std::string shm = soc_instance::shm_name("gem5_share_memory");
+    soc_instance::register_shm(shm);
+    soc_instance::install_crash_handlers();
+    base_bus *bus = new base_bus(0, shm.c_str());
+    soc_config::soc soc;
+    config.build(bus, soc, soc_instance::init_jobs());
+    double build_ms = elapsed_ms(t);
+    if (!soc.bridge) {
+        LOG_ERROR("The SoC topology has no bridge.");
+        return 1;
     }
-    cosim_bridge *co_bridge = new cosim_bridge(bus, i, 0, 0, 0, 1024,
-        "./fifo/qemu_to_soc_req",
-        "./fifo/qemu_to_soc_resp",
-        "./fifo/soc_to_qemu_req",
-        "./fifo/soc_to_qemu_resp"
-    );
+    cosim_bridge *co_bridge = soc.bridge;
 
+    // Opening the FIFOs waits for QEMU, reported separately from the SoC's own startup
     co_bridge->cosim_start_polling_remote();
+    printf("soc: %zu IPs, %lu MiB of RAM; startup config %.2f ms, build %.2f ms, "
+           "QEMU connect %.2f ms\n", soc.ips.size(), (unsigned long)(config.ram_size() >> 20),
+           config_ms, build_ms, elapsed_ms(t));
+    fflush(stdout);
 
+    // kill -USR1 <pid> prints the bridge latency percentiles, bus timing, cache and gem5
+    // port statistics and heat profile,
+    // kill -USR2 <pid> starts or stops tracing
     while(1) {
-        //LOG_DEBUG("idle");
+        pause();
+        if (dump_stats) {
+            dump_stats = 0;
+            co_bridge->dump_latency_stats();
+            bus->dump_timing_stats();
+            for (cache_ip *c : soc.caches) {
+                char name[32];
+                snprintf(name, sizeof(name), "cache %lu", (unsigned long)c->id);
+                c->print_stats(name);
+            }
+            for (gem5_port *g : soc.gem5_ports) {
+                char name[32];
+                snprintf(name, sizeof(name), "gem5 %lu", (unsigned long)g->id);
+                g->print_stats(name);
+            }
+            for (gem5_ring *r : soc.gem5_rings) {
+                r->print_stats(r->name().c_str());
+            }
+            heat_profile::dump();
+            fflush(stdout);
+        }
+        if (toggle_trace) {
+            toggle_trace = 0;
+            if (trace::enabled()) {
+                trace::stop();
+            } else {
+                trace::start();
+            }
+        }
     }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,199 @@
+#ifndef FAKE_QEMU_HH
+#define FAKE_QEMU_HH
+
+// QEMU end of a cosim_bridge for tests: the four FIFOs in a temporary directory and a
+// thread serving the requests the SoC sends to QEMU from a flat memory, including burst
+// and IRQ packets. Every packet is logged. Requests from QEMU to the SoC are sent with
+// request().
+//
+//   fake_qemu qemu(0x1000);
+//   cosim_bridge bridge(&bus, id, base, 0x1000, 0, 0, qemu.path(0), qemu.path(1),
+//                       qemu.path(2), qemu.path(3));
+//   qemu.connect(bridge);
+//   ...
+//   qemu.disconnect();     // Before the bridge is destroyed
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cosim_bridge.hh"
+
+class fake_qemu {
+public:
+    // @window: Size of the bridge window served from memory, accesses past it are dropped.
+    explicit fake_qemu(uint64_t window) : mem(window)
+    {
+        signal(SIGPIPE, SIG_IGN); // Broken FIFOs must fail the write, not kill the test
+        char tmpl[] = "/tmp/fake_qemu_XXXXXX";
+        dir = mkdtemp(tmpl) ? tmpl : "";
+        const char *names[4] = { "qemu_to_soc_req", "qemu_to_soc_resp", "soc_to_qemu_req",
+                                 "soc_to_qemu_resp" };
+        for (int i = 0; i < 4; i++) {
+            paths[i] = dir + "/" + names[i];
+            mkfifo(paths[i].c_str(), 0600);
+        }
+    }
+
+    ~fake_qemu()
+    {
+        disconnect();
+        if (server.joinable()) {
+            server.join(); // Ends when the bridge closes its side
+        }
+        for (const std::string &p : paths) {
+            unlink(p.c_str());
+        }
+        rmdir(dir.c_str());
+    }
+
+    // FIFO paths in the order of the cosim_bridge constructor.
+    char *path(int i)
+    {
+        return paths[i].data();
+    }
+
+    // Open both directions with @bridge and start serving it.
+    void connect(cosim_bridge &bridge)
+    {
+        server = std::thread([this]() { serve(); });
+        bridge.cosim_start_polling_remote();
+        rx_req = open(paths[0].c_str(), O_WRONLY);
+        rx_resp = open(paths[1].c_str(), O_RDONLY);
+    }
+
+    // Close the requests to the SoC, so the receive thread of the bridge ends.
+    void disconnect()
+    {
+        if (rx_req < 0) {
+            return;
+        }
+        close(rx_req);
+        close(rx_resp);
+        rx_req = rx_resp = -1;
+        // The receive thread is detached, give it time to see the end of file
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    // Stop answering: the FIFOs to the SoC are closed and its next request fails.
+    void hang_up()
+    {
+        int fd = tx_resp.exchange(-1);
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Send @cmd to the SoC and wait for its response, returns false if there is none.
+    bool request(exPktCmd &cmd)
+    {
+        return write(rx_req, &cmd, sizeof(cmd)) == sizeof(cmd) &&
+               read(rx_resp, &cmd, sizeof(cmd)) == sizeof(cmd);
+    }
+
+    // Packets received from the SoC so far.
+    std::vector<exPktCmd> packets()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return log;
+    }
+
+    void clear_packets()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        log.clear();
+    }
+
+    std::vector<uint8_t> mem; // The bridge window as QEMU sees it
+
+private:
+    // Serve SoC requests until the bridge closes its request FIFO.
+    void serve()
+    {
+        int req = open(paths[2].c_str(), O_RDONLY);
+        tx_resp = open(paths[3].c_str(), O_WRONLY);
+        exPktCmd cmd;
+        uint8_t payload[TX_BURST_MAX];
+        while (read_full(req, &cmd, sizeof(cmd))) {
+            uint64_t len = cmd.type == EX_PKT_WR_BURST || cmd.type == EX_PKT_RD_BURST ?
+                           cmd.length : 0;
+            if (cmd.type == EX_PKT_WR_BURST && !read_full(req, payload, len)) {
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                log.push_back(cmd);
+            }
+            bool in = cmd.addr <= mem.size() && (uint64_t)cmd.length <= mem.size() - cmd.addr;
+            switch (cmd.type) {
+            case EX_PKT_RD:
+                cmd.data = 0;
+                if (in && cmd.length <= 8) {
+                    memcpy(&cmd.data, &mem[cmd.addr], cmd.length);
+                }
+                break;
+            case EX_PKT_WR:
+                if (in && cmd.length <= 8) {
+                    memcpy(&mem[cmd.addr], &cmd.data, cmd.length);
+                }
+                break;
+            case EX_PKT_WR_BURST:
+                if (in) {
+                    memcpy(&mem[cmd.addr], payload, len);
+                }
+                break;
+            case EX_PKT_RD_BURST:
+                memset(payload, 0, len);
+                if (in) {
+                    memcpy(payload, &mem[cmd.addr], len);
+                }
+                break;
+            default:
+                break;
+            }
+            int type = cmd.type;
+            cmd.type = (exPktType)(type | EX_PKT_RESP_FLAG);
+            int fd = tx_resp.load();
+            if (fd < 0 || write(fd, &cmd, sizeof(cmd)) != sizeof(cmd) ||
+                (type == EX_PKT_RD_BURST && write(fd, payload, len) != (ssize_t)len)) {
+                break;
+            }
+        }
+        close(req);
+        hang_up();
+    }
+
+    static bool read_full(int fd, void *buf, size_t len)
+    {
+        size_t done = 0;
+        while (done < len) {
+            ssize_t ret = read(fd, (uint8_t *)buf + done, len - done);
+            if (ret <= 0) {
+                return false;
+            }
+            done += ret;
+        }
+        return true;
+    }
+
+    std::string dir;
+    std::string paths[4];
+    int rx_req = -1;
+    int rx_resp = -1;
+    std::atomic<int> tx_resp{-1};
+    std::thread server;
+    std::mutex mtx;
+    std::vector<exPktCmd> log;
+};
+
+#endif // FAKE_QEMU_HH
@@ -0,0 +1,603 @@
+// soc_bench: open-loop load generator for the cosim bridge protocol.
+//
+// Acts as a synthetic QEMU: it connects to the SoC FIFOs, issues a configurable
+// mix of reads and writes over the SoC RAM windows at a fixed rate from several client
+// threads, and records the latency of every request in log-linear histograms. IRQ packets
+// are not part of the mix: the SoC does not answer them, so they would have no latency
+// and only add unmeasured load.
+// Latency is measured from the time a request was scheduled to be sent, not from when
+// it was actually sent, so a stalled SoC shows up in the tail instead of slowing down
+// the load (no coordinated omission).
+//
+// Example:
+//     ./soc_bench --fifo-dir ./fifo --rate 200000 --threads 4 --mix 70:30
+//                 --size 4,8 --dist zipf --duration 10 --json run.json --baseline base.json
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cosim_bridge.hh"
+#include "sim_mode.hh"
+#include "latency_hist.hh"
+
+enum bench_op {
+    OP_READ = 0,
+    OP_WRITE = 1,
+    OP_MAX
+};
+
+static const char *op_names[OP_MAX] = { "read", "write" };
+
+struct bench_region {
+    uint64_t addr;
+    uint64_t size;
+};
+
+struct bench_config {
+    std::string fifo_dir = "./fifo";
+    double duration = 10.0;      // Seconds of measured load
+    double warmup = 1.0;         // Seconds of load before recording starts
+    double rate = 100000.0;      // Requests per second over all threads, 0 for closed loop
+    bool poisson = false;        // Exponential instead of fixed inter-arrival times
+    int threads = 1;
+    int mix[OP_MAX] = { 100, 0 };
+    std::vector<int> sizes = { 8 };
+    std::string dist = "uniform"; // uniform, seq or zipf
+    double zipf_theta = 0.99;
+    std::string json_path;
+    std::string baseline_path;
+    std::string sim_mode;        // functional or timed, empty to leave the SoC as is
+};
+
+// A request written to the FIFO and waiting for its response.
+// The SoC serves requests in order, so responses match the in-flight queue in order.
+struct inflight_req {
+    uint64_t intended_ns;
+    int op;
+    bool record;
+    std::atomic<bool> *done; // Set for closed-loop clients
+};
+
+static bench_config cfg;
+static std::vector<bench_region> regions;
+static uint64_t total_pages;
+
+static int req_fd, resp_fd;
+// send_mtx keeps the in-flight queue in FIFO order across clients, inflight_mtx guards the
+// queue itself. The receiver only takes inflight_mtx, so a client blocked writing to a full
+// FIFO never stops the responses that would drain it.
+static std::mutex send_mtx;
+static std::mutex inflight_mtx;
+static std::deque<inflight_req> inflight;
+static std::atomic<bool> stop{false};
+
+static latency_hist hist[OP_MAX];
+static std::atomic<uint64_t> sent[OP_MAX];
+static std::atomic<uint64_t> max_inflight{0};
+
+static inline uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool xfer(exPktCmd &cmd)
+{
+    if (write(req_fd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
+        return false;
+    }
+    return read(resp_fd, &cmd, sizeof(cmd)) == sizeof(cmd);
+}
+
+// Ask the SoC for its RAM regions, fall back to the soc_top layout if it does not answer.
+static void discover_regions()
+{
+    exPktCmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = EX_PKT_CTRL;
+    cmd.length = EX_CTRL_REGION_COUNT;
+    if (xfer(cmd) && cmd.length == ACCESS_OK && cmd.data) {
+        uint64_t count = cmd.data;
+        for (uint64_t i = 0; i < count; i++) {
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.type = EX_PKT_CTRL;
+            cmd.length = EX_CTRL_REGION_ADDR;
+            cmd.addr = i;
+            if (xfer(cmd) && cmd.length == ACCESS_OK) {
+                regions.push_back(bench_region{cmd.addr, cmd.data});
+            }
+        }
+    }
+    if (regions.empty()) {
+        for (uint64_t i = 0; i < 4; i++) {
+            for (uint64_t j = 1; j <= 8; j++) {
+                regions.push_back(bench_region{(i << 38) | (j << 34), 0x1000000});
+            }
+        }
+    }
+    total_pages = 0;
+    for (auto &r : regions) {
+        total_pages += r.size >> 12;
+    }
+    printf("soc_bench: %zu RAM regions, %lu pages\n", regions.size(), (unsigned long)total_pages);
+}
+
+// Switch the SoC execution mode, e.g. to compare functional and timed mode costs.
+static void set_sim_mode()
+{
+    exPktCmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = EX_PKT_CTRL;
+    cmd.length = EX_CTRL_SIM_MODE;
+    cmd.data = cfg.sim_mode == "functional" ? SIM_MODE_FUNCTIONAL : SIM_MODE_TIMED;
+    if (!xfer(cmd) || cmd.length != ACCESS_OK) {
+        fprintf(stderr, "soc_bench: the SoC did not accept the mode switch\n");
+        exit(1);
+    }
+    printf("soc_bench: SoC in %s mode\n", cfg.sim_mode.c_str());
+}
+
+// Zipf generator over [0, n) from Gray et al., "Quickly generating billion-record
+// synthetic databases".
+class zipf_gen {
+public:
+    zipf_gen(uint64_t n, double theta) : n(n), theta(theta)
+    {
+        zetan = zeta(n, theta);
+        double zeta2 = zeta(2, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+    }
+
+    uint64_t next(std::mt19937_64 &rng)
+    {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + pow(0.5, theta)) {
+            return 1;
+        }
+        return (uint64_t)(n * pow(eta * u - eta + 1.0, alpha)) % n;
+    }
+
+private:
+    static double zeta(uint64_t n, double theta)
+    {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++) {
+            sum += 1.0 / pow((double)i, theta);
+        }
+        return sum;
+    }
+
+    uint64_t n;
+    double theta, zetan, alpha, eta;
+};
+
+static uint64_t page_to_addr(uint64_t page)
+{
+    for (auto &r : regions) {
+        uint64_t pages = r.size >> 12;
+        if (page < pages) {
+            return r.addr + (page << 12);
+        }
+        page -= pages;
+    }
+    return regions[0].addr;
+}
+
+static void client_func(int tid, uint64_t start_ns, uint64_t record_ns, uint64_t end_ns)
+{
+    std::mt19937_64 rng(0x5eed + tid);
+    zipf_gen *zipf = cfg.dist == "zipf" ? new zipf_gen(total_pages, cfg.zipf_theta) : nullptr;
+    int mix_total = cfg.mix[OP_READ] + cfg.mix[OP_WRITE];
+    double interval_ns = cfg.rate > 0 ? 1e9 * cfg.threads / cfg.rate : 0;
+    std::exponential_distribution<double> exp_gap(1.0);
+    uint64_t seq_page = (total_pages / cfg.threads) * tid;
+    uint64_t seq_off = 0;
+    std::atomic<bool> done{false};
+    double next_ns = start_ns + interval_ns * tid / cfg.threads;
+
+    while (!stop.load(std::memory_order_relaxed)) {
+        // Closed-loop clients send as soon as the previous response arrived
+        uint64_t intended = interval_ns > 0 ? (uint64_t)next_ns : std::max(now_ns(), start_ns);
+        if (intended >= end_ns) {
+            break;
+        }
+        next_ns += cfg.poisson ? interval_ns * exp_gap(rng) : interval_ns;
+        // Sleep for most of the gap, spin for the rest to keep the schedule accurate
+        for (uint64_t t = now_ns(); t + 50000 < intended; t = now_ns()) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(intended - t - 50000));
+        }
+        while (now_ns() < intended) {
+        }
+
+        int pick = std::uniform_int_distribution<int>(0, mix_total - 1)(rng);
+        int op = pick < cfg.mix[OP_READ] ? OP_READ : OP_WRITE;
+        int size = cfg.sizes[std::uniform_int_distribution<size_t>(0, cfg.sizes.size() - 1)(rng)];
+
+        uint64_t page;
+        uint64_t offset;
+        if (cfg.dist == "seq") {
+            page = seq_page % total_pages;
+            offset = seq_off;
+            seq_off += size;
+            if (seq_off + size > 4096) {
+                seq_off = 0;
+                seq_page++;
+            }
+        } else {
+            page = zipf ? zipf->next(rng) :
+                   std::uniform_int_distribution<uint64_t>(0, total_pages - 1)(rng);
+            offset = std::uniform_int_distribution<uint64_t>(0, 4096 / size - 1)(rng) * size;
+        }
+
+        exPktCmd cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.length = size;
+        cmd.type = op == OP_READ ? EX_PKT_RD : EX_PKT_WR;
+        cmd.addr = page_to_addr(page) + offset;
+        cmd.data = rng();
+
+        bool closed = interval_ns == 0;
+        done.store(false);
+        {
+            std::lock_guard<std::mutex> lock(send_mtx);
+            {
+                std::lock_guard<std::mutex> ilock(inflight_mtx);
+                inflight.push_back(inflight_req{intended, op, intended >= record_ns,
+                                                closed ? &done : nullptr});
+                if (inflight.size() > max_inflight.load(std::memory_order_relaxed)) {
+                    max_inflight.store(inflight.size(), std::memory_order_relaxed);
+                }
+            }
+            if (write(req_fd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
+                perror("soc_bench: write");
+                stop.store(true);
+                break;
+            }
+        }
+        if (intended >= record_ns) {
+            sent[op].fetch_add(1, std::memory_order_relaxed);
+        }
+        if (closed) {
+            while (!done.load() && !stop.load(std::memory_order_relaxed)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    delete zipf;
+}
+
+static void receiver_func()
+{
+    exPktCmd cmd;
+    while (read(resp_fd, &cmd, sizeof(cmd)) == sizeof(cmd)) {
+        uint64_t t = now_ns();
+        inflight_req req;
+        {
+            std::lock_guard<std::mutex> lock(inflight_mtx);
+            if (inflight.empty()) {
+                fprintf(stderr, "soc_bench: unexpected response type %d\n", cmd.type);
+                continue;
+            }
+            req = inflight.front();
+            inflight.pop_front();
+        }
+        if (req.record) {
+            hist[req.op].record(t - req.intended_ns);
+        }
+        if (req.done) {
+            req.done->store(true);
+        }
+    }
+}
+
+static bool read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = read(fd, (uint8_t *)buf + done, len - done);
+        if (ret <= 0) {
+            return false;
+        }
+        done += ret;
+    }
+    return true;
+}
+
+// Serve requests the SoC sends to QEMU, reads return zero. Every request gets a response
+// header, read bursts also their payload, and the payload of write bursts is consumed.
+static void soc_to_qemu_func(int fd_req, int fd_resp)
+{
+    exPktCmd cmd;
+    uint8_t payload[TX_BURST_MAX];
+    while (read_full(fd_req, &cmd, sizeof(cmd))) {
+        bool burst = cmd.type == EX_PKT_WR_BURST || cmd.type == EX_PKT_RD_BURST;
+        size_t len = burst ? cmd.length : 0;
+        if (burst && (cmd.length < 0 || cmd.length > TX_BURST_MAX)) {
+            fprintf(stderr, "soc_bench: burst of %d bytes from the SoC\n", cmd.length);
+            break;
+        }
+        if (cmd.type == EX_PKT_WR_BURST && !read_full(fd_req, payload, len)) {
+            break;
+        }
+
+        size_t resp_len = 0;
+        if (cmd.type == EX_PKT_RD) {
+            cmd.data = 0;
+        } else if (cmd.type == EX_PKT_RD_BURST) {
+            cmd.type = (exPktType)(EX_PKT_RD_BURST | EX_PKT_RESP_FLAG);
+            memset(payload, 0, len);
+            resp_len = len;
+        } else {
+            cmd.type = EX_PKT_RESP_FLAG;
+        }
+        if (write(fd_resp, &cmd, sizeof(cmd)) != sizeof(cmd) ||
+            (resp_len && write(fd_resp, payload, resp_len) != (ssize_t)resp_len)) {
+            break;
+        }
+    }
+}
+
+static void write_json(double elapsed)
+{
+    std::ofstream f(cfg.json_path);
+    f << "{\n  \"config\": {\"rate\": " << cfg.rate << ", \"threads\": " << cfg.threads
+      << ", \"duration\": " << cfg.duration << ", \"dist\": \"" << cfg.dist << "\""
+      << ", \"mix\": [" << cfg.mix[0] << ", " << cfg.mix[1] << "]"
+      << ", \"poisson\": " << (cfg.poisson ? "true" : "false") << "},\n";
+    f << "  \"max_inflight\": " << max_inflight.load() << ",\n";
+    f << "  \"results\": {\n";
+    for (int op = 0; op < OP_MAX; op++) {
+        f << "    \"" << op_names[op] << "\": {\"sent\": " << sent[op].load()
+          << ", \"ops_per_sec\": " << sent[op].load() / elapsed
+          << ", \"count\": " << hist[op].count()
+          << ", \"p50\": " << hist[op].percentile(50)
+          << ", \"p90\": " << hist[op].percentile(90)
+          << ", \"p99\": " << hist[op].percentile(99)
+          << ", \"p999\": " << hist[op].percentile(99.9)
+          << ", \"p9999\": " << hist[op].percentile(99.99)
+          << ", \"max\": " << hist[op].max() << ", \"histogram\": [";
+        bool first = true;
+        hist[op].for_each_bucket([&](uint64_t value, uint64_t count) {
+            f << (first ? "" : ", ") << "[" << value << ", " << count << "]";
+            first = false;
+        });
+        f << "]}" << (op + 1 < OP_MAX ? "," : "") << "\n";
+    }
+    f << "  }\n}\n";
+    printf("soc_bench: results written to %s\n", cfg.json_path.c_str());
+}
+
+// Find "key": <number> following "section" in a JSON file written by write_json.
+static bool json_lookup(const std::string &text, const std::string &section,
+                        const std::string &key, double &value)
+{
+    size_t pos = text.find("\"" + section + "\"");
+    if (pos == std::string::npos) {
+        return false;
+    }
+    pos = text.find("\"" + key + "\":", pos);
+    if (pos == std::string::npos) {
+        return false;
+    }
+    value = atof(text.c_str() + pos + key.size() + 3);
+    return true;
+}
+
+static void compare_baseline()
+{
+    std::ifstream f(cfg.baseline_path);
+    if (!f) {
+        fprintf(stderr, "soc_bench: cannot read baseline %s\n", cfg.baseline_path.c_str());
+        return;
+    }
+    std::stringstream ss;
+    ss << f.rdbuf();
+    std::string text = ss.str();
+
+    const char *keys[] = { "p50", "p99", "p999", "max" };
+    printf("\nversus baseline %s:\n", cfg.baseline_path.c_str());
+    for (int op = 0; op < OP_MAX; op++) {
+        if (!hist[op].count()) {
+            continue;
+        }
+        printf("  %-6s", op_names[op]);
+        uint64_t now[] = { hist[op].percentile(50), hist[op].percentile(99),
+                           hist[op].percentile(99.9), hist[op].max() };
+        for (int k = 0; k < 4; k++) {
+            double base;
+            if (json_lookup(text, op_names[op], keys[k], base) && base > 0) {
+                printf("  %s %+.1f%%", keys[k], (now[k] - base) * 100.0 / base);
+            }
+        }
+        printf("\n");
+    }
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\n"
+           "  --fifo-dir DIR     directory of the SoC FIFOs (default ./fifo)\n"
+           "  --duration SEC     measured duration (default 10)\n"
+           "  --warmup SEC       load before recording (default 1)\n"
+           "  --rate OPS         requests per second over all threads, 0 = closed loop\n"
+           "  --poisson          exponential inter-arrival times\n"
+           "  --threads N        client threads (default 1)\n"
+           "  --mix R:W          read:write weights (default 100:0)\n"
+           "  --size LIST        access sizes in bytes, e.g. 1,2,4,8 (default 8)\n"
+           "  --dist D           uniform, seq or zipf (default uniform)\n"
+           "  --zipf-theta T     zipf skew (default 0.99)\n"
+           "  --json FILE        write results as JSON\n"
+           "  --baseline FILE    compare against a previous JSON result\n"
+           "  --sim-mode M       switch the SoC to functional or timed mode first\n", prog);
+}
+
+static void parse_args(int argc, char **argv)
+{
+    static struct option opts[] = {
+        { "fifo-dir", required_argument, 0, 'f' },
+        { "duration", required_argument, 0, 'd' },
+        { "warmup", required_argument, 0, 'W' },
+        { "rate", required_argument, 0, 'r' },
+        { "poisson", no_argument, 0, 'p' },
+        { "threads", required_argument, 0, 't' },
+        { "mix", required_argument, 0, 'm' },
+        { "size", required_argument, 0, 's' },
+        { "dist", required_argument, 0, 'D' },
+        { "zipf-theta", required_argument, 0, 'z' },
+        { "json", required_argument, 0, 'j' },
+        { "baseline", required_argument, 0, 'b' },
+        { "sim-mode", required_argument, 0, 'M' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+        switch (c) {
+        case 'f': cfg.fifo_dir = optarg; break;
+        case 'd': cfg.duration = atof(optarg); break;
+        case 'W': cfg.warmup = atof(optarg); break;
+        case 'r': cfg.rate = atof(optarg); break;
+        case 'p': cfg.poisson = true; break;
+        case 't': cfg.threads = std::max(1, atoi(optarg)); break;
+        case 'm':
+            if (sscanf(optarg, "%d:%d", &cfg.mix[0], &cfg.mix[1]) != 2 || cfg.mix[0] < 0 ||
+                cfg.mix[1] < 0 || cfg.mix[0] + cfg.mix[1] <= 0) {
+                fprintf(stderr, "bad --mix %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's': {
+            cfg.sizes.clear();
+            std::stringstream ss(optarg);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                int size = atoi(item.c_str());
+                if (size != 1 && size != 2 && size != 4 && size != 8) {
+                    fprintf(stderr, "bad size %s, the protocol carries 1, 2, 4 or 8 bytes\n",
+                            item.c_str());
+                    exit(1);
+                }
+                cfg.sizes.push_back(size);
+            }
+            break;
+        }
+        case 'D': cfg.dist = optarg; break;
+        case 'z': cfg.zipf_theta = atof(optarg); break;
+        case 'j': cfg.json_path = optarg; break;
+        case 'b': cfg.baseline_path = optarg; break;
+        case 'M': cfg.sim_mode = optarg; break;
+        default:
+            usage(argv[0]);
+            exit(c == 'h' ? 0 : 1);
+        }
+    }
+    if (cfg.dist != "uniform" && cfg.dist != "seq" && cfg.dist != "zipf") {
+        fprintf(stderr, "bad --dist %s\n", cfg.dist.c_str());
+        exit(1);
+    }
+    if (!cfg.sim_mode.empty() && cfg.sim_mode != "functional" && cfg.sim_mode != "timed") {
+        fprintf(stderr, "bad --sim-mode %s\n", cfg.sim_mode.c_str());
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    parse_args(argc, argv);
+
+    std::string q2s_req = cfg.fifo_dir + "/qemu_to_soc_req";
+    std::string q2s_resp = cfg.fifo_dir + "/qemu_to_soc_resp";
+    std::string s2q_req = cfg.fifo_dir + "/soc_to_qemu_req";
+    std::string s2q_resp = cfg.fifo_dir + "/soc_to_qemu_resp";
+    mkdir(cfg.fifo_dir.c_str(), 0755);
+    mkfifo(q2s_req.c_str(), 0666);
+    mkfifo(q2s_resp.c_str(), 0666);
+    mkfifo(s2q_req.c_str(), 0666);
+    mkfifo(s2q_resp.c_str(), 0666);
+
+    // Same open order as the SoC, which opens its TX FIFOs before the RX ones
+    printf("soc_bench: waiting for the SoC on %s\n", cfg.fifo_dir.c_str());
+    int s2q_req_fd = open(s2q_req.c_str(), O_RDONLY);
+    int s2q_resp_fd = open(s2q_resp.c_str(), O_WRONLY);
+    req_fd = open(q2s_req.c_str(), O_WRONLY);
+    resp_fd = open(q2s_resp.c_str(), O_RDONLY);
+    if (s2q_req_fd < 0 || s2q_resp_fd < 0 || req_fd < 0 || resp_fd < 0) {
+        perror("soc_bench: open");
+        return 1;
+    }
+    std::thread(soc_to_qemu_func, s2q_req_fd, s2q_resp_fd).detach();
+
+    discover_regions();
+    if (!cfg.sim_mode.empty()) {
+        set_sim_mode();
+    }
+
+    std::thread receiver(receiver_func);
+    uint64_t start = now_ns() + 10000000;
+    uint64_t record = start + (uint64_t)(cfg.warmup * 1e9);
+    uint64_t end = record + (uint64_t)(cfg.duration * 1e9);
+    std::vector<std::thread> clients;
+    for (int t = 0; t < cfg.threads; t++) {
+        clients.emplace_back(client_func, t, start, record, end);
+    }
+    for (auto &t : clients) {
+        t.join();
+    }
+
+    // Drain outstanding responses before reporting
+    for (int i = 0; i < 10000; i++) {
+        {
+            std::lock_guard<std::mutex> lock(inflight_mtx);
+            if (inflight.empty()) {
+                break;
+            }
+        }
+        usleep(1000);
+    }
+    double elapsed = cfg.duration;
+    close(req_fd);
+    receiver.detach();
+
+    printf("soc_bench: rate %.0f/s, %d threads, mix %d:%d, dist %s, max in flight %lu\n",
+           cfg.rate, cfg.threads, cfg.mix[0], cfg.mix[1], cfg.dist.c_str(),
+           (unsigned long)max_inflight.load());
+    for (int op = 0; op < OP_MAX; op++) {
+        if (sent[op].load()) {
+            printf("  %-6s sent %lu (%.0f/s), latency ns p50 %lu p99 %lu p99.9 %lu max %lu\n",
+                   op_names[op], (unsigned long)sent[op].load(), sent[op].load() / elapsed,
+                   (unsigned long)hist[op].percentile(50), (unsigned long)hist[op].percentile(99),
+                   (unsigned long)hist[op].percentile(99.9), (unsigned long)hist[op].max());
+        }
+    }
+    if (!cfg.json_path.empty()) {
+        write_json(elapsed);
+    }
+    if (!cfg.baseline_path.empty()) {
+        compare_baseline();
+    }
+    return 0;
+}
@@ -0,0 +1,1117 @@
+// soc_microbench: in-process micro benchmarks of SoC hot paths.
+//
+// Usage: ./soc_microbench [case...]   (all cases when none is given)
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <utility>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "bus.hh"
+#include "ram.hh"
+#include "static_bus.hh"
+#include "trace.hh"
+#include "heat_profile.hh"
+#include "virtqueue.hh"
+#include "coro_ip.hh"
+#include "latency_hist.hh"
+#include "alloc_check.hh"
+#include "pdes.hh"
+#include "cache.hh"
+#include "verify.hh"
+#include "gem5_port.hh"
+#include "cosim_bridge.hh"
+
+static inline uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Shared memory name unique to this process so runs do not collide.
+static std::string bench_shm_name(const char *what)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/soc_microbench_%s_%d", what, getpid());
+    return name;
+}
+
+// The RAM layout built by soc_top: 4 x 8 windows of 16 MiB at (i << 38) | (j << 34).
+static constexpr uint64_t SOC_RAM_SIZE = 0x1000000;
+
+static constexpr uint64_t soc_ram_base(size_t n)
+{
+    return ((uint64_t)(n / 8) << 38) | ((uint64_t)(n % 8 + 1) << 34);
+}
+
+template <typename Seq>
+struct soc_ram_static_bus;
+
+template <size_t... I>
+struct soc_ram_static_bus<std::index_sequence<I...> > {
+    typedef static_bus<static_slot<ram, soc_ram_base(I), SOC_RAM_SIZE>...> type;
+
+    template <typename T>
+    static type make(base_bus *fallback, T &rams)
+    {
+        return type(fallback, rams[I]...);
+    }
+};
+
+// Per-access cost of the dynamic base_bus against the compile-time static_bus.
+static void bench_dispatch()
+{
+    const size_t nr_rams = 32;
+    const size_t nr_addrs = 1 << 16;
+    const int rounds = 64;
+
+    std::string shm = bench_shm_name("dispatch");
+    base_bus bus(0, shm.c_str());
+    std::vector<ram *> rams;
+    for (size_t n = 0; n < nr_rams; n++) {
+        rams.push_back(new ram(&bus, n, soc_ram_base(n), SOC_RAM_SIZE, 0, 0));
+    }
+    typedef soc_ram_static_bus<std::make_index_sequence<32> > sbus_t;
+    sbus_t::type sbus = sbus_t::make(&bus, rams);
+
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> addrs(nr_addrs);
+    for (auto &a : addrs) {
+        // Stay within one page per window so the numbers show decode cost, not TLB misses
+        a = soc_ram_base(rng() % nr_rams) + (rng() % 512) * 8;
+    }
+
+    uint64_t sum = 0, data = 0;
+    // Fault the pages in before timing anything
+    for (uint64_t a : addrs) {
+        bus.master_write(a, 8, &data);
+    }
+
+    uint64_t t0 = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (uint64_t a : addrs) {
+            bus.master_read(a, 8, &data);
+            sum += data;
+        }
+    }
+    uint64_t t1 = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (uint64_t a : addrs) {
+            sbus.master_read(a, 8, &data);
+            sum += data;
+        }
+    }
+    uint64_t t2 = now_ns();
+
+    double n = (double)nr_addrs * rounds;
+    printf("dispatch: %zu RAM slaves, 8-byte random reads\n", nr_rams);
+    printf("  base_bus   %8.2f ns/access\n", (t1 - t0) / n);
+    printf("  static_bus %8.2f ns/access\n", (t2 - t1) / n);
+    if (sum == 1) {
+        printf("\n");
+    }
+
+    for (auto r : rams) {
+        delete r;
+    }
+}
+
+// Hot path cost of the bus timing layer: untimed reads against reads accounted on a
+// slave with timing, from one thread and from four threads contending for the slave.
+static void bench_timing()
+{
+    const size_t nr_addrs = 1 << 12;
+    const int rounds = 1024;
+
+    std::string shm = bench_shm_name("timing");
+    base_bus bus(0, shm.c_str());
+    ram *plain = new ram(&bus, 0, soc_ram_base(0), SOC_RAM_SIZE, 0, 0);
+    ram *timed = new ram(&bus, 1, soc_ram_base(1), SOC_RAM_SIZE, 0, 0);
+    bus.set_ip_timing(timed, 80, 12800);
+
+    auto run = [&](uint64_t base, int nr_threads) {
+        std::vector<std::thread> threads;
+        uint64_t t0 = now_ns();
+        for (int t = 0; t < nr_threads; t++) {
+            threads.emplace_back([&bus, base, nr_addrs, rounds]() {
+                uint64_t data = 0;
+                for (int r = 0; r < rounds; r++) {
+                    for (size_t i = 0; i < nr_addrs; i++) {
+                        bus.master_read(base + (i & 511) * 8, 8, &data);
+                    }
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        return (now_ns() - t0) / ((double)nr_addrs * rounds);
+    };
+
+    printf("timing: 8-byte reads, 80 ns / 12800 MB/s slave\n");
+    printf("  untimed 1 thread   %8.2f ns/access\n", run(soc_ram_base(0), 1));
+    printf("  timed   1 thread   %8.2f ns/access\n", run(soc_ram_base(1), 1));
+    printf("  untimed 4 threads  %8.2f ns/access (wall time per access of one thread)\n",
+           run(soc_ram_base(0), 4));
+    printf("  timed   4 threads  %8.2f ns/access (wall time per access of one thread)\n",
+           run(soc_ram_base(1), 4));
+    bus.dump_timing_stats();
+
+    delete plain;
+    delete timed;
+}
+
+// Cost of a trace span with tracing off and on.
+static void bench_trace()
+{
+    const int iters = 1 << 24;
+    volatile uint64_t sink = 0;
+
+    auto run = [&]() {
+        uint64_t t0 = now_ns();
+        for (int i = 0; i < iters; i++) {
+            trace_span span("bench", "bench", i);
+            sink = sink + i;
+        }
+        return (now_ns() - t0) / (double)iters;
+    };
+
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < iters; i++) {
+        sink = sink + i;
+    }
+    double base = (now_ns() - t0) / (double)iters;
+    double off = run();
+    trace::set_path("/dev/null");
+    trace::start();
+    double on = run();
+    trace::stop();
+
+    printf("trace: span around an empty loop body\n");
+    printf("  no span      %8.2f ns/iter\n", base);
+    printf("  tracing off  %8.2f ns/iter\n", off);
+    printf("  tracing on   %8.2f ns/iter (%d events per thread kept)\n", on, 1 << 20);
+}
+
+// Cost of the heat profile hook on the bus access path, off and sampling every 64th
+// access, over the soc_top RAM layout with a skewed address distribution.
+static void bench_heat()
+{
+    const size_t nr_rams = 32;
+    const size_t nr_addrs = 1 << 16;
+    const int rounds = 64;
+
+    std::string shm = bench_shm_name("heat");
+    base_bus bus(0, shm.c_str());
+    std::vector<ram *> rams;
+    for (size_t n = 0; n < nr_rams; n++) {
+        rams.push_back(new ram(&bus, n, soc_ram_base(n), SOC_RAM_SIZE, 0, 0));
+    }
+
+    // Most accesses go to a few pages of the first windows
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> addrs(nr_addrs);
+    for (auto &a : addrs) {
+        size_t n = std::min<size_t>(std::geometric_distribution<size_t>(0.3)(rng), nr_rams - 1);
+        a = soc_ram_base(n) + std::min<uint64_t>(std::geometric_distribution<uint64_t>(0.2)(rng),
+                                                 15) * 4096 + (rng() % 512) * 8;
+    }
+    uint64_t data = 0;
+    for (uint64_t a : addrs) {
+        bus.master_write(a, 8, &data);
+    }
+
+    auto run = [&]() {
+        uint64_t t0 = now_ns();
+        for (int r = 0; r < rounds; r++) {
+            for (uint64_t a : addrs) {
+                bus.master_read(a, 8, &data);
+            }
+        }
+        return (now_ns() - t0) / ((double)nr_addrs * rounds);
+    };
+
+    double off = run();
+    heat_profile::start(64);
+    double on = run();
+    heat_profile::stop();
+
+    printf("heat: 8-byte reads over %zu RAM windows\n", nr_rams);
+    printf("  sampling off     %8.2f ns/access\n", off);
+    printf("  every 64th       %8.2f ns/access\n", on);
+    heat_profile::print(5);
+
+    for (auto r : rams) {
+        delete r;
+    }
+}
+
+// Device side of the virtqueue bench: completes every chain without touching its buffers.
+class null_vq : public virtqueue_ip {
+public:
+    using virtqueue_ip::virtqueue_ip;
+
+    uint32_t process_chain(unsigned queue, const vq_chain &chain) override
+    {
+        (void)queue;
+        return chain.bufs[0].len;
+    }
+};
+
+// Receives the used buffer IRQs of the virtqueue bench in place of the bridge.
+class irq_counter : public base_ip {
+public:
+    irq_counter(base_bus *bus, uint64_t id)
+        : base_ip(bus, id, IP_TYPE_PERIPHERAL, 0, 0, 0, VQ_MAX_QUEUES)
+        {
+        }
+
+    void reset() override {}
+    void mem_slave_read(uint64_t, uint64_t, void *) override {}
+    void mem_slave_write(uint64_t, uint64_t, void *) override {}
+    void handle_irq(uint64_t) override { irqs++; }
+
+    std::atomic<uint64_t> irqs{0};
+};
+
+// Descriptor throughput of a virtqueue_ip with rings in SoC RAM, and the doorbells and
+// IRQs it takes. The driver runs in this thread, keeps the ring full of one-buffer chains,
+// polls the used ring and asks for an IRQ every half ring; the device drains the queue on
+// its action thread.
+static void bench_virtqueue()
+{
+    const uint64_t total = 1 << 21;
+    const uint16_t qsize = 256;
+    const uint64_t vq_base = 0x20000000;
+    const uint64_t ring = soc_ram_base(0);
+    const uint64_t desc_addr = ring, driver_addr = ring + 0x10000, device_addr = ring + 0x20000;
+    const uint64_t buf_addr = ring + 0x100000;
+
+    std::string shm = bench_shm_name("virtqueue");
+    base_bus bus(0, shm.c_str());
+    ram *mem = new ram(&bus, 0, ring, SOC_RAM_SIZE, 0, 0);
+    irq_counter *sink = new irq_counter(&bus, 1);
+    uint8_t *host = (uint8_t *)bus.master_get_shm_ptr(ring);
+
+    auto reg_write = [&](uint64_t reg, uint64_t val) {
+        bus.master_write(vq_base + reg, 8, &val);
+    };
+    auto at16 = [&](uint64_t addr) { return (uint16_t *)(host + (addr - ring)); };
+    auto load = [](uint16_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); };
+    auto store = [](uint16_t *p, uint16_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); };
+
+    struct desc {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t a, b; // Split: flags, next; packed: id, flags
+    };
+    desc *descs = (desc *)host;
+
+    printf("virtqueue: one-buffer chains, queue of %u, driver polling\n", qsize);
+    for (uint64_t flags : { (uint64_t)0, (uint64_t)VQ_F_EVENT_IDX, (uint64_t)(VQ_F_PACKED | VQ_F_EVENT_IDX) }) {
+        null_vq *vq = new null_vq(&bus, 2, vq_base, 1, 1, 0);
+        memset(host, 0, 0x30000);
+        sink->irqs = 0;
+        reg_write(VQ_REG_QUEUE_SEL, 0);
+        reg_write(VQ_REG_QUEUE_SIZE, qsize);
+        reg_write(VQ_REG_QUEUE_DESC, desc_addr);
+        reg_write(VQ_REG_QUEUE_DRIVER, driver_addr);
+        reg_write(VQ_REG_QUEUE_DEVICE, device_addr);
+        reg_write(VQ_REG_QUEUE_FLAGS, flags);
+        reg_write(VQ_REG_QUEUE_ENABLE, 1);
+
+        bool packed = flags & VQ_F_PACKED, event_idx = flags & VQ_F_EVENT_IDX;
+        std::vector<uint16_t> free_ids;
+        for (uint16_t i = 0; i < qsize; i++) {
+            free_ids.push_back(i);
+        }
+        uint64_t posted = 0, completed = 0, kicks = 0;
+        uint16_t avail_idx = 0, last_used = 0;  // Split indices, packed slots
+        bool avail_wrap = true, used_wrap = true;
+        if (!event_idx) {
+            store(at16(driver_addr), VQ_AVAIL_F_NO_INTERRUPT);
+        }
+
+        uint64_t t0 = now_ns();
+        while (completed < total) {
+            uint16_t added = 0;
+            while (!free_ids.empty() && posted < total) {
+                uint16_t id = free_ids.back();
+                free_ids.pop_back();
+                if (packed) {
+                    desc &d = descs[avail_idx];
+                    d.addr = buf_addr + id * 64;
+                    d.len = 64;
+                    d.a = id;
+                    store(&d.b, VQ_DESC_F_WRITE | (avail_wrap ? VQ_DESC_F_AVAIL : VQ_DESC_F_USED));
+                    if (++avail_idx == qsize) {
+                        avail_idx = 0;
+                        avail_wrap = !avail_wrap;
+                    }
+                } else {
+                    descs[id] = desc{buf_addr + id * 64, 64, VQ_DESC_F_WRITE, 0};
+                    *at16(driver_addr + 4 + 2 * (avail_idx & (qsize - 1))) = id;
+                    avail_idx++;
+                }
+                added++;
+                posted++;
+            }
+            if (added) {
+                bool kick;
+                if (!packed) {
+                    store(at16(driver_addr + 2), avail_idx);
+                }
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (packed) {
+                    uint16_t ev_flags = load(at16(device_addr + 2));
+                    uint16_t off_wrap = load(at16(device_addr));
+                    int event = off_wrap & 0x7fff;
+                    if ((bool)(off_wrap >> 15) != avail_wrap) {
+                        event -= qsize;
+                    }
+                    kick = ev_flags == VQ_EVENT_ENABLE ||
+                           (ev_flags == VQ_EVENT_DESC &&
+                            vq_need_event(event, avail_idx, avail_idx - added));
+                } else if (event_idx) {
+                    uint16_t avail_event = load(at16(device_addr + 4 + 8 * qsize));
+                    kick = vq_need_event(avail_event, avail_idx, avail_idx - added);
+                } else {
+                    kick = !(load(at16(device_addr)) & VQ_USED_F_NO_NOTIFY);
+                }
+                if (kick) {
+                    reg_write(VQ_REG_NOTIFY, 0);
+                    kicks++;
+                }
+            }
+
+            uint64_t reaped = 0;
+            if (packed) {
+                for (;;) {
+                    desc &d = descs[last_used];
+                    uint16_t f = load(&d.b);
+                    if ((bool)(f & VQ_DESC_F_AVAIL) != used_wrap || (bool)(f & VQ_DESC_F_USED) != used_wrap) {
+                        break;
+                    }
+                    free_ids.push_back(d.a);
+                    reaped++;
+                    if (++last_used == qsize) {
+                        last_used = 0;
+                        used_wrap = !used_wrap;
+                    }
+                }
+                if (event_idx) {
+                    uint16_t target = last_used + qsize / 2;
+                    bool wrap = used_wrap;
+                    if (target >= qsize) {
+                        target -= qsize;
+                        wrap = !wrap;
+                    }
+                    store(at16(driver_addr), target | (wrap << 15));
+                    store(at16(driver_addr + 2), VQ_EVENT_DESC);
+                }
+            } else {
+                uint16_t used_idx = load(at16(device_addr + 2));
+                while (last_used != used_idx) {
+                    uint32_t id = *(uint32_t *)(host + (device_addr - ring) + 4 + 8 * (last_used & (qsize - 1)));
+                    free_ids.push_back(id);
+                    last_used++;
+                    reaped++;
+                }
+                if (event_idx) {
+                    store(at16(driver_addr + 4 + 2 * qsize), last_used + qsize / 2);
+                }
+            }
+            completed += reaped;
+            if (!reaped) {
+                std::this_thread::yield();
+            }
+        }
+        double secs = (now_ns() - t0) / 1e9;
+
+        printf("  %-18s %7.2f M descriptors/s, %7.1f doorbells and %7.1f IRQs per 1M\n",
+               packed ? "packed event_idx" : event_idx ? "split event_idx" : "split",
+               total / secs / 1e6, kicks * 1e6 / total, sink->irqs.load() * 1e6 / total);
+        delete vq;
+    }
+
+    delete sink;
+    delete mem;
+}
+
+// Peripheral whose register writes each trigger an action, recording the latency from
+// the write to the action running on the action thread.
+class action_latency_ip : public base_ip {
+public:
+    action_latency_ip(base_bus *bus, uint64_t id, uint64_t base)
+        : base_ip(bus, id, IP_TYPE_PERIPHERAL, base, 0x1000, 0, 0)
+        {
+            start_action_thread();
+        }
+
+    ~action_latency_ip() override
+    {
+        stop_action_thread();
+    }
+
+    void reset() override {}
+    void mem_slave_read(uint64_t, uint64_t, void *) override {}
+    void mem_slave_write(uint64_t, uint64_t, void *) override {}
+
+    bool should_trigger_action(uint64_t, uint64_t, bool, void *) override
+    {
+        return true;
+    }
+
+    ip_action get_action(uint64_t offset, uint64_t size, void *data) override
+    {
+        ip_action action(IP_ACTION_CUSTOM, offset, *(uint64_t *)data, size);
+        action.timestamp = now_ns();
+        return action;
+    }
+
+    void process_action(const ip_action &action) override
+    {
+        hist.record(now_ns() - action.timestamp);
+        done.fetch_add(1, std::memory_order_release);
+    }
+
+    latency_hist hist;
+    std::atomic<uint64_t> done{0};
+};
+
+// Coroutine variant: writes with a non-zero value make the action read a register of
+// this IP through the bus, which goes through the executor's blocking threads.
+class coro_latency_ip : public coro_ip {
+public:
+    coro_latency_ip(base_bus *bus, uint64_t id, uint64_t base)
+        : coro_ip(bus, id, IP_TYPE_PERIPHERAL, base, 0x1000, 0, 0)
+        {
+        }
+
+    void reset() override {}
+    void mem_slave_read(uint64_t, uint64_t, void *data) override { *(uint64_t *)data = 0; }
+    void mem_slave_write(uint64_t, uint64_t, void *) override {}
+
+    bool should_trigger_action(uint64_t, uint64_t, bool, void *) override
+    {
+        return true;
+    }
+
+    ip_action get_action(uint64_t offset, uint64_t size, void *data) override
+    {
+        ip_action action(IP_ACTION_CUSTOM, offset, *(uint64_t *)data, size);
+        action.timestamp = now_ns();
+        return action;
+    }
+
+    co_task run_action(ip_action action) override
+    {
+        if (action.data) {
+            uint64_t reg;
+            co_await bus_read(base_addr + 0x800, sizeof(reg), &reg);
+        }
+        hist.record(now_ns() - action.timestamp);
+        done.fetch_add(1, std::memory_order_release);
+    }
+
+    latency_hist hist;
+    std::atomic<uint64_t> done{0};
+};
+
+// Heap allocations and latency of the action paths: register write to action thread,
+// register write to coroutine, and coroutine with a bus access on a blocking thread.
+// At most 256 actions are in flight. Allocations are counted in -DSOC_ALLOC_CHECK=ON
+// builds only.
+static void bench_alloc()
+{
+    const uint64_t total = 1000000;
+    const uint64_t inflight = 256;
+    std::string shm = bench_shm_name("alloc");
+    base_bus bus(0, shm.c_str());
+    action_latency_ip *aip = new action_latency_ip(&bus, 0, 0x20000000);
+    coro_latency_ip *cip = new coro_latency_ip(&bus, 1, 0x20001000);
+
+    auto run = [&](const char *name, uint64_t addr, uint64_t value, latency_hist &hist,
+                   std::atomic<uint64_t> &done) {
+        auto drive = [&](uint64_t n) {
+            uint64_t base = done.load();
+            for (uint64_t i = 0; i < n; i++) {
+                while (i - (done.load(std::memory_order_acquire) - base) >= inflight) {
+                    std::this_thread::yield();
+                }
+                bus.master_write(addr, 8, &value);
+            }
+            while (done.load(std::memory_order_acquire) - base < n) {
+                std::this_thread::yield();
+            }
+        };
+        drive(total / 10); // Warm up rings and pools
+        hist.reset();
+        uint64_t allocs = alloc_check::allocations();
+        uint64_t start = now_ns();
+        drive(total);
+        double secs = (now_ns() - start) / 1e9;
+        allocs = alloc_check::allocations() - allocs;
+        printf("  %-16s %9.0f actions/s  latency ns p50 %6lu p99 %7lu p99.9 %7lu max %8lu",
+               name, total / secs, (unsigned long)hist.percentile(50),
+               (unsigned long)hist.percentile(99), (unsigned long)hist.percentile(99.9),
+               (unsigned long)hist.max());
+        if (alloc_check::enabled()) {
+            printf("  %.1f allocs/1M", allocs * 1e6 / total);
+        }
+        printf("\n");
+    };
+
+    printf("alloc: %lu actions per path, at most %lu in flight%s\n", (unsigned long)total,
+           (unsigned long)inflight,
+           alloc_check::enabled() ? "" : ", build with -DSOC_ALLOC_CHECK=ON to count allocations");
+    run("action thread", 0x20000000, 0, aip->hist, aip->done);
+    run("coroutine", 0x20001000, 0, cip->hist, cip->done);
+    run("coroutine + bus", 0x20001000, 1, cip->hist, cip->done);
+
+    delete cip;
+    delete aip;
+}
+
+// LP of the pdes bench: masters send requests to memories, which answer them, each
+// event burns about @work_ns of CPU like a detailed timing model would.
+class bench_lp : public pdes_lp {
+public:
+    bench_lp(unsigned id, unsigned nr_masters, unsigned nr_mems,
+             const std::vector<uint64_t> &mem_lat)
+        : id(id), nr_masters(nr_masters), nr_mems(nr_mems), mem_lat(mem_lat), state(id + 1)
+        {
+        }
+
+    void handle_event(pdes_context &ctx, const pdes_event &ev) override
+    {
+        for (int i = 0; i < 64; i++) {
+            state = state * 6364136223846793005ULL + ev.action.data + i;
+        }
+        if (id < nr_masters) {
+            unsigned mem = state % nr_mems;
+            ctx.send(nr_masters + mem, mem_lat[mem] + (state >> 40) % 64,
+                     ip_action(IP_ACTION_CUSTOM, 0, state));
+        } else {
+            ctx.send(ev.src, mem_lat[id - nr_masters] + (state >> 40) % 32,
+                     ip_action(IP_ACTION_CUSTOM, 0, state));
+        }
+    }
+
+    unsigned id, nr_masters, nr_mems;
+    const std::vector<uint64_t> &mem_lat;
+    uint64_t state;
+};
+
+// Scaling of the parallel discrete-event engine: 48 master LPs with 4 requests in flight
+// each to 16 memory LPs, over links whose lookahead is the bus latency of the memories.
+// The model state must come out the same whatever the number of threads.
+static void bench_pdes()
+{
+    const unsigned nr_masters = 48, nr_mems = 16;
+    const uint64_t sim_ns = 200000;
+
+    std::string shm = bench_shm_name("pdes");
+    base_bus bus(0, shm.c_str());
+    std::vector<ram *> rams;
+    std::vector<uint64_t> mem_lat;
+    for (unsigned i = 0; i < nr_mems; i++) {
+        rams.push_back(new ram(&bus, i, soc_ram_base(i), 0x10000, 0, 0));
+        bus.set_ip_timing(rams.back(), 40 + i * 5, 12800, 64);
+        mem_lat.push_back(pdes_engine::bus_lookahead(rams.back(), 10));
+    }
+
+    unsigned max_threads = std::max(2u, std::thread::hardware_concurrency());
+    printf("pdes: %u masters, %u memories, %lu us simulated, up to %u threads\n", nr_masters,
+           nr_mems, (unsigned long)(sim_ns / 1000), max_threads);
+    double base_rate = 0;
+    uint64_t ref_digest = 0;
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        std::vector<bench_lp *> lps;
+        pdes_engine engine(threads);
+        for (unsigned i = 0; i < nr_masters + nr_mems; i++) {
+            lps.push_back(new bench_lp(i, nr_masters, nr_mems, mem_lat));
+            engine.add_lp(lps.back());
+        }
+        for (unsigned m = 0; m < nr_masters; m++) {
+            for (unsigned n = 0; n < nr_mems; n++) {
+                engine.add_link(m, nr_masters + n, mem_lat[n]);
+                engine.add_link(nr_masters + n, m, mem_lat[n]);
+            }
+            for (unsigned k = 0; k < 4; k++) {
+                engine.schedule(m, k, ip_action(IP_ACTION_CUSTOM, 0, k));
+            }
+        }
+
+        uint64_t start = now_ns();
+        uint64_t events = engine.run(sim_ns);
+        double rate = events * 1e9 / (now_ns() - start);
+        uint64_t digest = 0;
+        for (auto lp : lps) {
+            digest = digest * 31 + lp->state;
+            delete lp;
+        }
+        if (threads == 1) {
+            base_rate = rate;
+            ref_digest = digest;
+        }
+        printf("  %2u threads  %6.2f M events/s  speedup %5.2fx  %.1f events/window  %s\n",
+               threads, rate / 1e6, rate / base_rate,
+               (double)events / std::max<uint64_t>(1, engine.nr_windows()),
+               digest == ref_digest ? "same state" : "STATE DIFFERS");
+    }
+
+    for (auto r : rams) {
+        delete r;
+    }
+}
+
+// Cost of the cache model per access, alone and behind the bus, for a working set that
+// fits the 1 MiB cache, a random set 16 times larger and a sequential stream. One access
+// in four is a write.
+static void bench_cache()
+{
+    const uint64_t n = 1 << 22;
+    const uint64_t ram_base = soc_ram_base(0), cache_base = 0x2000000000;
+    std::string shm = bench_shm_name("cache");
+    base_bus bus(0, shm.c_str());
+    ram *r = new ram(&bus, 0, ram_base, SOC_RAM_SIZE, 0, 0);
+
+    std::mt19937_64 rng(1);
+    struct pattern {
+        const char *name;
+        std::vector<uint64_t> offsets;
+    } patterns[3] = { { "random 512K", {} }, { "random 16M", {} }, { "stream 16M", {} } };
+    for (uint64_t i = 0; i < n; i++) {
+        patterns[0].offsets.push_back(rng() % (512 << 10) & ~7ULL);
+        patterns[1].offsets.push_back(rng() % SOC_RAM_SIZE & ~7ULL);
+        patterns[2].offsets.push_back(i * 8 % SOC_RAM_SIZE);
+    }
+
+    auto hit_rate = [](const cache_stats &a, const cache_stats &b) {
+        uint64_t hits = b.read_hits - a.read_hits + b.write_hits - a.write_hits;
+        uint64_t misses = b.read_misses - a.read_misses + b.write_misses - a.write_misses;
+        return hits * 100.0 / std::max<uint64_t>(1, hits + misses);
+    };
+
+    printf("cache: 1024 sets x 16 ways x 64 B, %lu accesses per pattern, %s tag compare\n",
+           (unsigned long)n, __builtin_cpu_supports("avx2") ? "AVX2" : "SSE2");
+    for (CACHE_POLICY policy : { CACHE_POLICY_PLRU, CACHE_POLICY_SRRIP }) {
+        cache_config cfg;
+        cfg.policy = policy;
+        cache_ip *c = new cache_ip(&bus, 1, cache_base, SOC_RAM_SIZE, ram_base, cfg);
+        for (const pattern &p : patterns) {
+            c->reset();
+            for (uint64_t off : p.offsets) { // Warm up
+                c->access(off, 8, MMIO_ACCESS_RW_R);
+            }
+            cache_stats before = c->stats();
+            double ns = 1e9;
+            for (int run = 0; run < 3; run++) { // Best of 3, a VM neighbour easily adds 50%
+                uint64_t start = now_ns();
+                for (uint64_t i = 0; i < n; i++) {
+                    c->access(p.offsets[i], 8, i & 3 ? MMIO_ACCESS_RW_R : MMIO_ACCESS_RW_W);
+                }
+                ns = std::min(ns, (double)(now_ns() - start) / n);
+            }
+            printf("  model %-5s %-12s %6.2f ns/access  %5.1f%% hits\n",
+                   policy == CACHE_POLICY_PLRU ? "plru" : "srrip", p.name, ns,
+                   hit_rate(before, c->stats()));
+        }
+        delete c;
+    }
+
+    // 8-byte bus reads of the fitting set: the RAM directly, then through the cache window
+    for (int mode = -1; mode <= CACHE_MODE_WRITEBACK; mode++) {
+        cache_config cfg;
+        cfg.mode = (CACHE_MODE)std::max(mode, 0);
+        cache_ip *c = mode < 0 ? nullptr : new cache_ip(&bus, 1, cache_base, SOC_RAM_SIZE, ram_base, cfg);
+        uint64_t base = c ? cache_base : ram_base, value;
+        const std::vector<uint64_t> &offsets = patterns[0].offsets;
+        for (uint64_t off : offsets) {
+            bus.master_read(base + off, 8, &value);
+        }
+        double ns = 1e9;
+        for (int run = 0; run < 3; run++) {
+            uint64_t start = now_ns();
+            for (uint64_t off : offsets) {
+                bus.master_read(base + off, 8, &value);
+            }
+            ns = std::min(ns, (double)(now_ns() - start) / n);
+        }
+        printf("  bus   %-18s %6.2f ns/read\n",
+               !c ? "ram" : mode == CACHE_MODE_STATS ? "cache stats" : "cache writeback", ns);
+        if (c) {
+            delete c;
+        }
+    }
+
+    delete r;
+}
+
+// Throughput of the verification service on a 64 MiB buffer against plain reading: the
+// accelerated and the table driven CRC32C, a diff of equal buffers and a diff with 1000 corrupted bytes, and
+// reading the buffer back over the bus in 8-byte accesses as the old way of checking it.
+static void bench_verify()
+{
+    const size_t n = 64 << 20;
+    std::vector<uint8_t> data(n), golden(n);
+    std::mt19937_64 rng(3);
+    for (size_t i = 0; i < n; i += 8) {
+        uint64_t v = rng();
+        memcpy(&golden[i], &v, 8);
+    }
+    data = golden;
+    std::vector<verify_range> ranges(1024);
+
+    auto measure = [&](const char *name, size_t bytes, auto fn) {
+        double best = 1e18;
+        uint64_t result = 0;
+        for (int run = 0; run < 3; run++) {
+            uint64_t start = now_ns();
+            result = fn();
+            best = std::min(best, (double)(now_ns() - start));
+        }
+        printf("  %-22s %7.2f GB/s  result %lx\n", name, bytes / best, (unsigned long)result);
+    };
+
+    printf("verify: %zu MiB buffers\n", n >> 20);
+    measure("read (bandwidth)", n, [&]() {
+        uint64_t sum = 0, v;
+        for (size_t i = 0; i < n; i += 8) {
+            memcpy(&v, &data[i], 8);
+            sum += v;
+        }
+        return sum;
+    });
+    measure("crc32c", n, [&]() -> uint64_t { return mem_verify::crc32c(0, data.data(), n); });
+    measure("crc32c portable", n / 8, [&]() -> uint64_t {
+        return mem_verify::crc32c_portable(0, data.data(), n / 8);
+    });
+    measure("diff equal", n, [&]() {
+        return mem_verify::diff(data.data(), golden.data(), n, ranges.data(), ranges.size());
+    });
+    for (int i = 0; i < 1000; i++) {
+        data[rng() % n] ^= 0xff;
+    }
+    measure("diff 1000 corrupted", n, [&]() {
+        return mem_verify::diff(data.data(), golden.data(), n, ranges.data(), ranges.size());
+    });
+
+    std::string shm = bench_shm_name("verify");
+    base_bus bus(0, shm.c_str());
+    ram *r = new ram(&bus, 0, soc_ram_base(0), SOC_RAM_SIZE, 0, 0);
+    measure("bus read back 16 MiB", SOC_RAM_SIZE, [&]() {
+        uint64_t sum = 0, v;
+        for (uint64_t off = 0; off < SOC_RAM_SIZE; off += 8) {
+            bus.master_read(soc_ram_base(0) + off, 8, &v);
+            sum += v;
+        }
+        return sum;
+    });
+    delete r;
+}
+
+// Cost of forwarding accesses to gem5 through the shared memory ring against plain RAM,
+// with the stand-in as the gem5 side: 8-byte reads from one master, larger reads split
+// into 64-byte requests, and several masters sharing the ring so their requests batch.
+static void bench_gem5()
+{
+    const uint64_t n = 1 << 16;
+    const uint64_t port_base = 0x3000000000;
+    std::string shm = bench_shm_name("gem5");
+    base_bus bus(0, shm.c_str());
+    ram *r = new ram(&bus, 0, soc_ram_base(0), SOC_RAM_SIZE, 0, 0);
+
+    std::mt19937_64 rng(4);
+    std::vector<uint64_t> offsets(n);
+    for (uint64_t &off : offsets) {
+        off = rng() % (SOC_RAM_SIZE - 256) & ~7ULL;
+    }
+
+    // ns per access of @size bytes from @threads masters, best of 3
+    auto measure = [&](uint64_t base, uint64_t size, unsigned threads) {
+        double best = 1e9;
+        for (int run = 0; run < 3; run++) {
+            uint64_t start = now_ns();
+            std::vector<std::thread> masters;
+            for (unsigned t = 0; t < threads; t++) {
+                masters.emplace_back([&, t]() {
+                    uint8_t buf[256];
+                    for (uint64_t i = t; i < n; i += threads) {
+                        bus.master_read(base + offsets[i], size, buf);
+                    }
+                });
+            }
+            for (auto &m : masters) {
+                m.join();
+            }
+            best = std::min(best, (double)(now_ns() - start) / n);
+        }
+        return best;
+    };
+
+    printf("gem5: %lu reads per case, stand-in server, %u CPUs\n", (unsigned long)n,
+           std::thread::hardware_concurrency());
+    for (uint64_t size : { 8, 64, 256 }) {
+        printf("  ram        %3lu B  1 master   %8.1f ns/read\n", (unsigned long)size,
+               measure(soc_ram_base(0), size, 1));
+    }
+    struct { uint64_t size; unsigned threads; } runs[] = { { 8, 1 }, { 64, 1 }, { 256, 1 }, { 8, 4 } };
+    for (const auto &c : runs) {
+        std::string ring_shm = bench_shm_name("gem5_ring");
+        gem5_ring ring(ring_shm);
+        gem5_standin standin(ring_shm);
+        gem5_port *port = new gem5_port(&bus, 1, port_base, SOC_RAM_SIZE, &ring);
+        double ns = measure(port_base, c.size, c.threads);
+        printf("  gem5 port  %3lu B  %u master%s  %8.1f ns/read  ", (unsigned long)c.size,
+               c.threads, c.threads > 1 ? "s" : " ", ns);
+        ring.print_stats("ring");
+        port->print_stats("             modelled");
+        delete port;
+    }
+
+    delete r;
+}
+
+// Rings a doorbell register whose action records when it ran.
+class doorbell_ip : public base_ip {
+public:
+    doorbell_ip(base_bus *bus, uint64_t id, uint64_t base)
+        : base_ip(bus, id, IP_TYPE_PERIPHERAL, base, 0x1000, 0, 0)
+    {
+        add_doorbell(0, 8, 0, 0);
+        start_action_thread();
+    }
+
+    ~doorbell_ip() override
+    {
+        stop_action_thread();
+    }
+
+    void reset() override {}
+    void mem_slave_read(uint64_t, uint64_t, void *) override {}
+    void mem_slave_write(uint64_t, uint64_t, void *) override {}
+
+    bool should_trigger_action(uint64_t offset, uint64_t, bool, void *) override
+    {
+        return offset == 0;
+    }
+
+    ip_action get_action(uint64_t, uint64_t, void *) override
+    {
+        return ip_action(IP_ACTION_CUSTOM);
+    }
+
+    void process_action(const ip_action &) override
+    {
+        done.store(now_ns(), std::memory_order_release);
+    }
+
+    std::atomic<uint64_t> done{0};
+};
+
+// A doorbell rung through a bridge write packet against one rung through an eventfd,
+// one at a time: how long the ringing vCPU is held, and how long until the action runs.
+// The packet path is modelled with pipes and a thread serving them like fifo_recv_func.
+static void bench_doorbell()
+{
+    const int n = 20000;
+    const uint64_t bell = 0x30000000;
+    std::string shm = bench_shm_name("doorbell");
+    base_bus bus(0, shm.c_str());
+    doorbell_ip *ip = new doorbell_ip(&bus, 0, bell);
+
+    printf("doorbell: %d rings, %s mode, %u CPUs\n", n,
+           sim_mode::functional() ? "functional" : "timed", std::thread::hardware_concurrency());
+    auto run = [&](const char *name, auto kick) {
+        latency_hist held, action;
+        for (int i = 0; i < n; i++) {
+            uint64_t t0 = now_ns(), before = ip->done.load();
+            kick();
+            uint64_t t1 = now_ns();
+            while (ip->done.load(std::memory_order_acquire) == before) {
+                sched_yield();
+            }
+            held.record(t1 - t0);
+            action.record(ip->done.load() - t0);
+        }
+        printf("  %-8s vCPU held ns p50 %6lu p99 %6lu   action after ns p50 %6lu p99 %6lu\n",
+               name, (unsigned long)held.percentile(50), (unsigned long)held.percentile(99),
+               (unsigned long)action.percentile(50), (unsigned long)action.percentile(99));
+    };
+
+    int req[2], resp[2];
+    if (pipe(req) || pipe(resp)) {
+        return;
+    }
+    std::thread bridge([&]() {
+        exPktCmd cmd;
+        while (read(req[0], &cmd, sizeof(cmd)) == sizeof(cmd) && cmd.type == EX_PKT_WR) {
+            bus.master_write(cmd.addr, cmd.length, &cmd.data);
+            cmd.type = (exPktType)(EX_PKT_WR | EX_PKT_RESP_FLAG);
+            cmd.length = ACCESS_OK;
+            if (write(resp[1], &cmd, sizeof(cmd)) != sizeof(cmd)) {
+                break;
+            }
+        }
+    });
+    run("packet", [&]() {
+        exPktCmd cmd = { EX_PKT_WR, 8, bell, 0 };
+        if (write(req[1], &cmd, sizeof(cmd)) != sizeof(cmd) ||
+            read(resp[0], &cmd, sizeof(cmd)) != sizeof(cmd)) {
+            printf("doorbell: pipe failed\n");
+        }
+    });
+    exPktCmd stop = { EX_PKT_RD, 0, 0, 0 };
+    if (write(req[1], &stop, sizeof(stop)) == sizeof(stop)) {
+        bridge.join();
+    } else {
+        bridge.detach();
+    }
+
+    int efd = eventfd(0, EFD_CLOEXEC);
+    ip->bind_doorbell(0, dup(efd));
+    run("eventfd", [&]() {
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) != sizeof(one)) {
+            printf("doorbell: eventfd write failed\n");
+        }
+    });
+
+    close(efd);
+    for (int fd : { req[0], req[1], resp[0], resp[1] }) {
+        close(fd);
+    }
+    delete ip;
+}
+
+// An IRQ raised by an IP and sent to QEMU as a packet against one injected through an
+// irqfd, one at a time: how long the posting IP is held, and how long until a thread
+// standing in for the guest vCPU wakes. The QEMU side of the packet path is a thread that
+// reads the packet and signals the vCPU, as msi_notify would; KVM injection itself is
+// not modelled.
+static void bench_irq()
+{
+    const int n = 20000;
+    const uint64_t bridge_id = 1, vector = 32;
+    std::string shm = bench_shm_name("irq");
+    base_bus bus(0, shm.c_str());
+    char path[] = "unused";
+    cosim_bridge *bridge = new cosim_bridge(&bus, bridge_id, 0x20000000, 0x1000, vector, 1,
+                                            path, path, path, path);
+
+    int guest = eventfd(0, EFD_CLOEXEC);
+    std::atomic<uint64_t> woke{0};
+    std::atomic<bool> stop{false};
+    std::thread vcpu([&]() {
+        uint64_t count;
+        while (read(guest, &count, sizeof(count)) == sizeof(count) && !stop.load()) {
+            woke.store(now_ns(), std::memory_order_release);
+        }
+    });
+
+    printf("irq: %d IRQs, %u CPUs\n", n, std::thread::hardware_concurrency());
+    auto run = [&](const char *name, auto raise) {
+        latency_hist held, wake;
+        for (int i = 0; i < n; i++) {
+            uint64_t t0 = now_ns(), before = woke.load();
+            raise();
+            uint64_t t1 = now_ns();
+            while (woke.load(std::memory_order_acquire) == before) {
+                sched_yield();
+            }
+            held.record(t1 - t0);
+            wake.record(woke.load() - t0);
+        }
+        printf("  %-7s IP held ns p50 %6lu p99 %6lu   vCPU woken after ns p50 %6lu p99 %6lu\n",
+               name, (unsigned long)held.percentile(50), (unsigned long)held.percentile(99),
+               (unsigned long)wake.percentile(50), (unsigned long)wake.percentile(99));
+    };
+
+    int fifo[2];
+    if (pipe(fifo)) {
+        return;
+    }
+    std::thread qemu([&]() {
+        exPktCmd cmd;
+        uint64_t one = 1;
+        while (read(fifo[0], &cmd, sizeof(cmd)) == sizeof(cmd) && cmd.type == EX_PKT_IRQ) {
+            if (write(guest, &one, sizeof(one)) != sizeof(one)) {
+                break;
+            }
+        }
+    });
+    run("packet", [&]() {
+        exPktCmd cmd = { EX_PKT_IRQ, 0, 0, vector };
+        if (write(fifo[1], &cmd, sizeof(cmd)) != sizeof(cmd)) {
+            printf("irq: pipe write failed\n");
+        }
+    });
+    close(fifo[1]);
+    qemu.join();
+    close(fifo[0]);
+
+    exPktCmd cmd = { EX_PKT_CTRL, EX_CTRL_IRQFD_BIND, vector, (uint64_t)getpid() << 32 | guest };
+    bridge->handle_ctrl(cmd);
+    if (cmd.length == ACCESS_OK) {
+        run("irqfd", [&]() { bus.post_irq(bridge_id, vector); });
+    } else {
+        printf("irq: cannot bind the irqfd\n");
+    }
+
+    stop.store(true);
+    uint64_t one = 1;
+    if (write(guest, &one, sizeof(one)) == sizeof(one)) {
+        vcpu.join();
+    } else {
+        vcpu.detach();
+    }
+    close(guest);
+    delete bridge;
+}
+
+struct bench_case {
+    const char *name;
+    void (*fn)();
+};
+
+static const bench_case cases[] = {
+    { "dispatch", bench_dispatch },
+    { "timing", bench_timing },
+    { "trace", bench_trace },
+    { "heat", bench_heat },
+    { "virtqueue", bench_virtqueue },
+    { "alloc", bench_alloc },
+    { "pdes", bench_pdes },
+    { "cache", bench_cache },
+    { "verify", bench_verify },
+    { "gem5", bench_gem5 },
+    { "doorbell", bench_doorbell },
+    { "irq", bench_irq },
+};
+
+int main(int argc, char **argv)
+{
+    debugger::set_level(debugger::ERROR);
+
+    for (const bench_case &c : cases) {
+        bool run = argc < 2;
+        for (int i = 1; i < argc; i++) {
+            run |= strcmp(argv[i], c.name) == 0;
+        }
+        if (run) {
+            c.fn();
+        }
+    }
+    return 0;
+}
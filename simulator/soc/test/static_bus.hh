@@ -0,0 +1,169 @@
+#ifndef STATIC_BUS_HH
+#define STATIC_BUS_HH
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <tuple>
+#include <utility>
+
+#include "ip.hh"
+#include "bus.hh"
+
+// A slave of a static_bus: the IP type and its address range as compile-time parameters.
+// @IP: Concrete IP type, its access functions are called without virtual dispatch.
+// @BASE: Base address of the slave.
+// @SIZE: Size of the slave's address range.
+template <typename IP, uint64_t BASE, uint64_t SIZE>
+struct static_slot {
+    typedef IP ip_type;
+    static constexpr uint64_t base = BASE;
+    static constexpr uint64_t size = SIZE;
+
+    static constexpr bool contains(uint64_t addr)
+    {
+        return addr - BASE < SIZE;
+    }
+
+    static constexpr bool overlaps(uint64_t base2, uint64_t size2)
+    {
+        return BASE < base2 + size2 && base2 < BASE + SIZE;
+    }
+};
+
+// Bus with a topology fixed at compile time, for soc_microbench only.
+// Address decode is a chain of constant range compares and the slave access functions
+// are called directly, so the compiler can inline the whole access path. The benchmark
+// compares it with base_bus to measure what dynamic decode and virtual dispatch cost.
+// Addresses that no static slave decodes are forwarded to an optional base_bus.
+//
+//     static_bus<static_slot<ram, 0x400000000, 0x1000000>,
+//                static_slot<ram, 0x800000000, 0x1000000> > sbus(bus, ram0, ram1);
+//
+// It is not a drop-in for base_bus and soc_top does not use it. Accesses through it fire
+// the IP probes, but take a lock of the static_bus instead of the IP lock, so an IP must
+// not be accessed through both buses at once. They skip everything base_bus adds around
+// the slave: slave timing and charged latency, the bus probes, trace spans, heat profile
+// samples and the epoch guard, so slots must not be disconnected or remapped while it is
+// in use. The IPs are still constructed on (and connected to) a base_bus, which owns
+// their shared memory and IRQ routing.
+template <typename... Slots>
+class static_bus {
+public:
+    static constexpr size_t nr_slots = sizeof...(Slots);
+
+    // Constructor for static_bus.
+    // @fallback: Dynamic bus for addresses outside the static slots, may be nullptr.
+    // @ips: One IP per slot, in slot order. Each IP's base_addr and addr_size must match
+    //       its slot.
+    explicit static_bus(base_bus *fallback, typename Slots::ip_type *... ips)
+        : fallback(fallback), ips(ips...)
+    {
+        static_assert(no_overlap<Slots...>(), "static_bus slots overlap");
+        check_slots(std::make_index_sequence<nr_slots>());
+    }
+
+    // Master read and write functions, same semantics as base_bus::master_read/write.
+    void master_read(uint64_t addr, uint64_t size, void *data)
+    {
+        if (!dispatch<0>(MMIO_ACCESS_RW_R, addr, size, data)) {
+            miss(MMIO_ACCESS_RW_R, addr, size, data);
+        }
+    }
+
+    void master_write(uint64_t addr, uint64_t size, void *data)
+    {
+        if (!dispatch<0>(MMIO_ACCESS_RW_W, addr, size, data)) {
+            miss(MMIO_ACCESS_RW_W, addr, size, data);
+        }
+    }
+
+private:
+    template <size_t I>
+    using slot_t = typename std::tuple_element<I, std::tuple<Slots...> >::type;
+
+    template <size_t I>
+    inline bool dispatch(bool rw, uint64_t addr, uint64_t size, void *data)
+    {
+        if constexpr (I == nr_slots) {
+            return false;
+        } else {
+            typedef slot_t<I> slot;
+            if (slot::contains(addr)) {
+                slave_access(std::get<I>(ips), locks[I], rw, addr - slot::base, size, data);
+                return true;
+            }
+            return dispatch<I + 1>(rw, addr, size, data);
+        }
+    }
+
+    // mem_slave_access with the access functions of @T called directly, so the compiler
+    // can inline them. The IP lock is private to base_ip, a lock per slot stands in for it.
+    template <typename T>
+    static int slave_access(T *ip, std::mutex &lock, bool rw, uint64_t offset, uint64_t size,
+                            void *data)
+    {
+        BUS_ACCESS_CODE ret = ip->T::memaddr_can_access(rw, offset, size);
+        if (ret == ACCESS_OK) {
+            lock.lock();
+            if (rw == MMIO_ACCESS_RW_R) {
+                ip->T::mem_slave_read(offset, size, data);
+            } else {
+                ip->T::mem_slave_write(offset, size, data);
+            }
+            lock.unlock();
+
+            if (rw == MMIO_ACCESS_RW_W && ip->T::should_trigger_action(offset, size, rw, data)) {
+                ip_action action = ip->T::get_action(offset, size, data);
+                SOC_PROBE4(action_trigger, ip->id, action.type, action.addr, action.data);
+                ip->trigger_action(action);
+            }
+        }
+        SOC_PROBE5(ip_access, ip->id, rw, offset, size, ret);
+        return (int)ret;
+    }
+
+    void miss(bool rw, uint64_t addr, uint64_t size, void *data)
+    {
+        if (!fallback) {
+            LOG_ERROR("No IP found for address: %lx", addr);
+        } else if (rw == MMIO_ACCESS_RW_R) {
+            fallback->master_read(addr, size, data);
+        } else {
+            fallback->master_write(addr, size, data);
+        }
+    }
+
+    template <typename First, typename... Rest>
+    static constexpr bool no_overlap()
+    {
+        if constexpr (sizeof...(Rest) == 0) {
+            return true;
+        } else {
+            return (!First::overlaps(Rest::base, Rest::size) && ...) && no_overlap<Rest...>();
+        }
+    }
+
+    template <size_t... I>
+    void check_slots(std::index_sequence<I...>)
+    {
+        (check_slot<I>(), ...);
+    }
+
+    template <size_t I>
+    void check_slot()
+    {
+        base_ip *ip = std::get<I>(ips);
+        if (ip->base_addr != slot_t<I>::base || ip->addr_size != slot_t<I>::size) {
+            LOG_ERROR("static_bus slot %zu is %lx+%lx but IP %lu is at %lx+%lx", I,
+                      slot_t<I>::base, slot_t<I>::size, ip->id, ip->base_addr.load(),
+                      ip->addr_size.load());
+        }
+    }
+
+    base_bus *fallback;
+    std::tuple<typename Slots::ip_type *...> ips;
+    std::mutex locks[nr_slots];
+};
+
+#endif // STATIC_BUS_HH
@@ -0,0 +1,342 @@
+// Stress test of runtime topology changes under traffic.
+//
+// Reader threads hammer the bus with reads and writes while a remap thread keeps moving
+// RAM windows between two addresses (like BAR reprogramming) and a hot-plug thread
+// keeps connecting, disconnecting and deleting a RAM IP. Every RAM holds its own ID at
+// offset 0, so a read that decodes to the wrong IP or to freed memory is detected.
+// Afterwards, a shared memory pointer must stay usable after its RAM is disconnected,
+// and a topology change waiting for a reader must not keep other ones out of the bus.
+// A slave blocked in an access must hold up its own disconnect but no other topology
+// change, a slave must be able to remap and disconnect itself from its access, and
+// reader threads beyond the epoch slots must still get through.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include <unistd.h>
+
+#include "bus.hh"
+#include "ram.hh"
+#include "addr_map.hh"
+
+static const int NR_RAMS = 8;
+static const uint64_t RAM_SIZE = 0x10000;
+static const uint64_t HOTPLUG_ID = 100;
+
+static uint64_t home_base(int n) { return 0x100000000ULL + n * 0x1000000ULL; }
+static uint64_t away_base(int n) { return 0x200000000ULL + n * 0x1000000ULL; }
+static const uint64_t hotplug_base = 0x300000000ULL;
+static const uint64_t park_base = 0x400000000ULL; // Never accessed by the readers
+
+static std::atomic<bool> stop{false};
+static std::atomic<uint64_t> errors{0};
+static std::atomic<uint64_t> accesses{0};
+static std::atomic<uint64_t> hits{0};
+
+static void reader_func(base_bus *bus, int seed)
+{
+    uint64_t x = seed * 0x9e3779b97f4a7c15ULL + 1;
+    uint64_t local = 0, local_hits = 0;
+
+    while (!stop.load(std::memory_order_relaxed)) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        int n = x % (NR_RAMS + 1);
+        uint64_t base = n == NR_RAMS ? hotplug_base : ((x >> 8) & 1) ? away_base(n) : home_base(n);
+        uint64_t expect = n == NR_RAMS ? HOTPLUG_ID : (uint64_t)n;
+
+        // Offset 0 holds the RAM ID, a miss leaves the sentinel untouched
+        uint64_t data = ~0ULL;
+        bus->master_read(base, 8, &data);
+        if (data != ~0ULL) {
+            local_hits++;
+            if (data != expect) {
+                fprintf(stderr, "addr %lx: read id %lx, expected %lx\n",
+                        (unsigned long)base, (unsigned long)data, (unsigned long)expect);
+                errors++;
+            }
+        }
+
+        // Scratch writes elsewhere in the window keep writers in the mix
+        uint64_t scratch = x;
+        bus->master_write(base + 8 + (x % (RAM_SIZE / 8 - 1)) * 8, 8, &scratch);
+        local += 2;
+    }
+    accesses += local;
+    hits += local_hits;
+}
+
+// A pointer into a RAM outlives its IP, and the RAM connected again over the same window
+// gets the same mapping.
+static bool check_stale_pointer(base_bus &bus)
+{
+    const uint64_t base = park_base + 0x1000000;
+    ram *r = new ram(&bus, 200, base, RAM_SIZE, 0, 0);
+    volatile uint64_t *p = (volatile uint64_t *)bus.master_get_shm_ptr(base + 8);
+    *p = 0x5a5a;
+    delete r;
+    bool ok = *p == 0x5a5a;
+    r = new ram(&bus, 200, base, RAM_SIZE, 0, 0);
+    ok &= bus.master_get_shm_ptr(base + 8) == p;
+    delete r;
+    if (!ok) {
+        printf("test_addr_map: shared memory pointer lost with its RAM\n");
+    }
+    return ok;
+}
+
+// While a disconnect waits for a reader to leave its epoch, another thread can still
+// take the bus lock and publish a topology change.
+static bool check_lock_released(base_bus &bus)
+{
+    ram *r = new ram(&bus, 201, park_base + 0x2000000, RAM_SIZE, 0, 0);
+    ram *o = new ram(&bus, 205, park_base + 0xa000000, RAM_SIZE, 0, 0);
+    const uint64_t to = park_base + 0xb000000;
+    std::atomic<bool> reading{false}, release{false};
+    std::thread reader([&]() {
+        epoch_guard guard;
+        reading = true;
+        while (!release) {
+            std::this_thread::yield();
+        }
+    });
+    while (!reading) {
+        std::this_thread::yield();
+    }
+    std::thread unplug([&]() { bus.disconnect_ip(r); });
+    std::thread other([&]() { bus.remap_ip(o, to, RAM_SIZE); });
+    for (int i = 0; i < 1000 && o->base_addr != to; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    bool ok = o->base_addr == to;
+    release = true;
+    reader.join();
+    unplug.join();
+    other.join();
+    delete r;
+    delete o;
+    if (!ok) {
+        printf("test_addr_map: bus lock held while waiting for readers\n");
+    }
+    return ok;
+}
+
+// A slave whose reads block until released, and whose writes move it to the address
+// written, or disconnect it for 0.
+class gate_ip : public base_ip {
+public:
+    gate_ip(base_bus *bus, uint64_t id, uint64_t base)
+        : base_ip(bus, id, IP_TYPE_PERIPHERAL, base, 0x1000, 0, 0) {}
+
+    void reset() override {}
+    void mem_slave_read(uint64_t, uint64_t, void *data) override
+    {
+        inside = true;
+        while (!release) {
+            std::this_thread::yield();
+        }
+        memset(data, 0, 8);
+    }
+    void mem_slave_write(uint64_t, uint64_t, void *data) override
+    {
+        uint64_t to;
+        memcpy(&to, data, sizeof(to));
+        if (to) {
+            moved = bus->remap_ip(this, to, 0x1000);
+        } else {
+            bus->disconnect_ip(this);
+        }
+    }
+
+    std::atomic<bool> inside{false}, release{false};
+    bool moved = false;
+};
+
+// Wait up to a second for @flag.
+static bool wait_for(std::atomic<bool> &flag)
+{
+    for (int i = 0; i < 1000 && !flag; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return flag;
+}
+
+// Topology changes go on while a slave blocks in an access, except disconnecting that
+// slave, which waits for the access.
+static bool check_slow_slave(base_bus &bus)
+{
+    const uint64_t base = park_base + 0x3000000;
+    gate_ip *g = new gate_ip(&bus, 202, base);
+    ram *r = new ram(&bus, 203, park_base + 0x4000000, RAM_SIZE, 0, 0);
+    std::thread reader([&]() {
+        uint64_t v;
+        bus.master_read(base, 8, &v);
+    });
+    bool ok = wait_for(g->inside);
+
+    std::atomic<bool> remapped{false}, unplugged{false};
+    std::thread remap([&]() {
+        remapped = bus.remap_ip(r, park_base + 0x5000000, RAM_SIZE);
+    });
+    ok &= wait_for(remapped);
+    std::thread unplug([&]() {
+        bus.disconnect_ip(g);
+        unplugged = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ok &= !unplugged;
+    g->release = true;
+    reader.join();
+    remap.join();
+    unplug.join();
+    ok &= unplugged;
+    delete g;
+    delete r;
+    if (!ok) {
+        printf("test_addr_map: a blocked slave held up the topology, or was disconnected under its access\n");
+    }
+    return ok;
+}
+
+// A slave moves and then disconnects itself from its own write.
+static bool check_self_unplug(base_bus &bus)
+{
+    const uint64_t base = park_base + 0x6000000, to = park_base + 0x7000000;
+    gate_ip *g = new gate_ip(&bus, 204, base);
+    uint64_t v = to;
+    bus.master_write(base, 8, &v);
+    bool ok = g->moved && g->base_addr == to;
+    v = 0;
+    bus.master_write(to, 8, &v);
+    ok &= bus.master_lookup_shm_ptr(to, 8) == nullptr;
+    uint64_t version = bus.map_version();
+    delete g; // Already disconnected, the destructor leaves the map alone
+    ok &= bus.map_version() == version;
+    if (!ok) {
+        printf("test_addr_map: slave could not remap or disconnect itself\n");
+    }
+    return ok;
+}
+
+// More reader threads than epoch slots access the bus at once while the topology changes.
+static bool check_many_readers(base_bus &bus)
+{
+    const int nr = epoch_domain::MAX_READERS + 16;
+    const uint64_t base = park_base + 0x8000000;
+    ram *r = new ram(&bus, 205, base, RAM_SIZE, 0, 0);
+    uint64_t id = 205;
+    bus.master_write(base, 8, &id);
+
+    std::atomic<int> done{0};
+    std::atomic<bool> exit{false};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nr; i++) {
+        threads.emplace_back([&]() {
+            uint64_t v = 0;
+            bus.master_read(base, 8, &v); // Keeps the slot until the thread exits
+            if (v == 205) {
+                done++;
+            }
+            while (!exit) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            bus.master_read(base, 8, &v);
+        });
+    }
+    for (int i = 0; i < 2000 && done < nr; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    bool ok = done == nr && bus.remap_ip(r, park_base + 0x9000000, RAM_SIZE);
+    exit = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+    delete r;
+    if (!ok) {
+        printf("test_addr_map: %d of %d readers got through\n", done.load(), nr);
+    }
+    return ok;
+}
+
+int main()
+{
+    debugger::set_level(debugger::OFF);
+
+    std::string shm = "/test_addr_map_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    std::vector<ram *> rams;
+    for (int n = 0; n < NR_RAMS; n++) {
+        rams.push_back(new ram(&bus, n, home_base(n), RAM_SIZE, 0, 0));
+        uint64_t id = n;
+        bus.master_write(home_base(n), 8, &id);
+    }
+
+    // The shared memory outlives the IP, so every later hot-plug of this window finds its ID
+    ram *seed = new ram(&bus, HOTPLUG_ID, park_base, RAM_SIZE, 0, 0);
+    uint64_t seed_id = HOTPLUG_ID;
+    bus.master_write(park_base, 8, &seed_id);
+    delete seed;
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++) {
+        readers.emplace_back(reader_func, &bus, i + 1);
+    }
+
+    uint64_t remaps = 0;
+    std::thread remapper([&]() {
+        while (!stop.load()) {
+            for (int n = 0; n < NR_RAMS; n++) {
+                uint64_t to = rams[n]->base_addr == home_base(n) ? away_base(n) : home_base(n);
+                if (!bus.remap_ip(rams[n], to, RAM_SIZE)) {
+                    errors++;
+                }
+                remaps++;
+            }
+        }
+    });
+
+    uint64_t hotplugs = 0;
+    std::thread hotplugger([&]() {
+        while (!stop.load()) {
+            // Constructed out of the way, the IP is only decoded once it is complete
+            ram *r = new ram(&bus, HOTPLUG_ID, park_base, RAM_SIZE, 0, 0);
+            if (!bus.remap_ip(r, hotplug_base, RAM_SIZE)) {
+                errors++;
+            }
+            std::this_thread::yield();
+            bus.disconnect_ip(r);
+            delete r;
+            hotplugs++;
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    stop.store(true);
+    for (auto &t : readers) {
+        t.join();
+    }
+    remapper.join();
+    hotplugger.join();
+
+    printf("test_addr_map: %lu accesses (%lu decoded), %lu remaps, %lu hot-plugs, %lu errors\n",
+           (unsigned long)accesses.load(), (unsigned long)hits.load(), (unsigned long)remaps,
+           (unsigned long)hotplugs, (unsigned long)errors.load());
+
+    for (auto r : rams) {
+        delete r;
+    }
+
+    bool ok = errors.load() == 0 && hits.load() > 0 && remaps > 0 && hotplugs > 0;
+    ok &= check_stale_pointer(bus);
+    ok &= check_lock_released(bus);
+    ok &= check_slow_slave(bus);
+    ok &= check_self_unplug(bus);
+    ok &= check_many_readers(bus);
+    printf("test_addr_map: %s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
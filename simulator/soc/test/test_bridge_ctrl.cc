@@ -0,0 +1,92 @@
+// Test of the region advertisement control packets of the bridge.
+//
+// The shared memory name read back chunk by chunk must match the bus, chunk indices past
+// the name, including ones whose byte offset wraps, must return no data, and every RAM
+// IP must be advertised with its guest address, size, shm offset and ID, other IPs not.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bus.hh"
+#include "ram.hh"
+#include "cosim_bridge.hh"
+#include "fake_qemu.hh"
+#include "test_util.hh"
+
+static const uint64_t BRIDGE_BASE = 0x20000000;
+static const uint64_t RAM0_BASE = 0x100000000ULL;
+static const uint64_t RAM1_BASE = 0x200000000ULL;
+
+static exPktCmd ctrl(cosim_bridge &bridge, exCtrlOp op, uint64_t arg)
+{
+    exPktCmd cmd = { EX_PKT_CTRL, op, arg, 0 };
+    bridge.handle_ctrl(cmd);
+    return cmd;
+}
+
+static void test_shm_name(base_bus &bus, cosim_bridge &bridge)
+{
+    exPktCmd first = ctrl(bridge, EX_CTRL_SHM_NAME, 0);
+    std::string name;
+    for (uint64_t i = 0; i * 8 < first.addr; i++) {
+        exPktCmd c = ctrl(bridge, EX_CTRL_SHM_NAME, i);
+        char chunk[9] = {};
+        memcpy(chunk, &c.data, 8);
+        name += chunk;
+    }
+    expect(first.length == ACCESS_OK && name == bus.get_shm_name(), "shm name");
+
+    uint64_t past = (first.addr + 7) / 8;
+    expect(ctrl(bridge, EX_CTRL_SHM_NAME, past).data == 0, "chunk past the name");
+    // 1 << 61 chunks of 8 bytes wrap to byte offset 0
+    exPktCmd wrap = ctrl(bridge, EX_CTRL_SHM_NAME, 1ULL << 61);
+    expect(wrap.data == 0 && wrap.addr == first.addr, "wrapping chunk index");
+    expect(ctrl(bridge, EX_CTRL_SHM_NAME, ~0ULL).data == 0, "largest chunk index");
+}
+
+static void test_regions(cosim_bridge &bridge, ram &r0, ram &r1)
+{
+    exPktCmd count = ctrl(bridge, EX_CTRL_REGION_COUNT, 0);
+    expect(count.length == ACCESS_OK && count.data == 2, "region count");
+
+    bool found0 = false, found1 = false;
+    for (uint64_t i = 0; i < count.data; i++) {
+        exPktCmd addr = ctrl(bridge, EX_CTRL_REGION_ADDR, i);
+        exPktCmd shm = ctrl(bridge, EX_CTRL_REGION_SHM, i);
+        for (ram *r : { &r0, &r1 }) {
+            if (addr.addr == r->base_addr && addr.data == r->addr_size &&
+                shm.addr == r->shm_offset && shm.data == r->id) {
+                (r == &r0 ? found0 : found1) = true;
+            }
+        }
+    }
+    expect(found0 && found1, "regions advertised");
+    expect(ctrl(bridge, EX_CTRL_REGION_ADDR, 2).length == ACCESS_ADDR_ERROR &&
+           ctrl(bridge, EX_CTRL_REGION_SHM, ~0ULL).length == ACCESS_ADDR_ERROR,
+           "region index out of range");
+}
+
+int main()
+{
+    test_begin("test_bridge_ctrl");
+
+    std::string shm = "/test_bridge_ctrl_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    ram r0(&bus, 10, RAM0_BASE, 0x10000, 0, 0);
+    ram r1(&bus, 11, RAM1_BASE, 0x20000, 0, 0);
+    fake_qemu qemu(0x1000);
+    cosim_bridge bridge(&bus, 1, BRIDGE_BASE, 0x1000, 0, 0, qemu.path(0), qemu.path(1),
+                        qemu.path(2), qemu.path(3));
+    qemu.connect(bridge);
+
+    test_shm_name(bus, bridge);
+    test_regions(bridge, r0, r1);
+
+    qemu.disconnect();
+    return test_finish();
+}
@@ -0,0 +1,187 @@
+// Test of the bridge TX buffering towards QEMU.
+//
+// The bridge talks to a fake QEMU over FIFOs. Sequential writes to a write-combining
+// region must reach QEMU as bursts with the right data, and must be ordered before
+// uncached writes, reads of the same lines and fences. Sequential reads of a
+// prefetchable region must return QEMU's data while fetching whole lines, and no fetch
+// may reach outside the region. A word QEMU changes must not be read stale from the
+// prefetched lines, whether it is polled or read by a stream QEMU interrupted. Regions that are not line aligned or not inside the
+// window must be refused, and a burst QEMU does not take must be reported by the fence.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bus.hh"
+#include "cosim_bridge.hh"
+#include "fake_qemu.hh"
+#include "test_util.hh"
+
+static const uint64_t BRIDGE_BASE = 0x20000000;
+static const uint64_t WINDOW = 0x1000;
+static const uint64_t WC_BASE = 0x0;      // Write-combining region, 1 KiB
+static const uint64_t PF_BASE = 0x400;    // Prefetchable region, 512 bytes
+static const uint64_t PF_SIZE = 0x200;
+static const uint64_t UC_OFFSET = 0x800;  // Uncached
+
+static uint64_t rng = 0x853c49e6748fea9bULL;
+
+static int region(cosim_bridge &bridge, uint64_t offset, uint64_t data)
+{
+    exPktCmd cmd = { EX_PKT_CTRL, EX_CTRL_TX_REGION, offset, data };
+    bridge.handle_ctrl(cmd);
+    return cmd.length;
+}
+
+static void test_regions(cosim_bridge &bridge)
+{
+    expect(region(bridge, 0x20, 0x40 | TX_REGION_WC) == ACCESS_DENIED, "unaligned offset");
+    expect(region(bridge, 0x0, 0x30 | TX_REGION_WC) == ACCESS_DENIED, "unaligned size");
+    expect(region(bridge, WINDOW - 0x40, 0x80 | TX_REGION_PREFETCH) == ACCESS_DENIED,
+           "region past the window");
+    expect(region(bridge, ~0ULL & ~0x3fULL, 0x80 | TX_REGION_PREFETCH) == ACCESS_DENIED,
+           "region wrapping the address space");
+    expect(region(bridge, WC_BASE, 0x400 | TX_REGION_WC) == ACCESS_OK &&
+           region(bridge, PF_BASE, PF_SIZE | TX_REGION_PREFETCH) == ACCESS_OK, "regions declared");
+}
+
+// Sum of the bytes QEMU received in bursts and the number of single writes.
+static void count_writes(const std::vector<exPktCmd> &log, uint64_t &burst_bytes,
+                         uint64_t &bursts, uint64_t &singles)
+{
+    burst_bytes = bursts = singles = 0;
+    for (const exPktCmd &c : log) {
+        if (c.type == EX_PKT_WR_BURST) {
+            burst_bytes += c.length;
+            bursts++;
+        } else if (c.type == EX_PKT_WR) {
+            singles++;
+        }
+    }
+}
+
+static void test_write_combining(base_bus &bus, cosim_bridge &bridge, fake_qemu &qemu)
+{
+    std::vector<uint8_t> data(0x200);
+    for (auto &b : data) {
+        b = next_random(rng);
+    }
+    qemu.clear_packets();
+    for (uint64_t off = 0; off < data.size(); off += 8) {
+        bus.master_write(BRIDGE_BASE + WC_BASE + off, 8, &data[off]);
+    }
+    expect(bridge.tx_fence(), "fence after combined writes");
+
+    uint64_t bytes, bursts, singles;
+    count_writes(qemu.packets(), bytes, bursts, singles);
+    expect(bytes == data.size() && singles == 0, "combined writes reach QEMU as bursts");
+    expect(bursts < data.size() / 8 / 4, "writes are combined");
+    expect(!memcmp(&qemu.mem[WC_BASE], data.data(), data.size()), "burst data");
+
+    // An uncached write goes out after the buffered writes before it
+    uint64_t v = 0x1234;
+    qemu.clear_packets();
+    bus.master_write(BRIDGE_BASE + WC_BASE + 0x300, 8, &v);
+    bus.master_write(BRIDGE_BASE + UC_OFFSET, 8, &v);
+    std::vector<exPktCmd> log = qemu.packets();
+    expect(log.size() == 2 && log[0].type == EX_PKT_WR_BURST && log[0].addr == WC_BASE + 0x300 &&
+           log[1].type == EX_PKT_WR && log[1].addr == UC_OFFSET, "uncached write ordered after");
+
+    // A read of a buffered line sees the write
+    uint64_t w = 0xfeedfacecafebeefULL, back = 0;
+    bus.master_write(BRIDGE_BASE + WC_BASE + 0x100, 8, &w);
+    bus.master_read(BRIDGE_BASE + WC_BASE + 0x100, 8, &back);
+    expect(back == w, "read after a buffered write");
+}
+
+static void test_prefetch(base_bus &bus, fake_qemu &qemu)
+{
+    for (uint64_t i = 0; i < qemu.mem.size(); i++) {
+        qemu.mem[i] = next_random(rng);
+    }
+    qemu.clear_packets();
+    bool same = true;
+    for (uint64_t off = PF_BASE; off < PF_BASE + PF_SIZE; off += 8) {
+        uint64_t v = 0;
+        bus.master_read(BRIDGE_BASE + off, 8, &v);
+        same &= !memcmp(&v, &qemu.mem[off], 8);
+    }
+    expect(same, "prefetched reads return QEMU's data");
+
+    uint64_t reads = 0, fetched = 0;
+    bool inside = true;
+    for (const exPktCmd &c : qemu.packets()) {
+        if (c.type == EX_PKT_RD_BURST) {
+            fetched += c.length;
+            inside &= c.addr >= PF_BASE && c.addr + c.length <= PF_BASE + PF_SIZE &&
+                      c.addr % TX_LINE_SIZE == 0;
+        }
+        reads++;
+    }
+    expect(inside, "prefetches stay in the region and fetch whole lines");
+    expect(fetched && reads < PF_SIZE / 8 / 2, "sequential reads are prefetched");
+
+    // Reads straddling the end of the region are not served from it
+    uint64_t v = 0;
+    bus.master_read(BRIDGE_BASE + PF_BASE + PF_SIZE - 4, 8, &v);
+    expect(!memcmp(&v, &qemu.mem[PF_BASE + PF_SIZE - 4], 8), "read across the region end");
+}
+
+static void test_prefetch_stale(base_bus &bus, fake_qemu &qemu)
+{
+    // A master polling a word QEMU updates, with its line prefetched by the test above
+    const uint64_t poll = PF_BASE + 0x48;
+    bool fresh = true;
+    for (uint64_t i = 0; i < 4; i++) {
+        uint64_t v = 0;
+        memcpy(&qemu.mem[poll], &i, 8);
+        bus.master_read(BRIDGE_BASE + poll, 8, &v);
+        fresh &= v == i;
+    }
+    expect(fresh, "polled word follows QEMU");
+
+    // A stream that QEMU interrupts with a packet after changing the next word
+    uint64_t v = 0;
+    for (uint64_t off = PF_BASE; off < PF_BASE + 24; off += 8) {
+        bus.master_read(BRIDGE_BASE + off, 8, &v);
+    }
+    const uint64_t next = 0x1234567890abcdefULL;
+    memcpy(&qemu.mem[PF_BASE + 24], &next, 8);
+    exPktCmd cmd = { EX_PKT_RD, 8, 0, 0 }; // Nothing decodes address 0, any packet will do
+    expect(qemu.request(cmd), "QEMU request");
+    bus.master_read(BRIDGE_BASE + PF_BASE + 24, 8, &v);
+    expect(v == next, "stream sees QEMU's update after its packet");
+}
+
+static void test_lost_burst(base_bus &bus, cosim_bridge &bridge, fake_qemu &qemu)
+{
+    qemu.hang_up();
+    uint64_t v = 1;
+    bus.master_write(BRIDGE_BASE + WC_BASE, 8, &v);
+    expect(!bridge.tx_fence(), "fence reports a burst QEMU did not take");
+}
+
+int main()
+{
+    test_begin("test_bridge_tx");
+
+    std::string shm = "/test_bridge_tx_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    fake_qemu qemu(WINDOW);
+    cosim_bridge bridge(&bus, 1, BRIDGE_BASE, WINDOW, 0, 0, qemu.path(0), qemu.path(1),
+                        qemu.path(2), qemu.path(3));
+    qemu.connect(bridge);
+
+    test_regions(bridge);
+    test_write_combining(bus, bridge, qemu);
+    test_prefetch(bus, qemu);
+    test_prefetch_stale(bus, qemu);
+    test_lost_burst(bus, bridge, qemu);
+
+    qemu.disconnect();
+    return test_finish();
+}
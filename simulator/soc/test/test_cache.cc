@@ -0,0 +1,182 @@
+// Functional test of the cache IP.
+//
+// Random reads and writes of 1 to 200 bytes at any alignment go through the cache window
+// for a set of geometries, both replacement policies and both modes, and every read is
+// checked against a shadow copy of the memory. The caches are much smaller than the
+// backing RAM, so lines keep being evicted and, in write-back mode, written back. After
+// a flush the backing RAM must hold exactly the shadow copy. The 2-way tree-PLRU, which is
+// true LRU, is also checked hit for hit against an LRU reference. The largest tag must
+// not hit an empty way, and a window too large for 32-bit tags must not be cached.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <list>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "bus.hh"
+#include "ram.hh"
+#include "cache.hh"
+#include "test_util.hh"
+
+static const uint64_t RAM_BASE = 0x100000000ULL;
+static const uint64_t RAM_SIZE = 0x100000;
+static const uint64_t CACHE_BASE = 0x200000000ULL;
+static const int ACCESSES = 200000;
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static bool run_config(base_bus &bus, const cache_config &cfg)
+{
+    char name[96];
+    snprintf(name, sizeof(name), "%lu sets x %lu ways x %lu B %s %s", (unsigned long)cfg.sets,
+             (unsigned long)cfg.ways, (unsigned long)cfg.line_size,
+             cfg.policy == CACHE_POLICY_PLRU ? "plru" : "srrip",
+             cfg.mode == CACHE_MODE_STATS ? "stats" : "writeback");
+
+    std::vector<uint8_t> shadow(RAM_SIZE);
+    for (uint64_t off = 0; off < RAM_SIZE; off += 8) {
+        uint64_t v = next_random(rng);
+        memcpy(&shadow[off], &v, 8);
+    }
+    bus.master_write(RAM_BASE, RAM_SIZE, shadow.data());
+
+    cache_ip *c = new cache_ip(&bus, 1, CACHE_BASE, RAM_SIZE, RAM_BASE, cfg);
+    uint64_t errors = 0;
+    uint8_t buf[200];
+    for (int i = 0; i < ACCESSES; i++) {
+        uint64_t size = 1 + next_random(rng) % sizeof(buf);
+        // Half of the accesses in a hot 8 KiB, so there are hits as well
+        uint64_t range = next_random(rng) % 2 ? 0x2000 : RAM_SIZE;
+        uint64_t off = next_random(rng) % (range - size);
+        if (next_random(rng) % 3 == 0) {
+            for (uint64_t b = 0; b < size; b++) {
+                buf[b] = next_random(rng);
+            }
+            bus.master_write(CACHE_BASE + off, size, buf);
+            memcpy(&shadow[off], buf, size);
+        } else {
+            bus.master_read(CACHE_BASE + off, size, buf);
+            if (memcmp(buf, &shadow[off], size) && errors++ < 5) {
+                printf("test_cache: %s: read of %lu bytes at %lx differs\n", name,
+                       (unsigned long)size, (unsigned long)off);
+            }
+        }
+    }
+
+    c->flush();
+    std::vector<uint8_t> mem(RAM_SIZE);
+    bus.master_read(RAM_BASE, RAM_SIZE, mem.data());
+    if (mem != shadow) {
+        printf("test_cache: %s: backing RAM differs after flush\n", name);
+        errors++;
+    }
+
+    const cache_stats &st = c->stats();
+    uint64_t hits = st.read_hits + st.write_hits, misses = st.read_misses + st.write_misses;
+    if (!hits || !misses || !st.evictions ||
+        (cfg.mode == CACHE_MODE_WRITEBACK) != (st.writebacks > 0)) {
+        printf("test_cache: %s: unexpected statistics\n", name);
+        errors++;
+    }
+    c->print_stats(name);
+
+    delete c;
+    return errors == 0;
+}
+
+// With 2 ways the PLRU tree is a single bit pointing at the least recently used way.
+static bool check_lru(base_bus &bus)
+{
+    cache_config cfg;
+    cfg.sets = 1;
+    cfg.ways = 2;
+    cache_ip *c = new cache_ip(&bus, 1, CACHE_BASE, RAM_SIZE, RAM_BASE, cfg);
+    std::list<uint64_t> lru; // Most recently used first
+    uint64_t errors = 0;
+    for (int i = 0; i < 10000; i++) {
+        uint64_t line = next_random(rng) % 4;
+        auto it = std::find(lru.begin(), lru.end(), line);
+        bool expect = it != lru.end();
+        if (expect) {
+            lru.erase(it);
+        } else if (lru.size() == 2) {
+            lru.pop_back();
+        }
+        lru.push_front(line);
+        if (c->access(line * cfg.line_size, 8, MMIO_ACCESS_RW_R) != expect) {
+            errors++;
+        }
+    }
+    if (errors) {
+        printf("test_cache: 2-way PLRU differs from LRU on %lu accesses\n", (unsigned long)errors);
+    }
+    delete c;
+    return errors == 0;
+}
+
+// Lines whose tag is all ones, the widest window the tags cover and one byte past it.
+static bool check_tag_range(base_bus &bus)
+{
+    cache_config cfg;
+    cfg.sets = 1;
+    cfg.ways = 4;
+    cfg.line_size = 8;
+    const uint64_t widest = 1ULL << 35; // 2^32 lines of 8 bytes
+    bool ok = true;
+
+    cache_ip *c = new cache_ip(&bus, 1, CACHE_BASE, widest, RAM_BASE, cfg);
+    if (c->access(widest - 8, 8, MMIO_ACCESS_RW_R) || !c->access(widest - 8, 8, MMIO_ACCESS_RW_R) ||
+        c->stats().read_misses != 1 || c->stats().evictions != 0) {
+        printf("test_cache: the last line of the widest window hits an empty way\n");
+        ok = false;
+    }
+    delete c;
+
+    c = new cache_ip(&bus, 1, CACHE_BASE, widest + cfg.line_size, RAM_BASE, cfg);
+    if (c->access(0, 8, MMIO_ACCESS_RW_R) || c->access(0, 8, MMIO_ACCESS_RW_R) ||
+        c->stats().read_misses) {
+        printf("test_cache: a window too large for the tags is cached\n");
+        ok = false;
+    }
+    delete c;
+    return ok;
+}
+
+int main()
+{
+    debugger::set_level(debugger::OFF);
+
+    std::string shm = "/test_cache_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    ram *r = new ram(&bus, 0, RAM_BASE, RAM_SIZE, 0, 0);
+
+    bool ok = check_lru(bus) && check_tag_range(bus);
+    const uint64_t geometries[][3] = { // sets, ways, line
+        { 64, 4, 64 }, { 32, 8, 16 }, { 16, 16, 64 }, { 8, 32, 32 }, { 1, 12, 64 }, { 64, 1, 8 },
+    };
+    for (const auto &g : geometries) {
+        for (CACHE_POLICY policy : { CACHE_POLICY_PLRU, CACHE_POLICY_SRRIP }) {
+            for (CACHE_MODE mode : { CACHE_MODE_STATS, CACHE_MODE_WRITEBACK }) {
+                cache_config cfg;
+                cfg.sets = g[0];
+                cfg.ways = g[1];
+                cfg.line_size = g[2];
+                cfg.policy = policy;
+                cfg.mode = mode;
+                if (policy == CACHE_POLICY_PLRU && (g[1] & (g[1] - 1))) {
+                    continue;
+                }
+                ok &= run_config(bus, cfg);
+            }
+        }
+    }
+
+    delete r;
+    printf("test_cache: %s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,206 @@
+// Test of coroutine IPs.
+//
+// Register writes a coroutine IP asks to act on must start exactly one run_action() each,
+// reads and refused writes none, and an IP keeping the default hooks must never see an
+// action. The coroutines must move data through RAM, completed inline, and through a
+// register window, completed on a blocking thread, and RAM accesses must be seen by the
+// heat profiler like other bus accesses. IRQs must wake the coroutine waiting for them
+// whether they arrive before or after it waits.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include <unistd.h>
+
+#include "bus.hh"
+#include "ram.hh"
+#include "coro_ip.hh"
+#include "heat_profile.hh"
+#include "test_util.hh"
+
+static const uint64_t RAM_BASE = 0x100000000ULL;
+static const uint64_t RAM_ID = 3;
+static const uint64_t DEV_BASE = 0x20000000;
+static const uint64_t REGS_BASE = 0x20001000;
+
+static const uint64_t REG_GO = 0x0;     // Write: copy 8 bytes from RAM to the register window
+static const uint64_t REG_IRQ = 0x8;    // Write: wait for IRQ vector 0 then count
+static const uint64_t REG_RO = 0x10;    // Writes refused
+
+// A register window that is not RAM, so coroutine accesses to it go to a blocking thread.
+class regs_ip : public base_ip {
+public:
+    regs_ip(base_bus *bus, uint64_t id, uint64_t base)
+        : base_ip(bus, id, IP_TYPE_PERIPHERAL, base, 0x1000, 0, 0)
+    {
+    }
+
+    void reset() override {}
+    void mem_slave_read(uint64_t offset, uint64_t size, void *data) override
+    {
+        memcpy(data, &regs[offset / 8], size);
+    }
+    void mem_slave_write(uint64_t offset, uint64_t size, void *data) override
+    {
+        memcpy(&regs[offset / 8], data, size);
+    }
+
+    uint64_t regs[512] = {};
+};
+
+// Never overrides the action hooks, counts process_action calls.
+class plain_ip : public regs_ip {
+public:
+    using regs_ip::regs_ip;
+
+    void process_action(const ip_action &) override { actions++; }
+
+    std::atomic<int> actions{0};
+};
+
+class copy_ip : public coro_ip {
+public:
+    copy_ip(base_bus *bus, uint64_t id, co_executor *executor)
+        : coro_ip(bus, id, IP_TYPE_PERIPHERAL, DEV_BASE, 0x1000, 0, 1, executor)
+    {
+    }
+
+    void reset() override {}
+    BUS_ACCESS_CODE memaddr_can_access(bool rw, uint64_t offset, uint64_t size) override
+    {
+        if (offset + size > 0x1000) {
+            return ACCESS_ADDR_ERROR;
+        }
+        return rw == MMIO_ACCESS_RW_W && offset == REG_RO ? ACCESS_DENIED : ACCESS_OK;
+    }
+    void mem_slave_read(uint64_t, uint64_t size, void *data) override { memset(data, 0, size); }
+    void mem_slave_write(uint64_t, uint64_t, void *) override {}
+
+    bool should_trigger_action(uint64_t offset, uint64_t, bool, void *) override
+    {
+        return offset == REG_GO || offset == REG_IRQ || offset == REG_RO;
+    }
+
+    ip_action get_action(uint64_t offset, uint64_t size, void *data) override
+    {
+        uint64_t val = 0;
+        memcpy(&val, data, std::min<uint64_t>(size, sizeof(val)));
+        return ip_action(IP_ACTION_CUSTOM, offset, val);
+    }
+
+    co_task run_action(ip_action action) override
+    {
+        started++;
+        if (action.addr == REG_IRQ) {
+            co_await irq_ack(0);
+            irqs_seen++;
+            co_return;
+        }
+        // Copy RAM word @data to register @data and back to RAM one word later
+        uint64_t v = 0;
+        co_await bus_read(RAM_BASE + action.data * 8, 8, &v);
+        co_await bus_write(REGS_BASE + action.data * 8, 8, &v);
+        uint64_t back = 0;
+        co_await bus_read(REGS_BASE + action.data * 8, 8, &back);
+        co_await delay(1000);
+        co_await bus_write(RAM_BASE + 0x1000 + action.data * 8, 8, &back);
+        done++;
+    }
+
+    std::atomic<int> started{0};
+    std::atomic<int> done{0};
+    std::atomic<int> irqs_seen{0};
+};
+
+static bool wait_for(const std::atomic<int> &v, int n)
+{
+    for (int i = 0; i < 5000 && v.load() < n; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return v.load() == n;
+}
+
+static bool heat_recorded(uint64_t ip_id)
+{
+    char path[] = "/tmp/test_coro_heat_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    bool found = false;
+    if (heat_profile::write_csv(path)) {
+        FILE *f = fopen(path, "r");
+        char line[128];
+        while (f && fgets(line, sizeof(line), f)) {
+            found |= line[0] != 'i' && strtoull(line, nullptr, 10) == ip_id;
+        }
+        if (f) {
+            fclose(f);
+        }
+    }
+    unlink(path);
+    return found;
+}
+
+int main()
+{
+    test_begin("test_coro");
+
+    std::string shm = "/test_coro_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    ram mem(&bus, RAM_ID, RAM_BASE, 0x10000, 0, 0);
+    regs_ip regs(&bus, 4, REGS_BASE);
+    plain_ip plain(&bus, 5, 0x20002000);
+    co_executor executor(2, 2);
+    copy_ip dev(&bus, 6, &executor);
+
+    const int N = 32;
+    for (uint64_t i = 0; i < N; i++) {
+        uint64_t v = 0x1000 + i * 0x10001;
+        bus.master_write(RAM_BASE + i * 8, 8, &v);
+    }
+    heat_profile::reset();
+    heat_profile::start(1);
+
+    // One action per accepted write
+    for (uint64_t i = 0; i < N; i++) {
+        bus.master_write(DEV_BASE + REG_GO, 8, &i);
+    }
+    uint64_t v = 0;
+    bus.master_read(DEV_BASE + REG_GO, 8, &v);
+    bus.master_write(DEV_BASE + REG_RO, 8, &v);
+    expect(wait_for(dev.done, N) && dev.started == N, "one action per triggering write");
+    heat_profile::stop();
+    expect(heat_recorded(RAM_ID), "inline RAM accesses profiled");
+
+    bool same = true;
+    for (uint64_t i = 0; i < N; i++) {
+        uint64_t back = 0;
+        bus.master_read(RAM_BASE + 0x1000 + i * 8, 8, &back);
+        same &= back == 0x1000 + i * 0x10001 && regs.regs[i] == back;
+    }
+    expect(same, "data through RAM and the register window");
+
+    // Default hooks trigger nothing
+    bus.master_write(0x20002000, 8, &v);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    expect(plain.actions == 0, "default hooks trigger nothing");
+
+    // An IRQ before the wait is kept, one after it wakes the waiter
+    dev.recv_irq(6, 0);
+    bus.master_write(DEV_BASE + REG_IRQ, 8, &v);
+    expect(wait_for(dev.irqs_seen, 1), "IRQ received before the wait");
+    bus.master_write(DEV_BASE + REG_IRQ, 8, &v);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    expect(dev.irqs_seen == 1, "waiting for the IRQ");
+    dev.recv_irq(6, 0);
+    expect(wait_for(dev.irqs_seen, 2), "IRQ after the wait");
+
+    return test_finish();
+}
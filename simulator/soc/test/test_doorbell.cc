@@ -0,0 +1,214 @@
+// Test of doorbells delivered through eventfds.
+//
+// An IP declares a matching and a plain doorbell. They are advertised and bound through
+// the bridge control packets, with the eventfds taken from this process the way they
+// are taken from QEMU. Signalling an eventfd must replay the doorbell write on the
+// action thread, in both simulation modes, also while bus writes keep triggering
+// actions. A rebound doorbell uses the new eventfd, and an IP with bound doorbells must
+// shut down cleanly. When the eventfd cannot be taken, the bind must fail and the
+// doorbell must still work through write packets from QEMU.
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "bus.hh"
+#include "cosim_bridge.hh"
+#include "fake_qemu.hh"
+#include "test_util.hh"
+
+static const uint64_t BELL_BASE = 0x10000;
+static const uint64_t BRIDGE_BASE = 0x20000;
+static const uint64_t REG_MATCH = 0x8;
+static const uint64_t REG_PLAIN = 0x10;
+static const uint64_t MATCH_VALUE = 5;
+
+class bell_ip : public base_ip {
+public:
+    bell_ip(base_bus *bus, uint64_t id, uint64_t base, bool thread)
+        : base_ip(bus, id, IP_TYPE_PERIPHERAL, base, 0x1000, 0, 0)
+    {
+        add_doorbell(REG_MATCH, 8, MATCH_VALUE, IP_DOORBELL_DATAMATCH);
+        add_doorbell(REG_PLAIN, 4, 0, 0);
+        if (thread) {
+            start_action_thread();
+        }
+    }
+
+    ~bell_ip() override
+    {
+        stop_action_thread();
+    }
+
+    void reset() override {}
+    void mem_slave_read(uint64_t, uint64_t, void *) override {}
+    void mem_slave_write(uint64_t offset, uint64_t, void *data) override
+    {
+        if (offset == REG_MATCH) {
+            memcpy(&last_value, data, 8);
+        }
+    }
+
+    bool should_trigger_action(uint64_t offset, uint64_t, bool, void *) override
+    {
+        return offset == REG_MATCH || offset == REG_PLAIN;
+    }
+
+    ip_action get_action(uint64_t offset, uint64_t, void *) override
+    {
+        return ip_action(IP_ACTION_CUSTOM, offset);
+    }
+
+    void process_action(const ip_action &action) override
+    {
+        if (action.addr == REG_MATCH) {
+            matched++;
+        } else {
+            plain++;
+        }
+    }
+
+    std::atomic<uint64_t> matched{0};
+    std::atomic<uint64_t> plain{0};
+    uint64_t last_value = 0;
+};
+
+static bool wait_for(const std::atomic<uint64_t> &counter, uint64_t value)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (counter.load() < value) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    return true;
+}
+
+static void ring(int fd)
+{
+    uint64_t one = 1;
+    expect(write(fd, &one, sizeof(one)) == sizeof(one), "eventfd write");
+}
+
+// Issue a doorbell control packet, returns its status.
+static int ctrl(cosim_bridge &bridge, int op, uint64_t addr, uint64_t data, exPktCmd &out)
+{
+    out = exPktCmd{ EX_PKT_CTRL, op, addr, data };
+    bridge.handle_ctrl(out);
+    return out.length;
+}
+
+static void test_bind(SIM_MODE mode)
+{
+    std::string shm = "/test_doorbell_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    char path[] = "unused";
+    cosim_bridge bridge(&bus, 1, BRIDGE_BASE, 0x1000, 0, 1, path, path, path, path);
+    bell_ip *ip = new bell_ip(&bus, 0, BELL_BASE, true);
+    bell_ip *idle = new bell_ip(&bus, 2, BELL_BASE + 0x1000, false);
+    sim_mode::set(mode);
+
+    exPktCmd cmd;
+    expect(ctrl(bridge, EX_CTRL_DOORBELL_COUNT, 0, 0, cmd) == ACCESS_OK && cmd.data == 4,
+           "doorbell count");
+    expect(ctrl(bridge, EX_CTRL_DOORBELL_ADDR, 0, 0, cmd) == ACCESS_OK &&
+           cmd.addr == BELL_BASE + REG_MATCH && cmd.data == (8 | IP_DOORBELL_DATAMATCH),
+           "matching doorbell address");
+    expect(ctrl(bridge, EX_CTRL_DOORBELL_VALUE, 0, 0, cmd) == ACCESS_OK &&
+           cmd.data == MATCH_VALUE, "matching doorbell value");
+    expect(ctrl(bridge, EX_CTRL_DOORBELL_ADDR, 1, 0, cmd) == ACCESS_OK && cmd.data == 4,
+           "plain doorbell");
+    expect(ctrl(bridge, EX_CTRL_DOORBELL_ADDR, 4, 0, cmd) == ACCESS_ADDR_ERROR,
+           "doorbell index past the end");
+
+    int efd[3];
+    for (int &fd : efd) {
+        fd = eventfd(0, EFD_CLOEXEC);
+    }
+    uint64_t pid = (uint64_t)getpid() << 32;
+    expect(ctrl(bridge, EX_CTRL_DOORBELL_BIND, 0, pid | efd[0], cmd) == ACCESS_OK &&
+           ctrl(bridge, EX_CTRL_DOORBELL_BIND, 1, pid | efd[1], cmd) == ACCESS_OK,
+           "doorbells bound");
+    expect(ctrl(bridge, EX_CTRL_DOORBELL_BIND, 2, pid | efd[2], cmd) == ACCESS_DENIED,
+           "no binding without an action thread");
+    expect(ctrl(bridge, EX_CTRL_DOORBELL_BIND, 0, pid | 1000, cmd) == ACCESS_DENIED,
+           "bad fd");
+
+    ring(efd[0]);
+    expect(wait_for(ip->matched, 1) && ip->last_value == MATCH_VALUE, "matching doorbell replayed");
+    ring(efd[1]);
+    expect(wait_for(ip->plain, 1), "plain doorbell replayed");
+
+    // Bus writes and doorbells together, each doorbell is seen at least once after it rang
+    std::thread writer([&]() {
+        for (uint64_t i = 0; i < 2000; i++) {
+            uint32_t v = 0;
+            bus.master_write(BELL_BASE + REG_PLAIN, 4, &v);
+        }
+    });
+    for (int i = 0; i < 200; i++) {
+        uint64_t before = ip->matched.load();
+        ring(efd[0]);
+        if (!wait_for(ip->matched, before + 1)) {
+            expect(false, "doorbell lost among bus writes");
+            break;
+        }
+    }
+    writer.join();
+    expect(wait_for(ip->plain, 2001), "bus writes processed");
+
+    // Rebinding replaces the eventfd
+    int again = eventfd(0, EFD_CLOEXEC);
+    expect(ctrl(bridge, EX_CTRL_DOORBELL_BIND, 0, pid | again, cmd) == ACCESS_OK, "rebind");
+    uint64_t before = ip->matched.load();
+    ring(again);
+    expect(wait_for(ip->matched, before + 1), "rebound doorbell replayed");
+
+    for (int fd : efd) {
+        close(fd);
+    }
+    close(again);
+    delete idle;
+    delete ip; // Stops an action thread in poll()
+}
+
+// A doorbell whose eventfd cannot be taken still works through write packets.
+static void test_fallback()
+{
+    std::string shm = "/test_doorbell_fifo_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    fake_qemu qemu(0x1000);
+    cosim_bridge bridge(&bus, 1, BRIDGE_BASE, 0x1000, 0, 1, qemu.path(0), qemu.path(1),
+                        qemu.path(2), qemu.path(3));
+    bell_ip *ip = new bell_ip(&bus, 0, BELL_BASE, true);
+    sim_mode::set(SIM_MODE_TIMED);
+    qemu.connect(bridge);
+
+    exPktCmd cmd = { EX_PKT_CTRL, EX_CTRL_DOORBELL_BIND, 0, (uint64_t)getpid() << 32 | 1000 };
+    expect(qemu.request(cmd) && cmd.length == ACCESS_DENIED, "failed bind over the FIFO");
+    cmd = exPktCmd{ EX_PKT_WR, 8, BELL_BASE + REG_MATCH, MATCH_VALUE };
+    expect(qemu.request(cmd) && cmd.type == EX_PKT_RESP_FLAG, "doorbell write packet answered");
+    expect(wait_for(ip->matched, 1) && ip->last_value == MATCH_VALUE,
+           "doorbell reached through the write packet");
+
+    qemu.disconnect();
+    delete ip;
+}
+
+int main()
+{
+    test_begin("test_doorbell");
+
+    test_bind(SIM_MODE_TIMED);
+    test_bind(SIM_MODE_FUNCTIONAL);
+    test_fallback();
+
+    return test_finish();
+}
@@ -0,0 +1,149 @@
+// Test of the gem5 port ring with the stand-in server.
+//
+// Several masters write and read back random data through gem5 ports sharing one ring,
+// with sizes from 1 byte to several requests and addresses straddling requests and
+// pages, and every read is compared with a local copy. The modelled latency must cover
+// the stand-in latency and reach timed masters, a ring without a server must fail its
+// accesses after its timeout, and a topology with gem5 lines must build its ring and
+// stand-in.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bus.hh"
+#include "gem5_port.hh"
+#include "soc_config.hh"
+#include "test_util.hh"
+
+static const uint64_t PORT_BASE = 0x3000000000ULL;
+static const uint64_t PORT_SIZE = 0x100000;
+static const int MASTERS = 4;
+static const uint64_t LATENCY_NS = 50;
+
+// Master @m owns every MASTERS-th 8 KiB block of both ports, ports[0] covering the first
+// half of the shared address space and ports[1] the second.
+static void master(base_bus *bus, int m)
+{
+    uint64_t rng = 0x9e3779b97f4a7c15ULL * (m + 1);
+    std::vector<uint8_t> shadow(2 * PORT_SIZE / MASTERS);
+    std::vector<uint8_t> buf(512), out(512);
+    for (int i = 0; i < 3000; i++) {
+        uint64_t local = next_random(rng) % (shadow.size() - buf.size());
+        uint64_t size = next_random(rng) % 4 ? 1 + next_random(rng) % 16 : 1 + next_random(rng) % 400;
+        size = std::min<uint64_t>(size, 8192 - local % 8192);
+        uint64_t block = local / 8192, addr = PORT_BASE + (block * MASTERS + m) * 8192 + local % 8192;
+
+        if (next_random(rng) & 1) {
+            for (uint64_t k = 0; k < size; k++) {
+                buf[k] = next_random(rng);
+            }
+            bus->master_write(addr, size, buf.data());
+            memcpy(&shadow[local], buf.data(), size);
+        } else {
+            bus->master_read(addr, size, out.data());
+            if (memcmp(out.data(), &shadow[local], size)) {
+                fail("master %d read of %lu bytes at %lx differs", m, (unsigned long)size,
+                     (unsigned long)addr);
+                return;
+            }
+        }
+    }
+}
+
+static void test_ports()
+{
+    std::string shm = "/test_gem5_" + std::to_string(getpid());
+    std::string ring_shm = shm + "_ring";
+    base_bus bus(0, shm.c_str());
+    gem5_ring ring(ring_shm, 16); // Small, so masters wrap it and wait for slots
+    gem5_standin standin(ring_shm, LATENCY_NS);
+    expect(ring.ok() && standin.ok(), "ring and stand-in set up");
+
+    gem5_port *ports[2] = {
+        new gem5_port(&bus, 0, PORT_BASE, PORT_SIZE, &ring),
+        new gem5_port(&bus, 1, PORT_BASE + PORT_SIZE, PORT_SIZE, &ring),
+    };
+    std::vector<std::thread> threads;
+    for (int m = 0; m < MASTERS; m++) {
+        threads.emplace_back(master, &bus, m);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    uint64_t value = 0x1122334455667788ULL, back = 0, ps = 0;
+    expect(ring.transfer(MMIO_ACCESS_RW_W, PORT_BASE + 4092, 8, &value, ps) &&
+           ring.transfer(MMIO_ACCESS_RW_R, PORT_BASE + 4092, 8, &back, ps) && back == value,
+           "access straddling a page");
+    expect(ps >= LATENCY_NS * 1000, "modelled latency covers the stand-in latency");
+    expect(ring.transfer(MMIO_ACCESS_RW_R, PORT_BASE + 0x80000, 0, &back, ps) && ps == 0,
+           "empty access");
+
+    uint64_t issue = ip_timing::now_ns();
+    expect(bus.master_read_at(issue, PORT_BASE, 8, &back) >= issue + LATENCY_NS,
+           "modelled latency charged to timed accesses");
+
+    for (gem5_port *p : ports) {
+        delete p;
+    }
+}
+
+// Nothing serves this ring, its accesses must fail once the timeout passes.
+static void test_no_server()
+{
+    std::string shm = "/test_gem5_dead_" + std::to_string(getpid());
+    std::string ring_shm = shm + "_ring";
+    base_bus bus(0, shm.c_str());
+    gem5_ring ring(ring_shm, 16, 100);
+    gem5_port *port = new gem5_port(&bus, 0, PORT_BASE, PORT_SIZE, &ring);
+
+    uint64_t back = ~0ULL, ps = 0;
+    expect(!ring.transfer(MMIO_ACCESS_RW_R, PORT_BASE, 8, &back, ps) && ring.failed() &&
+           back == 0, "access without a server fails and reads zeros");
+    back = ~0ULL;
+    bus.master_read(PORT_BASE, 8, &back); // At once, the ring has failed
+    expect(back == 0, "later access through the port fails too");
+
+    delete port;
+}
+
+static void test_config()
+{
+    std::string shm = "/test_gem5_cfg_" + std::to_string(getpid());
+    std::string ring = "test_gem5_cfg_ring_" + std::to_string(getpid());
+    std::string text = "gem5 id=0 base=0x3000000000 size=1M count=2 stride=1M ring=" + ring +
+                       " slots=64 standin=1 latency=30\n";
+    soc_config config;
+    expect(config.parse(text, "gem5 topology") && config.ips().size() == 2, "gem5 topology");
+    expect(!soc_config().parse("gem5 id=0 base=0 size=1M slots=6\n", "bad slots"),
+           "slots must be a power of two");
+
+    base_bus bus(0, shm.c_str());
+    {
+        soc_config::soc soc;
+        config.build(&bus, soc, 1);
+        expect(soc.gem5_ports.size() == 2 && soc.gem5_rings.size() == 1 &&
+               soc.gem5_standins.size() == 1, "one shared ring with one stand-in");
+        uint64_t value = 42, back = 0;
+        bus.master_write(0x3000100000ULL, 8, &value);
+        bus.master_read(0x3000100000ULL, 8, &back);
+        expect(back == 42, "access through a configured port");
+    }
+}
+
+int main()
+{
+    test_begin("test_gem5");
+
+    test_ports();
+    test_no_server();
+    test_config();
+
+    return test_finish();
+}
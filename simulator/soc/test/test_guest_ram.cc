@@ -0,0 +1,185 @@
+// Test of the guest RAM window.
+//
+// A file stands in for QEMU's guest RAM. In passthrough mode window offsets must reach
+// the file directly or through the RAM block layout, and unbacked addresses must fault.
+// With the IOMMU enabled only IOTLB mappings may be reached, with their permissions, an
+// access crossing pages must follow each page's mapping, and the translation cache must
+// never serve a translation after it was changed or removed. Pages only partly backed,
+// by a RAM block ending inside them or by IOTLB entries smaller than a page, must be
+// followed byte for byte and never let an access run past the backing. Accesses before
+// attaching, past the window or reaching an unmapped byte must be refused as a whole,
+// without writing any part of them.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bus.hh"
+#include "guest_ram.hh"
+#include "test_util.hh"
+
+static const uint64_t WINDOW_BASE = 0x400000000ULL;
+static const uint64_t WINDOW_SIZE = 0x1000000;
+static const uint64_t FILE_SIZE = 0x40000;
+static const uint64_t PAGE = 0x1000;
+
+static uint64_t rng = 0xd1b54a32d192ed03ULL;
+
+static uint64_t read64(base_bus &bus, uint64_t iova)
+{
+    uint64_t v = 0;
+    bus.master_read(WINDOW_BASE + iova, 8, &v);
+    return v;
+}
+
+static void write64(base_bus &bus, uint64_t iova, uint64_t v)
+{
+    bus.master_write(WINDOW_BASE + iova, 8, &v);
+}
+
+// Whether the access is refused as an address error by the window
+static bool faults(guest_ram &g, bool rw, uint64_t iova, uint64_t size)
+{
+    std::vector<uint8_t> buf(size, 0x5a);
+    return g.mem_slave_access(rw, WINDOW_BASE + iova, size, buf.data()) == ACCESS_ADDR_ERROR;
+}
+
+static uint64_t file64(const uint8_t *file, uint64_t off)
+{
+    uint64_t v;
+    memcpy(&v, file + off, 8);
+    return v;
+}
+
+static void test_refused(guest_ram &g)
+{
+    uint64_t v = 0;
+    expect(g.mem_slave_access(MMIO_ACCESS_RW_R, WINDOW_BASE, 8, &v) == ACCESS_DENIED,
+           "access before attach");
+}
+
+static void test_passthrough(base_bus &bus, guest_ram &g, uint8_t *file)
+{
+    expect(read64(bus, 0x1230) == file64(file, 0x1230), "passthrough read");
+    write64(bus, 0x2238, 0x1122334455667788ULL);
+    expect(file64(file, 0x2238) == 0x1122334455667788ULL, "passthrough write");
+    expect(faults(g, MMIO_ACCESS_RW_R, FILE_SIZE, 8), "read past guest RAM faults");
+    expect(faults(g, MMIO_ACCESS_RW_R, FILE_SIZE - 8, 16), "read running past guest RAM faults");
+
+    uint64_t v = 0;
+    expect(g.mem_slave_access(MMIO_ACCESS_RW_R, WINDOW_BASE + WINDOW_SIZE - 4, 8, &v) ==
+           ACCESS_ADDR_ERROR, "access past the window");
+    expect(g.mem_slave_access(MMIO_ACCESS_RW_R, WINDOW_BASE + 8, ~0ULL - 4, &v) ==
+           ACCESS_ADDR_ERROR, "access size wrapping the window");
+
+    // GPA 0x100000 is file offset 0x8000, GPA 0 is no longer backed
+    g.add_ram_block(0x100000, 0x8000, 0x8000);
+    expect(read64(bus, 0x100010) == file64(file, 0x8010), "RAM block read");
+    expect(faults(g, MMIO_ACCESS_RW_R, 0x10, 8), "address outside the RAM blocks faults");
+    g.add_ram_block(0, 0, 0x8000);
+    expect(read64(bus, 0x10) == file64(file, 0x10), "second RAM block");
+    g.add_ram_block(0x200000, FILE_SIZE - 0x1000, ~0ULL - 0x100);
+    expect(faults(g, MMIO_ACCESS_RW_R, 0x200000, 8), "block past the file refused");
+
+    // A block ending in the middle of a page, at the end of the file mapping
+    g.add_ram_block(0x300000, FILE_SIZE - 0x800, 0x800);
+    expect(read64(bus, 0x3007f8) == file64(file, FILE_SIZE - 8), "read at the end of a block");
+    expect(faults(g, MMIO_ACCESS_RW_R, 0x3007f8, 16), "read running past a block faults");
+    expect(faults(g, MMIO_ACCESS_RW_W, 0x300800, 8), "write past a block faults");
+}
+
+static void test_iommu(base_bus &bus, guest_ram &g, uint8_t *file)
+{
+    g.set_iommu_enabled(true);
+    expect(faults(g, MMIO_ACCESS_RW_R, 0x3000, 8), "unmapped IOVA faults");
+
+    // IOVA 0x10000 -> GPA 0x5000 read only
+    g.iotlb_map(0x10000, 0x5000, PAGE, IOTLB_PERM_RO);
+    expect(read64(bus, 0x10008) == file64(file, 0x5008), "mapped read");
+    uint64_t before = file64(file, 0x5008);
+    write64(bus, 0x10008, 0xdead);
+    expect(file64(file, 0x5008) == before, "write to a read only mapping refused");
+
+    // Remapping the same IOVA read/write replaces the cached translation
+    uint64_t hits = g.get_tcache_hits(), misses = g.get_tcache_misses();
+    read64(bus, 0x10010);
+    expect(g.get_tcache_hits() > hits && g.get_tcache_misses() == misses, "translation cached");
+    g.iotlb_map(0x10000, 0x6000, PAGE, IOTLB_PERM_RW);
+    write64(bus, 0x10008, 0xbeef);
+    expect(file64(file, 0x6008) == 0xbeef && file64(file, 0x5008) == before,
+           "remapped IOVA goes to the new page");
+
+    g.iotlb_map(0x11000, 0x7000, PAGE, IOTLB_PERM_WO);
+    write64(bus, 0x11000, 0x77);
+    expect(file64(file, 0x7000) == 0x77 && faults(g, MMIO_ACCESS_RW_R, 0x11000, 8),
+           "write only mapping");
+
+    // Two IOVA pages mapped to GPA pages in reverse order
+    g.iotlb_map(0x20000, 0x3000, PAGE, IOTLB_PERM_RW);
+    g.iotlb_map(0x21000, 0x2000, PAGE, IOTLB_PERM_RW);
+    std::vector<uint8_t> out(32);
+    bus.master_read(WINDOW_BASE + 0x20ff0, out.size(), out.data());
+    expect(!memcmp(out.data(), file + 0x3ff0, 16) && !memcmp(out.data() + 16, file + 0x2000, 16),
+           "access crossing pages");
+
+    // Entries smaller than a page split it between two GPA ranges
+    g.iotlb_map(0x30000, 0x8000, 0x800, IOTLB_PERM_RW);
+    g.iotlb_map(0x30800, 0x9800, 0x800, IOTLB_PERM_RW);
+    bus.master_read(WINDOW_BASE + 0x307f0, out.size(), out.data());
+    expect(!memcmp(out.data(), file + 0x87f0, 16) && !memcmp(out.data() + 16, file + 0x9800, 16),
+           "access crossing IOTLB entries within a page");
+    g.iotlb_map(0x31000, 0x8000, 0x800, IOTLB_PERM_RW);
+    expect(read64(bus, 0x317f8) == file64(file, 0x87f8) &&
+           faults(g, MMIO_ACCESS_RW_R, 0x317f8, 16), "access past an entry smaller than a page");
+
+    // A write reaching an unmapped page is refused whole
+    g.iotlb_map(0x40000, 0xa000, PAGE, IOTLB_PERM_RW);
+    before = file64(file, 0xaff8);
+    std::vector<uint8_t> ones(32, 0x11);
+    expect(g.mem_slave_access(MMIO_ACCESS_RW_W, WINDOW_BASE + 0x40ff0, ones.size(), ones.data()) ==
+           ACCESS_ADDR_ERROR && file64(file, 0xaff8) == before, "faulting write not applied");
+
+    g.iotlb_unmap(0x10000, 2 * PAGE);
+    expect(faults(g, MMIO_ACCESS_RW_R, 0x10008, 8) && read64(bus, 0x20000) == file64(file, 0x3000),
+           "unmapped IOVAs fault, others stay");
+
+    g.set_iommu_enabled(false);
+    expect(read64(bus, 0x10008) == file64(file, 0x10008), "back to passthrough");
+}
+
+int main()
+{
+    test_begin("test_guest_ram");
+
+    char path[] = "/tmp/test_guest_ram_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || ftruncate(fd, FILE_SIZE) < 0) {
+        fail("guest RAM file");
+        return test_finish();
+    }
+    uint8_t *file = (uint8_t *)mmap(NULL, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    for (uint64_t i = 0; i < FILE_SIZE; i++) {
+        file[i] = next_random(rng);
+    }
+
+    std::string shm = "/test_guest_ram_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    guest_ram g(&bus, 1, WINDOW_BASE, WINDOW_SIZE, 0, 0);
+
+    test_refused(g);
+    expect(g.attach(path), "attach");
+    test_passthrough(bus, g, file);
+    expect(g.attach(path), "attach again drops the RAM blocks");
+    test_iommu(bus, g, file);
+
+    munmap(file, FILE_SIZE);
+    unlink(path);
+    return test_finish();
+}
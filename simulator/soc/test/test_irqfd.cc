@@ -0,0 +1,139 @@
+// Test of IRQ injection through irqfds.
+//
+// The bridge owns a range of IRQ vectors. Eventfds of this process stand in for the KVM
+// irqfds QEMU hands over with EX_CTRL_IRQFD_BIND. An IRQ posted on the bus to a bound
+// vector must signal its eventfd exactly once, also when several IPs post at the same
+// time. Vectors outside the bridge range and bad fds must be refused, a rebound vector
+// must signal the new eventfd only, and unbound vectors must not touch any eventfd.
+// Through FIFOs to a fake QEMU, unbound vectors and vectors whose bind failed must go out
+// as IRQ packets, whose responses must not put later requests out of step.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+
+#include "bus.hh"
+#include "cosim_bridge.hh"
+#include "fake_qemu.hh"
+#include "test_util.hh"
+
+static const uint64_t BRIDGE_ID = 1;
+static const uint64_t VEC_START = 32;
+static const uint64_t VEC_COUNT = 4;
+
+// Returns the count accumulated in @fd and clears it, 0 if it was not signalled.
+static uint64_t drain(int fd)
+{
+    uint64_t count = 0;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return 0;
+    }
+    return count;
+}
+
+static int bind(cosim_bridge &bridge, uint64_t vector, int fd)
+{
+    exPktCmd cmd = { EX_PKT_CTRL, EX_CTRL_IRQFD_BIND, vector, (uint64_t)getpid() << 32 | fd };
+    bridge.handle_ctrl(cmd);
+    return cmd.length;
+}
+
+static void test_bind()
+{
+    std::string shm = "/test_irqfd_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    char path[] = "unused";
+    cosim_bridge bridge(&bus, BRIDGE_ID, 0x20000, 0x1000, VEC_START, VEC_COUNT,
+                        path, path, path, path);
+
+    int efd[3];
+    for (int &fd : efd) {
+        fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+    expect(bind(bridge, VEC_START + 1, efd[0]) == ACCESS_OK &&
+           bind(bridge, VEC_START + 2, efd[1]) == ACCESS_OK, "vectors bound");
+    expect(bind(bridge, VEC_START + VEC_COUNT, efd[2]) == ACCESS_DENIED &&
+           bind(bridge, VEC_START - 1, efd[2]) == ACCESS_DENIED, "vectors outside the bridge");
+    expect(bind(bridge, VEC_START, 1000) == ACCESS_DENIED, "bad fd");
+
+    bus.post_irq(BRIDGE_ID, VEC_START + 1);
+    expect(drain(efd[0]) == 1 && drain(efd[1]) == 0, "IRQ signals its irqfd only");
+    for (int i = 0; i < 3; i++) {
+        bus.post_irq(BRIDGE_ID, VEC_START + 2);
+    }
+    expect(drain(efd[1]) == 3, "pending IRQs accumulate");
+
+    // Unbound vectors go out as packets, the bridge has no FIFO here so they are dropped
+    bus.post_irq(BRIDGE_ID, VEC_START);
+    bus.post_irq(BRIDGE_ID, VEC_START + 3);
+    expect(drain(efd[0]) == 0 && drain(efd[1]) == 0, "unbound vectors signal nothing");
+
+    std::vector<std::thread> posters;
+    for (int t = 0; t < 4; t++) {
+        posters.emplace_back([&bus, t]() {
+            for (int i = 0; i < 1000; i++) {
+                bus.post_irq(BRIDGE_ID, VEC_START + 1 + (t & 1));
+            }
+        });
+    }
+    for (auto &t : posters) {
+        t.join();
+    }
+    expect(drain(efd[0]) == 2000 && drain(efd[1]) == 2000, "concurrent IRQs");
+
+    // Rebinding replaces the eventfd
+    expect(bind(bridge, VEC_START + 1, efd[2]) == ACCESS_OK, "rebind");
+    bus.post_irq(BRIDGE_ID, VEC_START + 1);
+    expect(drain(efd[2]) == 1 && drain(efd[0]) == 0, "rebound vector signals the new irqfd");
+
+    for (int fd : efd) {
+        close(fd);
+    }
+}
+
+static void test_packets()
+{
+    std::string shm = "/test_irqfd_fifo_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    fake_qemu qemu(0x1000);
+    cosim_bridge bridge(&bus, BRIDGE_ID, 0x20000, 0x1000, VEC_START, VEC_COUNT,
+                        qemu.path(0), qemu.path(1), qemu.path(2), qemu.path(3));
+    qemu.connect(bridge);
+
+    // A bind QEMU sends whose fd cannot be taken leaves the vector on packets
+    exPktCmd cmd = { EX_PKT_CTRL, EX_CTRL_IRQFD_BIND, VEC_START + 1,
+                     (uint64_t)getpid() << 32 | 1000 };
+    expect(qemu.request(cmd) && cmd.length == ACCESS_DENIED, "failed bind over the FIFO");
+
+    uint64_t value = 0x1122334455667788ULL;
+    memcpy(&qemu.mem[0x100], &value, sizeof(value));
+    for (int i = 0; i < 3; i++) {
+        bus.post_irq(BRIDGE_ID, VEC_START + i % 2);
+        uint64_t back = 0;
+        bus.master_read(0x20100, 8, &back);
+        expect(back == value, "read after an IRQ packet gets its own response");
+    }
+    std::vector<exPktCmd> log = qemu.packets();
+    expect(log.size() == 6 && log[0].type == EX_PKT_IRQ && log[0].data == VEC_START &&
+           log[2].type == EX_PKT_IRQ && log[2].data == VEC_START + 1 &&
+           log[1].type == EX_PKT_RD, "IRQ packets in order with the reads");
+
+    qemu.disconnect();
+}
+
+int main()
+{
+    test_begin("test_irqfd");
+
+    test_bind();
+    test_packets();
+
+    return test_finish();
+}
@@ -0,0 +1,182 @@
+// Determinism test of the parallel discrete-event engine.
+//
+// DMA-like master LPs keep several requests in flight to memory LPs and now and then
+// notify each other, memories answer after a latency that depends on their state.
+// Every LP folds the events it handles (time, sender, payload) into a hash and draws its
+// decisions from its own random generator, so any change in the order or timing of the
+// events an LP sees changes its hash. The model is run on 1 thread and on several, and
+// must end in the same state with the same hashes every time.
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#include "pdes.hh"
+
+static const unsigned NR_MASTERS = 32;
+static const unsigned NR_MEMS = 16;
+static const unsigned INFLIGHT = 4;
+static const uint64_t RUN_NS = 200000;
+
+static const IP_ACTION_TYPE EV_START = IP_ACTION_CUSTOM;
+static const IP_ACTION_TYPE EV_REQ = (IP_ACTION_TYPE)(IP_ACTION_CUSTOM + 1);
+static const IP_ACTION_TYPE EV_RESP = (IP_ACTION_TYPE)(IP_ACTION_CUSTOM + 2);
+static const IP_ACTION_TYPE EV_NOTIFY = (IP_ACTION_TYPE)(IP_ACTION_CUSTOM + 3);
+
+static uint64_t mix(uint64_t h, uint64_t v)
+{
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h * 0xff51afd7ed558ccdULL;
+}
+
+// Lookahead of the link from LP @a to LP @b, what the bus latency would be in a SoC.
+static uint64_t lookahead(unsigned a, unsigned b)
+{
+    return 5 + (a * 7 + b * 13) % 36;
+}
+
+class model_lp : public pdes_lp {
+public:
+    explicit model_lp(unsigned id) : id(id), rng(0x1234567ULL * (id + 1)) {}
+
+    uint64_t hash = 0;
+
+protected:
+    uint64_t random()
+    {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return rng;
+    }
+
+    void record(pdes_context &ctx, const pdes_event &ev)
+    {
+        hash = mix(hash, ctx.now());
+        hash = mix(hash, ev.src);
+        hash = mix(hash, ev.action.type);
+        hash = mix(hash, ev.action.data);
+    }
+
+    unsigned id;
+    uint64_t rng;
+};
+
+class master_lp : public model_lp {
+public:
+    using model_lp::model_lp;
+
+    void handle_event(pdes_context &ctx, const pdes_event &ev) override
+    {
+        record(ctx, ev);
+        if (ev.action.type == EV_NOTIFY) {
+            return;
+        }
+        // A start or a response frees a slot, issue the next request
+        unsigned mem = NR_MASTERS + random() % NR_MEMS;
+        ctx.send(mem, lookahead(id, mem) + random() % 50, ip_action(EV_REQ, 0, random()));
+        if (random() % 16 == 0) {
+            unsigned peer = (id + 1 + random() % (NR_MASTERS - 1)) % NR_MASTERS;
+            ctx.send(peer, lookahead(id, peer) + 100, ip_action(EV_NOTIFY, 0, hash));
+        }
+    }
+};
+
+class mem_lp : public model_lp {
+public:
+    using model_lp::model_lp;
+
+    void handle_event(pdes_context &ctx, const pdes_event &ev) override
+    {
+        record(ctx, ev);
+        busy = std::max(busy, ctx.now()) + 3; // Serializes requests like a bus slave
+        uint64_t delay = busy - ctx.now() + lookahead(id, ev.src) + hash % 20;
+        ctx.send(ev.src, delay, ip_action(EV_RESP, 0, hash));
+    }
+
+private:
+    uint64_t busy = 0;
+};
+
+struct result {
+    std::vector<uint64_t> hashes;
+    std::vector<uint64_t> events;
+    uint64_t total = 0;
+    uint64_t next = 0;
+    uint64_t violations = 0;
+};
+
+static result run_model(unsigned threads)
+{
+    std::vector<model_lp *> lps;
+    pdes_engine engine(threads);
+    for (unsigned i = 0; i < NR_MASTERS; i++) {
+        lps.push_back(new master_lp(i));
+        engine.add_lp(lps.back());
+    }
+    for (unsigned i = 0; i < NR_MEMS; i++) {
+        lps.push_back(new mem_lp(NR_MASTERS + i));
+        engine.add_lp(lps.back());
+    }
+    for (unsigned m = 0; m < NR_MASTERS; m++) {
+        for (unsigned n = 0; n < NR_MEMS; n++) {
+            engine.add_link(m, NR_MASTERS + n, lookahead(m, NR_MASTERS + n));
+            engine.add_link(NR_MASTERS + n, m, lookahead(NR_MASTERS + n, m));
+        }
+        for (unsigned p = 0; p < NR_MASTERS; p++) {
+            if (p != m) {
+                engine.add_link(m, p, lookahead(m, p));
+            }
+        }
+        for (unsigned k = 0; k < INFLIGHT; k++) {
+            engine.schedule(m, k * 10, ip_action(EV_START, 0, k));
+        }
+    }
+
+    // Two runs, so stopping and resuming at a time boundary is covered too
+    result r;
+    r.total = engine.run(RUN_NS / 2);
+    r.total += engine.run(RUN_NS);
+    r.next = engine.next_event_time();
+    r.violations = engine.nr_violations();
+    for (unsigned i = 0; i < lps.size(); i++) {
+        r.hashes.push_back(lps[i]->hash);
+        r.events.push_back(engine.lp_events(i));
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "test_pdes %u threads", threads);
+    engine.print_stats(name);
+
+    for (auto lp : lps) {
+        delete lp;
+    }
+    return r;
+}
+
+int main()
+{
+    result ref = run_model(1);
+    bool ok = ref.total > 0 && ref.violations == 0;
+
+    unsigned cpus = std::max(4u, std::thread::hardware_concurrency());
+    for (unsigned threads : { 2u, 3u, 4u, cpus, 1u, 4u }) {
+        result r = run_model(threads);
+        bool same = r.hashes == ref.hashes && r.events == ref.events && r.total == ref.total &&
+                    r.next == ref.next && r.violations == 0;
+        if (!same) {
+            printf("test_pdes: %u threads differ from the single-threaded run\n", threads);
+        }
+        ok &= same;
+    }
+
+    uint64_t digest = 0;
+    for (uint64_t h : ref.hashes) {
+        digest = mix(digest, h);
+    }
+    printf("test_pdes: %lu events, state digest %016lx\n", (unsigned long)ref.total,
+           (unsigned long)digest);
+    printf("test_pdes: %s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,210 @@
+// Test of the functional execution mode.
+//
+// Actions queued in timed mode and still waiting or running when the SoC switches to
+// functional mode must run before the actions triggered after the switch, and never at
+// the same time as them. With nothing pending an action runs inline in the thread
+// triggering it, and an action triggered by process_action runs after it rather than
+// inside it. QEMU reads and writes of RAM served by the bridge fast path must return
+// the right data and be seen by the heat profiler like other bus accesses.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#include <unistd.h>
+
+#include "bus.hh"
+#include "ram.hh"
+#include "cosim_bridge.hh"
+#include "heat_profile.hh"
+#include "sim_mode.hh"
+#include "fake_qemu.hh"
+#include "test_util.hh"
+
+static const uint64_t RAM_BASE = 0x100000000ULL;
+static const uint64_t RAM_ID = 7;
+
+// Records the order its actions run in and how many run at once. An action of type
+// IP_ACTION_DMA_START triggers an IP_ACTION_DMA_DONE on the same IP.
+class recorder_ip : public base_ip {
+public:
+    recorder_ip(base_bus *bus, uint64_t id, uint64_t base, bool thread)
+        : base_ip(bus, id, IP_TYPE_PERIPHERAL, base, 0x1000, 0, 0)
+    {
+        if (thread) {
+            start_action_thread();
+        }
+    }
+
+    ~recorder_ip() override
+    {
+        stop_action_thread();
+    }
+
+    void reset() override {}
+    void mem_slave_read(uint64_t, uint64_t size, void *data) override { memset(data, 0, size); }
+    void mem_slave_write(uint64_t, uint64_t, void *) override {}
+
+    void process_action(const ip_action &action) override
+    {
+        int now = ++running;
+        max_running = std::max(max_running.load(), now);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            order.push_back(action.data);
+            threads.push_back(std::this_thread::get_id());
+        }
+        if (action.size) {
+            std::this_thread::sleep_for(std::chrono::microseconds(action.size));
+        }
+        if (action.type == IP_ACTION_DMA_START) {
+            ip_action next = {};
+            next.type = IP_ACTION_DMA_DONE;
+            next.data = action.data + 1;
+            trigger_action(next);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            order.push_back(~action.data); // Completion
+        }
+        running--;
+    }
+
+    size_t recorded()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return order.size();
+    }
+
+    std::mutex mtx;
+    std::vector<uint64_t> order;
+    std::vector<std::thread::id> threads;
+    std::atomic<int> running{0};
+    std::atomic<int> max_running{0};
+};
+
+static ip_action make_action(uint64_t data, uint64_t sleep_us = 0)
+{
+    ip_action a = {};
+    a.type = IP_ACTION_TIMER;
+    a.data = data;
+    a.size = sleep_us;
+    return a;
+}
+
+static void wait_recorded(recorder_ip &ip, size_t n)
+{
+    for (int i = 0; i < 5000 && ip.recorded() < n; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+static void test_switch(base_bus &bus)
+{
+    recorder_ip ip(&bus, 1, 0x20000000, true);
+    sim_mode::set(SIM_MODE_TIMED);
+    for (uint64_t i = 0; i < 20; i++) {
+        ip.trigger_action(make_action(i, 500));
+    }
+    sim_mode::set(SIM_MODE_FUNCTIONAL);
+    for (uint64_t i = 20; i < 40; i++) {
+        ip.trigger_action(make_action(i));
+    }
+    wait_recorded(ip, 80);
+
+    bool in_order = ip.order.size() == 80;
+    for (size_t k = 0; in_order && k < 80; k += 2) {
+        in_order = ip.order[k] == k / 2 && ip.order[k + 1] == ~(k / 2);
+    }
+    expect(in_order, "actions after the switch run after the queued ones");
+    expect(ip.max_running == 1, "actions never run concurrently");
+    sim_mode::set(SIM_MODE_TIMED);
+}
+
+static void test_inline(base_bus &bus)
+{
+    recorder_ip ip(&bus, 2, 0x20001000, true);
+    sim_mode::set(SIM_MODE_FUNCTIONAL);
+    ip.trigger_action(make_action(5));
+    expect(ip.recorded() == 2 && ip.threads[0] == std::this_thread::get_id(),
+           "action runs inline with nothing pending");
+
+    // Without an action thread, the action triggered by process_action runs after it
+    recorder_ip nothread(&bus, 3, 0x20002000, false);
+    ip_action start = make_action(10);
+    start.type = IP_ACTION_DMA_START;
+    nothread.trigger_action(start);
+    expect(nothread.order.size() == 4 && nothread.order[0] == 10 && nothread.order[1] == ~10ULL &&
+           nothread.order[2] == 11 && nothread.order[3] == ~11ULL,
+           "action triggered by an action runs after it");
+    sim_mode::set(SIM_MODE_TIMED);
+}
+
+static bool heat_recorded(uint64_t ip_id)
+{
+    char path[] = "/tmp/test_sim_mode_heat_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    bool found = false;
+    if (heat_profile::write_csv(path)) {
+        FILE *f = fopen(path, "r");
+        char line[128];
+        while (f && fgets(line, sizeof(line), f)) {
+            found |= strtoull(line, nullptr, 10) == ip_id && line[0] != 'i';
+        }
+        if (f) {
+            fclose(f);
+        }
+    }
+    unlink(path);
+    return found;
+}
+
+static void test_fast_forward(base_bus &bus)
+{
+    ram *r = new ram(&bus, RAM_ID, RAM_BASE, 0x10000, 0, 0);
+    {
+        fake_qemu qemu(0x1000);
+        cosim_bridge bridge(&bus, 1, 0x30000000, 0x1000, 0, 0, qemu.path(0), qemu.path(1),
+                            qemu.path(2), qemu.path(3));
+        qemu.connect(bridge);
+        sim_mode::set(SIM_MODE_FUNCTIONAL);
+        heat_profile::reset();
+        heat_profile::start(1);
+
+        exPktCmd wr = { EX_PKT_WR, 4, RAM_BASE + 0x104, 0xdeadbeef };
+        exPktCmd rd = { EX_PKT_RD, 8, RAM_BASE + 0x100, 0 };
+        expect(qemu.request(wr) && qemu.request(rd), "requests answered");
+        uint64_t back = 0;
+        bus.master_read(RAM_BASE + 0x100, 8, &back);
+        expect(rd.data == 0xdeadbeef00000000ULL && back == rd.data, "fast path data");
+        heat_profile::stop();
+        expect(heat_recorded(RAM_ID), "fast path accesses are profiled");
+
+        sim_mode::set(SIM_MODE_TIMED);
+        qemu.disconnect();
+    }
+    delete r;
+}
+
+int main()
+{
+    test_begin("test_sim_mode");
+
+    std::string shm = "/test_sim_mode_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    test_switch(bus);
+    test_inline(bus);
+    test_fast_forward(bus);
+
+    return test_finish();
+}
@@ -0,0 +1,207 @@
+// Test of the SoC configuration parser.
+//
+// The built-in topology and a file naming every IP type must parse into the expected
+// descriptions, with RAM ranges expanded and numbers scaled by their suffix. Malformed
+// lines, settings and numbers, duplicate or overlapping IDs, address ranges and IRQ
+// vectors, ranges wrapping the address space and invalid caches or gem5 rings must all
+// be refused, and a refused configuration must not keep IPs of an earlier one.
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <unistd.h>
+
+#include "soc_config.hh"
+#include "test_util.hh"
+
+static bool parses(const std::string &text)
+{
+    soc_config c;
+    return c.parse(text, "test");
+}
+
+static void refused(const std::string &text, const char *what)
+{
+    expect(!parses(text), what);
+}
+
+static void test_default()
+{
+    soc_config c;
+    expect(c.parse(soc_config::default_topology, "default"), "default topology");
+    expect(c.ips().size() == 35, "default topology IPs");
+    expect(c.ram_size() == 32 * (16ULL << 20), "default topology RAM size");
+    expect(c.shm_span() == 0xe000000000ULL + (16ULL << 20), "default topology shm span");
+
+    const soc_config::ip_desc &r = c.ips()[9];
+    expect(r.type == "ram" && r.id == 9 && r.base == 0x4800000000ULL && r.size == 16ULL << 20,
+           "RAM range expanded");
+    expect(r.latency_ns == 0 && r.bandwidth_mbps == 0, "default RAMs untimed");
+}
+
+static void test_valid()
+{
+    const char *text =
+        "# type     settings\n"
+        "\n"
+        "ram        id=0 base=0x100000000 size=64K count=2 stride=1G   # two RAMs\n"
+        "ram        id=2 base=0x100010000 size=64K burst=64 bandwidth=1000\n"
+        "guest_ram  id=3 base=0x1000000000000 size=1T\n"
+        "sim_ctrl   id=4 base=0x10000000\n"
+        "bridge     id=5 irq=0+1024 rx_req=a rx_resp=b\n"
+        "cache      id=6 base=0x2000000000 size=16K backing=0x140000000 sets=64 ways=4 "
+        "line=64 policy=srrip mode=writeback\n"
+        "gem5       id=7 base=0x3000000000 size=1M count=2 stride=1M ring=ddr slots=64 standin=1\n";
+    soc_config c;
+    expect(c.parse(text, "valid"), "every IP type");
+    expect(c.ips().size() == 9, "IPs of every type");
+    if (c.ips().size() != 9) {
+        return;
+    }
+    expect(c.ips()[1].id == 1 && c.ips()[1].base == 0x140000000ULL && c.ips()[1].size == 0x10000,
+           "count and stride");
+    expect(c.ips()[2].burst_bytes == 64 && c.ips()[2].bandwidth_mbps == 1000, "RAM timing");
+    expect(c.ips()[3].size == 1ULL << 40, "T suffix");
+    expect(c.ips()[4].size != 0, "sim_ctrl size");
+    expect(c.ips()[5].irq_start == 0 && c.ips()[5].irq_count == 1024 && c.ips()[5].fifos[0] == "a" &&
+           c.ips()[5].fifos[2] == "soc_to_qemu_req", "bridge IRQs and FIFOs");
+    expect(c.ips()[6].cache.ways == 4 && c.ips()[6].cache.policy == CACHE_POLICY_SRRIP &&
+           c.ips()[6].cache.mode == CACHE_MODE_WRITEBACK, "cache settings");
+    expect(c.ips()[8].base == 0x3000100000ULL && c.ips()[8].ring == "ddr" &&
+           c.ips()[8].ring_slots == 64, "gem5 settings");
+
+    expect(parses("ram id=0 base=0x100000000 size=64K\nram id=1 base=0x100010000 size=64K\n"),
+           "adjacent ranges");
+    expect(parses(""), "empty configuration");
+}
+
+static void test_malformed()
+{
+    refused("rom id=0 base=0x1000 size=4K\n", "unknown type");
+    refused("ram base=0x100000000 size=64K\n", "missing id");
+    refused("ram id=0 base=0x100000000 size=64K colour=red\n", "unknown key");
+    refused("ram id=0 base=0x100000000 size=64K latency\n", "key without a value");
+    refused("ram id=0 base=0x100000000 size=64Q\n", "bad suffix");
+    refused("ram id=0 base=0x10000000g size=64K\n", "trailing characters");
+    refused("ram id=0 base=-0x100000000 size=64K\n", "negative number");
+    refused("ram id=0 base=0x100000000 size=64K latency=0x100000000000000000\n",
+            "number out of range");
+    refused("ram id=0 base=0x100000000 size=64K latency=0x100000000000T\n",
+            "suffix overflows");
+    refused("ram id=0 base=0x100000000\n", "RAM without a size");
+    refused("ram id=0 base=0x100000800 size=64K\n", "RAM not page aligned");
+    refused("ram id=0 base=0x100000000 size=64K count=0\n", "count of 0");
+    refused("ram id=0 base=0x100000000 size=64K count=2 stride=32K\n", "stride below size");
+    refused("ram id=0 base=0xfffffffffff00000 size=2M\n", "range wrapping the address space");
+    refused("ram id=0 base=0x100000000 size=64K count=3 stride=0x8000000000000000\n",
+            "RAM range wrapping the address space");
+    refused("sim_ctrl id=0 base=0x10000000 latency=10\n", "key of another type");
+    refused("bridge id=0 irq=16\n", "IRQ range without a count");
+    refused("bridge id=0 irq=0+1024 tx_req=../x\n", "FIFO name with a slash");
+    refused("bridge id=0 irq=0xffffffffffffff00+0x200\n", "IRQ range wrapping");
+    refused("gem5 id=0 base=0x3000000000 size=1M slots=48\n", "ring size not a power of two");
+    refused("gem5 id=0 base=0x3000000000 size=1M standin=2\n", "bad stand-in flag");
+    refused("gem5 id=0 base=0x3000000000 size=1M ring=\n", "empty ring name");
+
+    // An error on one line does not stop the others from being checked
+    soc_config c;
+    expect(!c.parse("ram id=0 base=0x100000000 size=64K\nbad line\n"
+                    "ram id=1 base=0x100010000 size=64K\n", "test"), "bad line among good ones");
+    expect(c.ips().size() == 2, "good lines kept for the error report");
+}
+
+static void test_duplicate()
+{
+    refused("ram id=0 base=0x100000000 size=64K\nram id=0 base=0x200000000 size=64K\n",
+            "duplicate id");
+    refused("ram id=0 base=0x100000000 size=64K count=4 stride=64K\n"
+            "sim_ctrl id=2 base=0x10000000\n", "id within an expanded range");
+    refused("bridge id=0 irq=0+16\nbridge id=1 irq=16+16\n", "two bridges");
+    refused("guest_ram id=0 base=0x1000000000 size=1G\nguest_ram id=1 base=0x2000000000 size=1G\n",
+            "two guest_rams");
+    refused("gem5 id=0 base=0x3000000000 size=1M slots=64\n"
+            "gem5 id=1 base=0x3000100000 size=1M slots=128\n", "ring sizes disagree");
+    expect(parses("gem5 id=0 base=0x3000000000 size=1M slots=64\n"
+                  "gem5 id=1 base=0x3000100000 size=1M slots=128 ring=other\n"),
+           "different rings, different sizes");
+}
+
+static void test_overlap()
+{
+    refused("ram id=0 base=0x100000000 size=64K\nram id=1 base=0x10000f000 size=64K\n",
+            "overlapping RAMs");
+    refused("ram id=0 base=0x100000000 size=1G\nram id=1 base=0x100010000 size=64K\n",
+            "RAM inside another");
+    // The last range only overlaps the first, which reaches past the second
+    refused("ram id=0 base=0x100000000 size=1G\nram id=1 base=0x110000000 size=64K\n"
+            "sim_ctrl id=2 base=0x120000000\n", "range past a shorter one");
+    refused("ram id=0 base=0x100000000 size=64K count=2 stride=64K\n"
+            "sim_ctrl id=2 base=0x100018000\n", "sim_ctrl inside an expanded range");
+    refused("bridge id=0 irq=0+1024\nram id=1 base=0x100000000 size=64K irq=1000+8\n",
+            "overlapping IRQ ranges");
+    expect(parses("bridge id=0 irq=0+1024\nram id=1 base=0x100000000 size=64K irq=1024+8\n"),
+           "adjacent IRQ ranges");
+}
+
+static void test_cache()
+{
+    const std::string mem = "ram id=0 base=0x100000000 size=1M\n";
+    expect(parses(mem + "cache id=1 base=0x2000000000 size=64K backing=0x100000000\n"),
+           "default cache");
+    refused(mem + "cache id=1 base=0x2000000000 size=64K backing=0x1000f8000\n",
+            "backing past the memory");
+    refused(mem + "cache id=1 base=0x2000000000 size=64K backing=0x2000000000\n",
+            "cache backed by itself");
+    refused(mem + "cache id=1 base=0x2000000000 backing=0x100000000\n", "cache without a size");
+    refused(mem + "cache id=1 base=0x2000000000 size=64K backing=0x100000000 ways=3\n",
+            "PLRU with 3 ways");
+    expect(parses(mem + "cache id=1 base=0x2000000000 size=64K backing=0x100000000 ways=3 "
+                  "policy=srrip\n"), "SRRIP with 3 ways");
+    refused(mem + "cache id=1 base=0x2000000000 size=64K backing=0x100000000 sets=48\n",
+            "sets not a power of two");
+    refused(mem + "cache id=1 base=0x2000000000 size=64K backing=0x100000000 line=4\n",
+            "line too short");
+    refused(mem + "cache id=1 base=0x2000000000 size=64K backing=0x100000000 policy=lru\n",
+            "unknown policy");
+    refused(mem + "cache id=1 base=0x2000000000 size=64K backing=0x100000000 mode=wt\n",
+            "unknown mode");
+    refused("guest_ram id=0 base=0x1000000000000 size=0x1000000000000\n"
+            "cache id=1 base=0x2000000000000 size=0x1000000000000 backing=0x1000000000000 "
+            "sets=1 line=8\n", "tags wider than 32 bits");
+}
+
+static void test_reparse()
+{
+    soc_config c;
+    expect(c.parse("ram id=0 base=0x100000000 size=64K\n", "first"), "first configuration");
+    expect(!c.parse("ram id=0 base=0x100000000\n", "second"), "second configuration refused");
+    expect(c.ips().size() == 1 && c.ips()[0].size == 0, "previous IPs dropped");
+
+    expect(!c.load("/nonexistent/soc.cfg"), "missing file");
+    char path[] = "/tmp/test_soc_config_XXXXXX";
+    int fd = mkstemp(path);
+    const char text[] = "sim_ctrl id=4 base=0x10000000\n";
+    if (fd < 0 || write(fd, text, sizeof(text) - 1) != (ssize_t)(sizeof(text) - 1)) {
+        fail("config file");
+    } else {
+        expect(c.load(path) && c.ips().size() == 1 && c.ips()[0].id == 4, "load from a file");
+    }
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+}
+
+int main()
+{
+    test_begin("test_soc_config");
+    test_default();
+    test_valid();
+    test_malformed();
+    test_duplicate();
+    test_overlap();
+    test_cache();
+    test_reparse();
+    return test_finish();
+}
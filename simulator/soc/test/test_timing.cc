@@ -0,0 +1,79 @@
+// Test of the approximate slave timing.
+//
+// Completion times must follow the configured bandwidth exactly, also for bandwidths
+// that are not a whole number of picoseconds per byte and above 1 TB/s, and a stream of
+// small accesses must add up to the bandwidth rather than to a rounded time per access.
+// The token bucket must absorb its burst after idle and queue what comes after it, and
+// master_read_at must return the issue time plus latency and transfer time.
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <unistd.h>
+
+#include "bus.hh"
+#include "bus_timing.hh"
+#include "ram.hh"
+#include "test_util.hh"
+
+static const uint64_t RAM_BASE = 0x100000000ULL;
+
+static void test_bandwidth()
+{
+    // 1 MiB at 2400 MB/s takes 436906.67 ns, a per-byte time of 416 ps would give 436208
+    ip_timing slow(0, 2400, 0);
+    expect(slow.account(slow.origin_ns, 1 << 20) - slow.origin_ns == 436907, "2400 MB/s");
+
+    // Above 1e6 MB/s a per-byte time in ps would be 0
+    ip_timing fast(0, 2000000, 0);
+    expect(fast.account(fast.origin_ns, 1 << 20) - fast.origin_ns == 525, "2 TB/s");
+
+    // 1000 accesses of 8 bytes take 3333.33 ns, not 1000 times a rounded 4 ns
+    ip_timing small(0, 2400, 0);
+    uint64_t done = 0;
+    for (int i = 0; i < 1000; i++) {
+        done = small.account(small.origin_ns, 8);
+    }
+    expect(done - small.origin_ns == 3334, "small accesses add up to the bandwidth");
+
+    ip_timing unlimited(30, 0, 0);
+    expect(unlimited.account(unlimited.origin_ns + 10, 1 << 20) == unlimited.origin_ns + 40,
+           "unlimited bandwidth");
+}
+
+static void test_burst()
+{
+    // 1000 MB/s is one byte per ns
+    ip_timing t(100, 1000, 4096);
+    uint64_t issue = t.origin_ns + 1000;
+    expect(t.account(issue, 4096) == issue + 4096 + 100, "first access after idle");
+    expect(t.account(issue, 4096) == issue + 4096 + 100, "burst absorbed");
+    expect(t.account(issue, 4096) == issue + 2 * 4096 + 100, "queued past the burst");
+    expect(t.queue_delay.max() == 4096, "queueing delay recorded");
+}
+
+static void test_bus(base_bus &bus)
+{
+    ram r(&bus, 1, RAM_BASE, 0x10000, 0, 0);
+    bus.set_ip_timing(&r, 50, 1000);
+    uint64_t issue = ip_timing::now_ns() + 1000000, buf[8] = {};
+    expect(bus.master_read_at(issue, RAM_BASE, sizeof(buf), buf) == issue + 64 + 50,
+           "read latency");
+    expect(bus.master_write_at(issue + 1000, RAM_BASE, 8, buf) == issue + 1000 + 8 + 50,
+           "write latency");
+}
+
+int main()
+{
+    test_begin("test_timing");
+
+    test_bandwidth();
+    test_burst();
+
+    std::string shm = "/test_timing_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    test_bus(bus);
+
+    return test_finish();
+}
@@ -0,0 +1,86 @@
+// Test of starting and stopping timeline tracing.
+//
+// Stopping hands the events of every thread to the writer and the trace file must hold
+// them once flushed. Stopping while tracing is off must not touch the file, and a new
+// session must not carry events recorded before it started.
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+#include "trace.hh"
+#include "test_util.hh"
+
+static std::string read_file(const std::string &path)
+{
+    std::string s;
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f) {
+        return s;
+    }
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        s.append(buf, n);
+    }
+    fclose(f);
+    return s;
+}
+
+static int count(const std::string &s, const std::string &what)
+{
+    int n = 0;
+    for (size_t pos = s.find(what); pos != std::string::npos; pos = s.find(what, pos + 1)) {
+        n++;
+    }
+    return n;
+}
+
+int main()
+{
+    test_begin("test_trace");
+
+    std::string path = "/tmp/test_trace_" + std::to_string(getpid()) + ".json";
+    unlink(path.c_str());
+    trace::set_path(path.c_str());
+
+    expect(trace::stop() == 0, "stop without start");
+    trace::flush();
+    expect(access(path.c_str(), F_OK) != 0, "stop without start leaves the file alone");
+
+    trace::start();
+    for (int i = 0; i < 3; i++) {
+        trace::instant("main_event", "test", i);
+    }
+    std::thread other([] {
+        trace::instant("other_event", "test", 0);
+        trace::span("other_span", "test", 100, 200, 0);
+    });
+    other.join();
+    expect(trace::stop() == 5, "events of every thread collected");
+    trace::flush();
+    std::string first = read_file(path);
+    expect(count(first, "\"main_event\"") == 3 && count(first, "\"other_event\"") == 1 &&
+           count(first, "\"other_span\"") == 1 && first.find("]}") != std::string::npos,
+           "trace file written");
+
+    expect(trace::stop() == 0, "second stop");
+    trace::flush();
+    expect(read_file(path) == first, "second stop leaves the file alone");
+
+    // Spans are recorded by callers that checked enabled() earlier, possibly before stop
+    trace::span("stale_span", "test", 100, 200, 0);
+    trace::start();
+    trace::instant("new_event", "test", 0);
+    expect(trace::stop() == 1, "new session starts empty");
+    trace::flush();
+    std::string second = read_file(path);
+    expect(count(second, "\"new_event\"") == 1 && second.find("stale_span") == std::string::npos,
+           "events before the session dropped");
+
+    unlink(path.c_str());
+    return test_finish();
+}
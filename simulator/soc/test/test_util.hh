@@ -0,0 +1,67 @@
+#ifndef TEST_UTIL_HH
+#define TEST_UTIL_HH
+
+// Helpers shared by the unit tests: failure accounting with messages prefixed by the test
+// name, and a seeded xorshift generator so runs are reproducible.
+//
+//   int main()
+//   {
+//       test_begin("test_foo");
+//       expect(foo() == 1, "foo returns 1");
+//       return test_finish();
+//   }
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdarg>
+#include <atomic>
+
+#include "debugger.hh"
+
+inline const char *test_name = "test";
+inline std::atomic<int> test_failures{0};
+
+// Name the test and silence the simulator log.
+inline void test_begin(const char *name)
+{
+    test_name = name;
+    debugger::set_level(debugger::OFF);
+}
+
+// Record a failure, printing the printf style message. Safe from any thread.
+__attribute__((format(printf, 1, 2)))
+inline void fail(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    printf("%s: ", test_name);
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+    test_failures++;
+}
+
+inline void expect(bool cond, const char *what)
+{
+    if (!cond) {
+        fail("%s", what);
+    }
+}
+
+// Print the verdict, returns the exit status of the test.
+inline int test_finish()
+{
+    printf("%s: %s\n", test_name, test_failures ? "FAIL" : "PASS");
+    return test_failures ? 1 : 0;
+}
+
+// xorshift64, @state must not be 0.
+inline uint64_t next_random(uint64_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+#endif // TEST_UTIL_HH
@@ -0,0 +1,225 @@
+// Test of the DMA result verification service.
+//
+// The accelerated CRC32C must match the standard check value and the table driven
+// version for every length and alignment, also when chained. Diffs and CRC checks of
+// buffers with injected corruption are compared with a byte by byte reference, and the
+// descriptor path is run through the bus the way EX_CTRL_VERIFY does, including
+// descriptors at odd addresses, more ranges than room for them and bad requests, among
+// them sizes, addresses and granules chosen to overflow the range checks.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bus.hh"
+#include "ram.hh"
+#include "verify.hh"
+#include "test_util.hh"
+
+static const uint64_t RAM_BASE = 0x100000000ULL;
+static const uint64_t RAM_SIZE = 0x400000;
+
+static uint64_t rng = 0x2545f4914f6cdd1dULL;
+
+// Byte by byte version of mem_verify::diff.
+static std::vector<verify_range> reference_diff(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    std::vector<verify_range> out;
+    for (uint64_t i = 0; i < n; i++) {
+        if (a[i] == b[i]) {
+            continue;
+        }
+        if (!out.empty() && i - (out.back().offset + out.back().length) < VERIFY_MERGE_GAP) {
+            out.back().length = i + 1 - out.back().offset;
+        } else {
+            out.push_back(verify_range{i, 1});
+        }
+    }
+    return out;
+}
+
+// Flip bytes of @buf: a few isolated ones, a run and, now and then, a whole stretch.
+static void corrupt(uint8_t *buf, size_t n)
+{
+    int events = next_random(rng) % 6;
+    for (int e = 0; e < events; e++) {
+        uint64_t at = next_random(rng) % n;
+        uint64_t len = next_random(rng) % 4 == 0 ? next_random(rng) % 5000 : 1 + next_random(rng) % 16;
+        for (uint64_t i = at; i < std::min<uint64_t>(n, at + len); i++) {
+            buf[i] ^= 1 + next_random(rng) % 255;
+        }
+    }
+}
+
+static void test_crc()
+{
+    expect(mem_verify::crc32c(0, "123456789", 9) == 0xe3069283, "CRC32C check value");
+    expect(mem_verify::crc32c_portable(0, "123456789", 9) == 0xe3069283,
+           "portable CRC32C check value");
+
+    std::vector<uint8_t> buf(70000);
+    for (auto &b : buf) {
+        b = next_random(rng);
+    }
+    for (int i = 0; i < 2000; i++) {
+        size_t off = next_random(rng) % 64;
+        size_t len = i < 1000 ? i : next_random(rng) % (buf.size() - off);
+        size_t split = len ? next_random(rng) % len : 0;
+        uint32_t ref = mem_verify::crc32c_portable(0, &buf[off], len);
+        uint32_t crc = mem_verify::crc32c(0, &buf[off], len);
+        uint32_t chained = mem_verify::crc32c(mem_verify::crc32c(0, &buf[off], split),
+                                              &buf[off + split], len - split);
+        if (crc != ref || chained != ref) {
+            fail("CRC32C of %zu bytes at +%zu: %08x, chained %08x, expected %08x", len, off,
+                 crc, chained, ref);
+            return;
+        }
+    }
+}
+
+static void test_diff()
+{
+    const size_t n = 300000;
+    std::vector<uint8_t> golden(n), data(n);
+    std::vector<verify_range> ranges(16);
+    for (int round = 0; round < 200; round++) {
+        for (size_t i = 0; i < n; i++) {
+            golden[i] = next_random(rng);
+        }
+        data = golden;
+        corrupt(data.data(), n);
+        size_t len = n - next_random(rng) % 100;
+
+        std::vector<verify_range> ref = reference_diff(data.data(), golden.data(), len);
+        uint64_t count = mem_verify::diff(data.data(), golden.data(), len, ranges.data(),
+                                          ranges.size());
+        bool same = count == ref.size();
+        for (size_t i = 0; same && i < std::min(ranges.size(), ref.size()); i++) {
+            same = ranges[i].offset == ref[i].offset && ranges[i].length == ref[i].length;
+        }
+        if (!same) {
+            fail("diff round %d: %lu ranges, expected %zu", round, (unsigned long)count,
+                 ref.size());
+            return;
+        }
+    }
+}
+
+static void test_check()
+{
+    const size_t n = 1 << 20;
+    const uint64_t granule = 4096;
+    std::vector<uint8_t> data(n);
+    std::vector<uint32_t> crcs;
+    for (auto &b : data) {
+        b = next_random(rng);
+    }
+    for (size_t off = 0; off < n - 100; off += granule) {
+        crcs.push_back(mem_verify::crc32c(0, &data[off], std::min<size_t>(granule, n - 100 - off)));
+    }
+
+    verify_range r[4];
+    expect(mem_verify::check(data.data(), n - 100, granule, crcs.data(), r, 4) == 0,
+           "CRC check of intact data");
+    data[5 * granule + 7] ^= 1;
+    data[6 * granule] ^= 1;
+    data[n - 101] ^= 1; // In the short last granule
+    expect(mem_verify::check(data.data(), n - 100, granule, crcs.data(), r, 4) == 2 &&
+           r[0].offset == 5 * granule && r[0].length == 2 * granule &&
+           r[1].offset == (crcs.size() - 1) * granule && r[1].length == n - 100 - r[1].offset,
+           "CRC check ranges");
+}
+
+// The descriptor path, as run for EX_CTRL_VERIFY.
+static void test_run()
+{
+    std::string shm = "/test_verify_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    ram *r = new ram(&bus, 0, RAM_BASE, RAM_SIZE, 0, 0);
+    uint8_t *mem = (uint8_t *)bus.master_get_shm_ptr(RAM_BASE);
+
+    const uint64_t buf = 0x100000, golden = 0x200000, desc_off = 0x3;
+    const uint64_t size = 0x80000;
+    for (uint64_t i = 0; i < size; i++) {
+        mem[golden + i] = mem[buf + i] = next_random(rng);
+    }
+    for (int k = 0; k < 5; k++) {
+        mem[buf + 0x1000 + k * 0x10000] ^= 0x5a;
+    }
+
+    auto run = [&](uint32_t op, uint64_t addr, uint64_t len, uint64_t ref, uint64_t granule,
+                   uint32_t max_ranges, uint64_t &result) {
+        verify_desc d = { op, max_ranges, addr, len, ref, granule, ~0ULL };
+        memcpy(mem + desc_off, &d, sizeof(d));
+        return mem_verify::run(&bus, RAM_BASE + desc_off, result);
+    };
+    auto range_at = [&](int i) {
+        verify_range v;
+        memcpy(&v, mem + desc_off + sizeof(verify_desc) + i * sizeof(v), sizeof(v));
+        return v;
+    };
+
+    uint64_t result, stored;
+    expect(run(VERIFY_OP_CRC32C, RAM_BASE + golden, size, 0, 0, 0, result) == ACCESS_OK &&
+           result == mem_verify::crc32c(0, mem + golden, size), "CRC32C descriptor");
+    memcpy(&stored, mem + desc_off + offsetof(verify_desc, result), sizeof(stored));
+    expect(stored == result, "result stored in the descriptor");
+
+    expect(run(VERIFY_OP_DIFF, RAM_BASE + buf, size, RAM_BASE + golden, 0, 3, result) ==
+           ACCESS_OK && result == 5, "diff descriptor count");
+    expect(range_at(0).offset == 0x1000 && range_at(0).length == 1 &&
+           range_at(2).offset == 0x21000, "diff descriptor ranges");
+    expect(range_at(3).offset == 0 && range_at(3).length == 0, "no range past max_ranges");
+
+    std::vector<uint32_t> crcs;
+    for (uint64_t off = 0; off < size; off += 0x10000) {
+        crcs.push_back(mem_verify::crc32c(0, mem + golden + off, 0x10000));
+    }
+    memcpy(mem + 0x300000, crcs.data(), crcs.size() * sizeof(uint32_t));
+    expect(run(VERIFY_OP_CHECK, RAM_BASE + buf, size, RAM_BASE + 0x300000, 0x10000, 8,
+               result) == ACCESS_OK && result == 1 && range_at(0).offset == 0 &&
+           range_at(0).length == 5 * 0x10000, "CRC check descriptor");
+
+    expect(run(VERIFY_OP_DIFF, RAM_BASE + buf, RAM_SIZE, RAM_BASE + golden, 0, 0, result) ==
+           ACCESS_ADDR_ERROR, "range past the RAM");
+    expect(run(7, RAM_BASE + buf, size, 0, 0, 0, result) == ACCESS_DENIED, "bad operation");
+    expect(run(VERIFY_OP_CHECK, RAM_BASE + buf, size, RAM_BASE, 0, 0, result) == ACCESS_DENIED,
+           "CRC check without a granule");
+    expect(mem_verify::run(&bus, 0x10, result) == ACCESS_ADDR_ERROR, "descriptor not in RAM");
+
+    // Guest values chosen to wrap the range checks
+    expect(run(VERIFY_OP_CRC32C, RAM_BASE + 0x10, ~0ULL - 8, 0, 0, 0, result) ==
+           ACCESS_ADDR_ERROR, "size wrapping the address space");
+    expect(run(VERIFY_OP_CRC32C, ~0ULL - 4, 0x10, 0, 0, 0, result) == ACCESS_ADDR_ERROR,
+           "address wrapping the address space");
+    expect(run(VERIFY_OP_DIFF, RAM_BASE + buf, size, RAM_BASE + RAM_SIZE - 0x10, 0, 0, result) ==
+           ACCESS_ADDR_ERROR, "golden image past the RAM");
+    expect(run(VERIFY_OP_CHECK, RAM_BASE + buf, size, RAM_BASE, ~0ULL, 0, result) ==
+           ACCESS_DENIED, "granule wrapping the CRC count");
+    expect(run(VERIFY_OP_CHECK, RAM_BASE + buf, size, RAM_BASE, size + 1, 0, result) ==
+           ACCESS_DENIED, "granule larger than the range");
+    expect(run(VERIFY_OP_CHECK, RAM_BASE + buf, size, RAM_BASE + RAM_SIZE - 8, 0x10000, 0,
+               result) == ACCESS_ADDR_ERROR, "CRC array past the RAM");
+    expect(run(VERIFY_OP_CHECK, RAM_BASE + buf, size, ~0ULL - 4, 0x10000, 0, result) ==
+           ACCESS_ADDR_ERROR, "CRC array wrapping the address space");
+    expect(run(VERIFY_OP_CRC32C, RAM_BASE + buf, size, 0, 0, ~0u, result) == ACCESS_ADDR_ERROR,
+           "result ranges past the RAM");
+
+    delete r;
+}
+
+int main()
+{
+    test_begin("test_verify");
+
+    test_crc();
+    test_diff();
+    test_check();
+    test_run();
+
+    return test_finish();
+}
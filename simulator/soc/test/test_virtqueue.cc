@@ -0,0 +1,409 @@
+// Test of virtqueue_ip with a driver in the test thread.
+//
+// The driver posts batches of chains with random numbers of readable and writable
+// buffers, some through indirect tables, on a split and a packed queue in SoC RAM. The
+// device copies the readable bytes of every chain into its writable buffers, inverted
+// with a pattern. After enough batches for the descriptors, the avail and used rings and
+// the packed wrap counters to wrap several times, every used element must name its
+// chain with the right length and every writable buffer hold the expected bytes. Chains
+// longer than VQ_MAX_CHAIN, looping chains and oversized indirect tables must complete
+// with a used length of 0, count as errors and not disturb the chains around them.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "bus.hh"
+#include "ram.hh"
+#include "virtqueue.hh"
+#include "test_util.hh"
+
+static const uint64_t RAM_BASE = 0x100000000ULL;
+static const uint64_t RAM_SIZE = 0x400000;
+static const uint64_t VQ_BASE = 0x20000000;
+static const uint16_t QSIZE = 128;
+static const uint8_t PATTERN = 0x5a;
+
+// Layout of each queue in RAM, queue q at RAM_BASE + q * QUEUE_AREA
+static const uint64_t QUEUE_AREA = 0x200000;
+static const uint64_t DESC_OFF = 0x0;
+static const uint64_t DRIVER_OFF = 0x1000;
+static const uint64_t DEVICE_OFF = 0x2000;
+static const uint64_t TABLE_OFF = 0x10000;  // Indirect tables, 0x800 each
+static const uint64_t BUF_OFF = 0x80000;    // Buffers, 0x100 each
+
+static uint64_t rng = 0x2545f4914f6cdd1dULL;
+
+struct desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t a, b; // Split: flags, next; packed: id, flags
+};
+
+// Copies the readable bytes of a chain to its writable buffers, XORed with PATTERN.
+class echo_vq : public virtqueue_ip {
+public:
+    using virtqueue_ip::virtqueue_ip;
+
+    uint32_t process_chain(unsigned queue, const vq_chain &chain) override
+    {
+        (void)queue;
+        uint8_t buf[VQ_MAX_CHAIN * 0x100];
+        uint64_t n = chain_read(chain, 0, buf, sizeof(buf));
+        for (uint64_t i = 0; i < n; i++) {
+            buf[i] ^= PATTERN;
+        }
+        return chain_write(chain, 0, buf, n);
+    }
+};
+
+// Receives the used buffer IRQs in place of the bridge.
+class irq_sink : public base_ip {
+public:
+    irq_sink(base_bus *bus, uint64_t id)
+        : base_ip(bus, id, IP_TYPE_PERIPHERAL, 0, 0, 0, VQ_MAX_QUEUES)
+        {
+        }
+
+    void reset() override {}
+    void mem_slave_read(uint64_t, uint64_t, void *) override {}
+    void mem_slave_write(uint64_t, uint64_t, void *) override {}
+    void handle_irq(uint64_t) override { irqs++; }
+
+    std::atomic<uint64_t> irqs{0};
+};
+
+// A chain as posted by the driver and what the device must make of it.
+struct posted {
+    std::vector<desc> bufs;  // addr, len and VQ_DESC_F_WRITE in a
+    bool indirect = false;
+    bool loop = false;       // Split only: one descriptor chained to itself
+    bool bad = false;        // Expected to be rejected
+    uint16_t id = 0;         // Split: head descriptor, packed: buffer ID
+    uint16_t slots = 0;      // Descriptors taken in the ring
+    uint32_t readable = 0;
+    std::vector<uint8_t> data; // Readable bytes
+};
+
+class driver {
+public:
+    driver(base_bus &bus, uint8_t *ram, unsigned index, bool packed)
+        : bus(bus), index(index), packed(packed)
+    {
+        base = RAM_BASE + index * QUEUE_AREA;
+        host = ram + index * QUEUE_AREA;
+        memset(host, 0, QUEUE_AREA);
+        reg(VQ_REG_QUEUE_SEL, index);
+        reg(VQ_REG_QUEUE_SIZE, QSIZE);
+        reg(VQ_REG_QUEUE_DESC, base + DESC_OFF);
+        reg(VQ_REG_QUEUE_DRIVER, base + DRIVER_OFF);
+        reg(VQ_REG_QUEUE_DEVICE, base + DEVICE_OFF);
+        reg(VQ_REG_QUEUE_FLAGS, packed ? VQ_F_PACKED | VQ_F_EVENT_IDX : 0);
+        reg(VQ_REG_QUEUE_ENABLE, 1);
+    }
+
+    void reg(uint64_t offset, uint64_t val)
+    {
+        bus.master_write(VQ_BASE + offset, 8, &val);
+    }
+
+    uint64_t read_reg(uint64_t offset)
+    {
+        uint64_t val = 0;
+        reg(VQ_REG_QUEUE_SEL, index);
+        bus.master_read(VQ_BASE + offset, 8, &val);
+        return val;
+    }
+
+    // A chain of @nr_bufs buffers of random sizes, at least one readable and one writable,
+    // with at least one writable buffer of 0x100 bytes for two readable ones of at most
+    // 0x80 bytes.
+    posted make_chain(unsigned slot, unsigned nr_bufs, bool indirect)
+    {
+        posted p;
+        p.indirect = indirect;
+        unsigned nr_read = 1 + next_random(rng) % std::max(1u, nr_bufs * 2 / 3);
+        for (unsigned i = 0; i < nr_bufs; i++) {
+            bool write = i >= nr_read;
+            uint32_t len = write ? 0x100 : 1 + next_random(rng) % 0x80;
+            uint64_t addr = base + BUF_OFF + (slot * VQ_MAX_CHAIN * 2 + i) * 0x100;
+            p.bufs.push_back(desc{ addr, len, (uint16_t)(write ? VQ_DESC_F_WRITE : 0), 0 });
+            if (!write) {
+                for (uint32_t k = 0; k < len; k++) {
+                    p.data.push_back(next_random(rng));
+                }
+                memcpy(at(addr), &p.data[p.readable], len);
+                p.readable += len;
+            } else {
+                memset(at(addr), 0, len);
+            }
+        }
+        return p;
+    }
+
+    // Put @p on the ring, the head descriptor last.
+    void post(posted &p, unsigned slot)
+    {
+        uint64_t table = base + TABLE_OFF + slot * 0x800;
+        std::vector<desc> ring_descs;
+        if (p.indirect) {
+            desc *t = (desc *)at(table);
+            for (size_t i = 0; i < p.bufs.size(); i++) {
+                t[i] = p.bufs[i];
+                if (!packed) {
+                    t[i].a |= i + 1 < p.bufs.size() ? VQ_DESC_F_NEXT : 0;
+                    t[i].b = i + 1;
+                } else {
+                    t[i].b = t[i].a;
+                    t[i].a = 0;
+                }
+            }
+            ring_descs.push_back(desc{ table, (uint32_t)(p.bufs.size() * sizeof(desc)),
+                                       VQ_DESC_F_INDIRECT, 0 });
+        } else {
+            ring_descs = p.bufs;
+        }
+        p.slots = ring_descs.size();
+        desc *ring = (desc *)(host + DESC_OFF);
+
+        if (!packed) {
+            uint16_t first = next_desc;
+            for (size_t i = 0; i < ring_descs.size(); i++) {
+                uint16_t d = (first + i) % QSIZE;
+                ring[d] = ring_descs[i];
+                if (i + 1 < ring_descs.size()) {
+                    ring[d].a |= VQ_DESC_F_NEXT;
+                    ring[d].b = (d + 1) % QSIZE;
+                }
+            }
+            if (p.loop) {
+                ring[first].a |= VQ_DESC_F_NEXT;
+                ring[first].b = first;
+            }
+            next_desc = (first + ring_descs.size()) % QSIZE;
+            p.id = first;
+            uint16_t *avail = (uint16_t *)(host + DRIVER_OFF);
+            avail[2 + avail_idx % QSIZE] = first;
+            avail_idx++;
+            return;
+        }
+
+        uint16_t head_flags = 0;
+        uint16_t head = avail_idx;
+        for (size_t i = 0; i < ring_descs.size(); i++) {
+            desc d = ring_descs[i];
+            uint16_t flags = d.a | (i + 1 < ring_descs.size() ? VQ_DESC_F_NEXT : 0) |
+                             (avail_wrap ? VQ_DESC_F_AVAIL : VQ_DESC_F_USED);
+            ring[avail_idx] = desc{ d.addr, d.len, p.id, i ? flags : (uint16_t)0 };
+            if (!i) {
+                head_flags = flags;
+            }
+            if (++avail_idx == QSIZE) {
+                avail_idx = 0;
+                avail_wrap = !avail_wrap;
+            }
+        }
+        __atomic_store_n(&ring[head].b, head_flags, __ATOMIC_RELEASE);
+    }
+
+    // Publish the posted chains and ring the doorbell.
+    void kick()
+    {
+        if (!packed) {
+            __atomic_store_n((uint16_t *)(host + DRIVER_OFF + 2), avail_idx, __ATOMIC_RELEASE);
+        }
+        reg(VQ_REG_NOTIFY, index);
+    }
+
+    // Wait for @n used elements, returns their (id, len).
+    std::vector<std::pair<uint16_t, uint32_t> > reap(size_t n, const std::vector<posted> &chains)
+    {
+        std::vector<std::pair<uint16_t, uint32_t> > used;
+        desc *ring = (desc *)(host + DESC_OFF);
+        for (int spin = 0; used.size() < n && spin < 5000; ) {
+            if (!packed) {
+                uint16_t idx = __atomic_load_n((uint16_t *)(host + DEVICE_OFF + 2), __ATOMIC_ACQUIRE);
+                if (idx == last_used) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    spin++;
+                    continue;
+                }
+                uint32_t *elem = (uint32_t *)(host + DEVICE_OFF + 4 + 8 * (last_used % QSIZE));
+                used.push_back({ (uint16_t)elem[0], elem[1] });
+                last_used++;
+                continue;
+            }
+            uint16_t flags = __atomic_load_n(&ring[last_used].b, __ATOMIC_ACQUIRE);
+            if ((bool)(flags & VQ_DESC_F_AVAIL) != used_wrap ||
+                (bool)(flags & VQ_DESC_F_USED) != used_wrap) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                spin++;
+                continue;
+            }
+            uint16_t id = ring[last_used].a;
+            used.push_back({ id, ring[last_used].len });
+            uint16_t slots = 1;
+            for (const posted &p : chains) {
+                if (p.id == id) {
+                    slots = p.slots;
+                }
+            }
+            last_used += slots;
+            if (last_used >= QSIZE) {
+                last_used -= QSIZE;
+                used_wrap = !used_wrap;
+            }
+        }
+        return used;
+    }
+
+    // Check the used elements and writable buffers of @chains.
+    bool check(const std::vector<posted> &chains)
+    {
+        auto used = reap(chains.size(), chains);
+        if (used.size() != chains.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < chains.size(); i++) {
+            const posted &p = chains[i];
+            if (used[i].first != p.id || used[i].second != (p.bad ? 0 : p.readable)) {
+                return false;
+            }
+            if (p.bad) {
+                continue;
+            }
+            uint32_t done = 0;
+            for (const desc &d : p.bufs) {
+                if (!(d.a & VQ_DESC_F_WRITE)) {
+                    continue;
+                }
+                const uint8_t *b = at(d.addr);
+                for (uint32_t k = 0; k < d.len; k++, done++) {
+                    uint8_t want = done < p.readable ? p.data[done] ^ PATTERN : 0;
+                    if (b[k] != want) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    uint8_t *at(uint64_t addr)
+    {
+        return host + (addr - base);
+    }
+
+    base_bus &bus;
+    unsigned index;
+    bool packed;
+    uint64_t base;
+    uint8_t *host;
+    uint16_t next_desc = 0;    // Split: next free descriptor, used round robin
+    uint16_t avail_idx = 0;    // Split: free running index, packed: slot
+    uint16_t last_used = 0;
+    bool avail_wrap = true;
+    bool used_wrap = true;
+};
+
+// Batches of good chains wrapping the rings several times.
+static void test_chains(driver &drv, const char *name)
+{
+    bool good = true;
+    uint64_t chains = 0;
+    for (int batch = 0; batch < 40 && good; batch++) {
+        std::vector<posted> posted_chains;
+        for (unsigned slot = 0; slot < 8; slot++) {
+            bool indirect = next_random(rng) % 3 == 0;
+            unsigned nr_bufs = 2 + next_random(rng) % (indirect ? 20 : 6);
+            posted p = drv.make_chain(slot, nr_bufs, indirect);
+            p.id = slot;
+            drv.post(p, slot);
+            posted_chains.push_back(p);
+        }
+        drv.kick();
+        good = drv.check(posted_chains);
+        chains += posted_chains.size();
+    }
+    char what[64];
+    snprintf(what, sizeof(what), "%s chains and data", name);
+    expect(good, what);
+    snprintf(what, sizeof(what), "%s chains counted", name);
+    expect(drv.read_reg(VQ_REG_QUEUE_CHAINS) == chains, what);
+}
+
+// Chains the device must reject, each posted with a good chain after it. The pairs go out
+// one at a time, as a chain of VQ_MAX_CHAIN buffers takes half the ring.
+static void test_errors(driver &drv, const char *name)
+{
+    bool good = true;
+    auto add = [&](posted p) {
+        std::vector<posted> chains;
+        p.id = 0;
+        drv.post(p, 0);
+        chains.push_back(p);
+        posted ok = drv.make_chain(1, 3, false);
+        ok.id = 1;
+        drv.post(ok, 1);
+        chains.push_back(ok);
+        drv.kick();
+        good &= drv.check(chains);
+    };
+
+    add(drv.make_chain(0, VQ_MAX_CHAIN, false)); // Exactly VQ_MAX_CHAIN buffers is fine
+    add(drv.make_chain(0, VQ_MAX_CHAIN, true));
+    posted too_long = drv.make_chain(0, VQ_MAX_CHAIN + 1, false);
+    too_long.bad = true;
+    add(too_long);
+    posted big_table = drv.make_chain(0, VQ_MAX_CHAIN + 1, true);
+    big_table.bad = true;
+    add(big_table);
+    unsigned expected = 2;
+    if (!drv.packed) {
+        posted loop = drv.make_chain(0, 2, false);
+        loop.bufs.pop_back();
+        loop.loop = true;
+        loop.bad = true;
+        add(loop);
+        expected++;
+    }
+
+    char what[64];
+    snprintf(what, sizeof(what), "%s rejected chains completed empty", name);
+    expect(good, what);
+    snprintf(what, sizeof(what), "%s errors counted", name);
+    expect(drv.read_reg(VQ_REG_QUEUE_ERRORS) == expected, what);
+}
+
+int main()
+{
+    test_begin("test_virtqueue");
+
+    std::string shm = "/test_virtqueue_" + std::to_string(getpid());
+    base_bus bus(0, shm.c_str());
+    ram *mem = new ram(&bus, 0, RAM_BASE, RAM_SIZE, 0, 0);
+    irq_sink *sink = new irq_sink(&bus, 1);
+    echo_vq *vq = new echo_vq(&bus, 2, VQ_BASE, 2, 1, 0);
+    uint8_t *host = (uint8_t *)bus.master_get_shm_ptr(RAM_BASE);
+
+    driver split(bus, host, 0, false);
+    driver packed(bus, host, 1, true);
+    test_chains(split, "split");
+    test_chains(packed, "packed");
+    test_errors(split, "split");
+    test_errors(packed, "packed");
+    expect(sink->irqs > 0, "used buffer notifications");
+
+    delete vq;
+    delete sink;
+    delete mem;
+    return test_finish();
+}
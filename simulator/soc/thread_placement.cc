@@ -0,0 +1,294 @@
+#include "thread_placement.hh"
+#include "debugger.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+// Highest NUMA node a placement may name, set_mempolicy takes a mask of this many bits
+#define MAX_NUMA_NODES 1024
+
+thread_placement &thread_placement::instance()
+{
+    static thread_placement inst;
+    return inst;
+}
+
+bool thread_placement::parse_int(const std::string &s, long min, long max, int &v)
+{
+    char *end;
+    if (s.empty()) {
+        return false;
+    }
+    errno = 0;
+    long n = strtol(s.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE || n < min || n > max) {
+        return false;
+    }
+    v = (int)n;
+    return true;
+}
+
+bool thread_placement::parse_cpu_list(const std::string &list, std::vector<int> &cpus)
+{
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t dash = item.find('-');
+        int first, last;
+        if (!parse_int(item.substr(0, dash), 0, CPU_SETSIZE - 1, first)) {
+            return false;
+        }
+        last = first;
+        if (dash != std::string::npos &&
+            (!parse_int(item.substr(dash + 1), first, CPU_SETSIZE - 1, last))) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return !cpus.empty();
+}
+
+bool thread_placement::node_cpus(int node, std::vector<int> &cpus)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    std::ifstream f(path);
+    std::string list;
+    if (!std::getline(f, list)) {
+        return false;
+    }
+    return parse_cpu_list(list, cpus);
+}
+
+bool thread_placement::qemu_vcpu_cpus(int pid, std::vector<int> &cpus)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return false;
+    }
+
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    std::vector<int> last_cpus;
+    bool all_unpinned = true;
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        int tid;
+        if (!parse_int(ent->d_name, 1, INT32_MAX, tid)) {
+            continue;
+        }
+
+        // QEMU names its vCPU threads "CPU <n>/KVM" or "CPU <n>/TCG"
+        char comm[32] = {0};
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/comm", pid, tid);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        bool is_vcpu = fgets(comm, sizeof(comm), f) && strncmp(comm, "CPU ", 4) == 0;
+        fclose(f);
+        if (!is_vcpu) {
+            continue;
+        }
+
+        cpu_set_t set;
+        if (sched_getaffinity(tid, sizeof(set), &set) == 0) {
+            if (CPU_COUNT(&set) < nr_cpus) {
+                all_unpinned = false;
+            }
+            CPU_OR(&pinned, &pinned, &set);
+        }
+
+        // Field 39 of stat is the CPU the thread last ran on
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", pid, tid);
+        std::ifstream stat(path);
+        std::string line;
+        if (std::getline(stat, line)) {
+            std::stringstream ss(line.substr(line.rfind(')') + 2));
+            std::string field;
+            for (int i = 3; i <= 39 && ss >> field; i++) {
+            }
+            int cpu;
+            if (parse_int(field, 0, CPU_SETSIZE - 1, cpu)) {
+                last_cpus.push_back(cpu);
+            }
+        }
+    }
+    closedir(dir);
+
+    if (!all_unpinned) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &pinned)) {
+                cpus.push_back(cpu);
+            }
+        }
+    } else {
+        // vCPUs float, follow the CPUs they currently run on
+        cpus = last_cpus;
+    }
+    return !cpus.empty();
+}
+
+bool thread_placement::load(const char *path)
+{
+    std::ifstream f(path);
+    if (!f) {
+        LOG_ERROR("Failed to open thread placement config %s", path);
+        return false;
+    }
+
+    thread_placement &inst = instance();
+    std::lock_guard<std::mutex> lock(inst.mtx);
+    std::string line;
+    int lineno = 0;
+    while (std::getline(f, line)) {
+        lineno++;
+        line = line.substr(0, line.find('#'));
+        std::stringstream ss(line);
+        std::string role, kv;
+        if (!(ss >> role)) {
+            continue;
+        }
+
+        placement &p = inst.roles[role];
+        while (ss >> kv) {
+            size_t eq = kv.find('=');
+            std::string key = kv.substr(0, eq);
+            std::string value = eq == std::string::npos ? "" : kv.substr(eq + 1);
+            bool ok = true;
+            if (key == "cpus") {
+                p.cpus.clear();
+                ok = parse_cpu_list(value, p.cpus);
+            } else if (key == "node") {
+                ok = parse_int(value, 0, MAX_NUMA_NODES - 1, p.node);
+            } else if (key == "fifo") {
+                ok = parse_int(value, 1, 99, p.fifo_prio);
+            } else if (key == "colocate") {
+                p.colocate_qemu = true;
+                ok = (value == "qemu");
+            } else if (key == "qemu_pid") {
+                ok = parse_int(value, 1, INT32_MAX, p.qemu_pid);
+            } else {
+                ok = false;
+            }
+            if (!ok) {
+                LOG_WARN("%s:%d: ignoring bad setting %s for %s", path, lineno, kv.c_str(), role.c_str());
+            }
+        }
+    }
+    LOG_INFO("Loaded thread placement config %s", path);
+    return true;
+}
+
+void thread_placement::load_from_env()
+{
+    const char *path = getenv("SOC_THREAD_CONFIG");
+    if (path) {
+        load(path);
+    }
+}
+
+void thread_placement::apply(const char *role, const char *name)
+{
+    char short_name[16];
+    snprintf(short_name, sizeof(short_name), "%s", name);
+    pthread_setname_np(pthread_self(), short_name);
+
+    thread_placement &inst = instance();
+    placement p;
+    {
+        std::lock_guard<std::mutex> lock(inst.mtx);
+        auto it = inst.roles.find(role);
+        if (it == inst.roles.end()) {
+            return;
+        }
+        p = it->second;
+    }
+
+    std::vector<int> cpus = p.cpus;
+    if (p.colocate_qemu) {
+        int pid = p.qemu_pid;
+        const char *env = getenv("SOC_QEMU_PID");
+        if (!pid && env && !parse_int(env, 1, INT32_MAX, pid)) {
+            LOG_WARN("Thread %s: ignoring bad SOC_QEMU_PID %s", name, env);
+        }
+        cpus.clear();
+        if (!pid || !qemu_vcpu_cpus(pid, cpus)) {
+            LOG_WARN("Thread %s: no QEMU vCPU threads found to colocate with", name);
+        }
+    }
+
+    if (p.node >= 0) {
+        std::vector<int> on_node;
+        if (!node_cpus(p.node, on_node)) {
+            LOG_WARN("Thread %s: NUMA node %d not found", name, p.node);
+        } else {
+            if (cpus.empty()) {
+                cpus = on_node;
+            } else {
+                std::vector<int> both;
+                for (int cpu : cpus) {
+                    if (std::find(on_node.begin(), on_node.end(), cpu) != on_node.end()) {
+                        both.push_back(cpu);
+                    }
+                }
+                if (both.empty()) {
+                    LOG_WARN("Thread %s: none of its CPUs are on NUMA node %d, keeping them "
+                             "and only preferring the node's memory", name, p.node);
+                } else {
+                    cpus = both;
+                }
+            }
+            const size_t bits = sizeof(unsigned long) * 8;
+            unsigned long nodemask[MAX_NUMA_NODES / (sizeof(unsigned long) * 8)] = {};
+            nodemask[p.node / bits] = 1UL << (p.node % bits);
+            // The kernel reads one bit less than the maxnode it is given
+            if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, MAX_NUMA_NODES + 1) < 0) {
+                LOG_WARN("Thread %s: failed to prefer memory of node %d: %s",
+                         name, p.node, strerror(errno));
+            }
+        }
+    }
+
+    if (!cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            CPU_SET(cpu, &set);
+        }
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (ret) {
+            LOG_WARN("Thread %s: failed to set CPU affinity: %s", name, strerror(ret));
+        }
+    }
+
+    if (p.fifo_prio > 0) {
+        struct sched_param param;
+        param.sched_priority = p.fifo_prio;
+        int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret) {
+            LOG_WARN("Thread %s: failed to set SCHED_FIFO priority %d: %s",
+                     name, p.fifo_prio, strerror(ret));
+        }
+    }
+
+    LOG_DEBUG("Thread %s placed as %s on %zu CPUs, node %d, fifo %d",
+              name, role, cpus.size(), p.node, p.fifo_prio);
+}
@@ -0,0 +1,70 @@
+#ifndef THREAD_PLACEMENT_HH
+#define THREAD_PLACEMENT_HH
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <sched.h>
+#include <sys/types.h>
+
+// Runtime placement of simulator threads.
+// Every thread created by the simulator calls thread_placement::apply() with its role
+// when it starts. The placement of each role is read from a configuration file with one
+// role per line followed by key=value settings, e.g.
+//
+//     # role      settings
+//     main        cpus=0
+//     bridge_rx   cpus=2 fifo=50
+//     ip_action   node=0
+//     co_worker   cpus=4-7
+//     bridge_rx   colocate=qemu
+//
+// Keys:
+//   cpus=LIST      CPU affinity, a list such as 0,2,4-7.
+//   node=N         NUMA node, restricts the CPUs to the node and prefers its memory.
+//                  CPUs none of which are on the node are kept, with a warning.
+//   fifo=PRIO      Run with SCHED_FIFO at priority PRIO, 1 to 99 (needs CAP_SYS_NICE).
+//   colocate=qemu  Run on the CPUs of the QEMU vCPU threads, QEMU is found from the
+//                  qemu_pid=PID key or the SOC_QEMU_PID environment variable.
+//
+// The file is named by the SOC_THREAD_CONFIG environment variable. Roles without an
+// entry are left unpinned, but their threads are still named.
+class thread_placement {
+public:
+    // Load the placement configuration from @path.
+    // Returns false if the file could not be read, bad lines are logged and skipped.
+    static bool load(const char *path);
+
+    // Load the configuration named by SOC_THREAD_CONFIG, if set.
+    static void load_from_env();
+
+    // Apply the placement of @role to the calling thread and name it @name.
+    // @role: Role of the thread, e.g. "bridge_rx", "ip_action", "main".
+    // @name: Thread name shown by ps/top/perf, truncated to 15 characters.
+    static void apply(const char *role, const char *name);
+
+private:
+    struct placement {
+        std::vector<int> cpus;
+        int node = -1;
+        int fifo_prio = 0;
+        bool colocate_qemu = false;
+        int qemu_pid = 0;
+    };
+
+    static thread_placement &instance();
+
+    // Parse a decimal integer in [@min, @max], the whole of @s must be the number.
+    static bool parse_int(const std::string &s, long min, long max, int &v);
+    static bool parse_cpu_list(const std::string &list, std::vector<int> &cpus);
+    static bool node_cpus(int node, std::vector<int> &cpus);
+    static bool qemu_vcpu_cpus(int pid, std::vector<int> &cpus);
+
+    std::mutex mtx;
+    std::map<std::string, placement> roles;
+};
+
+#endif // THREAD_PLACEMENT_HH
@@ -0,0 +1,180 @@
+#include "trace.hh"
+#include "debugger.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+std::atomic<bool> trace::on{false};
+uint64_t trace::bus_min = 64;
+std::string trace::path = "soc_trace.json";
+std::mutex trace::mtx;
+std::vector<trace::thread_buffer *> trace::buffers;
+thread_local trace::thread_buffer *trace::local = nullptr;
+std::mutex trace::writer_mtx;
+std::thread trace::writer;
+
+trace::thread_buffer *trace::self()
+{
+    if (!local) {
+        thread_buffer *buf = new thread_buffer();
+        buf->tid = syscall(SYS_gettid);
+        std::lock_guard<std::mutex> lock(mtx);
+        buffers.push_back(buf);
+        local = buf;
+    }
+    return local;
+}
+
+void trace::record(const event &e)
+{
+    alloc_check::allow tracing; // The event buffers grow while tracing is on
+    thread_buffer *buf = self();
+    std::lock_guard<std::mutex> lock(buf->mtx);
+    if (buf->events.size() < MAX_EVENTS_PER_THREAD) {
+        buf->events.push_back(e);
+    } else {
+        buf->dropped++;
+    }
+}
+
+void trace::span(const char *name, const char *cat, uint64_t start_ns, uint64_t end_ns,
+                 uint64_t arg)
+{
+    record(event{ name, cat, start_ns, end_ns - start_ns, arg });
+}
+
+void trace::instant(const char *name, const char *cat, uint64_t arg)
+{
+    if (enabled()) {
+        record(event{ name, cat, now_ns(), ~0ULL, arg });
+    }
+}
+
+void trace::start()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    for (thread_buffer *buf : buffers) {
+        std::lock_guard<std::mutex> buf_lock(buf->mtx);
+        buf->events.clear();
+        buf->dropped = 0;
+    }
+    on.store(true);
+    LOG_INFO("Tracing started, writing to %s on stop.", path.c_str());
+}
+
+uint64_t trace::stop()
+{
+    if (!on.exchange(false)) {
+        return 0;
+    }
+
+    // Take the events out of the buffers and leave the formatting and the file to a
+    // writer thread, stop is called from the bridge RX thread
+    std::vector<thread_events> threads;
+    uint64_t collected = 0, dropped = 0;
+    std::string file;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (thread_buffer *buf : buffers) {
+            std::lock_guard<std::mutex> buf_lock(buf->mtx);
+            if (buf->events.empty()) {
+                continue;
+            }
+            threads.emplace_back();
+            threads.back().tid = buf->tid;
+            threads.back().events.swap(buf->events);
+            collected += threads.back().events.size();
+            dropped += buf->dropped;
+        }
+        file = path;
+    }
+
+    std::lock_guard<std::mutex> lock(writer_mtx);
+    if (writer.joinable()) {
+        writer.join();
+    } else {
+        atexit(flush); // The process must not exit with the writer running
+    }
+    writer = std::thread(write_file, std::move(file), std::move(threads), dropped);
+    return collected;
+}
+
+void trace::flush()
+{
+    std::lock_guard<std::mutex> lock(writer_mtx);
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+void trace::write_file(std::string file, std::vector<thread_events> threads, uint64_t dropped)
+{
+    FILE *f = fopen(file.c_str(), "w");
+    if (!f) {
+        LOG_ERROR("Failed to open trace file %s.", file.c_str());
+        return;
+    }
+
+    int pid = getpid();
+    uint64_t written = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(f, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"soc\"}}", pid);
+    for (const thread_events &t : threads) {
+        // Threads are named by thread_placement once they start, look the name up late
+        char name[16] = "";
+        char comm[64];
+        snprintf(comm, sizeof(comm), "/proc/self/task/%d/comm", t.tid);
+        FILE *c = fopen(comm, "r");
+        if (!c || !fgets(name, sizeof(name), c)) {
+            snprintf(name, sizeof(name), "%d", t.tid);
+        }
+        name[strcspn(name, "\n")] = 0;
+        if (c) {
+            fclose(c);
+        }
+        fprintf(f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", pid, t.tid, name);
+        for (const event &e : t.events) {
+            if (e.dur_ns == ~0ULL) {
+                fprintf(f, ",\n{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"cat\":\"%s\","
+                        "\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"arg\":\"0x%lx\"}}",
+                        e.name, e.cat, pid, t.tid, e.ts_ns / 1000.0, e.arg);
+            } else {
+                fprintf(f, ",\n{\"ph\":\"X\",\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,"
+                        "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":\"0x%lx\"}}",
+                        e.name, e.cat, pid, t.tid, e.ts_ns / 1000.0, e.dur_ns / 1000.0,
+                        e.arg);
+            }
+        }
+        written += t.events.size();
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    LOG_INFO("Tracing stopped, %lu events written to %s, %lu dropped.", written, file.c_str(),
+             dropped);
+}
+
+void trace::set_path(const char *file)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    path = file;
+}
+
+void trace::load_from_env()
+{
+    const char *min = getenv("SOC_TRACE_BUS_MIN");
+    if (min) {
+        bus_min = strtoull(min, NULL, 0);
+    }
+    const char *env = getenv("SOC_TRACE");
+    if (env && env[0]) {
+        set_path(env);
+        start();
+    }
+}
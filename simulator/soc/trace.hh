@@ -0,0 +1,139 @@
+#ifndef TRACE_HH
+#define TRACE_HH
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Timeline tracing in the Chrome trace-event format, viewable in Perfetto
+// (ui.perfetto.dev) or chrome://tracing.
+// Events are appended to a buffer of the calling thread and only written out when
+// tracing stops, by a writer thread, so neither recording an event nor stopping does
+// I/O. When tracing is off every
+// instrumentation point costs one relaxed load and a predicted branch.
+//
+// Tracing is started and stopped at runtime with the EX_CTRL_TRACE bridge control
+// packet, SIGUSR2 to soc_top, or from the start with SOC_TRACE=<file>. The trace is
+// written to the SOC_TRACE file, soc_trace.json by default.
+//
+// Event names and categories must be string literals, only the pointers are stored.
+class trace {
+public:
+    static bool enabled()
+    {
+        return on.load(std::memory_order_relaxed);
+    }
+
+    // Start recording, dropping the events of any previous recording.
+    static void start();
+
+    // Stop recording and hand the recorded events to a thread writing them to the trace
+    // file. Does nothing, and leaves the trace file alone, if tracing is off.
+    // Returns the number of events handed over.
+    static uint64_t stop();
+
+    // Wait for the trace file of the last stop to be written.
+    static void flush();
+
+    // Set the file the trace is written to.
+    static void set_path(const char *file);
+
+    // Start tracing if SOC_TRACE is set, and read SOC_TRACE_BUS_MIN.
+    static void load_from_env();
+
+    // Smallest bus access, in bytes, traced as a span.
+    static uint64_t bus_min_size()
+    {
+        return bus_min;
+    }
+
+    // Record a complete span [@start_ns, @end_ns) of steady_clock time.
+    static void span(const char *name, const char *cat, uint64_t start_ns, uint64_t end_ns,
+                     uint64_t arg);
+
+    // Record an instant event.
+    static void instant(const char *name, const char *cat, uint64_t arg);
+
+    static uint64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    struct event {
+        const char *name;
+        const char *cat;
+        uint64_t ts_ns;
+        uint64_t dur_ns; // ~0 for instant events
+        uint64_t arg;
+    };
+
+    // Events of one thread. The owner appends under @mtx, which is only ever contended
+    // while the trace is being written.
+    struct thread_buffer {
+        std::mutex mtx;
+        std::vector<event> events;
+        uint64_t dropped = 0;
+        int tid;
+    };
+
+    static const size_t MAX_EVENTS_PER_THREAD = 1 << 20;
+
+    // Events taken out of a thread_buffer by stop.
+    struct thread_events {
+        int tid;
+        std::vector<event> events;
+    };
+
+    static thread_buffer *self();
+    static void record(const event &e);
+    static void write_file(std::string file, std::vector<thread_events> threads,
+                           uint64_t dropped);
+
+    static std::atomic<bool> on;
+    static uint64_t bus_min;
+    static std::string path;
+    static std::mutex mtx; // Protects buffers and path
+    static std::vector<thread_buffer *> buffers; // Never freed, threads may still hold them
+    static thread_local thread_buffer *local;
+    static std::mutex writer_mtx; // Protects writer
+    static std::thread writer;    // Writing the file of the last stop
+};
+
+// Traces the lifetime of the object as a span.
+// @cond allows skipping spans that are not interesting, e.g. small bus accesses.
+//
+//     trace_span span("bridge_tx", "bridge", cmd.addr);
+class trace_span {
+public:
+    trace_span(const char *name, const char *cat, uint64_t arg, bool cond = true)
+        : name(name), cat(cat), arg(arg), start(0)
+    {
+        if (cond && trace::enabled()) {
+            start = trace::now_ns();
+        }
+    }
+
+    ~trace_span()
+    {
+        if (start) {
+            trace::span(name, cat, start, trace::now_ns(), arg);
+        }
+    }
+
+    trace_span(const trace_span &) = delete;
+    trace_span &operator=(const trace_span &) = delete;
+
+private:
+    const char *name;
+    const char *cat;
+    uint64_t arg;
+    uint64_t start;
+};
+
+#endif // TRACE_HH
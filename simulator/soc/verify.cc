@@ -0,0 +1,296 @@
+#include "verify.hh"
+#include "bus.hh"
+#include "debugger.hh"
+
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define VERIFY_CRC_X86 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78u // Reflected Castagnoli polynomial
+
+// Bytes of each of the three streams of the hardware CRC, a shift table folds them.
+#define CRC_STREAM 256
+
+struct crc_tables {
+    uint32_t byte[256];       // CRC register update for one byte
+    uint32_t shift[4][256];   // Register advanced over CRC_STREAM zero bytes, per byte of it
+    bool hw;
+
+    crc_tables()
+    {
+        for (uint32_t v = 0; v < 256; v++) {
+            uint32_t c = v;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            }
+            byte[v] = c;
+        }
+
+        // Advancing over zeros is linear in the register, so the shift of any register
+        // is the XOR of the shifts of its bits
+        uint32_t bit_shift[32];
+        for (int b = 0; b < 32; b++) {
+            uint32_t c = 1u << b;
+            for (int i = 0; i < CRC_STREAM; i++) {
+                c = byte[c & 0xff] ^ (c >> 8);
+            }
+            bit_shift[b] = c;
+        }
+        for (int k = 0; k < 4; k++) {
+            for (uint32_t v = 0; v < 256; v++) {
+                uint32_t c = 0;
+                for (int b = 0; b < 8; b++) {
+                    if (v & (1u << b)) {
+                        c ^= bit_shift[k * 8 + b];
+                    }
+                }
+                shift[k][v] = c;
+            }
+        }
+
+#ifdef VERIFY_CRC_X86
+        hw = __builtin_cpu_supports("sse4.2");
+#else
+        hw = false;
+#endif
+    }
+
+    uint32_t advance(uint32_t c) const
+    {
+        return shift[0][c & 0xff] ^ shift[1][(c >> 8) & 0xff] ^ shift[2][(c >> 16) & 0xff] ^
+               shift[3][c >> 24];
+    }
+};
+
+static const crc_tables &tables()
+{
+    static const crc_tables t;
+    return t;
+}
+
+static inline uint64_t load64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+#ifdef VERIFY_CRC_X86
+// The crc32 instruction has a latency of 3 cycles and a throughput of 1, so three
+// independent streams over consecutive thirds of each block keep it busy. The register
+// of the block is then shift(shift(c0) ^ c1) ^ c2.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(const crc_tables &t, uint32_t crc, const uint8_t *p, size_t n)
+{
+    while (n && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        n--;
+    }
+    while (n >= 3 * CRC_STREAM) {
+        uint64_t c0 = crc, c1 = 0, c2 = 0;
+        for (size_t i = 0; i < CRC_STREAM; i += 8) {
+            c0 = _mm_crc32_u64(c0, load64(p + i));
+            c1 = _mm_crc32_u64(c1, load64(p + CRC_STREAM + i));
+            c2 = _mm_crc32_u64(c2, load64(p + 2 * CRC_STREAM + i));
+        }
+        crc = t.advance(t.advance((uint32_t)c0) ^ (uint32_t)c1) ^ (uint32_t)c2;
+        p += 3 * CRC_STREAM;
+        n -= 3 * CRC_STREAM;
+    }
+    uint64_t c = crc;
+    while (n >= 8) {
+        c = _mm_crc32_u64(c, load64(p));
+        p += 8;
+        n -= 8;
+    }
+    crc = c;
+    while (n--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t mem_verify::crc32c_portable(uint32_t crc, const void *data, size_t size)
+{
+    const crc_tables &t = tables();
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    while (size--) {
+        crc = t.byte[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t mem_verify::crc32c(uint32_t crc, const void *data, size_t size)
+{
+#ifdef VERIFY_CRC_X86
+    const crc_tables &t = tables();
+    if (t.hw) {
+        return ~crc32c_hw(t, ~crc, (const uint8_t *)data, size);
+    }
+#endif
+    return crc32c_portable(crc, data, size);
+}
+
+// Collects ranges in order, merging a range that starts less than @gap bytes after the
+// end of the previous one. The first @max ranges are stored to @out, which may be
+// unaligned guest memory.
+class range_sink {
+public:
+    range_sink(verify_range *out, uint64_t max, uint64_t gap) : out(out), max(max), gap(gap) {}
+
+    void add(uint64_t offset, uint64_t length)
+    {
+        if (count && offset - (last.offset + last.length) < gap) {
+            last.length = offset + length - last.offset;
+            return;
+        }
+        store();
+        last = verify_range{offset, length};
+        count++;
+    }
+
+    uint64_t finish()
+    {
+        store();
+        return count;
+    }
+
+private:
+    void store()
+    {
+        if (count && count <= max) {
+            memcpy((uint8_t *)out + (count - 1) * sizeof(verify_range), &last, sizeof(last));
+        }
+    }
+
+    verify_range *out;
+    uint64_t max;
+    uint64_t gap;
+    uint64_t count = 0;
+    verify_range last = {0, 0};
+};
+
+// First i in [from, n) where @a and @b differ, n if none.
+static uint64_t first_diff(const uint8_t *a, const uint8_t *b, uint64_t i, uint64_t n)
+{
+    // Equal pages are skipped with memcmp, which the C library vectorizes
+    while (i + 4096 <= n && !memcmp(a + i, b + i, 4096)) {
+        i += 4096;
+    }
+    while (i + 8 <= n && load64(a + i) == load64(b + i)) {
+        i += 8;
+    }
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline bool has_zero_byte(uint64_t v)
+{
+    return (v - 0x0101010101010101ULL) & ~v & 0x8080808080808080ULL;
+}
+
+uint64_t mem_verify::diff(const void *data, const void *golden, size_t size,
+                          verify_range *ranges, uint64_t max_ranges)
+{
+    const uint8_t *a = (const uint8_t *)data, *b = (const uint8_t *)golden;
+    range_sink sink(ranges, max_ranges, VERIFY_MERGE_GAP);
+    uint64_t i = first_diff(a, b, 0, size);
+    while (i < size) {
+        // Extend over differing bytes, 8 at a time while none of them is equal
+        uint64_t end = i + 1;
+        while (end + 8 <= size && !has_zero_byte(load64(a + end) ^ load64(b + end))) {
+            end += 8;
+        }
+        while (end < size && a[end] != b[end]) {
+            end++;
+        }
+        sink.add(i, end - i);
+        i = first_diff(a, b, end, size);
+    }
+    return sink.finish();
+}
+
+uint64_t mem_verify::check(const void *data, size_t size, uint64_t granule, const void *crcs,
+                           verify_range *ranges, uint64_t max_ranges)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    range_sink sink(ranges, max_ranges, 1);
+    for (uint64_t off = 0, g = 0; off < size; off += granule, g++) {
+        uint64_t len = std::min<uint64_t>(granule, size - off);
+        uint32_t expect;
+        memcpy(&expect, (const uint8_t *)crcs + g * sizeof(expect), sizeof(expect));
+        if (crc32c(0, p + off, len) != expect) {
+            sink.add(off, len);
+        }
+    }
+    return sink.finish();
+}
+
+BUS_ACCESS_CODE mem_verify::run(base_bus *bus, uint64_t desc_addr, uint64_t &result)
+{
+    uint8_t *desc_ptr = (uint8_t *)bus->master_lookup_shm_ptr(desc_addr, sizeof(verify_desc));
+    if (!desc_ptr) {
+        LOG_ERROR("verify: descriptor at %lx is not in RAM", desc_addr);
+        return ACCESS_ADDR_ERROR;
+    }
+    // Copied, the guest could still be changing it
+    verify_desc d;
+    memcpy(&d, desc_ptr, sizeof(d));
+
+    verify_range *ranges = nullptr;
+    if (d.max_ranges) {
+        ranges = (verify_range *)bus->master_lookup_shm_ptr(desc_addr + sizeof(d),
+                                                            d.max_ranges * sizeof(verify_range));
+    }
+    const uint8_t *data = (const uint8_t *)bus->master_lookup_shm_ptr(d.addr, d.size);
+    if ((d.max_ranges && !ranges) || (d.size && !data)) {
+        LOG_ERROR("verify: range %lx+%lx or %u result ranges are not in RAM", d.addr, d.size,
+                  d.max_ranges);
+        return ACCESS_ADDR_ERROR;
+    }
+
+    result = 0;
+    switch (d.op) {
+    case VERIFY_OP_CRC32C:
+        result = crc32c(0, data, d.size);
+        break;
+    case VERIFY_OP_DIFF: {
+        const void *golden = bus->master_lookup_shm_ptr(d.ref, d.size);
+        if (d.size && !golden) {
+            LOG_ERROR("verify: golden image %lx+%lx is not in RAM", d.ref, d.size);
+            return ACCESS_ADDR_ERROR;
+        }
+        result = d.size ? diff(data, golden, d.size, ranges, d.max_ranges) : 0;
+        break;
+    }
+    case VERIFY_OP_CHECK: {
+        if (!d.granule || d.granule > d.size) {
+            LOG_ERROR("verify: CRC check of %lx bytes with a granule of %lx", d.size, d.granule);
+            return ACCESS_DENIED;
+        }
+        // Written so it cannot overflow, 1 <= nr_crcs <= d.size which fits in RAM
+        uint64_t nr_crcs = d.size / d.granule + (d.size % d.granule != 0);
+        const void *crcs = bus->master_lookup_shm_ptr(d.ref, nr_crcs * sizeof(uint32_t));
+        if (nr_crcs && !crcs) {
+            LOG_ERROR("verify: CRC array %lx of %lu entries is not in RAM", d.ref, nr_crcs);
+            return ACCESS_ADDR_ERROR;
+        }
+        result = check(data, d.size, d.granule, crcs, ranges, d.max_ranges);
+        break;
+    }
+    default:
+        LOG_ERROR("verify: unknown operation %u", d.op);
+        return ACCESS_DENIED;
+    }
+
+    memcpy(desc_ptr + offsetof(verify_desc, result), &result, sizeof(result));
+    return ACCESS_OK;
+}
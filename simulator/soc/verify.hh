@@ -0,0 +1,77 @@
+#ifndef VERIFY_HH
+#define VERIFY_HH
+
+#include <cstdint>
+#include <cstddef>
+
+#include "ip.hh"
+
+class base_bus;
+
+// Verification of DMA results inside the SoC.
+// Regression tests used to check device-written buffers by reading them back over the
+// bridge or dumping them to files, which for large buffers takes longer than the test.
+// With the EX_CTRL_VERIFY bridge control packet the guest instead places a verify_desc
+// in SoC RAM and the SoC checks the buffer directly in the RAM shared memory, at memory
+// bandwidth, returning only what differs.
+//
+// Operations, on [addr, addr + size):
+//   VERIFY_OP_CRC32C: result = CRC32C of the range, for a golden hash kept by the guest.
+//   VERIFY_OP_DIFF:   compare with the golden image at ref, result = number of differing
+//                     ranges. Differences less than VERIFY_MERGE_GAP bytes apart are
+//                     reported as one range.
+//   VERIFY_OP_CHECK:  ref holds the CRC32C of every granule bytes of the range (the last
+//                     granule may be short) as little endian uint32_t, result = number
+//                     of ranges of consecutive granules whose CRC differs.
+// The first max_ranges ranges are written right after the descriptor, offsets relative
+// to addr. Every address is a bus address, and each of the range, the golden image, the
+// CRC array and the descriptor with its ranges must lie within one RAM IP.
+enum VERIFY_OP {
+    VERIFY_OP_CRC32C = 0,
+    VERIFY_OP_DIFF = 1,
+    VERIFY_OP_CHECK = 2,
+};
+
+#define VERIFY_MERGE_GAP 64
+
+struct verify_range {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct verify_desc {
+    uint32_t op;         // VERIFY_OP
+    uint32_t max_ranges; // Room for verify_range entries after the descriptor
+    uint64_t addr;
+    uint64_t size;
+    uint64_t ref;        // Golden image (DIFF) or CRC array (CHECK)
+    uint64_t granule;    // Bytes per CRC (CHECK)
+    uint64_t result;     // Written by the SoC
+};
+
+class mem_verify {
+public:
+    // CRC32C (Castagnoli) of @size bytes at @data, continuing from @crc, 0 to start:
+    // crc32c(crc32c(0, a), b) is the CRC of a followed by b. Uses the SSE4.2 crc32
+    // instruction on three interleaved streams when the CPU has it.
+    static uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+    // Table driven CRC32C, the reference for crc32c() in tests and benchmarks.
+    static uint32_t crc32c_portable(uint32_t crc, const void *data, size_t size);
+
+    // Compare @size bytes of @data and @golden, see VERIFY_OP_DIFF.
+    // Returns the number of ranges, the first @max_ranges are stored in @ranges.
+    static uint64_t diff(const void *data, const void *golden, size_t size,
+                         verify_range *ranges, uint64_t max_ranges);
+
+    // Check every @granule bytes of @data against @crcs, see VERIFY_OP_CHECK.
+    static uint64_t check(const void *data, size_t size, uint64_t granule, const void *crcs,
+                          verify_range *ranges, uint64_t max_ranges);
+
+    // Run the verify_desc at bus address @desc_addr and store its result, also returned
+    // in @result. Returns ACCESS_ADDR_ERROR if a range is not in RAM shared memory and
+    // ACCESS_DENIED for a bad operation.
+    static BUS_ACCESS_CODE run(base_bus *bus, uint64_t desc_addr, uint64_t &result);
+};
+
+#endif // VERIFY_HH
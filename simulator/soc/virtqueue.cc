@@ -0,0 +1,530 @@
+#include "virtqueue.hh"
+#include "bus.hh"
+
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+
+// Split ring layout: avail { flags, idx, ring[size], used_event },
+// used { flags, idx, ring[size] { id, len }, avail_event }.
+#define SPLIT_AVAIL_RING(i)   (4 + 2 * (uint64_t)(i))
+#define SPLIT_USED_RING(i)    (4 + 8 * (uint64_t)(i))
+
+// Packed event suppression area: { off_wrap, flags }.
+#define PACKED_EVENT_OFF_WRAP 0
+#define PACKED_EVENT_FLAGS    2
+
+// Chains processed between two used index updates and notification checks, so a polling
+// driver sees progress during a long drain.
+#define VQ_PUBLISH_BATCH 64
+
+struct vq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id_or_flags; // Split: flags, packed: buffer ID
+    uint16_t next_or_flags; // Split: next, packed: flags
+};
+
+virtqueue_ip::virtqueue_ip(base_bus *bus, uint64_t id, uint64_t base_address, unsigned nr_queues,
+                           uint64_t irq_dest, uint64_t irq_vector, uint64_t dma_base)
+    : base_ip(bus, id, IP_TYPE_PERIPHERAL, base_address, VQ_REG_SIZE, 0, 0),
+      nr_queues(std::min(nr_queues, (unsigned)VQ_MAX_QUEUES)),
+      irq_dest(irq_dest), irq_vector(irq_vector), dma_base(dma_base)
+{
+    // A notify of queue q can be an ioeventfd matching q
+    for (unsigned q = 0; q < this->nr_queues; q++) {
+        add_doorbell(VQ_REG_NOTIFY, 8, q, IP_DOORBELL_DATAMATCH);
+    }
+    start_action_thread();
+}
+
+virtqueue_ip::~virtqueue_ip()
+{
+    stop_action_thread();
+}
+
+void virtqueue_ip::reset()
+{
+    std::lock_guard<std::mutex> lock(vq_mtx);
+    for (queue &q : queues) {
+        q = queue();
+    }
+    queue_sel = 0;
+}
+
+BUS_ACCESS_CODE virtqueue_ip::memaddr_can_access(bool rw, uint64_t offset, uint64_t size)
+{
+    if (offset + size > VQ_REG_SIZE) {
+        return ACCESS_ADDR_ERROR;
+    }
+    if (rw == MMIO_ACCESS_RW_W && offset >= VQ_REG_QUEUE_CHAINS) {
+        return ACCESS_DENIED;
+    }
+    return ACCESS_OK;
+}
+
+void virtqueue_ip::mem_slave_read(uint64_t offset, uint64_t size, void *data)
+{
+    std::lock_guard<std::mutex> lock(vq_mtx);
+    const queue &q = queues[queue_sel];
+    uint64_t val = 0;
+    switch (offset & ~7ULL) {
+    case VQ_REG_QUEUE_SEL:    val = queue_sel; break;
+    case VQ_REG_QUEUE_SIZE:   val = q.size; break;
+    case VQ_REG_QUEUE_DESC:   val = q.desc_addr; break;
+    case VQ_REG_QUEUE_DRIVER: val = q.driver_addr; break;
+    case VQ_REG_QUEUE_DEVICE: val = q.device_addr; break;
+    case VQ_REG_QUEUE_FLAGS:  val = q.flags; break;
+    case VQ_REG_QUEUE_ENABLE: val = q.enabled; break;
+    case VQ_REG_QUEUE_CHAINS: val = q.chains; break;
+    case VQ_REG_QUEUE_IRQS:   val = q.irqs; break;
+    case VQ_REG_QUEUE_ERRORS: val = q.errors; break;
+    }
+    val >>= (offset & 7) * 8;
+    memcpy(data, &val, std::min<uint64_t>(size, sizeof(val)));
+}
+
+void virtqueue_ip::mem_slave_write(uint64_t offset, uint64_t size, void *data)
+{
+    uint64_t val = 0;
+    memcpy(&val, data, std::min<uint64_t>(size, sizeof(val)));
+    if (offset == VQ_REG_NOTIFY) {
+        return; // Handled as an action
+    }
+
+    std::lock_guard<std::mutex> lock(vq_mtx);
+    queue &q = queues[queue_sel];
+    switch (offset) {
+    case VQ_REG_QUEUE_SEL:
+        if (val < nr_queues) {
+            queue_sel = val;
+        }
+        break;
+    case VQ_REG_QUEUE_SIZE:   q.size = std::min<uint64_t>(val, 32768); break;
+    case VQ_REG_QUEUE_DESC:   q.desc_addr = val; break;
+    case VQ_REG_QUEUE_DRIVER: q.driver_addr = val; break;
+    case VQ_REG_QUEUE_DEVICE: q.device_addr = val; break;
+    case VQ_REG_QUEUE_FLAGS:  q.flags = val & (VQ_F_PACKED | VQ_F_EVENT_IDX); break;
+    case VQ_REG_QUEUE_ENABLE:
+        if (val) {
+            enable_queue(q);
+        } else {
+            q.enabled = false;
+        }
+        break;
+    }
+}
+
+bool virtqueue_ip::should_trigger_action(uint64_t offset, uint64_t size, bool rw, void *data)
+{
+    (void)size; (void)rw; (void)data;
+    return offset == VQ_REG_NOTIFY;
+}
+
+ip_action virtqueue_ip::get_action(uint64_t offset, uint64_t size, void *data)
+{
+    (void)offset;
+    uint64_t val = 0;
+    memcpy(&val, data, std::min<uint64_t>(size, sizeof(val)));
+    return ip_action(IP_ACTION_CUSTOM, 0, val);
+}
+
+void virtqueue_ip::process_action(const ip_action &action)
+{
+    if (action.type == IP_ACTION_CUSTOM && action.data < nr_queues) {
+        process_queue(action.data);
+    }
+}
+
+uint8_t *virtqueue_ip::map_area(uint64_t addr, uint64_t size)
+{
+    return (uint8_t *)bus->master_lookup_shm_ptr(dma_base + addr, size);
+}
+
+// Resolve the ring areas and start from the initial ring state. The direct pointers are
+// taken here, so a queue must be re-enabled after the RAM backing it is remapped.
+void virtqueue_ip::enable_queue(queue &q)
+{
+    if (!q.size || ((q.flags & VQ_F_PACKED) == 0 && (q.size & (q.size - 1)))) {
+        LOG_ERROR("virtqueue %lu: bad queue size %lu", id, q.size);
+        return;
+    }
+    if (q.flags & VQ_F_PACKED) {
+        q.desc = map_area(q.desc_addr, 16 * q.size);
+        q.driver = map_area(q.driver_addr, 4);
+        q.device = map_area(q.device_addr, 4);
+    } else {
+        q.desc = map_area(q.desc_addr, 16 * q.size);
+        q.driver = map_area(q.driver_addr, SPLIT_AVAIL_RING(q.size) + 2);
+        q.device = map_area(q.device_addr, SPLIT_USED_RING(q.size) + 2);
+    }
+    q.last_avail = 0;
+    q.used_idx = 0;
+    q.avail_wrap = true;
+    q.used_wrap = true;
+    q.signalled_used = 0;
+    q.unsignalled = 0;
+    q.signalled_valid = false;
+    q.enabled = true;
+    set_notify(q, true);
+    LOG_DEBUG("virtqueue %lu: queue enabled, size %lu, %s, %s", id, q.size,
+              q.flags & VQ_F_PACKED ? "packed" : "split", q.desc ? "direct" : "via bus");
+}
+
+uint16_t virtqueue_ip::load16(uint8_t *host, uint64_t addr, uint64_t off, bool acquire)
+{
+    if (host) {
+        return __atomic_load_n((uint16_t *)(host + off), acquire ? __ATOMIC_ACQUIRE : __ATOMIC_RELAXED);
+    }
+    uint16_t v = 0;
+    mem_master_read(dma_base + addr + off, sizeof(v), &v);
+    return v;
+}
+
+void virtqueue_ip::store16(uint8_t *host, uint64_t addr, uint64_t off, uint16_t v, bool release)
+{
+    if (host) {
+        __atomic_store_n((uint16_t *)(host + off), v, release ? __ATOMIC_RELEASE : __ATOMIC_RELAXED);
+        return;
+    }
+    mem_master_write(dma_base + addr + off, sizeof(v), &v);
+}
+
+void virtqueue_ip::ring_read(uint8_t *host, uint64_t addr, uint64_t off, void *data, uint64_t size)
+{
+    if (host) {
+        memcpy(data, host + off, size);
+    } else {
+        mem_master_read(dma_base + addr + off, size, data);
+    }
+}
+
+void virtqueue_ip::ring_write(uint8_t *host, uint64_t addr, uint64_t off, const void *data, uint64_t size)
+{
+    if (host) {
+        memcpy(host + off, data, size);
+    } else {
+        mem_master_write(dma_base + addr + off, size, (void *)data);
+    }
+}
+
+void virtqueue_ip::add_buf(vq_chain &c, uint64_t addr, uint32_t len, uint16_t flags)
+{
+    if (c.nr_bufs == VQ_MAX_CHAIN) {
+        c.error = true;
+        return;
+    }
+    c.bufs[c.nr_bufs++] = vq_buf{addr, len, (flags & VQ_DESC_F_WRITE) != 0};
+}
+
+// An indirect table is an array of descriptors in the format of the ring. Split tables are
+// chained with the NEXT flag, packed tables are used whole. A table with more entries
+// than fit in the chain puts the chain in error without reading it.
+void virtqueue_ip::read_indirect(vq_chain &c, uint64_t addr, uint32_t len, bool packed)
+{
+    uint32_t n = len / sizeof(vq_desc);
+    if (!n || n > VQ_MAX_CHAIN - c.nr_bufs) {
+        if (packed || !n) {
+            c.error = true;
+            return;
+        }
+        n = VQ_MAX_CHAIN - c.nr_bufs; // Enough if a NEXT flag ends the chain in time
+    }
+    vq_desc table[VQ_MAX_CHAIN];
+    uint8_t *host = map_area(addr, n * sizeof(vq_desc));
+    ring_read(host, addr, 0, table, n * sizeof(vq_desc));
+    for (uint32_t i = 0; i < n; i++) {
+        uint16_t flags = packed ? table[i].next_or_flags : table[i].id_or_flags;
+        add_buf(c, table[i].addr, table[i].len, flags);
+        if (!packed && !(flags & VQ_DESC_F_NEXT)) {
+            return;
+        }
+    }
+    if (!packed) {
+        c.error = true; // No end within the table, or within what fits in the chain
+    }
+}
+
+bool virtqueue_ip::pop_split(queue &q, uint16_t avail_idx, vq_chain &c)
+{
+    if (q.last_avail == avail_idx) {
+        return false;
+    }
+    uint16_t head = load16(q.driver, q.driver_addr, SPLIT_AVAIL_RING(q.last_avail & (q.size - 1)));
+    q.last_avail++;
+
+    c.id = head;
+    c.nr_descs = 0;
+    c.nr_bufs = 0;
+    c.error = false;
+    uint16_t i = head;
+    bool ended = false;
+    for (uint64_t n = 0; n < q.size && !ended; n++) {
+        vq_desc d;
+        ring_read(q.desc, q.desc_addr, (i & (q.size - 1)) * sizeof(d), &d, sizeof(d));
+        q.descs++;
+        if (d.id_or_flags & VQ_DESC_F_INDIRECT) {
+            read_indirect(c, d.addr, d.len, false);
+        } else {
+            add_buf(c, d.addr, d.len, d.id_or_flags);
+        }
+        ended = !(d.id_or_flags & VQ_DESC_F_NEXT);
+        i = d.next_or_flags;
+    }
+    c.error |= !ended; // A loop in the descriptor table
+    return true;
+}
+
+bool virtqueue_ip::pop_packed(queue &q, vq_chain &c)
+{
+    uint16_t flags = load16(q.desc, q.desc_addr, q.last_avail * sizeof(vq_desc) + 14, true);
+    bool avail = flags & VQ_DESC_F_AVAIL, used = flags & VQ_DESC_F_USED;
+    if (avail != q.avail_wrap || used == q.avail_wrap) {
+        return false;
+    }
+
+    c.nr_descs = 0;
+    c.nr_bufs = 0;
+    c.error = false;
+    for (uint64_t n = 0; n < q.size; n++) {
+        vq_desc d;
+        ring_read(q.desc, q.desc_addr, q.last_avail * sizeof(d), &d, sizeof(d));
+        q.descs++;
+        c.nr_descs++;
+        c.id = d.id_or_flags;
+        if (d.next_or_flags & VQ_DESC_F_INDIRECT) {
+            read_indirect(c, d.addr, d.len, true);
+        } else {
+            add_buf(c, d.addr, d.len, d.next_or_flags);
+        }
+        if (++q.last_avail == q.size) {
+            q.last_avail = 0;
+            q.avail_wrap = !q.avail_wrap;
+        }
+        if (!(d.next_or_flags & VQ_DESC_F_NEXT)) {
+            return true;
+        }
+    }
+    c.error = true; // No end within the ring
+    return true;
+}
+
+void virtqueue_ip::push_split(queue &q, const vq_chain &c, uint32_t len)
+{
+    uint32_t elem[2] = { c.id, len };
+    ring_write(q.device, q.device_addr, SPLIT_USED_RING(q.used_idx & (q.size - 1)), elem, sizeof(elem));
+    q.used_idx++;
+}
+
+// The used element goes into the slot of the chain's first descriptor, its flags are
+// written last so the driver never sees a half written element.
+void virtqueue_ip::push_packed(queue &q, const vq_chain &c, uint32_t len)
+{
+    uint64_t off = q.used_idx * sizeof(vq_desc);
+    uint16_t id = c.id;
+    ring_write(q.desc, q.desc_addr, off + 8, &len, sizeof(len));
+    ring_write(q.desc, q.desc_addr, off + 12, &id, sizeof(id));
+    uint16_t flags = q.used_wrap ? (VQ_DESC_F_AVAIL | VQ_DESC_F_USED) : 0;
+    store16(q.desc, q.desc_addr, off + 14, flags, true);
+
+    q.used_idx += c.nr_descs;
+    q.unsignalled += c.nr_descs;
+    if (q.used_idx >= q.size) {
+        q.used_idx -= q.size;
+        q.used_wrap = !q.used_wrap;
+    }
+}
+
+// Ask the driver to ring (@enable) or not to ring the doorbell for this queue.
+void virtqueue_ip::set_notify(queue &q, bool enable)
+{
+    if (q.flags & VQ_F_PACKED) {
+        uint16_t flags = VQ_EVENT_DISABLE;
+        if (enable && (q.flags & VQ_F_EVENT_IDX)) {
+            store16(q.device, q.device_addr, PACKED_EVENT_OFF_WRAP,
+                    q.last_avail | (q.avail_wrap << 15));
+            flags = VQ_EVENT_DESC;
+        } else if (enable) {
+            flags = VQ_EVENT_ENABLE;
+        }
+        store16(q.device, q.device_addr, PACKED_EVENT_FLAGS, flags);
+    } else if (q.flags & VQ_F_EVENT_IDX) {
+        // Suppression is implicit while draining, the driver only rings once it passes
+        // the index published here
+        if (enable) {
+            store16(q.device, q.device_addr, SPLIT_USED_RING(q.size), q.last_avail);
+        }
+    } else {
+        store16(q.device, q.device_addr, 0, enable ? 0 : VQ_USED_F_NO_NOTIFY);
+    }
+}
+
+bool virtqueue_ip::has_avail(queue &q)
+{
+    if (q.flags & VQ_F_PACKED) {
+        uint16_t flags = load16(q.desc, q.desc_addr, q.last_avail * sizeof(vq_desc) + 14, true);
+        return (bool)(flags & VQ_DESC_F_AVAIL) == q.avail_wrap &&
+               (bool)(flags & VQ_DESC_F_USED) != q.avail_wrap;
+    }
+    return load16(q.driver, q.driver_addr, 2, true) != q.last_avail;
+}
+
+// Whether the driver wants a used buffer notification for the chains published since
+// the last one, same rules as QEMU's virtio_should_notify().
+bool virtqueue_ip::should_interrupt(queue &q)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool valid = q.signalled_valid;
+    q.signalled_valid = true;
+
+    if (q.flags & VQ_F_PACKED) {
+        // Slot positions wrap at the ring size, the old position is taken as a distance
+        // back from the new one so the comparison works across the wrap, like Linux does
+        uint16_t new_idx = q.used_idx, old_idx = new_idx - q.unsignalled;
+        q.unsignalled = 0;
+        uint16_t flags = load16(q.driver, q.driver_addr, PACKED_EVENT_FLAGS);
+        if (flags != VQ_EVENT_DESC) {
+            return flags == VQ_EVENT_ENABLE;
+        }
+        uint16_t off_wrap = load16(q.driver, q.driver_addr, PACKED_EVENT_OFF_WRAP);
+        int event = off_wrap & 0x7fff;
+        if ((bool)(off_wrap >> 15) != q.used_wrap) {
+            event -= q.size;
+        }
+        return !valid || vq_need_event(event, new_idx, old_idx);
+    }
+    if (!(q.flags & VQ_F_EVENT_IDX)) {
+        return !(load16(q.driver, q.driver_addr, 0) & VQ_AVAIL_F_NO_INTERRUPT);
+    }
+    uint16_t old_idx = q.signalled_used, new_idx = q.used_idx;
+    q.signalled_used = new_idx;
+    uint16_t used_event = load16(q.driver, q.driver_addr, SPLIT_AVAIL_RING(q.size));
+    return !valid || vq_need_event(used_event, new_idx, old_idx);
+}
+
+// Make the chains completed since the last flush visible to the driver and notify it if
+// it asked for it.
+void virtqueue_ip::flush_used(queue &q, unsigned index)
+{
+    if (!(q.flags & VQ_F_PACKED)) {
+        store16(q.device, q.device_addr, 2, q.used_idx, true);
+    }
+    if (should_interrupt(q)) {
+        q.irqs++;
+        post_irq(irq_dest, irq_vector + index);
+    } else {
+        q.irqs_suppressed++;
+    }
+}
+
+void virtqueue_ip::process_queue(unsigned index)
+{
+    std::lock_guard<std::mutex> lock(vq_mtx);
+    queue &q = queues[index];
+    q.doorbells++;
+    if (!q.enabled) {
+        return;
+    }
+
+    // Flushing before the used index moves by half a ring keeps the event index checks
+    // of the packed layout, which compare slot positions, unambiguous
+    bool packed = q.flags & VQ_F_PACKED;
+    uint64_t batch = std::max<uint64_t>(1, std::min<uint64_t>(VQ_PUBLISH_BATCH, q.size / 2));
+    uint64_t pending = 0;
+    for (;;) {
+        q.passes++;
+        set_notify(q, false);
+        uint16_t avail_idx = packed ? 0 : load16(q.driver, q.driver_addr, 2, true);
+        while (packed ? pop_packed(q, chain) : pop_split(q, avail_idx, chain)) {
+            uint32_t len = 0;
+            if (!chain.error) {
+                len = process_chain(index, chain);
+            } else {
+                LOG_ERROR("virtqueue %lu queue %u: chain %u is malformed or longer than %d "
+                          "buffers", id, index, chain.id, VQ_MAX_CHAIN);
+                q.errors++;
+            }
+            if (packed) {
+                push_packed(q, chain, len);
+            } else {
+                push_split(q, chain, len);
+            }
+            q.chains++;
+            pending += packed ? chain.nr_descs : 1;
+            if (pending >= batch) {
+                flush_used(q, index);
+                pending = 0;
+            }
+            if (!packed && q.last_avail == avail_idx) {
+                avail_idx = load16(q.driver, q.driver_addr, 2, true);
+            }
+        }
+        if (pending) {
+            flush_used(q, index);
+            pending = 0;
+        }
+
+        // Re-enable doorbells, then look again for chains added before the driver saw it
+        set_notify(q, true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!has_avail(q)) {
+            break;
+        }
+    }
+}
+
+uint64_t virtqueue_ip::chain_read(const vq_chain &c, uint64_t offset, void *data, uint64_t len)
+{
+    uint64_t done = 0;
+    for (uint32_t i = 0; i < c.nr_bufs && done < len; i++) {
+        const vq_buf &b = c.bufs[i];
+        if (b.write) {
+            continue;
+        }
+        if (offset >= b.len) {
+            offset -= b.len;
+            continue;
+        }
+        uint64_t n = std::min<uint64_t>(b.len - offset, len - done);
+        uint8_t *host = map_area(b.addr + offset, n);
+        ring_read(host, b.addr + offset, 0, (uint8_t *)data + done, n);
+        done += n;
+        offset = 0;
+    }
+    return done;
+}
+
+uint64_t virtqueue_ip::chain_write(const vq_chain &c, uint64_t offset, const void *data, uint64_t len)
+{
+    uint64_t done = 0;
+    for (uint32_t i = 0; i < c.nr_bufs && done < len; i++) {
+        const vq_buf &b = c.bufs[i];
+        if (!b.write) {
+            continue;
+        }
+        if (offset >= b.len) {
+            offset -= b.len;
+            continue;
+        }
+        uint64_t n = std::min<uint64_t>(b.len - offset, len - done);
+        uint8_t *host = map_area(b.addr + offset, n);
+        ring_write(host, b.addr + offset, 0, (const uint8_t *)data + done, n);
+        done += n;
+        offset = 0;
+    }
+    return done;
+}
+
+void virtqueue_ip::print_stats()
+{
+    std::lock_guard<std::mutex> lock(vq_mtx);
+    for (unsigned i = 0; i < nr_queues; i++) {
+        const queue &q = queues[i];
+        if (!q.enabled && !q.chains) {
+            continue;
+        }
+        printf("virtqueue %lu queue %u: %lu chains, %lu descriptors, %lu doorbells, %lu passes, "
+               "%lu irqs, %lu irqs suppressed, %lu errors\n", id, i, q.chains, q.descs,
+               q.doorbells, q.passes, q.irqs, q.irqs_suppressed, q.errors);
+    }
+}
@@ -0,0 +1,196 @@
+#ifndef VIRTQUEUE_HH
+#define VIRTQUEUE_HH
+
+#include "ip.hh"
+
+#include <cstdint>
+#include <mutex>
+
+// Register offsets of a virtqueue_ip, 64-bit registers. The queue registers apply to the
+// queue selected by VQ_REG_QUEUE_SEL, like virtio-mmio.
+#define VQ_REG_QUEUE_SEL    0x00 // RW: selected queue
+#define VQ_REG_QUEUE_SIZE   0x08 // RW: number of descriptors, a power of two for split rings
+#define VQ_REG_QUEUE_DESC   0x10 // RW: address of the descriptor table / packed ring
+#define VQ_REG_QUEUE_DRIVER 0x18 // RW: address of the available ring / driver event area
+#define VQ_REG_QUEUE_DEVICE 0x20 // RW: address of the used ring / device event area
+#define VQ_REG_QUEUE_FLAGS  0x28 // RW: VQ_F_* ring format and features
+#define VQ_REG_QUEUE_ENABLE 0x30 // RW: 1 starts the queue from index 0, 0 stops it
+#define VQ_REG_NOTIFY       0x38 // WO: doorbell, the value is the queue index (also an ip_doorbell)
+#define VQ_REG_QUEUE_CHAINS 0x40 // RO: descriptor chains completed by the selected queue
+#define VQ_REG_QUEUE_IRQS   0x48 // RO: used buffer notifications sent by the selected queue
+#define VQ_REG_QUEUE_ERRORS 0x50 // RO: chains the selected queue completed without processing
+#define VQ_REG_SIZE         0x1000
+
+#define VQ_F_PACKED    1 // Packed ring layout (VIRTIO_F_RING_PACKED), split otherwise
+#define VQ_F_EVENT_IDX 2 // Event index notification suppression (VIRTIO_RING_F_EVENT_IDX)
+
+// Descriptor flags, shared by both layouts.
+#define VQ_DESC_F_NEXT     1
+#define VQ_DESC_F_WRITE    2
+#define VQ_DESC_F_INDIRECT 4
+#define VQ_DESC_F_AVAIL    (1 << 7)  // Packed only
+#define VQ_DESC_F_USED     (1 << 15) // Packed only
+
+#define VQ_AVAIL_F_NO_INTERRUPT 1 // Split: driver does not want used buffer notifications
+#define VQ_USED_F_NO_NOTIFY     1 // Split: device does not want doorbells
+
+#define VQ_EVENT_ENABLE  0 // Packed event suppression flags
+#define VQ_EVENT_DISABLE 1
+#define VQ_EVENT_DESC    2
+
+#define VQ_MAX_QUEUES 16
+#define VQ_MAX_CHAIN  64 // Buffers per chain, longer chains are rejected
+
+// Wrap-around safe check whether an event index was crossed when an index moved from
+// @old_idx to @new_idx (vring_need_event of the virtio spec).
+static inline bool vq_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+// One buffer of a descriptor chain.
+struct vq_buf {
+    uint64_t addr;  // Bus address
+    uint32_t len;
+    bool write;     // Device writable
+};
+
+// A descriptor chain popped from a queue.
+struct vq_chain {
+    uint16_t id;       // Head index (split) or buffer ID (packed)
+    uint16_t nr_descs; // Ring slots used by the chain, packed only
+    uint32_t nr_bufs;
+    bool error;        // Malformed or longer than VQ_MAX_CHAIN buffers
+    vq_buf bufs[VQ_MAX_CHAIN];
+};
+
+// Base class for devices that exchange work with a driver through virtio descriptor rings.
+// The driver places descriptor chains on a queue and rings the doorbell once for a whole
+// batch. The device drains every available chain, calls process_chain() for each and
+// hands them back on the used ring, updating the used index once per batch of chains.
+// Both directions support event index suppression: while the device drains a queue it
+// tells the driver not to ring, and it only raises the used buffer IRQ when the driver's
+// event index was crossed, so a busy queue moves many chains per bridge message.
+// A chain of more than VQ_MAX_CHAIN buffers, or one that does not end within the ring,
+// is logged, completed with a used length of 0 without calling process_chain() and
+// counted in VQ_REG_QUEUE_ERRORS.
+//
+// Split and packed layouts follow the virtio 1.1 specification, little-endian. Ring and
+// buffer addresses are bus addresses plus the dma_base given to the constructor, so
+// rings can live in SoC RAM (dma_base 0) or in guest memory through the guest_ram
+// window (dma_base at the window). Rings in a RAM IP are accessed through its shared
+// memory directly, others through bus accesses.
+//
+//     class my_blk : public virtqueue_ip {
+//         uint32_t process_chain(unsigned queue, const vq_chain &chain) override
+//         {
+//             blk_req req;
+//             chain_read(chain, 0, &req, sizeof(req));
+//             ...
+//             return chain_write(chain, 0, &status, 1);
+//         }
+//     };
+class virtqueue_ip : public base_ip {
+public:
+    // Constructor for virtqueue_ip.
+    // @nr_queues: Number of queues, at most VQ_MAX_QUEUES.
+    // @irq_dest: ID of the IP receiving the used buffer IRQs, usually the cosim bridge.
+    // @irq_vector: IRQ vector of queue 0, queue N raises @irq_vector + N.
+    // @dma_base: Added to every ring and buffer address programmed by the driver.
+    virtqueue_ip(base_bus *bus, uint64_t id, uint64_t base_address, unsigned nr_queues,
+                 uint64_t irq_dest, uint64_t irq_vector, uint64_t dma_base = 0);
+    ~virtqueue_ip() override;
+
+    void reset() override;
+
+    BUS_ACCESS_CODE memaddr_can_access(bool rw, uint64_t offset, uint64_t size) override;
+
+    void mem_slave_read(uint64_t offset, uint64_t size, void *data) override;
+    void mem_slave_write(uint64_t offset, uint64_t size, void *data) override;
+
+    bool should_trigger_action(uint64_t offset, uint64_t size, bool rw, void *data) override;
+    ip_action get_action(uint64_t offset, uint64_t size, void *data) override;
+    void process_action(const ip_action &action) override;
+
+    // Count a doorbell of @queue and drain it. Called from the action thread.
+    void process_queue(unsigned queue);
+
+    // Print the per-queue counters.
+    void print_stats();
+
+protected:
+    // Process one descriptor chain of @queue.
+    // Returns the number of bytes written to the device writable buffers of @chain.
+    virtual uint32_t process_chain(unsigned queue, const vq_chain &chain) = 0;
+
+    // Copy between the buffers of @chain and @data, starting @offset bytes into the
+    // readable (chain_read) or writable (chain_write) buffers of the chain.
+    // Return the number of bytes copied.
+    uint64_t chain_read(const vq_chain &chain, uint64_t offset, void *data, uint64_t len);
+    uint64_t chain_write(const vq_chain &chain, uint64_t offset, const void *data, uint64_t len);
+
+    unsigned nr_queues;
+
+private:
+    struct queue {
+        // Programmed by the driver
+        uint64_t size = 0;
+        uint64_t desc_addr = 0;
+        uint64_t driver_addr = 0;
+        uint64_t device_addr = 0;
+        uint64_t flags = 0;
+        bool enabled = false;
+
+        // Direct pointers to the ring areas, nullptr when accessed through the bus
+        uint8_t *desc = nullptr;
+        uint8_t *driver = nullptr;
+        uint8_t *device = nullptr;
+
+        uint16_t last_avail = 0;  // Next chain to pop (split: free running index)
+        uint16_t used_idx = 0;    // Next used slot (split: free running index)
+        bool avail_wrap = true;   // Packed wrap counters
+        bool used_wrap = true;
+        uint16_t signalled_used = 0;   // Split: used index at the last notification check
+        uint16_t unsignalled = 0;      // Packed: used slots since the last notification check
+        bool signalled_valid = false;
+
+        uint64_t chains = 0;
+        uint64_t descs = 0;
+        uint64_t doorbells = 0;
+        uint64_t passes = 0;
+        uint64_t irqs = 0;
+        uint64_t irqs_suppressed = 0;
+        uint64_t errors = 0;
+    };
+
+    void enable_queue(queue &q);
+    uint8_t *map_area(uint64_t addr, uint64_t size);
+
+    // Ring accesses through the direct pointer @host + @off, or the bus at @addr + @off.
+    uint16_t load16(uint8_t *host, uint64_t addr, uint64_t off, bool acquire = false);
+    void store16(uint8_t *host, uint64_t addr, uint64_t off, uint16_t v, bool release = false);
+    void ring_read(uint8_t *host, uint64_t addr, uint64_t off, void *data, uint64_t size);
+    void ring_write(uint8_t *host, uint64_t addr, uint64_t off, const void *data, uint64_t size);
+
+    // Append a buffer to @chain, marking the chain in error when it is full.
+    void add_buf(vq_chain &chain, uint64_t addr, uint32_t len, uint16_t flags);
+    void read_indirect(vq_chain &chain, uint64_t addr, uint32_t len, bool packed);
+    bool pop_split(queue &q, uint16_t avail_idx, vq_chain &chain);
+    bool pop_packed(queue &q, vq_chain &chain);
+    void push_split(queue &q, const vq_chain &chain, uint32_t len);
+    void push_packed(queue &q, const vq_chain &chain, uint32_t len);
+    void set_notify(queue &q, bool enable);
+    bool has_avail(queue &q);
+    bool should_interrupt(queue &q);
+    void flush_used(queue &q, unsigned index);
+
+    queue queues[VQ_MAX_QUEUES];
+    uint64_t queue_sel = 0;
+    uint64_t irq_dest;
+    uint64_t irq_vector;
+    uint64_t dma_base;
+    std::mutex vq_mtx; // Serializes queue processing with register accesses
+    vq_chain chain;    // Scratch chain of the processing thread
+};
+
+#endif // VIRTQUEUE_HH
@@ -0,0 +1,180 @@
+#!/bin/bash
+# Run several co-simulation instances side by side on one host.
+#
+# Every instance gets its own name (farm0, farm1, ...), which namespaces its shared
+# memory (/dev/shm/farmN_gem5_share_memory), its FIFO directory (fifo/farmN) and its
+# output files, and its own slice of the host CPUs: nproc / N cores, used by both the SoC
+# threads (through a generated SOC_THREAD_CONFIG) and QEMU (through taskset).
+#
+# usage: ./cosim_farm.sh [-n N] [--bench SEC]
+#   -n N         number of instances (default 2)
+#   --bench SEC  drive each SoC with a closed-loop soc_bench for SEC seconds instead of
+#                booting QEMU, to measure how throughput scales with the instance count
+#
+# In bench mode the instances are run 1, 2, 4, ... and finally N at a time, each on a
+# slice of the same size, and every round prints the throughput of each instance, their
+# sum, and the efficiency of each instance against the single instance run (100% when
+# instances do not slow each other down). The script exits non-zero if any soc_bench
+# fails or any SoC dies during a round.
+#
+# Logs go to farm/farmN_soc.log and farm/farmN_qemu.log (or farmN_bench.log). Killing
+# the script stops every instance and removes their FIFOs and shared memory.
+
+nr=2
+bench=0
+while [ $# -gt 0 ]; do
+	case $1 in
+	-n) nr=$2; shift ;;
+	--bench) bench=$2; shift ;;
+	*) echo "usage: $0 [-n N] [--bench SEC]"; exit 1 ;;
+	esac
+	shift
+done
+
+top=$(cd "$(dirname "$0")/../../.." && pwd)
+soc=${SOC_BIN:-$top/simulator/soc/build/soc.out}
+soc_bench=${SOC_BENCH_BIN:-$top/simulator/soc/build/soc_bench}
+qemu=$top/simulator/qemu/build/qemu-system-riscv64
+work=$(pwd)/farm
+
+cpus=$(nproc)
+per=$((cpus / nr))
+if [ $per -lt 1 ]; then
+	echo "warning: $nr instances on $cpus CPUs, instances will share CPUs"
+	per=1
+fi
+
+pids=""
+stop_instances() {
+	[ -n "$pids" ] && kill $pids 2>/dev/null
+	wait 2>/dev/null
+	pids=""
+	for i in $(seq 0 $((nr - 1))); do
+		rm -rf "$work/fifo/farm$i"
+		rm -f /dev/shm/farm${i}_*
+	done
+}
+cleanup() {
+	trap - EXIT INT TERM
+	stop_instances
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mkdir -p "$work"
+cd "$work"
+
+# Start instance $1: its SoC, and either soc_bench (bench mode) or QEMU in front of it.
+# The soc_bench pid is left in bench_pid, the SoC pid in soc_pid.
+start_instance() {
+	local i=$1
+	local name=farm$i
+	local first=$((i * per % cpus))
+	local last=$((first + per - 1))
+	local rest=$((first + 1))-$last
+	[ $per -eq 1 ] && rest=$first
+	local fifo=$work/fifo/$name
+	mkdir -p $fifo
+
+	# Main and RX threads on the first core of the slice, the rest share the others
+	cat > ${name}_threads.conf <<-EOF
+	main        cpus=$first
+	bridge_rx   cpus=$first
+	ip_action   cpus=$rest
+	co_worker   cpus=$rest
+	co_blocking cpus=$rest
+	EOF
+
+	if [ $bench -gt 0 ]; then
+		# soc_bench creates the FIFOs and plays the QEMU side, closed loop so that
+		# the request rate is what the SoC sustains
+		rm -f ${name}_bench.json
+		taskset -c $rest $soc_bench --fifo-dir $fifo --duration $bench --rate 0 \
+			--threads 1 --json ${name}_bench.json > ${name}_bench.log 2>&1 &
+		bench_pid=$!
+		pids="$pids $!"
+		sleep 0.2
+	fi
+
+	SOC_THREAD_CONFIG=${name}_threads.conf $soc --instance $name --fifo-dir $fifo \
+		--log-level error > ${name}_soc.log 2>&1 &
+	soc_pid=$!
+	pids="$pids $!"
+
+	if [ $bench -eq 0 ]; then
+		# The SoC creates the FIFOs, -snapshot keeps the shared disk image untouched
+		while [ ! -p $fifo/soc_to_qemu_resp ]; do sleep 0.1; done
+		taskset -c $first-$last $qemu \
+			-M virt \
+			-smp $per \
+			-m 2G \
+			-kernel $top/test/arch/riscv64/Image \
+			-drive id=disk1,file=$top/test/arch/riscv64/vdisk_root.img,format=raw,if=virtio \
+			-snapshot \
+			-append "console=ttyS0 root=/dev/vda1" \
+			-serial file:${name}_console.log \
+			-display none \
+			-device pciemu,has_soc_backend=true,qemu_req_fd_name="$fifo/qemu_to_soc_req",qemu_resp_fd_name="$fifo/qemu_to_soc_resp",soc_backend_shm_name="/${name}_gem5_share_memory" \
+			> ${name}_qemu.log 2>&1 &
+		pids="$pids $!"
+	fi
+	echo "$name: cpus $first-$last, fifos $fifo, shm /${name}_gem5_share_memory"
+}
+
+# Requests per second of every op type an instance's soc_bench reported, summed
+bench_ops() {
+	sed -n 's/.*"ops_per_sec": \([0-9.e+]*\).*/\1/p' farm$1_bench.json |
+		awk '{ s += $1 } END { printf "%.0f", s }'
+}
+
+if [ $bench -eq 0 ]; then
+	for i in $(seq 0 $((nr - 1))); do
+		start_instance $i
+	done
+	wait
+	exit 0
+fi
+
+rounds=""
+for ((n = 1; n < nr; n *= 2)); do
+	rounds="$rounds $n"
+done
+rounds="$rounds $nr"
+
+failed=0
+single=0
+for n in $rounds; do
+	echo "== $n instance(s)"
+	bench_pids=()
+	soc_pids=()
+	for i in $(seq 0 $((n - 1))); do
+		start_instance $i
+		bench_pids[$i]=$bench_pid
+		soc_pids[$i]=$soc_pid
+	done
+
+	total=0
+	line=""
+	for i in $(seq 0 $((n - 1))); do
+		if ! wait ${bench_pids[$i]} || [ ! -s farm${i}_bench.json ]; then
+			echo "farm$i: soc_bench failed, see $work/farm${i}_bench.log"
+			failed=1
+			continue
+		fi
+		if ! kill -0 ${soc_pids[$i]} 2>/dev/null; then
+			echo "farm$i: SoC exited during the run, see $work/farm${i}_soc.log"
+			failed=1
+		fi
+		ops=$(bench_ops $i)
+		total=$((total + ops))
+		line="$line farm$i=$ops"
+	done
+	stop_instances
+
+	[ $n -eq 1 ] && single=$total
+	eff="n/a"
+	[ $single -gt 0 ] && eff=$(awk -v t=$total -v n=$n -v s=$single \
+		'BEGIN { printf "%.1f%%", 100 * t / (n * s) }')
+	echo "$n instance(s): ops/s$line, aggregate $total, per-instance efficiency $eff"
+done
+exit $failed
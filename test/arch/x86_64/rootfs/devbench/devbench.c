@@ -0,0 +1,416 @@
+/*
+ * User-space device latency benchmark.
+ *
+ * Maps a BAR of the co-simulated device without a kernel driver and times MMIO and
+ * DMA operations issued from tight polling loops, so the numbers contain the bridge
+ * and SoC cost but no IRQ, syscall or driver overhead.
+ *
+ * Devices, one of:
+ *   vfio:0000:00:03.0   VFIO, the device bound to vfio-pci (type1 IOMMU or noiommu)
+ *   uio:0               UIO, the device behind /dev/uio0 from uio_pci_generic
+ *   pci:0000:00:03.0    the sysfs resource file, no driver needed
+ * DMA buffers are mapped through the IOMMU with VFIO type1, otherwise their physical
+ * address is taken from /proc/self/pagemap, which needs root.
+ *
+ * Tests:
+ *   read    read the register at -o, each read waits for the device
+ *   write   posted writes to the register at -o
+ *   rw      a write followed by a read back of the register at -o
+ *   dma     memory to memory copy of -s bytes on channel -c of the dw_axi_dmac,
+ *           polling the channel interrupt status for completion
+ *
+ * Each test reports ops/s and latency percentiles in ns, e.g.
+ *   devbench -d pci:0000:00:03.0 -t read -o 0x0 -n 100000
+ *   devbench -d vfio:0000:00:03.0 -t dma -s 4096 -V
+ *
+ * Build: gcc -O2 -static devbench.c -o devbench (test/linux_drivers/build_drivers.sh)
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/vfio.h>
+
+/* dw_axi_dmac registers, see drivers/dma/dw-axi-dmac in Linux */
+#define DMAC_CFG		0x010
+#define DMAC_CFG_EN		(1 << 0)
+#define DMAC_CHEN		0x018
+#define CH_BASE(ch)		(0x100 + (ch) * 0x100)
+#define CH_SAR			0x000
+#define CH_DAR			0x008
+#define CH_BLOCK_TS		0x010
+#define CH_CTL			0x018
+#define CH_CFG			0x020
+#define CH_INTSTATUS_ENA	0x080
+#define CH_INTSTATUS		0x088
+#define CH_INTCLEAR		0x098
+
+#define CH_CTL_WIDTH_64		3
+#define CH_CTL_SRC_WIDTH(w)	((uint64_t)(w) << 8)
+#define CH_CTL_DST_WIDTH(w)	((uint64_t)(w) << 11)
+#define CH_CTL_MSIZE_32		4
+#define CH_CTL_SRC_MSIZE(m)	((uint64_t)(m) << 14)
+#define CH_CTL_DST_MSIZE(m)	((uint64_t)(m) << 18)
+#define CH_CTL_LAST		(1ULL << 62)
+#define CH_CTL_VALID		(1ULL << 63)
+#define CH_IRQ_DMA_TFR		(1 << 1)
+#define CH_IRQ_ALL		0xffffffffULL
+
+#define PCI_COMMAND		0x04
+#define PCI_COMMAND_MEMORY	0x2
+#define PCI_COMMAND_MASTER	0x4
+
+#define DMA_IOVA		0x10000000ULL
+#define DMA_TIMEOUT_NS		1000000000ULL
+
+struct device {
+	volatile uint8_t *bar;
+	size_t bar_size;
+	int cfg_fd;		/* PCI config space */
+	off_t cfg_off;
+	int container;		/* VFIO, -1 otherwise */
+	int iommu;		/* DMA through VFIO_IOMMU_MAP_DMA */
+};
+
+static void die(const char *fmt, ...)
+{
+	int err = errno;
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "devbench: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, ": %s\n", strerror(err));
+	va_end(ap);
+	exit(1);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t reg_read(struct device *dev, uint64_t off, int width)
+{
+	if (width == 8)
+		return *(volatile uint64_t *)(dev->bar + off);
+	return *(volatile uint32_t *)(dev->bar + off);
+}
+
+static inline void reg_write(struct device *dev, uint64_t off, int width, uint64_t val)
+{
+	if (width == 8)
+		*(volatile uint64_t *)(dev->bar + off) = val;
+	else
+		*(volatile uint32_t *)(dev->bar + off) = val;
+}
+
+static void *map_or_die(int fd, size_t size, off_t off, const char *what)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off);
+
+	if (p == MAP_FAILED)
+		die("cannot map %s", what);
+	return p;
+}
+
+/* Map BAR @bar through the resource file of the PCI device directory @dir */
+static void map_resource(struct device *dev, const char *dir, int bar)
+{
+	char path[256];
+	struct stat st;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/resource%d", dir, bar);
+	fd = open(path, O_RDWR | O_SYNC);
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0)
+		die("cannot open %s", path);
+	dev->bar_size = st.st_size;
+	dev->bar = map_or_die(fd, dev->bar_size, 0, path);
+	close(fd);
+
+	snprintf(path, sizeof(path), "%s/config", dir);
+	dev->cfg_fd = open(path, O_RDWR);
+	if (dev->cfg_fd < 0)
+		die("cannot open %s", path);
+}
+
+static void open_pci(struct device *dev, const char *bdf, int bar)
+{
+	char dir[256];
+
+	snprintf(dir, sizeof(dir), "/sys/bus/pci/devices/%s", bdf);
+	map_resource(dev, dir, bar);
+}
+
+/*
+ * uio_pci_generic only forwards interrupts and registers no maps, so the BAR is mapped
+ * through the resource file of the PCI device behind /dev/uioN.
+ */
+static void open_uio(struct device *dev, const char *num, int bar)
+{
+	char dir[256];
+
+	snprintf(dir, sizeof(dir), "/sys/class/uio/uio%s/device", num);
+	map_resource(dev, dir, bar);
+}
+
+static void open_vfio(struct device *dev, const char *bdf, int bar)
+{
+	struct vfio_group_status status = { .argsz = sizeof(status) };
+	struct vfio_region_info region = { .argsz = sizeof(region) };
+	char path[256], link[256];
+	const char *group_name;
+	int group, fd, noiommu;
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/iommu_group", bdf);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len < 0)
+		die("%s is not bound to vfio-pci", bdf);
+	link[len] = 0;
+	group_name = strrchr(link, '/') + 1;
+
+	/* Without an IOMMU, vfio-pci is loaded with enable_unsafe_noiommu_mode=1 */
+	snprintf(path, sizeof(path), "/dev/vfio/%s", group_name);
+	group = open(path, O_RDWR);
+	noiommu = group < 0;
+	if (noiommu) {
+		snprintf(path, sizeof(path), "/dev/vfio/noiommu-%s", group_name);
+		group = open(path, O_RDWR);
+	}
+	dev->container = open("/dev/vfio/vfio", O_RDWR);
+	if (group < 0 || dev->container < 0)
+		die("cannot open the VFIO group of %s", bdf);
+	if (ioctl(group, VFIO_GROUP_GET_STATUS, &status) < 0 ||
+	    !(status.flags & VFIO_GROUP_FLAGS_VIABLE) ||
+	    ioctl(group, VFIO_GROUP_SET_CONTAINER, &dev->container) < 0 ||
+	    ioctl(dev->container, VFIO_SET_IOMMU, noiommu ? VFIO_NOIOMMU_IOMMU : VFIO_TYPE1_IOMMU) < 0)
+		die("cannot set up the VFIO container of %s", bdf);
+	fd = ioctl(group, VFIO_GROUP_GET_DEVICE_FD, bdf);
+	if (fd < 0)
+		die("cannot get the VFIO device %s", bdf);
+
+	region.index = VFIO_PCI_BAR0_REGION_INDEX + bar;
+	if (ioctl(fd, VFIO_DEVICE_GET_REGION_INFO, &region) < 0 ||
+	    !(region.flags & VFIO_REGION_INFO_FLAG_MMAP))
+		die("BAR of %s cannot be mapped", bdf);
+	dev->bar_size = region.size;
+	dev->bar = map_or_die(fd, region.size, region.offset, bdf);
+
+	region.index = VFIO_PCI_CONFIG_REGION_INDEX;
+	if (ioctl(fd, VFIO_DEVICE_GET_REGION_INFO, &region) < 0)
+		die("no config space for %s", bdf);
+	dev->cfg_fd = fd;
+	dev->cfg_off = region.offset;
+	dev->iommu = !noiommu;
+}
+
+static void enable_bus_master(struct device *dev)
+{
+	uint16_t cmd;
+
+	if (pread(dev->cfg_fd, &cmd, 2, dev->cfg_off + PCI_COMMAND) != 2)
+		die("cannot read the PCI command register");
+	cmd |= PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER;
+	if (pwrite(dev->cfg_fd, &cmd, 2, dev->cfg_off + PCI_COMMAND) != 2)
+		die("cannot enable bus mastering");
+}
+
+/* Locked, zeroed memory and the address the device uses for it */
+static void *dma_alloc(struct device *dev, size_t size, uint64_t *dma_addr)
+{
+	static uint64_t iova = DMA_IOVA;
+	void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED | MAP_POPULATE, -1, 0);
+	uint64_t entry;
+	int fd;
+
+	if (buf == MAP_FAILED)
+		die("cannot allocate %zu bytes of DMA memory", size);
+	if (dev->iommu) {
+		struct vfio_iommu_type1_dma_map map = {
+			.argsz = sizeof(map),
+			.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+			.vaddr = (uintptr_t)buf,
+			.iova = iova,
+			.size = size,
+		};
+		if (ioctl(dev->container, VFIO_IOMMU_MAP_DMA, &map) < 0)
+			die("cannot map %zu bytes for DMA", size);
+		*dma_addr = iova;
+		iova += (size + 0xfffff) & ~0xfffffULL;
+		return buf;
+	}
+
+	/* One page, so it is physically contiguous */
+	if (size > (size_t)getpagesize()) {
+		errno = EINVAL;
+		die("without an IOMMU DMA buffers are limited to one page");
+	}
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0 || pread(fd, &entry, 8, (uintptr_t)buf / getpagesize() * 8) != 8 ||
+	    !(entry & (1ULL << 63)) || !(entry & ((1ULL << 55) - 1)))
+		die("no physical address in /proc/self/pagemap, run as root");
+	close(fd);
+	*dma_addr = (entry & ((1ULL << 55) - 1)) * getpagesize();
+	return buf;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *test, uint64_t *lat, unsigned long n, uint64_t total_ns,
+		   size_t bytes)
+{
+	static const double pct[] = { 50, 90, 99, 99.9 };
+	unsigned i;
+
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	printf("%s: %lu ops in %.3f s, %.0f ops/s", test, n, total_ns / 1e9,
+	       n * 1e9 / total_ns);
+	if (bytes)
+		printf(", %.1f MB/s", (double)bytes * n * 1e3 / total_ns);
+	printf("\n  latency ns: min %llu", (unsigned long long)lat[0]);
+	for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+		printf(" p%g %llu", pct[i], (unsigned long long)lat[(size_t)(n * pct[i] / 100)]);
+	printf(" max %llu\n", (unsigned long long)lat[n - 1]);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: devbench -d vfio:BDF|uio:N|pci:BDF [-b bar] [-t read|write|rw|dma]\n"
+		"                [-n ops] [-o offset] [-w 4|8] [-s dma bytes] [-c channel] [-V]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct device dev = { .cfg_fd = -1, .container = -1 };
+	const char *spec = NULL, *test = "read";
+	unsigned long n = 100000, warmup, i;
+	uint64_t off = 0, size = 4096, total, *lat, t;
+	uint64_t src_dma, dst_dma, ctl, ch_base;
+	uint8_t *src, *dst;
+	int bar = 0, width = 4, ch = 0, verify = 0, opt;
+
+	while ((opt = getopt(argc, argv, "d:b:t:n:o:w:s:c:V")) != -1) {
+		switch (opt) {
+		case 'd': spec = optarg; break;
+		case 'b': bar = atoi(optarg); break;
+		case 't': test = optarg; break;
+		case 'n': n = strtoul(optarg, NULL, 0); break;
+		case 'o': off = strtoull(optarg, NULL, 0); break;
+		case 'w': width = atoi(optarg); break;
+		case 's': size = strtoull(optarg, NULL, 0); break;
+		case 'c': ch = atoi(optarg); break;
+		case 'V': verify = 1; break;
+		default: usage();
+		}
+	}
+	if (!spec || !n || (width != 4 && width != 8))
+		usage();
+	if (!strncmp(spec, "vfio:", 5))
+		open_vfio(&dev, spec + 5, bar);
+	else if (!strncmp(spec, "uio:", 4))
+		open_uio(&dev, spec + 4, bar);
+	else if (!strncmp(spec, "pci:", 4))
+		open_pci(&dev, spec + 4, bar);
+	else
+		usage();
+	enable_bus_master(&dev);
+
+	lat = calloc(n, sizeof(*lat));
+	warmup = n / 10 < 1000 ? n / 10 : 1000;
+	if (!lat)
+		die("cannot allocate %lu samples", n);
+
+	if (!strcmp(test, "read") || !strcmp(test, "write") || !strcmp(test, "rw")) {
+		int rd = test[0] == 'r', wr = test[0] != 'r' || test[1] == 'w';
+		uint64_t sink = 0;
+
+		if (off + width > dev.bar_size) {
+			errno = ERANGE;
+			die("offset %llx outside of the BAR", (unsigned long long)off);
+		}
+		for (i = 0; i < warmup + n; i++) {
+			t = now_ns();
+			if (wr)
+				reg_write(&dev, off, width, i);
+			if (rd)
+				sink += reg_read(&dev, off, width);
+			if (i >= warmup)
+				lat[i - warmup] = now_ns() - t;
+		}
+		total = 0;
+		for (i = 0; i < n; i++)
+			total += lat[i];
+		report(test, lat, n, total, 0);
+		return sink == 42; /* Keeps the reads */
+	}
+	if (strcmp(test, "dma"))
+		usage();
+
+	/* Memory to memory copies on one channel, polling its interrupt status */
+	ch_base = CH_BASE(ch);
+	if (!size || size % 8 || ch < 0 || ch > 7 || ch_base + CH_INTCLEAR + 8 > dev.bar_size) {
+		errno = EINVAL;
+		die("bad DMA size %llu or channel %d", (unsigned long long)size, ch);
+	}
+	src = dma_alloc(&dev, size, &src_dma);
+	dst = dma_alloc(&dev, size, &dst_dma);
+	for (i = 0; i < size; i++)
+		src[i] = i * 7 + 1;
+
+	ctl = CH_CTL_SRC_WIDTH(CH_CTL_WIDTH_64) | CH_CTL_DST_WIDTH(CH_CTL_WIDTH_64) |
+	      CH_CTL_SRC_MSIZE(CH_CTL_MSIZE_32) | CH_CTL_DST_MSIZE(CH_CTL_MSIZE_32) |
+	      CH_CTL_LAST | CH_CTL_VALID;
+	reg_write(&dev, DMAC_CFG, 8, DMAC_CFG_EN);
+	reg_write(&dev, ch_base + CH_CFG, 8, 0);	/* Contiguous blocks, memory to memory */
+	reg_write(&dev, ch_base + CH_INTSTATUS_ENA, 8, CH_IRQ_ALL);
+	total = now_ns();
+	for (i = 0; i < warmup + n; i++) {
+		if (i == warmup)
+			total = now_ns();
+		if (verify)
+			memset(dst, 0, size);
+		t = now_ns();
+		reg_write(&dev, ch_base + CH_INTCLEAR, 8, CH_IRQ_ALL);
+		reg_write(&dev, ch_base + CH_SAR, 8, src_dma);
+		reg_write(&dev, ch_base + CH_DAR, 8, dst_dma);
+		reg_write(&dev, ch_base + CH_BLOCK_TS, 8, size / 8 - 1);
+		reg_write(&dev, ch_base + CH_CTL, 8, ctl);
+		reg_write(&dev, DMAC_CHEN, 8, 0x101ULL << ch);	/* Enable and its write enable */
+		while (!(reg_read(&dev, ch_base + CH_INTSTATUS, 8) & CH_IRQ_DMA_TFR)) {
+			if (now_ns() - t > DMA_TIMEOUT_NS) {
+				fprintf(stderr, "devbench: DMA %lu timed out, status %llx\n", i,
+					(unsigned long long)reg_read(&dev, ch_base + CH_INTSTATUS, 8));
+				return 1;
+			}
+		}
+		if (i >= warmup)
+			lat[i - warmup] = now_ns() - t;
+		if (verify && memcmp(src, dst, size)) {
+			fprintf(stderr, "devbench: DMA %lu copied wrong data\n", i);
+			return 1;
+		}
+	}
+	report("dma", lat, n, now_ns() - total, size);
+	return 0;
+}
@@ -1,17 +1,18 @@
-export KERNELDIR=$(pwd)/../../guest_sw_stack/linux/
+here=$(cd "$(dirname "$0")" && pwd) || exit 1
+export KERNELDIR=$here/../../guest_sw_stack/linux/
 
-#cd pci_driver_model
+#cd "$here/pci_driver_model" || exit 1
 #make -j $(nproc)
-#cd ..
 
-cd axi_dmac
+cd "$here/axi_dmac" || exit 1
 make -j $(nproc)
-cd ..
 
-#cd dw_edma
+#cd "$here/dw_edma" || exit 1
 #make -j $(nproc)
-#cd ..
 
-#cd dts-platform-driver-model
+#cd "$here/dts-platform-driver-model" || exit 1
 #make -j $(nproc)
-#cd ..
\ No newline at end of file
+
+# User-space polling benchmark, static for the busybox rootfs
+devbench=$here/../arch/x86_64/rootfs/devbench
+gcc -O2 -static -o "$devbench/devbench" "$devbench/devbench.c"